@@ -916,6 +916,114 @@ ring_buffer__new(int map_fd, ring_buffer_sample_fn sample_cb, void* ctx, const s
 void
 ring_buffer__free(struct ring_buffer* rb);
 
+/**
+ * @brief Add another ring buffer map to a ring buffer manager. The map uses the callback mode of the manager.
+ *
+ * @param[in] rb Pointer to ring buffer manager.
+ * @param[in] map_fd File descriptor to ring buffer map.
+ * @param[in] sample_cb Pointer to ring buffer notification callback function for this map.
+ * @param[in] ctx Pointer to sample_cb callback function.
+ *
+ * @returns 0 on success, or a negative number on error.
+ */
+int
+ring_buffer__add(struct ring_buffer* rb, int map_fd, ring_buffer_sample_fn sample_cb, void* ctx);
+
+/**
+ * @brief Poll all ring buffer maps of a ring buffer manager for records, waiting once for any of them.
+ *
+ * Only supported for managers created by ebpf_ring_buffer__new with EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK.
+ * Otherwise the callbacks are invoked from async completion threads.
+ *
+ * If timeout_ms is zero, poll will not wait but only invoke the callbacks on records that are ready.
+ * If timeout_ms is -1, poll will wait until data is ready (no timeout).
+ *
+ * @param[in] rb Pointer to ring buffer manager.
+ * @param[in] timeout_ms maximum time to wait for (in milliseconds).
+ *
+ * @returns number of records consumed, INT_MAX, or a negative number on error. A negative value returned by a
+ * callback stops consuming and is returned.
+ */
+int
+ring_buffer__poll(struct ring_buffer* rb, int timeout_ms);
+
+/**
+ * @brief Consume the records available in all ring buffer maps of a ring buffer manager without waiting.
+ *
+ * Only supported for managers created by ebpf_ring_buffer__new with EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK.
+ *
+ * @param[in] rb Pointer to ring buffer manager.
+ *
+ * @returns number of records consumed, INT_MAX, or a negative number on error.
+ */
+int
+ring_buffer__consume(struct ring_buffer* rb);
+
+/**
+ * @brief Get an epoll file descriptor for a ring buffer manager.
+ *
+ * NOT supported, as there is no epoll on Windows. ring_buffer__poll waits for all the maps of the manager.
+ *
+ * @param[in] rb Pointer to ring buffer manager.
+ *
+ * @returns -ENOTSUP.
+ */
+int
+ring_buffer__epoll_fd(const struct ring_buffer* rb);
+
+/* User ring buffer APIs */
+struct user_ring_buffer;
+
+/**
+ * @brief Creates a producer for a BPF_MAP_TYPE_USER_RINGBUF map. Records are written directly into memory shared
+ * with the kernel and are consumed by programs with bpf_user_ringbuf_read.
+ *
+ * @param[in] map_fd File descriptor to user ring buffer map.
+ * @param[in] opts User ring buffer options.
+ *
+ * @returns Pointer to user ring buffer producer, or NULL on error with errno containing an error code.
+ */
+struct user_ring_buffer*
+user_ring_buffer__new(int map_fd, const struct user_ring_buffer_opts* opts);
+
+/**
+ * @brief Reserves space for a record in a user ring buffer. The record is visible to programs once it is
+ * submitted, and records submitted after it are held back until then. This function is not thread safe.
+ *
+ * @param[in] rb Pointer to user ring buffer producer.
+ * @param[in] size Size of the record.
+ *
+ * @returns Pointer to the record data, or NULL with errno set to ENOSPC if the ring is full.
+ */
+void*
+user_ring_buffer__reserve(struct user_ring_buffer* rb, __u32 size);
+
+/**
+ * @brief Submits a record reserved with user_ring_buffer__reserve.
+ *
+ * @param[in] rb Pointer to user ring buffer producer.
+ * @param[in] sample Pointer to the record data.
+ */
+void
+user_ring_buffer__submit(struct user_ring_buffer* rb, void* sample);
+
+/**
+ * @brief Discards a record reserved with user_ring_buffer__reserve. Programs skip discarded records.
+ *
+ * @param[in] rb Pointer to user ring buffer producer.
+ * @param[in] sample Pointer to the record data.
+ */
+void
+user_ring_buffer__discard(struct user_ring_buffer* rb, void* sample);
+
+/**
+ * @brief Frees a user ring buffer producer.
+ *
+ * @param[in] rb Pointer to user ring buffer producer to be freed.
+ */
+void
+user_ring_buffer__free(struct user_ring_buffer* rb);
+
 /* Perf buffer APIs */
 struct perf_buffer;
 
@@ -956,7 +1064,8 @@ perf_buffer__free(struct perf_buffer* pb);
  * Poll for available data and consume records, if any are available.
  *
  * Must be called to receive callbacks by default (without auto callbacks).
- * NOT supported when PERFBUF_FLAG_AUTO_CALLBACK is set.
+ * Records from all CPU rings are consumed in one call.
+ * NOT supported when EBPF_PERFBUF_FLAG_AUTO_CALLBACK is set.
  *
  * If timeout_ms is zero, poll will not wait but only invoke the callback on records that are ready.
  * If timeout_ms is -1, poll will wait until data is ready (no timeout).
@@ -969,6 +1078,18 @@ perf_buffer__free(struct perf_buffer* pb);
 int
 perf_buffer__poll(struct perf_buffer* pb, int timeout_ms);
 
+/**
+ * @brief Consume the records available on all CPU rings without waiting.
+ *
+ * NOT supported when EBPF_PERFBUF_FLAG_AUTO_CALLBACK is set.
+ *
+ * @param[in] pb Pointer to perf buffer manager.
+ *
+ * @returns number of records consumed, INT_MAX, or a negative number on error
+ */
+int
+perf_buffer__consume(struct perf_buffer* pb);
+
 /** @} */
 
 #else
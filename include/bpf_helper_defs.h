@@ -137,7 +137,8 @@ EBPF_HELPER(int, bpf_csum_diff, (void* from, int from_size, void* to, int to_siz
  * @param[in, out] map Pointer to ring buffer map.
  * @param[in] data Data to copy into ring buffer map.
  * @param[in] size Length of data.
- * @param[in] flags Flags indicating if notification for new data availability should be sent.
+ * @param[in] flags BPF_RB_NO_WAKEUP to suppress the notification for this record, BPF_RB_FORCE_WAKEUP to send it
+ * regardless of the wakeup policy of the map, or 0 to follow the policy.
  * @returns 0 on success and a negative value on error.
  */
 EBPF_HELPER(int, bpf_ringbuf_output, (void* ring_buffer, void* data, uint64_t size, uint64_t flags));
@@ -514,3 +515,22 @@ EBPF_HELPER(int, bpf_perf_event_output, (void* ctx, void* perf_event_array, uint
 #ifndef __doxygen
 #define bpf_perf_event_output ((bpf_perf_event_output_t)BPF_FUNC_perf_event_output)
 #endif
+
+/**
+ * @brief Consume the oldest record that user mode wrote into a user ring buffer map. Records are written with
+ * user_ring_buffer__reserve and user_ring_buffer__submit. A record larger than size is truncated to size, and
+ * is consumed regardless.
+ *
+ * @param[in, out] user_ring_buffer Pointer to user ring buffer map.
+ * @param[out] data Buffer that receives the record.
+ * @param[in] size Length of data.
+ * @param[in] flags Reserved, must be 0.
+ * @returns Length of the record on success, or a negative error code.
+ * @retval -EBPF_OBJECT_NOT_FOUND No record is ready.
+ * @retval -EBPF_INVALID_ARGUMENT One or more parameters are invalid.
+ * @retval -EBPF_INVALID_STATE The producer wrote an invalid record.
+ */
+EBPF_HELPER(int, bpf_user_ringbuf_read, (void* user_ring_buffer, void* data, uint64_t size, uint64_t flags));
+#ifndef __doxygen
+#define bpf_user_ringbuf_read ((bpf_user_ringbuf_read_t)BPF_FUNC_user_ringbuf_read)
+#endif
@@ -626,6 +626,149 @@ extern "C"
     ebpf_ring_buffer_map_write(
         fd_t ring_buffer_map_fd, _In_reads_bytes_(data_length) const void* data, size_t data_length) EBPF_NO_EXCEPT;
 
+    struct ring_buffer;
+
+/**
+ * @brief Invoke the ring buffer callbacks only from ring_buffer__poll and ring_buffer__consume, instead of from
+ * async completion threads as soon as records are available.
+ */
+#define EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK ((uint64_t)1 << 0)
+
+    /**
+     * @brief Options for ebpf_ring_buffer__new. This extends the libbpf ring_buffer_opts with eBPF for Windows
+     * specific wakeup coalescing and flags. The consumer is notified once any enabled threshold is reached; when all
+     * are 0 it is notified on every record.
+     */
+    typedef struct ebpf_ring_buffer_opts
+    {
+        size_t sz;               ///< Size of this structure, for forward/backward compatibility.
+        size_t wakeup_bytes;     ///< Number of pending bytes that notifies the consumer, 0 to disable.
+        uint32_t wakeup_records; ///< Number of pending records that notifies the consumer, 0 to disable.
+        uint32_t max_latency_ms; ///< Maximum time a pending record waits for a notification, 0 to disable. At most
+                                 ///< UINT32_MAX / 1000.
+        uint64_t flags;          ///< EBPF_RINGBUF_FLAG_* flags.
+    } ebpf_ring_buffer_opts_t;
+
+    /**
+     * @brief Create a ring buffer manager for a BPF_MAP_TYPE_RINGBUF map, like ring_buffer__new but with
+     * eBPF for Windows specific options. The wakeup policy is a property of the map and applies to all consumers.
+     * The flags apply to all maps later added with ring_buffer__add.
+     *
+     * @param[in] map_fd File descriptor of the ring buffer map.
+     * @param[in] sample_cb Function called on each received data record.
+     * @param[in] ctx User-provided context passed into sample_cb.
+     * @param[in] opts Optional ring buffer options.
+     *
+     * @returns Pointer to ring buffer manager, or NULL on error with errno containing an error code.
+     */
+    _Ret_maybenull_ struct ring_buffer*
+    ebpf_ring_buffer__new(
+        int map_fd,
+        _In_ int (*sample_cb)(void* ctx, void* data, size_t size),
+        _In_opt_ void* ctx,
+        _In_opt_ const ebpf_ring_buffer_opts_t* opts) EBPF_NO_EXCEPT;
+
+    /**
+     * @brief Read the newest records of a BPF_MAP_TYPE_RINGBUF map without consuming them. This is mainly useful
+     * for maps created with BPF_F_RINGBUF_OVERWRITE, which keep the most recent history. Those maps can't be
+     * subscribed to, as producers drop the oldest records while a subscriber may be reading them. A snapshot holds
+     * all of the records in the ring.
+     *
+     * @param[in] map_fd File descriptor of the ring buffer map.
+     * @param[in] sample_cb Function called on each record, oldest first. A non-zero return value stops the walk.
+     * @param[in] ctx User-provided context passed into sample_cb.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_INVALID_FD The file descriptor is not valid.
+     * @retval EBPF_INVALID_ARGUMENT The map is not a ring buffer map.
+     * @retval EBPF_TIMEOUT Producers kept overwriting the records being copied.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_snapshot(
+        fd_t map_fd, _In_ int (*sample_cb)(void* ctx, void* data, size_t size), _In_opt_ void* ctx) EBPF_NO_EXCEPT;
+
+    /**
+     * @brief Map the values of a BPF_MAP_TYPE_ARRAY map created with BPF_F_MMAPABLE into the calling process, so
+     * that they can be read and written directly instead of one element per call. Value i starts at offset
+     * i * value_size. Accesses are not synchronized with programs updating the map. Each process maps the values
+     * once and later calls return the same pointer. The mapping is removed when the map is freed, so the map must be
+     * kept open while the values are in use.
+     *
+     * @param[in] map_fd File descriptor of the array map.
+     * @param[out] buffer Pointer to the values.
+     * @param[out] buffer_size Size of the values in bytes, max_entries * value_size.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_INVALID_FD The file descriptor is not valid.
+     * @retval EBPF_INVALID_ARGUMENT The map is not an array map created with BPF_F_MMAPABLE.
+     * @retval EBPF_NO_MEMORY Unable to map the values.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_map_mmap(fd_t map_fd, _Outptr_ void** buffer, _Out_ size_t* buffer_size) EBPF_NO_EXCEPT;
+
+    /**
+     * @brief Enable or disable counting the operations on all maps. The counters are returned in the statistics
+     * field of bpf_map_info and are kept while counting is disabled. Counting is disabled by default.
+     *
+     * @param[in] enabled True to count map operations, false to stop counting.
+     * @retval EBPF_SUCCESS The operation was successful.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_set_map_statistics_enabled(bool enabled) EBPF_NO_EXCEPT;
+
+    /**
+     * @brief Write data into the perf event array map ring of the current CPU.
+     *
+     * @param [in] perf_event_array_map_fd perf event array map file descriptor.
+     * @param [in] data Pointer to data to be written.
+     * @param [in] data_length Length of data to be written.
+     * @retval EPBF_SUCCESS Successfully wrote record into the perf event array.
+     * @retval EBPF_OUT_OF_SPACE Unable to output to the perf event array due to inadequate space.
+     * @retval EBPF_NO_MEMORY Out of memory.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_perf_event_array_map_write(
+        fd_t perf_event_array_map_fd, _In_reads_bytes_(data_length) const void* data, size_t data_length)
+        EBPF_NO_EXCEPT;
+
+    struct perf_buffer;
+
+/**
+ * @brief Invoke the perf buffer callbacks from async completion threads as soon as records are available, instead
+ * of from perf_buffer__poll and perf_buffer__consume.
+ */
+#define EBPF_PERFBUF_FLAG_AUTO_CALLBACK ((uint64_t)1 << 0)
+
+    /**
+     * @brief Options for ebpf_perf_buffer__new. This extends the libbpf perf_buffer_opts with eBPF for Windows
+     * specific flags.
+     */
+    typedef struct ebpf_perf_buffer_opts
+    {
+        size_t sz;      ///< Size of this structure, for forward/backward compatibility.
+        uint64_t flags; ///< EBPF_PERFBUF_FLAG_* flags.
+    } ebpf_perf_buffer_opts_t;
+
+    /**
+     * @brief Create a perf buffer manager for a BPF_MAP_TYPE_PERF_EVENT_ARRAY map, like perf_buffer__new but
+     * with eBPF for Windows specific options.
+     *
+     * @param[in] map_fd File descriptor of the perf event array map.
+     * @param[in] page_cnt Number of memory pages for each per-CPU buffer (unused, the map definition is used).
+     * @param[in] sample_cb Function called on each received data record.
+     * @param[in] lost_cb Optional function called when record loss has occurred.
+     * @param[in] ctx User-provided context passed into sample_cb and lost_cb.
+     * @param[in] opts Optional perf buffer options.
+     *
+     * @returns Pointer to perf buffer manager, or NULL on error with errno containing an error code.
+     */
+    _Ret_maybenull_ struct perf_buffer*
+    ebpf_perf_buffer__new(
+        int map_fd,
+        size_t page_cnt,
+        _In_ void (*sample_cb)(void* ctx, int cpu, void* data, uint32_t size),
+        _In_opt_ void (*lost_cb)(void* ctx, int cpu, uint64_t cnt),
+        _In_opt_ void* ctx,
+        _In_opt_ const ebpf_perf_buffer_opts_t* opts) EBPF_NO_EXCEPT;
+
     /**
      * @brief Get eBPF program type for the specified BPF program type.
      *
@@ -32,6 +32,8 @@ typedef enum bpf_map_type
     BPF_MAP_TYPE_STACK = 12,            ///< Stack.
     BPF_MAP_TYPE_RINGBUF = 13,          ///< Ring buffer.
     BPF_MAP_TYPE_PERF_EVENT_ARRAY = 14, ///< Perf event array.
+    BPF_MAP_TYPE_USER_RINGBUF = 15,     ///< Ring buffer written by user mode and drained by programs.
+    BPF_MAP_TYPE_BLOOM_FILTER = 16,     ///< Bloom filter, where values are added with push and tested with peek.
 } ebpf_map_type_t;
 
 #define BPF_MAP_TYPE_PER_CPU(X)                                                                                    \
@@ -54,6 +56,8 @@ static const char* const _ebpf_map_type_names[] = {
     BPF_ENUM_TO_STRING(BPF_MAP_TYPE_STACK),
     BPF_ENUM_TO_STRING(BPF_MAP_TYPE_RINGBUF),
     BPF_ENUM_TO_STRING(BPF_MAP_TYPE_PERF_EVENT_ARRAY),
+    BPF_ENUM_TO_STRING(BPF_MAP_TYPE_USER_RINGBUF),
+    BPF_ENUM_TO_STRING(BPF_MAP_TYPE_BLOOM_FILTER),
 };
 
 static const char* const _ebpf_map_display_names[] = {
@@ -72,6 +76,8 @@ static const char* const _ebpf_map_display_names[] = {
     "stack",
     "ringbuf",
     "perf_event_array",
+    "user_ringbuf",
+    "bloom_filter",
 };
 
 typedef enum ebpf_map_option
@@ -110,6 +116,11 @@ typedef struct _ebpf_map_definition_in_memory
     uint32_t max_entries; ///< Maximum number of entries allowed in the map.
     ebpf_id_t inner_map_id;
     ebpf_pin_type_t pinning;
+    uint32_t map_flags; ///< Map flags (BPF_F_*).
+    /// Map type specific data, such as the number of hash functions of a bloom filter. For BPF_MAP_TYPE_HASH this
+    /// is the number of seconds an entry can go without being looked up or updated before it is deleted, or zero
+    /// if entries don't expire (Windows-specific).
+    uint64_t map_extra;
 } ebpf_map_definition_in_memory_t;
 
 /**
@@ -171,6 +182,7 @@ typedef enum
     BPF_FUNC_ktime_get_boot_ms = 30,         ///< \ref bpf_ktime_get_boot_ms
     BPF_FUNC_ktime_get_ms = 31,              ///< \ref bpf_ktime_get_ms
     BPF_FUNC_perf_event_output = 32,         ///< \ref bpf_perf_event_output
+    BPF_FUNC_user_ringbuf_read = 33,         ///< \ref bpf_user_ringbuf_read
 } ebpf_helper_id_t;
 
 // Cross-platform BPF program types.
@@ -370,6 +382,23 @@ struct bpf_link_info
 
 #define BPF_OBJ_NAME_LEN 64
 
+/**
+ * @brief Counters of the operations on a map, collected while map statistics are enabled with
+ * ebpf_set_map_statistics_enabled (Windows-specific).
+ */
+typedef struct _ebpf_map_statistics
+{
+    uint64_t lookup_count;                 ///< Number of lookups.
+    uint64_t lookup_hit_count;             ///< Number of lookups that found an entry.
+    uint64_t lookup_miss_count;            ///< Number of lookups that found no entry.
+    uint64_t update_count;                 ///< Number of successful updates.
+    uint64_t update_out_of_space_count;    ///< Number of updates that failed because the map was full.
+    uint64_t update_no_memory_count;       ///< Number of updates that failed to allocate memory.
+    uint64_t delete_count;                 ///< Number of successful deletes.
+    uint64_t lru_eviction_count;           ///< Number of entries evicted from an LRU map to make room.
+    uint64_t bucket_lock_contention_count; ///< Number of hash map updates that found their bucket lock held.
+} ebpf_map_statistics_t;
+
 /**
  * @brief eBPF map information.  This structure can be retrieved by calling
  * \ref bpf_obj_get_info_by_fd on a map fd.
@@ -384,16 +413,25 @@ struct bpf_map_info
     uint32_t max_entries;        ///< Maximum number of entries allowed in the map.
     char name[BPF_OBJ_NAME_LEN]; ///< Null-terminated map name.
     uint32_t map_flags;          ///< Map flags.
+    uint64_t map_extra;          ///< Map type specific data.
 
     // Windows-specific fields.
-    ebpf_id_t inner_map_id;     ///< ID of inner map template.
-    uint32_t pinned_path_count; ///< Number of pinned paths.
+    ebpf_id_t inner_map_id;           ///< ID of inner map template.
+    uint32_t pinned_path_count;       ///< Number of pinned paths.
+    uint64_t expired_entry_count;     ///< Number of entries of a hash map with a TTL that expired.
+    ebpf_map_statistics_t statistics; ///< Counters of the operations on the map.
 };
 
 #define BPF_ANY 0x0
 #define BPF_NOEXIST 0x1
 #define BPF_EXIST 0x2
 
+/* Map creation flags. */
+#define BPF_F_NO_PREALLOC (1U << 0)        ///< Hash map allocates entries on update instead of at creation.
+#define BPF_F_MMAPABLE (1U << 10)          ///< Array map values can be mapped into user mode.
+#define BPF_F_UPDATE_IN_PLACE (1U << 30)   ///< Hash map overwrites values of existing keys in place (Windows-specific).
+#define BPF_F_RINGBUF_OVERWRITE (1U << 31) ///< Ring buffer overwrites the oldest records when full (Windows-specific).
+
 /**
  * @brief eBPF program information.  This structure can be retrieved by calling
  * \ref bpf_obj_get_info_by_fd on a program fd.
@@ -414,6 +452,10 @@ struct bpf_prog_info
     uint32_t link_count;                 ///< Number of attached links.
 };
 
+/* BPF_FUNC_ringbuf_output flags. */
+#define BPF_RB_NO_WAKEUP (1ULL << 0)    ///< Don't notify the consumer about this record.
+#define BPF_RB_FORCE_WAKEUP (1ULL << 1) ///< Notify the consumer regardless of the wakeup policy of the map.
+
 /* BPF_FUNC_perf_event_output flags. */
 #define EBPF_MAP_FLAG_INDEX_MASK 0xffffffffULL
 #define EBPF_MAP_FLAG_INDEX_SHIFT 0
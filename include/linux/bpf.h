@@ -99,6 +99,11 @@ typedef struct
     uint32_t numa_node;                  ///< Not supported, must be zero.
     char map_name[SYS_BPF_OBJ_NAME_LEN]; ///< Map name.
     uint32_t map_ifindex;                ///< Not supported, must be zero.
+    uint32_t btf_fd;                     ///< Not supported, must be zero.
+    uint32_t btf_key_type_id;            ///< Not supported, must be zero.
+    uint32_t btf_value_type_id;          ///< Not supported, must be zero.
+    uint32_t btf_vmlinux_value_type_id;  ///< Not supported, must be zero.
+    uint64_t map_extra;                  ///< Map type specific data.
 } sys_bpf_map_create_attr_t;
 
 typedef struct
@@ -5,6 +5,7 @@
 
 #include "api_common.hpp"
 #include "ebpf_api.h"
+#include "ebpf_ring_buffer_record.h"
 #include "spec_type_descriptors.hpp"
 
 #if !defined(EBPF_API_LOCKING)
@@ -641,9 +642,14 @@ typedef int (*ring_buffer_sample_fn)(void* ctx, void* data, size_t size);
  * @param[in] ring_buffer_map_fd File descriptor to the ring buffer map.
  * @param[in, out] sample_callback_context Pointer to supplied context to be passed in notification callback.
  * @param[in] sample_callback Function pointer to notification handler.
+ * @param[in] flags Subscription flags. If EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK is set, the callback is only invoked
+ * from ebpf_ring_buffer_map_consume, otherwise it is invoked from async completion threads.
+ * @param[in] ready_event Event set when records may be available, required with EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK.
+ * The event must outlive the subscription and may be shared with other subscriptions.
  * @param[out] subscription Opaque pointer to ring buffer subscription object.
  *
  * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_ARGUMENT The map is not a ring buffer or the flags are invalid.
  * @retval EBPF_NO_MEMORY Out of memory.
  */
 _Must_inspect_result_ ebpf_result_t
@@ -651,8 +657,67 @@ ebpf_ring_buffer_map_subscribe(
     fd_t ring_buffer_map_fd,
     _Inout_opt_ void* sample_callback_context,
     ring_buffer_sample_fn sample_callback,
+    uint64_t flags,
+    _In_opt_ HANDLE ready_event,
     _Outptr_ ring_buffer_subscription_t** subscription) noexcept;
 
+/**
+ * @brief Indicate the records available in a ring buffer subscription created with
+ * EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK, without waiting. Must not be called concurrently for the same subscription.
+ *
+ * @param[in, out] subscription Pointer to ring buffer subscription.
+ * @param[out] record_count Number of records indicated to the sample callback.
+ * @param[out] sample_result Non-zero value returned by the sample callback, which stops the drain and leaves the
+ * record in the ring, or 0.
+ *
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_OPERATION_NOT_SUPPORTED The subscription uses auto callbacks.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_consume(
+    _Inout_ ring_buffer_subscription_t* subscription, _Out_ uint32_t* record_count, _Out_ int* sample_result) noexcept;
+
+/**
+ * @brief Set the wakeup policy of a ring buffer map. Async queries on the map are completed once any enabled
+ * threshold is reached. All zero restores the default of completing them on every record.
+ *
+ * @param[in] ring_buffer_map_fd File descriptor to the ring buffer map.
+ * @param[in] wakeup_bytes Number of pending bytes that triggers a wakeup, 0 to disable.
+ * @param[in] wakeup_records Number of pending records that triggers a wakeup, 0 to disable.
+ * @param[in] max_latency_ms Maximum time in milliseconds a pending record waits for a wakeup, 0 to disable. At most
+ * UINT32_MAX / 1000.
+ *
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_FD The file descriptor is not valid.
+ * @retval EBPF_INVALID_ARGUMENT The map is not a ring buffer map, or the max latency is too large.
+ * @retval EBPF_NO_MEMORY Out of memory.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_set_wakeup(
+    fd_t ring_buffer_map_fd, size_t wakeup_bytes, uint32_t wakeup_records, uint32_t max_latency_ms) noexcept;
+
+/**
+ * @brief Map the data and offsets page of a user ring buffer map into the calling process. The data is writable,
+ * so the process can produce records without an IOCTL per record.
+ *
+ * @param[in] map_fd File descriptor to the user ring buffer map.
+ * @param[out] buffer Pointer to the ring buffer data, mapped twice back to back.
+ * @param[out] buffer_size Size of the ring buffer data.
+ * @param[out] offsets Pointer to the shared producer and consumer offsets.
+ * @param[out] producer_offset Current producer offset.
+ *
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_FD The file descriptor is not valid.
+ * @retval EBPF_INVALID_ARGUMENT The map is not a user ring buffer map.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_user_ring_buffer_map_query_buffer(
+    fd_t map_fd,
+    _Outptr_ uint8_t** buffer,
+    _Out_ size_t* buffer_size,
+    _Outptr_ ebpf_ring_buffer_offsets_t** offsets,
+    _Out_ size_t* producer_offset) noexcept;
+
 /**
  * @brief Unsubscribe from the ring buffer map event notifications.
  *
@@ -665,15 +730,18 @@ typedef void (*perf_buffer_sample_fn)(void* ctx, int cpu, void* data, uint32_t s
 typedef void (*perf_buffer_lost_fn)(void* ctx, int cpu, uint64_t cnt);
 
 /**
- * @brief Subscribe for notifications from the input perf event array map.
+ * @brief Subscribe for notifications from every CPU ring of the input perf event array map.
  *
  * @param[in] perf_event_array_map_fd File descriptor to the perf event array map.
- * @param[in, out] sample_callback_context Pointer to supplied context to be passed in notification callback.
+ * @param[in, out] callback_context Pointer to supplied context to be passed in notification callbacks.
  * @param[in] sample_callback Function pointer to notification handler.
- * @param[in] lost_callback Function pointer to lost record notification handler.
+ * @param[in] lost_callback Optional function pointer to lost record notification handler.
+ * @param[in] flags Subscription flags. If EBPF_PERFBUF_FLAG_AUTO_CALLBACK is set, the callbacks are invoked from
+ * async completion threads, otherwise they are only invoked from ebpf_perf_event_array_map_poll.
  * @param[out] subscription Opaque pointer to perf event array subscription object.
  *
  * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_ARGUMENT The map is not a perf event array or the flags are invalid.
  * @retval EBPF_NO_MEMORY Out of memory.
  */
 _Must_inspect_result_ ebpf_result_t
@@ -681,11 +749,28 @@ ebpf_perf_event_array_map_subscribe(
     fd_t perf_event_array_map_fd,
     _Inout_opt_ void* callback_context,
     perf_buffer_sample_fn sample_callback,
-    perf_buffer_lost_fn lost_callback,
+    _In_opt_ perf_buffer_lost_fn lost_callback,
+    uint64_t flags,
     _Outptr_ perf_event_array_subscription_t** subscription) noexcept;
 
 /**
- * @brief Unsubscribe from the perf event array map event notifications.
+ * @brief Indicate the records available on all CPU rings of a perf event array subscription, waiting for records to
+ * become available if there are none.
+ *
+ * @param[in, out] subscription Pointer to perf event array subscription.
+ * @param[in] timeout_ms Maximum time to wait in milliseconds. 0 does not wait, a negative value waits indefinitely.
+ * @param[out] record_count Number of records indicated to the sample callback.
+ *
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_OPERATION_NOT_SUPPORTED The subscription uses EBPF_PERFBUF_FLAG_AUTO_CALLBACK.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_perf_event_array_map_poll(
+    _Inout_ perf_event_array_subscription_t* subscription, int32_t timeout_ms, _Out_ uint32_t* record_count) noexcept;
+
+/**
+ * @brief Unsubscribe from the perf event array map event notifications. No callback is invoked once this function
+ * returns, so it must not be called from within a callback.
  *
  * @param[in] subscription Pointer to perf event array subscription to be canceled.
  */
@@ -199,6 +199,7 @@ bpf(int cmd, union bpf_attr* attr, unsigned int size)
             struct bpf_map_create_opts opts = {
                 .inner_map_fd = map_create_attr->inner_map_fd,
                 .map_flags = map_create_attr->map_flags,
+                .map_extra = map_create_attr->map_extra,
                 .numa_node = map_create_attr->numa_node,
                 .map_ifindex = map_create_attr->map_ifindex,
             };
@@ -207,6 +208,11 @@ bpf(int cmd, union bpf_attr* attr, unsigned int size)
                 return -EINVAL;
             }
 
+            if (map_create_attr->btf_fd != 0 || map_create_attr->btf_key_type_id != 0 ||
+                map_create_attr->btf_value_type_id != 0 || map_create_attr->btf_vmlinux_value_type_id != 0) {
+                return -EINVAL;
+            }
+
             return bpf_map_create(
                 map_create_attr->map_type,
                 map_create_attr->map_name,
@@ -317,7 +317,8 @@ ebpf_map_create(
 
     ebpf_assert(map_fd);
 
-    if (opts && (opts->map_flags != 0 || opts->numa_node != 0 || opts->map_ifindex != 0)) {
+    // Map flags are validated by the execution context, which knows which flags each map type supports.
+    if (opts && (opts->numa_node != 0 || opts->map_ifindex != 0)) {
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
@@ -328,6 +329,8 @@ ebpf_map_create(
         map_definition.key_size = key_size;
         map_definition.value_size = value_size;
         map_definition.max_entries = max_entries;
+        map_definition.map_flags = opts ? opts->map_flags : 0;
+        map_definition.map_extra = opts ? opts->map_extra : 0;
 
         // bpf_map_create_opts has inner_map_fd defined as __u32, so it cannot be set to
         // ebpf_fd_invalid (-1). Hence treat inner_map_fd = 0 as ebpf_fd_invalid.
@@ -465,7 +468,6 @@ _ebpf_map_lookup_element_helper(fd_t map_fd, bool find_and_delete, _In_opt_ cons
     uint32_t type;
 
     ebpf_assert(value);
-    *((uint8_t*)value) = 0;
 
     map_handle = _get_handle_from_file_descriptor(map_fd);
     if (map_handle == ebpf_handle_invalid) {
@@ -482,6 +484,16 @@ _ebpf_map_lookup_element_helper(fd_t map_fd, bool find_and_delete, _In_opt_ cons
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
+    if (type == BPF_MAP_TYPE_BLOOM_FILTER) {
+        // A bloom filter lookup tests for the value passed in, which is sent in place of the key.
+        if (find_and_delete) {
+            result = EBPF_OPERATION_NOT_SUPPORTED;
+            goto Exit;
+        }
+        result = _map_lookup_element(map_handle, false, value_size, (uint8_t*)value, value_size, (uint8_t*)value);
+        goto Exit;
+    }
+    *((uint8_t*)value) = 0;
     assert(value_size != 0);
     if (BPF_MAP_TYPE_PER_CPU(type)) {
         value_size = EBPF_PAD_8(value_size) * libbpf_num_possible_cpus();
@@ -517,7 +529,6 @@ _ebpf_map_lookup_element_batch_helper(
 
     size_t input_count = *count;
     size_t count_returned = 0;
-    size_t max_entries_per_batch = 0;
     size_t key_size = 0;
     size_t value_size = 0;
 
@@ -528,97 +539,70 @@ _ebpf_map_lookup_element_batch_helper(
     ebpf_assert(count);
 
     if (*count == 0) {
-        result = EBPF_INVALID_ARGUMENT;
-        goto Exit;
+        EBPF_RETURN_RESULT(EBPF_INVALID_ARGUMENT);
     }
 
     map_handle = _get_handle_from_file_descriptor(map_fd);
     if (map_handle == ebpf_handle_invalid) {
-        result = EBPF_INVALID_FD;
-        goto Exit;
+        EBPF_RETURN_RESULT(EBPF_INVALID_FD);
     }
 
     // Get map properties, either from local cache or from execution context.
     result = _get_map_descriptor_properties(map_handle, &type, &key_size_u32, &value_size_u32, &max_entries_u32);
     if (result != EBPF_SUCCESS) {
-        goto Exit;
+        EBPF_RETURN_RESULT(result);
     }
 
     key_size = key_size_u32;
     value_size = value_size_u32;
 
     if (key_size == 0 || value_size == 0 || input_count == 0) {
-        result = EBPF_INVALID_ARGUMENT;
-        goto Exit;
+        EBPF_RETURN_RESULT(EBPF_INVALID_ARGUMENT);
     }
 
     if (BPF_MAP_TYPE_PER_CPU(type)) {
         value_size = EBPF_PAD_8(value_size) * libbpf_num_possible_cpus();
     }
 
-    // Compute the maximum number of entries that can be updated in a single batch.
-    max_entries_per_batch = UINT16_MAX - EBPF_OFFSET_OF(_ebpf_operation_map_get_next_key_value_batch_reply, data);
-    max_entries_per_batch /= (key_size + value_size);
-
-    while (count_returned < input_count) {
-        // Fetch the next batch of entries.
-        size_t entries_to_fetch = min(input_count - count_returned, max_entries_per_batch);
-
-        ebpf_protocol_buffer_t request_buffer(
-            EBPF_OFFSET_OF(_ebpf_operation_map_get_next_key_value_batch_request, previous_key) +
-            (previous_key ? key_size : 0));
-        auto request = reinterpret_cast<_ebpf_operation_map_get_next_key_value_batch_request*>(request_buffer.data());
-        ebpf_protocol_buffer_t reply_buffer(
-            EBPF_OFFSET_OF(_ebpf_operation_map_get_next_key_value_batch_reply, data) +
-            entries_to_fetch * (key_size + value_size));
-        auto reply = reinterpret_cast<_ebpf_operation_map_get_next_key_value_batch_reply*>(reply_buffer.data());
-
-        request->header.length = static_cast<uint16_t>(request_buffer.size());
-        request->header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_GET_NEXT_KEY_VALUE_BATCH;
-        request->handle = map_handle;
-        request->find_and_delete = find_and_delete;
-        if (previous_key) {
-            std::copy(previous_key, previous_key + key_size, request->previous_key);
-        }
-
-        result = win32_error_code_to_ebpf_result(invoke_ioctl(request_buffer, reply_buffer));
-        if (result != EBPF_SUCCESS) {
-            goto Exit;
-        }
-
-        size_t entries_returned =
-            reply->header.length - EBPF_OFFSET_OF(_ebpf_operation_map_get_next_key_value_batch_reply, data);
-        entries_returned /= (key_size + value_size);
-
-        // Add this check to make the static analyzer happy.
-        if (entries_returned == 0) {
-            result = EBPF_INVALID_ARGUMENT;
-            goto Exit;
-        }
+    // The keys and values are written directly to the caller's arrays, so one request returns as many entries as fit
+    // in them.
+    ebpf_protocol_buffer_t request_buffer(
+        EBPF_OFFSET_OF(ebpf_operation_map_get_next_key_value_batch_user_buffer_request_t, previous_key) +
+        (previous_key ? key_size : 0));
+    auto request =
+        reinterpret_cast<ebpf_operation_map_get_next_key_value_batch_user_buffer_request_t*>(request_buffer.data());
+    ebpf_operation_map_get_next_key_value_batch_user_buffer_reply_t reply;
 
-        for (uint32_t index = 0; index < entries_returned; index++) {
-            uint8_t* key_data = reply->data + index * (key_size + value_size);
-            uint8_t* value_data = reply->data + index * (key_size + value_size) + key_size;
-            std::copy(key_data, key_data + key_size, (uint8_t*)keys + (count_returned + index) * key_size);
-            std::copy(value_data, value_data + value_size, (uint8_t*)values + (count_returned + index) * value_size);
-        }
-        count_returned += entries_returned;
+    request->header.length = static_cast<uint16_t>(request_buffer.size());
+    request->header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_GET_NEXT_KEY_VALUE_BATCH_USER_BUFFER;
+    request->handle = map_handle;
+    request->find_and_delete = find_and_delete;
+    request->cursor = 0;
+    request->count = input_count;
+    request->keys = reinterpret_cast<uint64_t>(keys);
+    request->values = reinterpret_cast<uint64_t>(values);
+    if (previous_key) {
+        std::copy(previous_key, previous_key + key_size, request->previous_key);
+    }
+
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request_buffer, reply));
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
 
-        // Set the previous_key for the next batch.
-        if (find_and_delete || count_returned == 0) {
-            // If find_and_delete is set to true, the entries are already deleted.
-            // If no more entries are returned, there is no need to fetch more.
-            // Hence the previous_key is set to null.
-            previous_key = nullptr;
-        } else {
-            // Point previous_key to the last key in the batch.
-            previous_key = (uint8_t*)keys + (count_returned - 1) * key_size;
-        }
+    // The execution context returns at least one entry on success, and never more than were requested.
+    if (reply.count_of_elements_returned == 0 || reply.count_of_elements_returned > input_count) {
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+    count_returned = static_cast<size_t>(reply.count_of_elements_returned);
 
-        // Partial return signals last no more entries.
-        if (entries_returned != entries_to_fetch) {
-            break;
-        }
+    if (find_and_delete) {
+        // The entries returned are already deleted.
+        previous_key = nullptr;
+    } else {
+        // Point previous_key to the last key returned.
+        previous_key = (uint8_t*)keys + (count_returned - 1) * key_size;
     }
 
     memset((uint8_t*)out_batch, 0, key_size);
@@ -749,11 +733,9 @@ _update_map_element_batch(
 {
     EBPF_LOG_ENTRY();
     ebpf_result_t result;
-    ebpf_protocol_buffer_t request_buffer;
-    ebpf_operation_map_update_element_batch_request_t* request;
-    ebpf_operation_map_update_element_batch_reply_t reply;
+    ebpf_operation_map_update_element_batch_user_buffer_request_t request;
+    ebpf_operation_map_update_element_batch_user_buffer_reply_t reply;
     size_t input_count = *count;
-    size_t max_entries_per_batch = 0;
 
     ebpf_assert(value);
     ebpf_assert(key || !key_size);
@@ -763,54 +745,23 @@ _update_map_element_batch(
         goto Exit;
     }
 
-    // Compute the maximum number of entries that can be updated in a single batch.
-    max_entries_per_batch = UINT16_MAX - EBPF_OFFSET_OF(ebpf_operation_map_update_element_batch_request_t, data);
-    max_entries_per_batch /= (key_size + value_size);
-
-    try {
-        for (size_t key_index = 0; key_index < input_count;) {
-            // Compute the number of entries to update in this batch.
-            size_t entries_to_update = min(input_count - key_index, max_entries_per_batch);
-
-            request_buffer.resize(
-                EBPF_OFFSET_OF(ebpf_operation_map_update_element_batch_request_t, data) +
-                entries_to_update * (key_size + value_size));
-            request = reinterpret_cast<ebpf_operation_map_update_element_batch_request_t*>(request_buffer.data());
-
-            request->header.length = static_cast<uint16_t>(request_buffer.size());
-            request->header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_UPDATE_ELEMENT_BATCH;
-            request->handle = (uint64_t)map_handle;
-            request->option = static_cast<ebpf_map_option_t>(flags);
-
-            for (size_t index = 0; index < entries_to_update; index++) {
-                uint8_t* source_key = (uint8_t*)key + (key_index + index) * key_size;
-                uint8_t* source_value = (uint8_t*)value + (key_index + index) * value_size;
-                uint8_t* destination_key = request->data + index * (key_size + value_size);
-                uint8_t* destination_value = request->data + index * (key_size + value_size) + key_size;
-
-                std::copy(source_key, source_key + key_size, destination_key);
-                std::copy(source_value, source_value + value_size, destination_value);
-            }
-
-            result = win32_error_code_to_ebpf_result(invoke_ioctl(request_buffer, reply));
-            if (result != EBPF_SUCCESS) {
-                goto Exit;
-            }
-
-            // Check number of entries updated in this batch.
-            if (reply.count_of_elements_processed != entries_to_update) {
-                result = EBPF_INVALID_ARGUMENT;
-                goto Exit;
-            }
-
-            key_index += entries_to_update;
-        }
-        result = EBPF_SUCCESS;
-    } catch (const std::bad_alloc&) {
-        result = EBPF_NO_MEMORY;
+    // The keys and values are read directly from the caller's arrays, so all of them are updated in one request.
+    request.header.length = sizeof(request);
+    request.header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_UPDATE_ELEMENT_BATCH_USER_BUFFER;
+    request.handle = (uint64_t)map_handle;
+    request.option = static_cast<ebpf_map_option_t>(flags);
+    request.count = input_count;
+    request.keys = reinterpret_cast<uint64_t>(key);
+    request.values = reinterpret_cast<uint64_t>(value);
+
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request, reply));
+    if (result != EBPF_SUCCESS) {
         goto Exit;
-    } catch (...) {
-        result = EBPF_FAILED;
+    }
+
+    // Check number of entries updated.
+    if (reply.count_of_elements_processed != input_count) {
+        result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
 
@@ -1052,13 +1003,11 @@ ebpf_map_delete_element_batch(fd_t map_fd, _In_ const void* keys, _Inout_ uint32
     uint32_t value_size_u32;
     uint32_t max_entries_u32;
     uint32_t type;
-    ebpf_protocol_buffer_t request_buffer;
-    ebpf_operation_map_delete_element_batch_request_t* request;
-    ebpf_operation_map_delete_element_batch_reply_t reply;
+    ebpf_operation_map_delete_element_batch_user_buffer_request_t request;
+    ebpf_operation_map_delete_element_batch_user_buffer_reply_t reply;
     size_t key_size;
     size_t value_size;
     size_t input_count = *count;
-    size_t max_entries_per_batch;
 
     if (flags != 0) {
         result = EBPF_INVALID_ARGUMENT;
@@ -1088,49 +1037,22 @@ ebpf_map_delete_element_batch(fd_t map_fd, _In_ const void* keys, _Inout_ uint32
     }
     assert(value_size != 0);
 
-    // Compute the maximum number of entries that can be updated in a single batch.
-    max_entries_per_batch = UINT16_MAX - EBPF_OFFSET_OF(ebpf_operation_map_delete_element_batch_request_t, keys);
-    max_entries_per_batch /= key_size;
+    // The keys are read directly from the caller's array, so all of them are deleted in one request.
+    request.header.length = sizeof(request);
+    request.header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_DELETE_ELEMENT_BATCH_USER_BUFFER;
+    request.handle = (uint64_t)map_handle;
+    request.count = input_count;
+    request.keys = reinterpret_cast<uint64_t>(keys);
 
-    if (max_entries_per_batch == 0) {
-        result = EBPF_INVALID_ARGUMENT;
-        goto Exit;
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request, reply));
+    if (result == EBPF_INVALID_OBJECT) {
+        result = EBPF_INVALID_FD;
     }
-
-    try {
-        for (size_t key_index = 0; key_index < input_count;) {
-            // Compute the number of entries to update in this batch.
-            size_t entries_to_delete = min(input_count - key_index, max_entries_per_batch);
-
-            request_buffer.resize(
-                EBPF_OFFSET_OF(ebpf_operation_map_delete_element_batch_request_t, keys) + key_size * entries_to_delete);
-            request = reinterpret_cast<ebpf_operation_map_delete_element_batch_request_t*>(request_buffer.data());
-
-            request->header.length = static_cast<uint16_t>(request_buffer.size());
-            request->header.id = ebpf_operation_id_t::EBPF_OPERATION_MAP_DELETE_ELEMENT_BATCH;
-            request->handle = (uint64_t)map_handle;
-
-            // Copy keys into request buffer.
-            memcpy(request->keys, (uint8_t*)keys + key_size * key_index, key_size * entries_to_delete);
-
-            result = win32_error_code_to_ebpf_result(invoke_ioctl(request_buffer, reply));
-            if (result == EBPF_INVALID_OBJECT) {
-                result = EBPF_INVALID_FD;
-            }
-            if (result != EBPF_SUCCESS) {
-                goto Exit;
-            }
-            if (reply.count_of_elements_processed != entries_to_delete) {
-                result = EBPF_INVALID_ARGUMENT;
-                goto Exit;
-            }
-            key_index += reply.count_of_elements_processed;
-        }
-    } catch (const std::bad_alloc&) {
-        result = EBPF_NO_MEMORY;
+    if (result != EBPF_SUCCESS) {
         goto Exit;
-    } catch (...) {
-        result = EBPF_FAILED;
+    }
+    if (reply.count_of_elements_processed != input_count) {
+        result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
 
@@ -4268,8 +4190,9 @@ typedef struct _ebpf_ring_buffer_subscription
 {
     _ebpf_ring_buffer_subscription()
         : unsubscribed(false), ring_buffer_map_handle(ebpf_handle_invalid), sample_callback_context(nullptr),
-          sample_callback(nullptr), buffer(nullptr), reply({}), async_ioctl_completion(nullptr),
-          async_ioctl_failed(false)
+          sample_callback(nullptr), auto_callback(true), ready_event(nullptr), buffer(nullptr), buffer_size(0),
+          offsets(nullptr), consumer_offset(0), reply({}), async_ioctl_completion(nullptr), query_pending(false),
+          query_ready(false), async_ioctl_failed(false)
     {
     }
     ~_ebpf_ring_buffer_subscription()
@@ -4287,14 +4210,117 @@ typedef struct _ebpf_ring_buffer_subscription
     ebpf_handle_t ring_buffer_map_handle;
     void* sample_callback_context;
     ring_buffer_sample_fn sample_callback;
+    // If set, records are indicated from the async completion threads instead of from
+    // ebpf_ring_buffer_map_consume.
+    bool auto_callback;
+    // Signaled when the async query completes without auto callbacks. Owned by the caller and may be shared by
+    // several subscriptions, so that one wait covers all of them.
+    HANDLE ready_event;
     uint8_t* buffer;
+    size_t buffer_size;
+    // Shared producer and consumer offsets. Records are drained by reading the producer offset and advancing the
+    // consumer offset here, the async query is only used to wait when the ring is empty.
+    ebpf_ring_buffer_offsets_t* offsets;
+    size_t consumer_offset;
     ebpf_operation_ring_buffer_map_async_query_reply_t reply;
     _Write_guarded_by_(lock) async_ioctl_completion_t* async_ioctl_completion;
+    _Write_guarded_by_(lock) bool query_pending;
+    _Write_guarded_by_(lock) bool query_ready;
     _Write_guarded_by_(lock) bool async_ioctl_failed;
 } ebpf_ring_buffer_subscription_t;
 
 typedef std::unique_ptr<ebpf_ring_buffer_subscription_t> ebpf_ring_buffer_subscription_ptr;
 
+/**
+ * @brief Post the async query that waits for records past the current consumer offset of a ring buffer
+ * subscription. Must be called with the subscription lock held, or before the subscription is published.
+ */
+static ebpf_result_t
+_ebpf_ring_buffer_subscription_post_query(_Inout_ ebpf_ring_buffer_subscription_t* subscription)
+{
+    // First, register wait for the new async IOCTL operation completion.
+    ebpf_result_t result = register_wait_async_ioctl_operation(subscription->async_ioctl_completion);
+    if (result != EBPF_SUCCESS) {
+        subscription->async_ioctl_failed = true;
+        return result;
+    }
+
+    // Then, post the async IOCTL.
+    ebpf_operation_ring_buffer_map_async_query_request_t async_query_request{
+        sizeof(async_query_request),
+        ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_ASYNC_QUERY,
+        subscription->ring_buffer_map_handle,
+        subscription->consumer_offset};
+    memset(&subscription->reply, 0, sizeof(ebpf_operation_ring_buffer_map_async_query_reply_t));
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(
+        async_query_request,
+        subscription->reply,
+        get_async_ioctl_operation_overlapped(subscription->async_ioctl_completion)));
+    if (result == EBPF_PENDING) {
+        result = EBPF_SUCCESS;
+    }
+    if (result == EBPF_SUCCESS) {
+        subscription->query_pending = true;
+    } else {
+        subscription->async_ioctl_failed = true;
+    }
+    return result;
+}
+
+/**
+ * @brief Indicate the records available in a ring buffer subscription to the subscriber. Keeps draining through the
+ * shared offsets page for as long as producers keep up, and stops early if the sample callback returns non-zero.
+ * Must only be called from one thread at a time.
+ *
+ * @param[in, out] subscription Ring buffer subscription to drain.
+ * @param[out] sample_result Non-zero value returned by the sample callback, 0 if all records were consumed.
+ *
+ * @returns Number of records indicated to the subscriber.
+ */
+static uint32_t
+_ebpf_ring_buffer_subscription_drain(_Inout_ ebpf_ring_buffer_subscription_t* subscription, _Out_ int* sample_result)
+{
+    size_t consumer = subscription->consumer_offset;
+    uint32_t record_count = 0;
+
+    *sample_result = 0;
+    while (*sample_result == 0) {
+        size_t start = consumer;
+        size_t producer = ReadULong64Acquire(&subscription->offsets->producer_offset);
+        for (;;) {
+            auto record =
+                ebpf_ring_buffer_next_record(subscription->buffer, subscription->buffer_size, consumer, producer);
+
+            if (record == nullptr) {
+                // No more records, or the next record is still being written by a producer.
+                break;
+            }
+
+            if (!record->header.discarded) {
+                *sample_result = subscription->sample_callback(
+                    subscription->sample_callback_context,
+                    const_cast<void*>(reinterpret_cast<const void*>(record->data)),
+                    record->header.length - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
+                if (*sample_result != 0) {
+                    break;
+                }
+                record_count++;
+            }
+
+            consumer += record->header.length;
+        }
+
+        // Release the consumed space to the producers.
+        WriteULong64Release(&subscription->offsets->consumer_offset, consumer);
+        if (consumer == start) {
+            break;
+        }
+    }
+    subscription->consumer_offset = consumer;
+
+    return record_count;
+}
+
 static ebpf_result_t
 _ebpf_ring_buffer_map_async_query_completion(_Inout_ void* completion_context) NO_EXCEPT_TRY
 {
@@ -4304,9 +4330,6 @@ _ebpf_ring_buffer_map_async_query_completion(_Inout_ void* completion_context) N
     ebpf_ring_buffer_subscription_t* subscription =
         reinterpret_cast<ebpf_ring_buffer_subscription_t*>(completion_context);
 
-    size_t consumer = 0;
-    size_t producer = 0;
-
     ebpf_result_t result = EBPF_SUCCESS;
     // Check the result of the completed async IOCTL call.
     result = get_async_ioctl_result(subscription->async_ioctl_completion);
@@ -4316,9 +4339,10 @@ _ebpf_ring_buffer_map_async_query_completion(_Inout_ void* completion_context) N
             // The async IOCTL was not canceled, but completed with a failure status. Mark the subscription object as
             // such, so that it gets freed when the user eventually unsubscribes.
             std::scoped_lock lock{subscription->lock};
+            subscription->query_pending = false;
             subscription->async_ioctl_failed = true;
             EBPF_RETURN_RESULT(result);
-        } else {
+        } else if (subscription->auto_callback) {
             // User has canceled subscription. Invoke user specified callback for the final time with NULL record. This
             // will let the user app clean up its state.
             TraceLoggingWrite(
@@ -4330,84 +4354,31 @@ _ebpf_ring_buffer_map_async_query_completion(_Inout_ void* completion_context) N
 
             subscription->sample_callback(subscription->sample_callback_context, nullptr, 0);
         }
-    } else {
+    } else if (subscription->auto_callback) {
         // Async IOCTL operation returned with success status. Read the ring buffer records and indicate it to the
-        // subscriber.
-
-        size_t ring_buffer_size = 0;
-        uint32_t dummy;
-
-        result = _get_map_descriptor_properties(
-            subscription->ring_buffer_map_handle,
-            &dummy,
-            &dummy,
-            &dummy,
-            reinterpret_cast<uint32_t*>(&ring_buffer_size));
-        if (result != EBPF_SUCCESS) {
-            EBPF_RETURN_RESULT(result);
-        }
-
-        ebpf_operation_ring_buffer_map_async_query_reply_t* reply = &subscription->reply;
-        ebpf_ring_buffer_map_async_query_result_t* async_query_result = &reply->async_query_result;
-        consumer = async_query_result->consumer;
-        producer = async_query_result->producer;
-        for (;;) {
-            auto record = ebpf_ring_buffer_next_record(subscription->buffer, ring_buffer_size, consumer, producer);
-
-            if (record == nullptr) {
-                // No more records.
-                break;
-            }
-
-            int callback_result = subscription->sample_callback(
-                subscription->sample_callback_context,
-                const_cast<void*>(reinterpret_cast<const void*>(record->data)),
-                record->header.length - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
-            if (callback_result != 0) {
-                break;
-            }
-
-            consumer += record->header.length;
-        }
+        // subscriber, and only go back to the kernel to wait once the ring is empty.
+        int sample_result;
+        (void)_ebpf_ring_buffer_subscription_drain(subscription, &sample_result);
     }
 
     bool free_subscription = false;
     {
         std::scoped_lock lock{subscription->lock};
+        subscription->query_pending = false;
 
         if (subscription->unsubscribed) {
             //  If the user has unsubscribed, this is the final callback. Mark the
             //  subscription context for deletion.
             result = EBPF_CANCELED;
             free_subscription = true;
-        } else {
+        } else if (subscription->auto_callback) {
             // If still subscribed, post the next async IOCTL call while holding the lock. It is safe to do so as the
             // async call is not blocking.
-
-            // First, register wait for the new async IOCTL operation completion.
-            result = register_wait_async_ioctl_operation(subscription->async_ioctl_completion);
-            if (result != EBPF_SUCCESS) {
-                EBPF_RETURN_RESULT(result);
-            }
-
-            // Then, post the async IOCTL.
-            ebpf_operation_ring_buffer_map_async_query_request_t async_query_request{
-                sizeof(async_query_request),
-                ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_ASYNC_QUERY,
-                subscription->ring_buffer_map_handle,
-                consumer};
-            memset(&subscription->reply, 0, sizeof(ebpf_operation_ring_buffer_map_async_query_reply_t));
-            result = win32_error_code_to_ebpf_result(invoke_ioctl(
-                async_query_request,
-                subscription->reply,
-                get_async_ioctl_operation_overlapped(subscription->async_ioctl_completion)));
-            if (result != EBPF_SUCCESS) {
-                if (result == EBPF_PENDING) {
-                    result = EBPF_SUCCESS;
-                } else {
-                    subscription->async_ioctl_failed = true;
-                }
-            }
+            result = _ebpf_ring_buffer_subscription_post_query(subscription);
+        } else {
+            // Hand the subscription over to the next call to ebpf_ring_buffer_map_consume.
+            subscription->query_ready = true;
+            SetEvent(subscription->ready_event);
         }
     }
     if (free_subscription) {
@@ -4423,6 +4394,8 @@ ebpf_ring_buffer_map_subscribe(
     fd_t map_fd,
     _Inout_opt_ void* sample_callback_context,
     ring_buffer_sample_fn sample_callback,
+    uint64_t flags,
+    _In_opt_ HANDLE ready_event,
     _Outptr_ ring_buffer_subscription_t** subscription) NO_EXCEPT_TRY
 {
     EBPF_LOG_ENTRY();
@@ -4434,6 +4407,12 @@ ebpf_ring_buffer_map_subscribe(
 
         ebpf_result_t result = EBPF_SUCCESS;
 
+        if ((flags & ~EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK) != 0 ||
+            ((flags & EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK) && ready_event == nullptr)) {
+            result = EBPF_INVALID_ARGUMENT;
+            EBPF_RETURN_RESULT(result);
+        }
+
         uint32_t key_size = 0;
         uint32_t value_size = 0;
         uint32_t max_entries = 0;
@@ -4493,11 +4472,16 @@ ebpf_ring_buffer_map_subscribe(
         ebpf_assert(query_buffer_reply.header.id == ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_QUERY_BUFFER);
         local_subscription->buffer =
             reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(query_buffer_reply.buffer_address));
+        local_subscription->buffer_size = max_entries;
+        local_subscription->offsets =
+            reinterpret_cast<ebpf_ring_buffer_offsets_t*>(static_cast<uintptr_t>(query_buffer_reply.offsets_address));
+        local_subscription->consumer_offset = query_buffer_reply.consumer_offset;
 
         // Initialize the async IOCTL operation.
         local_subscription->sample_callback_context = sample_callback_context;
         local_subscription->sample_callback = sample_callback;
-        memset(&local_subscription->reply, 0, sizeof(ebpf_operation_ring_buffer_map_async_query_reply_t));
+        local_subscription->auto_callback = !(flags & EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK);
+        local_subscription->ready_event = ready_event;
         result = initialize_async_ioctl_operation(
             local_subscription.get(),
             _ebpf_ring_buffer_map_async_query_completion,
@@ -4507,22 +4491,7 @@ ebpf_ring_buffer_map_subscribe(
         }
 
         // Issue the async query IOCTL.
-        ebpf_operation_ring_buffer_map_async_query_request_t async_query_request{
-            sizeof(async_query_request),
-            ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_ASYNC_QUERY,
-            local_subscription->ring_buffer_map_handle,
-            query_buffer_reply.consumer_offset};
-        result = win32_error_code_to_ebpf_result(invoke_ioctl(
-            async_query_request,
-            local_subscription->reply,
-            get_async_ioctl_operation_overlapped(local_subscription->async_ioctl_completion)));
-        if (result != EBPF_SUCCESS) {
-            if (result == EBPF_PENDING) {
-                result = EBPF_SUCCESS;
-            } else {
-                local_subscription->async_ioctl_failed = true;
-            }
-        }
+        result = _ebpf_ring_buffer_subscription_post_query(local_subscription.get());
 
         // If the async IOCTL failed, then free the subscription object.
         if (result == EBPF_SUCCESS) {
@@ -4592,197 +4561,493 @@ ebpf_ring_buffer_map_write(fd_t map_fd, _In_reads_bytes_(data_length) const void
 }
 CATCH_NO_MEMORY_EBPF_RESULT
 
-bool
-ebpf_ring_buffer_map_unsubscribe(_In_ _Post_invalid_ ring_buffer_subscription_t* subscription) NO_EXCEPT_TRY
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_set_wakeup(
+    fd_t map_fd, size_t wakeup_bytes, uint32_t wakeup_records, uint32_t max_latency_ms) NO_EXCEPT_TRY
 {
     EBPF_LOG_ENTRY();
-    ebpf_assert(subscription);
-    boolean cancel_result = true;
-    boolean free_subscription = false;
-    {
-        std::scoped_lock lock{subscription->lock};
-        // Set the unsubscribed flag, so that if a completion callback is ongoing, it does not issue another async
-        // IOCTL.
-        subscription->unsubscribed = true;
-        // Check if an earlier async operation has failed. In that case a new async operation will not be queued. This
-        // is the only case in which the subscription object can be freed in this function.
-        if (subscription->async_ioctl_failed) {
-            free_subscription = true;
-        } else {
-            // Attempt to cancel an ongoing async IOCTL.
-
-            TraceLoggingWrite(
-                ebpf_tracelog_provider,
-                EBPF_TRACELOG_EVENT_GENERIC_MESSAGE,
-                TraceLoggingLevel(WINEVENT_LEVEL_INFO),
-                TraceLoggingKeyword(EBPF_TRACELOG_KEYWORD_API),
-                TraceLoggingString(__FUNCTION__, "Attempt to cancel async query on ring_buffer map."));
-
-            cancel_result =
-                cancel_async_ioctl(get_async_ioctl_operation_overlapped(subscription->async_ioctl_completion));
-            // If the async operation could be canceled, a final completion callback would be invoked with EBPF_CANCELED
-            // status. If the async operation could not be canceled, that would mean a callback is ongoing which would
-            // eventually find out the subscription is canceled and will not post another async operation. In either
-            // case the final callback would free the subscription object.
-        }
+    ebpf_handle_t map_handle = _get_handle_from_file_descriptor(map_fd);
+    if (map_handle == ebpf_handle_invalid) {
+        EBPF_RETURN_RESULT(EBPF_INVALID_FD);
     }
 
-    if (free_subscription) {
-        delete subscription;
-    }
+    ebpf_operation_ring_buffer_map_set_wakeup_request_t request = {0};
+    request.header.length = sizeof(request);
+    request.header.id = ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_SET_WAKEUP;
+    request.map_handle = (uint64_t)map_handle;
+    request.wakeup_bytes = wakeup_bytes;
+    request.wakeup_records = wakeup_records;
+    request.max_latency_ms = max_latency_ms;
 
-    EBPF_RETURN_BOOL(cancel_result);
+    EBPF_RETURN_RESULT(win32_error_code_to_ebpf_result(invoke_ioctl(request)));
 }
-CATCH_NO_MEMORY_BOOL
+CATCH_NO_MEMORY_EBPF_RESULT
 
-typedef struct _ebpf_perf_event_array_subscription
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_snapshot(
+    fd_t map_fd, _In_ int (*sample_cb)(void* ctx, void* data, size_t size), _In_opt_ void* ctx) NO_EXCEPT_TRY
 {
-    _ebpf_perf_event_array_subscription()
-        : unsubscribed(false), perf_event_array_map_handle(ebpf_handle_invalid), callback_context(nullptr),
-          sample_callback(nullptr), lost_callback(nullptr), buffer(nullptr), reply({}), async_ioctl_completion(nullptr),
-          async_ioctl_failed(false)
-    {
+    EBPF_LOG_ENTRY();
+    ebpf_assert(sample_cb);
+    ebpf_handle_t map_handle = _get_handle_from_file_descriptor(map_fd);
+    if (map_handle == ebpf_handle_invalid) {
+        EBPF_RETURN_RESULT(EBPF_INVALID_FD);
     }
-    ~_ebpf_perf_event_array_subscription() { EBPF_LOG_ENTRY(); }
-    std::mutex lock;
-    _Write_guarded_by_(lock) boolean unsubscribed;
-    ebpf_handle_t perf_event_array_map_handle;
-    void* callback_context;
-    perf_buffer_sample_fn sample_callback;
-    perf_buffer_lost_fn lost_callback;
-    uint8_t* buffer;
-    uint32_t cpu_id;
-    ebpf_operation_perf_event_array_map_async_query_reply_t reply;
-    _Write_guarded_by_(lock) async_ioctl_completion_t* async_ioctl_completion;
-    _Write_guarded_by_(lock) bool async_ioctl_failed;
-} ebpf_perf_event_array_subscription_t;
-
-typedef std::unique_ptr<ebpf_perf_event_array_subscription_t> ebpf_perf_event_array_subscription_ptr;
 
-static ebpf_result_t
-_ebpf_perf_event_array_map_async_query_completion(_Inout_ void* completion_context) NO_EXCEPT_TRY
-{
-    EBPF_LOG_ENTRY();
-    ebpf_assert(completion_context);
+    uint32_t type;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t max_entries;
+    ebpf_result_t result = _get_map_descriptor_properties(map_handle, &type, &key_size, &value_size, &max_entries);
+    if (result != EBPF_SUCCESS) {
+        EBPF_RETURN_RESULT(result);
+    }
+    if (type != BPF_MAP_TYPE_RINGBUF) {
+        EBPF_RETURN_RESULT(EBPF_INVALID_ARGUMENT);
+    }
 
-    ebpf_perf_event_array_subscription_t* subscription =
-        reinterpret_cast<ebpf_perf_event_array_subscription_t*>(completion_context);
+    // The records are copied straight to this buffer. Sized to the ring, it holds every record.
+    std::vector<uint8_t> buffer(max_entries);
+    ebpf_operation_ring_buffer_map_snapshot_request_t request = {0};
+    ebpf_operation_ring_buffer_map_snapshot_reply_t reply;
+    request.header.length = sizeof(request);
+    request.header.id = ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_SNAPSHOT;
+    request.map_handle = (uint64_t)map_handle;
+    request.buffer = reinterpret_cast<uint64_t>(buffer.data());
+    request.buffer_length = buffer.size();
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request, reply));
+    if (result != EBPF_SUCCESS) {
+        EBPF_RETURN_RESULT(result);
+    }
 
-    const uint32_t cpu_id = subscription->cpu_id;
+    size_t length = static_cast<size_t>(std::min<uint64_t>(reply.length, buffer.size()));
+    size_t offset = 0;
+    while (offset < length) {
+        auto record = reinterpret_cast<const ebpf_ring_buffer_record_t*>(buffer.data() + offset);
+        if (!record->header.discarded) {
+            int callback_result = sample_cb(
+                ctx,
+                const_cast<void*>(reinterpret_cast<const void*>(record->data)),
+                record->header.length - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
+            if (callback_result != 0) {
+                break;
+            }
+        }
+        offset += record->header.length;
+    }
 
-    size_t consumer = 0;
-    size_t producer = 0;
-    size_t lost_count = 0;
+    EBPF_RETURN_RESULT(EBPF_SUCCESS);
+}
+CATCH_NO_MEMORY_EBPF_RESULT
 
-    ebpf_result_t result = EBPF_SUCCESS;
-    // Check the result of the completed async IOCTL call.
-    result = get_async_ioctl_result(subscription->async_ioctl_completion);
+_Must_inspect_result_ ebpf_result_t
+ebpf_map_mmap(fd_t map_fd, _Outptr_ void** buffer, _Out_ size_t* buffer_size) NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_assert(buffer);
+    ebpf_assert(buffer_size);
+    *buffer = nullptr;
+    *buffer_size = 0;
+
+    uint32_t key_size = 0;
+    uint32_t value_size = 0;
+    uint32_t max_entries = 0;
+    uint32_t type;
+    ebpf_handle_t map_handle = _get_handle_from_file_descriptor(map_fd);
+    if (map_handle == ebpf_handle_invalid) {
+        EBPF_RETURN_RESULT(EBPF_INVALID_FD);
+    }
 
+    ebpf_result_t result = _get_map_descriptor_properties(map_handle, &type, &key_size, &value_size, &max_entries);
     if (result != EBPF_SUCCESS) {
-        if (result != EBPF_CANCELED) {
-            // The async IOCTL was not canceled, but completed with a failure status. Mark the subscription object as
-            // such, so that it gets freed when the user eventually unsubscribes.
-            std::scoped_lock lock{subscription->lock};
-            subscription->async_ioctl_failed = true;
-            EBPF_RETURN_RESULT(result);
+        EBPF_RETURN_RESULT(result);
+    }
+
+    // The execution context checks that the map was created with BPF_F_MMAPABLE.
+    ebpf_operation_array_map_query_buffer_request_t request{
+        sizeof(request), ebpf_operation_id_t::EBPF_OPERATION_ARRAY_MAP_QUERY_BUFFER, map_handle};
+    ebpf_operation_array_map_query_buffer_reply_t reply{};
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request, reply));
+    if (result != EBPF_SUCCESS) {
+        EBPF_RETURN_RESULT(result);
+    }
+
+    *buffer = reinterpret_cast<void*>(static_cast<uintptr_t>(reply.buffer_address));
+    *buffer_size = static_cast<size_t>(max_entries) * value_size;
+    EBPF_RETURN_RESULT(EBPF_SUCCESS);
+}
+CATCH_NO_MEMORY_EBPF_RESULT
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_set_map_statistics_enabled(bool enabled) NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_operation_set_map_statistics_enabled_request_t request{
+        sizeof(request), ebpf_operation_id_t::EBPF_OPERATION_SET_MAP_STATISTICS_ENABLED, enabled ? 1u : 0u};
+    EBPF_RETURN_RESULT(win32_error_code_to_ebpf_result(invoke_ioctl(request)));
+}
+CATCH_NO_MEMORY_EBPF_RESULT
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_user_ring_buffer_map_query_buffer(
+    fd_t map_fd,
+    _Outptr_ uint8_t** buffer,
+    _Out_ size_t* buffer_size,
+    _Outptr_ ebpf_ring_buffer_offsets_t** offsets,
+    _Out_ size_t* producer_offset) NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    *buffer = nullptr;
+    *buffer_size = 0;
+    *offsets = nullptr;
+    *producer_offset = 0;
+
+    uint32_t key_size = 0;
+    uint32_t value_size = 0;
+    uint32_t max_entries = 0;
+    uint32_t type;
+    ebpf_handle_t map_handle = _get_handle_from_file_descriptor(map_fd);
+    if (map_handle == ebpf_handle_invalid) {
+        EBPF_RETURN_RESULT(EBPF_INVALID_FD);
+    }
+
+    ebpf_result_t result = _get_map_descriptor_properties(map_handle, &type, &key_size, &value_size, &max_entries);
+    if (result != EBPF_SUCCESS) {
+        EBPF_RETURN_RESULT(result);
+    }
+    if (type != BPF_MAP_TYPE_USER_RINGBUF) {
+        result = EBPF_INVALID_ARGUMENT;
+        EBPF_LOG_MESSAGE_ERROR(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_API,
+            "user_ring_buffer__new API is called on a map that is not of the user ring buffer type.",
+            result);
+        EBPF_RETURN_RESULT(result);
+    }
+
+    // The mappings belong to the process, so they outlive the map handle used to create them, but not the map.
+    ebpf_operation_ring_buffer_map_query_buffer_request_t request{
+        sizeof(request), ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_QUERY_BUFFER, map_handle};
+    ebpf_operation_ring_buffer_map_query_buffer_reply_t reply{};
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(request, reply));
+    if (result != EBPF_SUCCESS) {
+        EBPF_RETURN_RESULT(result);
+    }
+
+    *buffer = reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(reply.buffer_address));
+    *buffer_size = max_entries;
+    *offsets = reinterpret_cast<ebpf_ring_buffer_offsets_t*>(static_cast<uintptr_t>(reply.offsets_address));
+    *producer_offset = ReadULong64Acquire(&(*offsets)->producer_offset);
+    EBPF_RETURN_RESULT(EBPF_SUCCESS);
+}
+CATCH_NO_MEMORY_EBPF_RESULT
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_consume(
+    _Inout_ ring_buffer_subscription_t* subscription, _Out_ uint32_t* record_count, _Out_ int* sample_result)
+    NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_assert(subscription);
+    ebpf_assert(record_count);
+    ebpf_assert(sample_result);
+
+    ebpf_result_t result = EBPF_SUCCESS;
+    *record_count = 0;
+    *sample_result = 0;
+
+    if (subscription->auto_callback) {
+        // Records are indicated from the async completion threads.
+        result = EBPF_OPERATION_NOT_SUPPORTED;
+        EBPF_RETURN_RESULT(result);
+    }
+
+    bool query_ready;
+    {
+        std::scoped_lock lock{subscription->lock};
+        query_ready = subscription->query_ready;
+        subscription->query_ready = false;
+    }
+
+    // Records are read through the shared offsets page, so they can be drained whether or not the async query has
+    // completed. The async query is only re-armed once it has.
+    *record_count = _ebpf_ring_buffer_subscription_drain(subscription, sample_result);
+
+    if (query_ready) {
+        std::scoped_lock lock{subscription->lock};
+        if (!subscription->unsubscribed) {
+            result = _ebpf_ring_buffer_subscription_post_query(subscription);
+        }
+    }
+
+    EBPF_RETURN_RESULT(result);
+}
+CATCH_NO_MEMORY_EBPF_RESULT
+
+bool
+ebpf_ring_buffer_map_unsubscribe(_In_ _Post_invalid_ ring_buffer_subscription_t* subscription) NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_assert(subscription);
+    boolean cancel_result = true;
+    boolean free_subscription = false;
+    {
+        std::scoped_lock lock{subscription->lock};
+        // Set the unsubscribed flag, so that if a completion callback is ongoing, it does not issue another async
+        // IOCTL.
+        subscription->unsubscribed = true;
+        // Check if an earlier async operation has failed, or if the last completed one is waiting to be handed over to
+        // ebpf_ring_buffer_map_consume. In either case no async operation is pending, which is the only case in which
+        // the subscription object can be freed in this function.
+        if (subscription->async_ioctl_failed || !subscription->query_pending) {
+            free_subscription = true;
         } else {
-            // User has canceled subscription. Invoke user specified callback for the final time with NULL record. This
-            // will let the user app clean up its state.
+            // Attempt to cancel an ongoing async IOCTL.
+
             TraceLoggingWrite(
                 ebpf_tracelog_provider,
                 EBPF_TRACELOG_EVENT_GENERIC_MESSAGE,
                 TraceLoggingLevel(WINEVENT_LEVEL_INFO),
                 TraceLoggingKeyword(EBPF_TRACELOG_KEYWORD_API),
-                TraceLoggingString(
-                    __FUNCTION__, "perf_event_array map async query completion invoked with EBPF_CANCELED."));
+                TraceLoggingString(__FUNCTION__, "Attempt to cancel async query on ring_buffer map."));
 
-            subscription->sample_callback(subscription->callback_context, cpu_id, nullptr, 0);
+            cancel_result =
+                cancel_async_ioctl(get_async_ioctl_operation_overlapped(subscription->async_ioctl_completion));
+            // If the async operation could be canceled, a final completion callback would be invoked with EBPF_CANCELED
+            // status. If the async operation could not be canceled, that would mean a callback is ongoing which would
+            // eventually find out the subscription is canceled and will not post another async operation. In either
+            // case the final callback would free the subscription object.
         }
-    } else {
-        // Async IOCTL operation returned with success status. Read the ring buffer records and indicate it to the
-        // subscriber.
+    }
 
-        size_t perf_event_array_size = 0;
-        uint32_t dummy;
+    if (free_subscription) {
+        delete subscription;
+    }
 
-        result = _get_map_descriptor_properties(
-            subscription->perf_event_array_map_handle,
-            &dummy,
-            &dummy,
-            &dummy,
-            reinterpret_cast<uint32_t*>(&perf_event_array_size));
-        if (result != EBPF_SUCCESS) {
-            EBPF_RETURN_RESULT(result);
+    EBPF_RETURN_BOOL(cancel_result);
+}
+CATCH_NO_MEMORY_BOOL
+
+typedef struct _ebpf_perf_event_array_subscription ebpf_perf_event_array_subscription_t;
+
+// State for the subscription to a single CPU ring of a perf event array map.
+typedef struct _ebpf_perf_event_array_ring_subscription
+{
+    _ebpf_perf_event_array_ring_subscription()
+        : subscription(nullptr), cpu_id(0), buffer(nullptr), consumer_offset(0), lost_count(0), reply({}),
+          async_ioctl_completion(nullptr), query_pending(false), query_ready(false), async_ioctl_failed(false)
+    {
+    }
+    ~_ebpf_perf_event_array_ring_subscription()
+    {
+        if (async_ioctl_completion != nullptr) {
+            clean_up_async_ioctl_completion(async_ioctl_completion);
+        }
+    }
+    ebpf_perf_event_array_subscription_t* subscription;
+    uint32_t cpu_id;
+    const uint8_t* buffer;
+    // Offset of the next record to be read from this ring.
+    size_t consumer_offset;
+    // Lost record count already reported to the subscriber.
+    size_t lost_count;
+    ebpf_operation_perf_event_array_map_async_query_reply_t reply;
+    async_ioctl_completion_t* async_ioctl_completion;
+    // The following fields are guarded by the lock of the parent subscription.
+    bool query_pending;
+    bool query_ready;
+    bool async_ioctl_failed;
+} ebpf_perf_event_array_ring_subscription_t;
+
+typedef std::unique_ptr<ebpf_perf_event_array_ring_subscription_t> ebpf_perf_event_array_ring_subscription_ptr;
+
+typedef struct _ebpf_perf_event_array_subscription
+{
+    _ebpf_perf_event_array_subscription()
+        : unsubscribed(false), perf_event_array_map_handle(ebpf_handle_invalid), ring_size(0),
+          callback_context(nullptr), sample_callback(nullptr), lost_callback(nullptr), auto_callback(false),
+          pending_query_count(0), ready_event(nullptr), rundown_event(nullptr)
+    {
+    }
+    ~_ebpf_perf_event_array_subscription()
+    {
+        EBPF_LOG_ENTRY();
+        // Free the per-CPU state first, as it references the map handle and events.
+        rings.clear();
+        if (ready_event != nullptr) {
+            ::CloseHandle(ready_event);
+        }
+        if (rundown_event != nullptr) {
+            ::CloseHandle(rundown_event);
         }
+        if (perf_event_array_map_handle != ebpf_handle_invalid) {
+            Platform::CloseHandle(perf_event_array_map_handle);
+        }
+    }
+    std::mutex lock;
+    _Write_guarded_by_(lock) boolean unsubscribed;
+    ebpf_handle_t perf_event_array_map_handle;
+    size_t ring_size;
+    void* callback_context;
+    perf_buffer_sample_fn sample_callback;
+    perf_buffer_lost_fn lost_callback;
+    // If set, records are indicated from the async completion threads instead of from
+    // ebpf_perf_event_array_map_poll.
+    bool auto_callback;
+    _Write_guarded_by_(lock) uint32_t pending_query_count;
+    // Auto-reset event signaled when a ring has records ready to be consumed by ebpf_perf_event_array_map_poll.
+    HANDLE ready_event;
+    // Manual-reset event signaled when the last async query completes after unsubscribe.
+    HANDLE rundown_event;
+    std::vector<ebpf_perf_event_array_ring_subscription_ptr> rings;
+} ebpf_perf_event_array_subscription_t;
+
+typedef std::unique_ptr<ebpf_perf_event_array_subscription_t> ebpf_perf_event_array_subscription_ptr;
+
+/**
+ * @brief Post the next async query IOCTL for the given CPU ring. The request returns the records consumed so far to
+ * the kernel.
+ */
+static _Requires_lock_held_(ring->subscription->lock) ebpf_result_t
+    _ebpf_perf_event_array_ring_post_query(_Inout_ ebpf_perf_event_array_ring_subscription_t* ring)
+{
+    ebpf_perf_event_array_subscription_t* subscription = ring->subscription;
 
-        ebpf_operation_perf_event_array_map_async_query_reply_t* reply = &subscription->reply;
-        ebpf_perf_event_array_map_async_query_result_t* async_query_result = &reply->async_query_result;
-        consumer = async_query_result->consumer;
-        producer = async_query_result->producer;
-        lost_count = async_query_result->lost_count;
-        if (lost_count > 0) {
-            subscription->lost_callback(subscription->callback_context, cpu_id, lost_count);
+    // First, register wait for the new async IOCTL operation completion.
+    ebpf_result_t result = register_wait_async_ioctl_operation(ring->async_ioctl_completion);
+    if (result != EBPF_SUCCESS) {
+        ring->async_ioctl_failed = true;
+        return result;
+    }
+
+    // Then, post the async IOCTL.
+    ebpf_operation_perf_event_array_map_async_query_request_t async_query_request{
+        sizeof(async_query_request),
+        ebpf_operation_id_t::EBPF_OPERATION_PERF_EVENT_ARRAY_MAP_ASYNC_QUERY,
+        subscription->perf_event_array_map_handle,
+        ring->cpu_id,
+        ring->consumer_offset};
+    memset(&ring->reply, 0, sizeof(ebpf_operation_perf_event_array_map_async_query_reply_t));
+    result = win32_error_code_to_ebpf_result(invoke_ioctl(
+        async_query_request, ring->reply, get_async_ioctl_operation_overlapped(ring->async_ioctl_completion)));
+    if (result == EBPF_PENDING) {
+        result = EBPF_SUCCESS;
+    }
+    if (result == EBPF_SUCCESS) {
+        ring->query_pending = true;
+        subscription->pending_query_count++;
+    } else {
+        ring->async_ioctl_failed = true;
+    }
+    return result;
+}
+
+/**
+ * @brief Indicate lost records and all the records that the last completed async query reported for the given
+ * CPU ring. Must only be called while no async query is pending on the ring.
+ *
+ * @returns Number of records indicated to the subscriber.
+ */
+static uint32_t
+_ebpf_perf_event_array_ring_dispatch(_Inout_ ebpf_perf_event_array_ring_subscription_t* ring)
+{
+    ebpf_perf_event_array_subscription_t* subscription = ring->subscription;
+    const ebpf_perf_event_array_map_async_query_result_t* async_query_result = &ring->reply.async_query_result;
+    uint32_t record_count = 0;
+
+    // The kernel reports the total number of records lost on this CPU, indicate only the new losses.
+    if (async_query_result->lost_count > ring->lost_count) {
+        if (subscription->lost_callback != nullptr) {
+            subscription->lost_callback(
+                subscription->callback_context, ring->cpu_id, async_query_result->lost_count - ring->lost_count);
         }
-        for (;;) {
-            auto record =
-                ebpf_perf_event_array_next_record(subscription->buffer, perf_event_array_size, consumer, producer);
+        ring->lost_count = async_query_result->lost_count;
+    }
 
-            if (record == nullptr) {
-                // No more records.
-                break;
-            }
+    size_t consumer = ring->consumer_offset;
+    size_t producer = async_query_result->producer;
+    for (;;) {
+        auto record = ebpf_perf_event_array_next_record(ring->buffer, subscription->ring_size, consumer, producer);
+        if (record == nullptr) {
+            // No more records, or the next record is still being written by a producer.
+            break;
+        }
 
+        if (!record->header.discarded) {
             subscription->sample_callback(
                 subscription->callback_context,
-                cpu_id,
+                ring->cpu_id,
                 const_cast<void*>(reinterpret_cast<const void*>(record->data)),
-                record->header.length - EBPF_OFFSET_OF(ebpf_perf_event_array_record_t, data));
-            consumer += record->header.length;
+                record->header.length);
+            record_count++;
         }
+
+        // Perf event array records are 8 byte aligned and the header length only covers the data.
+        consumer += EBPF_PAD_8(EBPF_OFFSET_OF(ebpf_perf_event_array_record_t, data) + record->header.length);
     }
+    ring->consumer_offset = consumer;
 
-    bool free_subscription = false;
+    return record_count;
+}
+
+static ebpf_result_t
+_ebpf_perf_event_array_map_async_query_completion(_Inout_ void* completion_context) NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_assert(completion_context);
+
+    ebpf_perf_event_array_ring_subscription_t* ring =
+        reinterpret_cast<ebpf_perf_event_array_ring_subscription_t*>(completion_context);
+    ebpf_perf_event_array_subscription_t* subscription = ring->subscription;
+
+    // Check the result of the completed async IOCTL call.
+    ebpf_result_t result = get_async_ioctl_result(ring->async_ioctl_completion);
+
+    if (result == EBPF_SUCCESS && subscription->auto_callback) {
+        // No other async query is pending on this ring and the poll path is not used in this mode, so the ring can
+        // be read without holding the subscription lock.
+        (void)_ebpf_perf_event_array_ring_dispatch(ring);
+    } else if (result == EBPF_CANCELED) {
+        TraceLoggingWrite(
+            ebpf_tracelog_provider,
+            EBPF_TRACELOG_EVENT_GENERIC_MESSAGE,
+            TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+            TraceLoggingKeyword(EBPF_TRACELOG_KEYWORD_API),
+            TraceLoggingString(
+                __FUNCTION__, "perf_event_array map async query completion invoked with EBPF_CANCELED."));
+    }
+
+    bool signal_rundown = false;
     {
         std::scoped_lock lock{subscription->lock};
 
-        if (subscription->unsubscribed) {
-            // If the user has unsubscribed, this is the final callback. Mark the
-            // subscription context for deletion.
-            result = EBPF_CANCELED;
-            free_subscription = true;
-        } else {
-            // If still subscribed, post the next async IOCTL call while holding the lock. It is safe to do so as the
-            // async call is not blocking.
+        ring->query_pending = false;
+        subscription->pending_query_count--;
 
-            // First, register wait for the new async IOCTL operation completion.
-            result = register_wait_async_ioctl_operation(subscription->async_ioctl_completion);
-            if (result != EBPF_SUCCESS) {
-                EBPF_RETURN_RESULT(result);
+        if (result != EBPF_SUCCESS) {
+            if (result != EBPF_CANCELED) {
+                // The async IOCTL was not canceled, but completed with a failure status. Stop reading this ring.
+                ring->async_ioctl_failed = true;
             }
-
-            // Then, post the async IOCTL.
-            ebpf_operation_perf_event_array_map_async_query_request_t async_query_request{
-                sizeof(async_query_request),
-                ebpf_operation_id_t::EBPF_OPERATION_RING_BUFFER_MAP_ASYNC_QUERY,
-                subscription->perf_event_array_map_handle,
-                cpu_id,
-                consumer};
-            memset(&subscription->reply, 0, sizeof(ebpf_operation_perf_event_array_map_async_query_reply_t));
-            result = win32_error_code_to_ebpf_result(invoke_ioctl(
-                async_query_request,
-                subscription->reply,
-                get_async_ioctl_operation_overlapped(subscription->async_ioctl_completion)));
-            if (result != EBPF_SUCCESS) {
-                if (result == EBPF_PENDING) {
-                    result = EBPF_SUCCESS;
-                } else {
-                    subscription->async_ioctl_failed = true;
-                }
+        } else if (!subscription->unsubscribed) {
+            if (subscription->auto_callback) {
+                // Post the next async IOCTL call while holding the lock. It is safe to do so as the async call is not
+                // blocking.
+                result = _ebpf_perf_event_array_ring_post_query(ring);
+            } else {
+                // Hand the ring over to the next call to ebpf_perf_event_array_map_poll.
+                ring->query_ready = true;
+                SetEvent(subscription->ready_event);
             }
         }
+
+        signal_rundown = subscription->unsubscribed && (subscription->pending_query_count == 0);
     }
-    if (free_subscription) {
-        delete subscription;
+
+    // The subscription may be freed by ebpf_perf_event_array_map_unsubscribe as soon as the rundown event is set, so
+    // it must not be accessed after that.
+    if (signal_rundown) {
+        SetEvent(subscription->rundown_event);
     }
 
     EBPF_RETURN_RESULT(result);
@@ -4794,16 +5059,195 @@ ebpf_perf_event_array_map_subscribe(
     fd_t map_fd,
     _Inout_opt_ void* callback_context,
     perf_buffer_sample_fn sample_callback,
-    perf_buffer_lost_fn lost_callback,
+    _In_opt_ perf_buffer_lost_fn lost_callback,
+    uint64_t flags,
     _Outptr_ perf_event_array_subscription_t** subscription) NO_EXCEPT_TRY
 {
     EBPF_LOG_ENTRY();
-    UNREFERENCED_PARAMETER(map_fd);
-    UNREFERENCED_PARAMETER(callback_context);
-    UNREFERENCED_PARAMETER(sample_callback);
-    UNREFERENCED_PARAMETER(lost_callback);
-    UNREFERENCED_PARAMETER(subscription);
-    EBPF_RETURN_RESULT(EBPF_OPERATION_NOT_SUPPORTED);
+    try {
+        ebpf_assert(sample_callback);
+        ebpf_assert(subscription);
+
+        ebpf_result_t result = EBPF_SUCCESS;
+
+        uint32_t key_size = 0;
+        uint32_t value_size = 0;
+        uint32_t max_entries = 0;
+        uint32_t type;
+
+        *subscription = nullptr;
+
+        if ((flags & ~EBPF_PERFBUF_FLAG_AUTO_CALLBACK) != 0) {
+            result = EBPF_INVALID_ARGUMENT;
+            EBPF_RETURN_RESULT(result);
+        }
+
+        ebpf_handle_t map_handle = _get_handle_from_file_descriptor(map_fd);
+        if (map_handle == ebpf_handle_invalid) {
+            result = EBPF_INVALID_FD;
+            EBPF_RETURN_RESULT(result);
+        }
+
+        result = _get_map_descriptor_properties(map_handle, &type, &key_size, &value_size, &max_entries);
+        if (result != EBPF_SUCCESS) {
+            EBPF_RETURN_RESULT(result);
+        }
+
+        if (type != BPF_MAP_TYPE_PERF_EVENT_ARRAY) {
+            result = EBPF_INVALID_ARGUMENT;
+            EBPF_LOG_MESSAGE_ERROR(
+                EBPF_TRACELOG_LEVEL_ERROR,
+                EBPF_TRACELOG_KEYWORD_API,
+                "perf_buffer__new API is called on a map that is not of the perf event array type.",
+                result);
+            EBPF_RETURN_RESULT(result);
+        }
+
+        ebpf_perf_event_array_subscription_ptr local_subscription =
+            std::make_unique<ebpf_perf_event_array_subscription_t>();
+        local_subscription->ring_size = max_entries;
+        local_subscription->callback_context = callback_context;
+        local_subscription->sample_callback = sample_callback;
+        local_subscription->lost_callback = lost_callback;
+        local_subscription->auto_callback = (flags & EBPF_PERFBUF_FLAG_AUTO_CALLBACK) != 0;
+
+        if (!Platform::DuplicateHandle(
+                reinterpret_cast<ebpf_handle_t>(GetCurrentProcess()),
+                map_handle,
+                reinterpret_cast<ebpf_handle_t>(GetCurrentProcess()),
+                &local_subscription->perf_event_array_map_handle,
+                0,
+                FALSE,
+                DUPLICATE_SAME_ACCESS)) {
+            result = win32_error_code_to_ebpf_result(GetLastError());
+            _Analysis_assume_(result != EBPF_SUCCESS);
+            EBPF_LOG_WIN32_API_FAILURE(EBPF_TRACELOG_KEYWORD_API, DuplicateHandle);
+            EBPF_RETURN_RESULT(result);
+        }
+
+        local_subscription->ready_event = CreateEvent(nullptr, false, false, nullptr);
+        local_subscription->rundown_event = CreateEvent(nullptr, true, false, nullptr);
+        if (local_subscription->ready_event == nullptr || local_subscription->rundown_event == nullptr) {
+            result = win32_error_code_to_ebpf_result(GetLastError());
+            _Analysis_assume_(result != EBPF_SUCCESS);
+            EBPF_LOG_WIN32_API_FAILURE(EBPF_TRACELOG_KEYWORD_API, CreateEvent);
+            EBPF_RETURN_RESULT(result);
+        }
+
+        // Map each CPU ring into the process and prepare its async query.
+        uint32_t cpu_count = static_cast<uint32_t>(libbpf_num_possible_cpus());
+        for (uint32_t cpu_id = 0; cpu_id < cpu_count; cpu_id++) {
+            ebpf_perf_event_array_ring_subscription_ptr ring =
+                std::make_unique<ebpf_perf_event_array_ring_subscription_t>();
+            ring->subscription = local_subscription.get();
+            ring->cpu_id = cpu_id;
+
+            // Get user-mode address to the ring's shared data.
+            ebpf_operation_perf_event_array_map_query_buffer_request_t query_buffer_request{
+                sizeof(query_buffer_request),
+                ebpf_operation_id_t::EBPF_OPERATION_PERF_EVENT_ARRAY_MAP_QUERY_BUFFER,
+                local_subscription->perf_event_array_map_handle,
+                cpu_id};
+            ebpf_operation_perf_event_array_map_query_buffer_reply_t query_buffer_reply{};
+            result = win32_error_code_to_ebpf_result(invoke_ioctl(query_buffer_request, query_buffer_reply));
+            if (result != EBPF_SUCCESS) {
+                EBPF_RETURN_RESULT(result);
+            }
+            ebpf_assert(
+                query_buffer_reply.header.id == ebpf_operation_id_t::EBPF_OPERATION_PERF_EVENT_ARRAY_MAP_QUERY_BUFFER);
+            ring->buffer = reinterpret_cast<const uint8_t*>(static_cast<uintptr_t>(query_buffer_reply.buffer_address));
+            ring->consumer_offset = query_buffer_reply.consumer_offset;
+
+            result = initialize_async_ioctl_operation(
+                ring.get(), _ebpf_perf_event_array_map_async_query_completion, &ring->async_ioctl_completion);
+            if (result != EBPF_SUCCESS) {
+                EBPF_RETURN_RESULT(result);
+            }
+
+            local_subscription->rings.push_back(std::move(ring));
+        }
+
+        // Issue the async query IOCTL on every ring.
+        {
+            std::scoped_lock lock{local_subscription->lock};
+            for (auto& ring : local_subscription->rings) {
+                result = _ebpf_perf_event_array_ring_post_query(ring.get());
+                if (result != EBPF_SUCCESS) {
+                    break;
+                }
+            }
+        }
+
+        *subscription = local_subscription.release();
+        if (result != EBPF_SUCCESS) {
+            // Cancel the queries that were already posted and free the subscription object.
+            (void)ebpf_perf_event_array_map_unsubscribe(*subscription);
+            *subscription = nullptr;
+        }
+
+        EBPF_RETURN_RESULT(result);
+    } catch (const std::bad_alloc&) {
+        return EBPF_NO_MEMORY;
+    }
+}
+CATCH_NO_MEMORY_EBPF_RESULT
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_perf_event_array_map_poll(
+    _Inout_ perf_event_array_subscription_t* subscription, int32_t timeout_ms, _Out_ uint32_t* record_count)
+    NO_EXCEPT_TRY
+{
+    EBPF_LOG_ENTRY();
+    ebpf_assert(subscription);
+    ebpf_assert(record_count);
+
+    ebpf_result_t result = EBPF_SUCCESS;
+    *record_count = 0;
+
+    if (subscription->auto_callback) {
+        // Records are indicated from the async completion threads.
+        result = EBPF_OPERATION_NOT_SUPPORTED;
+        EBPF_RETURN_RESULT(result);
+    }
+
+    for (bool waited = false;; waited = true) {
+        // Drain every ring whose async query has completed, then re-arm it.
+        for (auto& ring : subscription->rings) {
+            {
+                std::scoped_lock lock{subscription->lock};
+                if (!ring->query_ready) {
+                    continue;
+                }
+                ring->query_ready = false;
+            }
+
+            *record_count += _ebpf_perf_event_array_ring_dispatch(ring.get());
+
+            std::scoped_lock lock{subscription->lock};
+            if (!subscription->unsubscribed) {
+                ebpf_result_t post_result = _ebpf_perf_event_array_ring_post_query(ring.get());
+                if (post_result != EBPF_SUCCESS) {
+                    result = post_result;
+                }
+            }
+        }
+
+        if (*record_count > 0 || waited || timeout_ms == 0) {
+            break;
+        }
+
+        DWORD wait_result = WaitForSingleObject(
+            subscription->ready_event, (timeout_ms < 0) ? INFINITE : static_cast<DWORD>(timeout_ms));
+        if (wait_result == WAIT_FAILED) {
+            result = win32_error_code_to_ebpf_result(GetLastError());
+            EBPF_LOG_WIN32_API_FAILURE(EBPF_TRACELOG_KEYWORD_API, WaitForSingleObject);
+            break;
+        } else if (wait_result == WAIT_TIMEOUT) {
+            break;
+        }
+    }
+
+    EBPF_RETURN_RESULT(result);
 }
 CATCH_NO_MEMORY_EBPF_RESULT
 
@@ -4812,10 +5256,55 @@ ebpf_perf_event_array_map_write(fd_t map_fd, _In_reads_bytes_(data_length) const
     NO_EXCEPT_TRY
 {
     EBPF_LOG_ENTRY();
-    UNREFERENCED_PARAMETER(map_fd);
-    UNREFERENCED_PARAMETER(data);
-    UNREFERENCED_PARAMETER(data_length);
-    EBPF_RETURN_RESULT(EBPF_OPERATION_NOT_SUPPORTED);
+    ebpf_result_t result = EBPF_SUCCESS;
+    ebpf_handle_t map_handle = ebpf_handle_invalid;
+    ebpf_protocol_buffer_t request_buffer;
+    ebpf_operation_perf_event_array_map_write_data_request_t* request;
+
+    if (!data || !data_length) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    try {
+        uint32_t key_size = 0;
+        uint32_t value_size = 0;
+        uint32_t max_entries = 0;
+        uint32_t type;
+
+        map_handle = _get_handle_from_file_descriptor(map_fd);
+        if (map_handle == ebpf_handle_invalid) {
+            result = EBPF_INVALID_FD;
+            EBPF_RETURN_RESULT(result);
+        }
+
+        result = _get_map_descriptor_properties(map_handle, &type, &key_size, &value_size, &max_entries);
+        if (result != EBPF_SUCCESS) {
+            EBPF_RETURN_RESULT(result);
+        }
+
+        if (type != BPF_MAP_TYPE_PERF_EVENT_ARRAY) {
+            result = EBPF_INVALID_ARGUMENT;
+            EBPF_LOG_MESSAGE_ERROR(
+                EBPF_TRACELOG_LEVEL_ERROR,
+                EBPF_TRACELOG_KEYWORD_API,
+                "ebpf_perf_event_array_map_write API is called on a map that is not of the perf event array type.",
+                result);
+            EBPF_RETURN_RESULT(result);
+        }
+
+        request_buffer.resize(
+            EBPF_OFFSET_OF(ebpf_operation_perf_event_array_map_write_data_request_t, data) + data_length);
+        request = reinterpret_cast<ebpf_operation_perf_event_array_map_write_data_request_t*>(request_buffer.data());
+        request->header.length = static_cast<uint16_t>(request_buffer.size());
+        request->header.id = ebpf_operation_id_t::EBPF_OPERATION_PERF_EVENT_ARRAY_MAP_WRITE_DATA;
+        request->map_handle = (uint64_t)map_handle;
+        std::copy((uint8_t*)data, (uint8_t*)data + data_length, request->data);
+
+        result = win32_error_code_to_ebpf_result(invoke_ioctl(request_buffer));
+    } catch (const std::bad_alloc&) {
+        EBPF_RETURN_RESULT(EBPF_NO_MEMORY);
+    }
+    EBPF_RETURN_RESULT(result);
 }
 CATCH_NO_MEMORY_EBPF_RESULT
 
@@ -4823,8 +5312,41 @@ bool
 ebpf_perf_event_array_map_unsubscribe(_In_ _Post_invalid_ perf_event_array_subscription_t* subscription) NO_EXCEPT_TRY
 {
     EBPF_LOG_ENTRY();
-    UNREFERENCED_PARAMETER(subscription);
-    EBPF_RETURN_BOOL(false);
+    ebpf_assert(subscription);
+    bool cancel_result = true;
+    bool wait_for_rundown = false;
+    {
+        std::scoped_lock lock{subscription->lock};
+        // Set the unsubscribed flag, so that completion callbacks and pollers do not issue another async IOCTL.
+        subscription->unsubscribed = true;
+
+        TraceLoggingWrite(
+            ebpf_tracelog_provider,
+            EBPF_TRACELOG_EVENT_GENERIC_MESSAGE,
+            TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+            TraceLoggingKeyword(EBPF_TRACELOG_KEYWORD_API),
+            TraceLoggingString(__FUNCTION__, "Attempt to cancel async queries on perf_event_array map."));
+
+        for (auto& ring : subscription->rings) {
+            if (ring->query_pending) {
+                // If the async operation could not be canceled, a completion callback is ongoing which will find out
+                // the subscription is canceled and will not post another async operation.
+                if (!cancel_async_ioctl(get_async_ioctl_operation_overlapped(ring->async_ioctl_completion))) {
+                    cancel_result = false;
+                }
+            }
+        }
+        wait_for_rundown = (subscription->pending_query_count > 0);
+    }
+
+    // Wait for the final completion callback of every ring before freeing the subscription, so that no callback is
+    // invoked after this function returns.
+    if (wait_for_rundown) {
+        (void)WaitForSingleObject(subscription->rundown_event, INFINITE);
+    }
+    delete subscription;
+
+    EBPF_RETURN_BOOL(cancel_result);
 }
 CATCH_NO_MEMORY_BOOL
 
@@ -354,28 +354,83 @@ bpf_map_get_next_id(uint32_t start_id, uint32_t* next_id)
 
 typedef struct ring_buffer
 {
+    ring_buffer() : flags(0), ready_event(nullptr) {}
+    ~ring_buffer()
+    {
+        for (auto it = subscriptions.begin(); it != subscriptions.end(); it++) {
+            (void)ebpf_ring_buffer_map_unsubscribe(*it);
+        }
+        subscriptions.clear();
+        // The event is only referenced by subscriptions that are still waiting, so it is closed last.
+        if (ready_event != nullptr) {
+            ::CloseHandle(ready_event);
+        }
+    }
     std::vector<ring_buffer_subscription_t*> subscriptions;
+    uint64_t flags;
+    // Shared by all the subscriptions without auto callbacks, so that ring_buffer__poll waits for all maps at once.
+    HANDLE ready_event;
 } ring_buffer_t;
 
+static ebpf_result_t
+_ring_buffer_add_subscription(
+    _Inout_ ring_buffer_t* ring_buffer, int map_fd, ring_buffer_sample_fn sample_cb, _In_opt_ void* ctx) noexcept
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    ring_buffer_subscription_t* subscription = nullptr;
+
+    try {
+        // Reserve the slot first, so that adding the subscription below cannot fail.
+        ring_buffer->subscriptions.reserve(ring_buffer->subscriptions.size() + 1);
+    } catch (const std::bad_alloc&) {
+        return EBPF_NO_MEMORY;
+    }
+
+    result = ebpf_ring_buffer_map_subscribe(
+        map_fd, ctx, sample_cb, ring_buffer->flags, ring_buffer->ready_event, &subscription);
+    if (result == EBPF_SUCCESS) {
+        ring_buffer->subscriptions.push_back(subscription);
+    }
+    return result;
+}
+
 struct ring_buffer*
-ring_buffer__new(int map_fd, ring_buffer_sample_fn sample_cb, void* ctx, const struct ring_buffer_opts* /* opts */)
+ebpf_ring_buffer__new(
+    int map_fd, ring_buffer_sample_fn sample_cb, void* ctx, const ebpf_ring_buffer_opts_t* opts) noexcept
 {
     ebpf_result result = EBPF_SUCCESS;
     ring_buffer_t* local_ring_buffer = nullptr;
+    uint64_t flags = (opts != nullptr && opts->sz >= sizeof(ebpf_ring_buffer_opts_t)) ? opts->flags : 0;
 
-    if (sample_cb == nullptr) {
+    if (sample_cb == nullptr || (flags & ~EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK) != 0) {
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
 
     try {
         std::unique_ptr<ring_buffer_t> ring_buffer = std::make_unique<ring_buffer_t>();
-        ring_buffer_subscription_t* subscription = nullptr;
-        result = ebpf_ring_buffer_map_subscribe(map_fd, ctx, sample_cb, &subscription);
+        ring_buffer->flags = flags;
+        if (flags & EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK) {
+            ring_buffer->ready_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+            if (ring_buffer->ready_event == nullptr) {
+                result = win32_error_code_to_ebpf_result(GetLastError());
+                goto Exit;
+            }
+        }
+        result = _ring_buffer_add_subscription(ring_buffer.get(), map_fd, sample_cb, ctx);
         if (result != EBPF_SUCCESS) {
             goto Exit;
         }
-        ring_buffer->subscriptions.push_back(subscription);
+        // The policy is set once the subscription exists, so that a failed subscription leaves the map unchanged.
+        // Until then the consumer is woken for every record.
+        if (opts != nullptr && opts->sz >= EBPF_OFFSET_OF(ebpf_ring_buffer_opts_t, flags) &&
+            (opts->wakeup_bytes != 0 || opts->wakeup_records != 0 || opts->max_latency_ms != 0)) {
+            result =
+                ebpf_ring_buffer_map_set_wakeup(map_fd, opts->wakeup_bytes, opts->wakeup_records, opts->max_latency_ms);
+            if (result != EBPF_SUCCESS) {
+                goto Exit;
+            }
+        }
         local_ring_buffer = ring_buffer.release();
     } catch (const std::bad_alloc&) {
         result = EBPF_NO_MEMORY;
@@ -389,34 +444,199 @@ Exit:
     EBPF_RETURN_POINTER(ring_buffer_t*, local_ring_buffer);
 }
 
+struct ring_buffer*
+ring_buffer__new(int map_fd, ring_buffer_sample_fn sample_cb, void* ctx, const struct ring_buffer_opts* /* opts */)
+{
+    return ebpf_ring_buffer__new(map_fd, sample_cb, ctx, nullptr);
+}
+
+int
+ring_buffer__add(struct ring_buffer* rb, int map_fd, ring_buffer_sample_fn sample_cb, void* ctx)
+{
+    if (rb == nullptr || sample_cb == nullptr) {
+        return libbpf_err(-EINVAL);
+    }
+
+    return libbpf_result_err(_ring_buffer_add_subscription(rb, map_fd, sample_cb, ctx));
+}
+
 void
 ring_buffer__free(struct ring_buffer* ring_buffer)
 {
-    for (auto it = ring_buffer->subscriptions.begin(); it != ring_buffer->subscriptions.end(); it++) {
-        (void)ebpf_ring_buffer_map_unsubscribe(*it);
-    }
-    ring_buffer->subscriptions.clear();
     delete ring_buffer;
 }
 
+int
+ring_buffer__consume(struct ring_buffer* rb)
+{
+    if (rb == nullptr) {
+        return libbpf_err(-EINVAL);
+    }
+
+    int64_t total_count = 0;
+    for (auto& subscription : rb->subscriptions) {
+        uint32_t record_count = 0;
+        int sample_result = 0;
+        ebpf_result_t result = ebpf_ring_buffer_map_consume(subscription, &record_count, &sample_result);
+        total_count += record_count;
+        if (result != EBPF_SUCCESS) {
+            return libbpf_result_err(result);
+        }
+        if (sample_result < 0) {
+            // Like libbpf, a negative callback result stops consuming and is returned to the caller.
+            return libbpf_err(sample_result);
+        }
+    }
+    return (total_count > INT_MAX) ? INT_MAX : static_cast<int>(total_count);
+}
+
+int
+ring_buffer__poll(struct ring_buffer* rb, int timeout_ms)
+{
+    if (rb == nullptr) {
+        return libbpf_err(-EINVAL);
+    }
+
+    if (!(rb->flags & EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK)) {
+        // Records are indicated from the async completion threads.
+        return libbpf_result_err(EBPF_OPERATION_NOT_SUPPORTED);
+    }
+
+    for (bool waited = false;; waited = true) {
+        int record_count = ring_buffer__consume(rb);
+        if (record_count != 0 || waited || timeout_ms == 0) {
+            return record_count;
+        }
+
+        // One wait covers every map in the manager, as they all share the ready event.
+        DWORD wait_result =
+            WaitForSingleObject(rb->ready_event, (timeout_ms < 0) ? INFINITE : static_cast<DWORD>(timeout_ms));
+        if (wait_result == WAIT_FAILED) {
+            return libbpf_result_err(win32_error_code_to_ebpf_result(GetLastError()));
+        } else if (wait_result == WAIT_TIMEOUT) {
+            return 0;
+        }
+    }
+}
+
+int
+ring_buffer__epoll_fd(const struct ring_buffer* /* rb */)
+{
+    // There is no epoll on Windows, ring_buffer__poll waits for all maps in the manager instead.
+    return libbpf_err(-ENOTSUP);
+}
+
+typedef struct user_ring_buffer
+{
+    uint8_t* buffer;
+    size_t buffer_size;
+    ebpf_ring_buffer_offsets_t* offsets;
+    // Only written by this producer, the copy in the offsets page is what the kernel reads.
+    size_t producer_offset;
+} user_ring_buffer_t;
+
+struct user_ring_buffer*
+user_ring_buffer__new(int map_fd, const struct user_ring_buffer_opts* /* opts */)
+{
+    ebpf_result_t result;
+    user_ring_buffer_t* local_user_ring_buffer = nullptr;
+
+    try {
+        std::unique_ptr<user_ring_buffer_t> user_ring_buffer = std::make_unique<user_ring_buffer_t>();
+        result = ebpf_user_ring_buffer_map_query_buffer(
+            map_fd,
+            &user_ring_buffer->buffer,
+            &user_ring_buffer->buffer_size,
+            &user_ring_buffer->offsets,
+            &user_ring_buffer->producer_offset);
+        if (result != EBPF_SUCCESS) {
+            goto Exit;
+        }
+        local_user_ring_buffer = user_ring_buffer.release();
+    } catch (const std::bad_alloc&) {
+        result = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+Exit:
+    if (result != EBPF_SUCCESS) {
+        errno = libbpf_result_err(result);
+        EBPF_LOG_FUNCTION_ERROR(result);
+    }
+    EBPF_RETURN_POINTER(user_ring_buffer_t*, local_user_ring_buffer);
+}
+
+void*
+user_ring_buffer__reserve(struct user_ring_buffer* rb, uint32_t size)
+{
+    size_t record_length = (size_t)size + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    size_t consumer_offset = ReadULong64Acquire(&rb->offsets->consumer_offset);
+    // Keep at least one byte free, matching the kernel producers, so a full ring is distinguishable from an empty one.
+    if (rb->buffer_size - (rb->producer_offset - consumer_offset) <= record_length) {
+        errno = ENOSPC;
+        return nullptr;
+    }
+
+    // The ring is mapped twice back to back, so a record that wraps is still contiguous.
+    ebpf_ring_buffer_record_t* record =
+        reinterpret_cast<ebpf_ring_buffer_record_t*>(rb->buffer + rb->producer_offset % rb->buffer_size);
+    record->header.length = (uint32_t)record_length;
+    record->header.discarded = 0;
+    record->header.locked = 1;
+
+    // Release ensures the locked header is visible before the kernel can observe the new producer offset.
+    rb->producer_offset += record_length;
+    WriteULong64Release(&rb->offsets->producer_offset, rb->producer_offset);
+    return record->data;
+}
+
+static void
+_user_ring_buffer_release_record(_In_ void* sample, bool discard)
+{
+    ebpf_ring_buffer_record_t* record = reinterpret_cast<ebpf_ring_buffer_record_t*>(
+        static_cast<uint8_t*>(sample) - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
+    record->header.discarded = discard ? 1 : 0;
+    // Complete the writes to the record before the kernel can observe it as unlocked.
+    MemoryBarrier();
+    record->header.locked = 0;
+}
+
+void
+user_ring_buffer__submit(struct user_ring_buffer* /* rb */, void* sample)
+{
+    _user_ring_buffer_release_record(sample, false);
+}
+
+void
+user_ring_buffer__discard(struct user_ring_buffer* /* rb */, void* sample)
+{
+    _user_ring_buffer_release_record(sample, true);
+}
+
+void
+user_ring_buffer__free(struct user_ring_buffer* rb)
+{
+    delete rb;
+}
+
 typedef struct perf_buffer
 {
-    std::vector<perf_event_array_subscription_t*> subscriptions;
+    perf_event_array_subscription_t* subscription;
 } perf_buffer_t;
 
 struct perf_buffer*
-perf_buffer__new(
+ebpf_perf_buffer__new(
     int map_fd,
     size_t page_cnt,
     perf_buffer_sample_fn sample_cb,
     perf_buffer_lost_fn lost_cb,
     void* ctx,
-    const struct perf_buffer_opts* opts)
+    const ebpf_perf_buffer_opts_t* opts) noexcept
 {
     ebpf_result result = EBPF_SUCCESS;
     perf_buffer_t* local_perf_buffer = nullptr;
+    uint64_t flags = (opts != nullptr && opts->sz >= sizeof(ebpf_perf_buffer_opts_t)) ? opts->flags : 0;
 
-    UNREFERENCED_PARAMETER(opts);
+    // Each per-CPU ring is sized by the map definition.
     UNREFERENCED_PARAMETER(page_cnt);
 
     if (sample_cb == nullptr) {
@@ -426,12 +646,11 @@ perf_buffer__new(
 
     try {
         std::unique_ptr<perf_buffer_t> perf_buffer = std::make_unique<perf_buffer_t>();
-        perf_event_array_subscription_t* subscription = nullptr;
-        result = ebpf_perf_event_array_map_subscribe(map_fd, ctx, sample_cb, lost_cb, &subscription);
+        result =
+            ebpf_perf_event_array_map_subscribe(map_fd, ctx, sample_cb, lost_cb, flags, &perf_buffer->subscription);
         if (result != EBPF_SUCCESS) {
             goto Exit;
         }
-        perf_buffer->subscriptions.push_back(subscription);
         local_perf_buffer = perf_buffer.release();
     } catch (const std::bad_alloc&) {
         result = EBPF_NO_MEMORY;
@@ -445,36 +664,48 @@ Exit:
     EBPF_RETURN_POINTER(perf_buffer*, local_perf_buffer);
 }
 
+struct perf_buffer*
+perf_buffer__new(
+    int map_fd,
+    size_t page_cnt,
+    perf_buffer_sample_fn sample_cb,
+    perf_buffer_lost_fn lost_cb,
+    void* ctx,
+    const struct perf_buffer_opts* /* opts */)
+{
+    // Match Linux: callbacks are only invoked from perf_buffer__poll and perf_buffer__consume.
+    return ebpf_perf_buffer__new(map_fd, page_cnt, sample_cb, lost_cb, ctx, nullptr);
+}
+
 void
 perf_buffer__free(struct perf_buffer* pb)
 {
-    for (auto it = pb->subscriptions.begin(); it != pb->subscriptions.end(); it++) {
-        (void)ebpf_perf_event_array_map_unsubscribe(*it);
+    if (pb == nullptr) {
+        return;
     }
-    pb->subscriptions.clear();
+    (void)ebpf_perf_event_array_map_unsubscribe(pb->subscription);
     delete pb;
 }
 
 int
 perf_buffer__poll(struct perf_buffer* pb, int timeout_ms)
 {
-    if (!pb) {
-        return -1;
+    if (pb == nullptr) {
+        return libbpf_err(-EINVAL);
     }
 
-    // Create an array of handles for the subscriptions
-    std::vector<HANDLE> handles;
-    for (auto& sub : pb->subscriptions) {
-    }
-
-    // Wait for any of the handles to be signaled
-    DWORD result = WaitForMultipleObjects(handles.size(), handles.data(), FALSE, timeout_ms);
-    if (result == WAIT_FAILED) {
-        return -1;
+    uint32_t record_count = 0;
+    ebpf_result_t result = ebpf_perf_event_array_map_poll(pb->subscription, timeout_ms, &record_count);
+    if (result != EBPF_SUCCESS) {
+        return libbpf_result_err(result);
     }
+    return (record_count > INT_MAX) ? INT_MAX : static_cast<int>(record_count);
+}
 
-    // Return the index of the signaled handle
-    return result - WAIT_OBJECT_0;
+int
+perf_buffer__consume(struct perf_buffer* pb)
+{
+    return perf_buffer__poll(pb, 0);
 }
 
 const char*
@@ -26,18 +26,46 @@ handle_ebpf_show_maps(
     IN LPCVOID data,
     OUT BOOL* done)
 {
-    UNREFERENCED_PARAMETER(argv);
-    UNREFERENCED_PARAMETER(current_index);
-    UNREFERENCED_PARAMETER(argc);
     UNREFERENCED_PARAMETER(machine);
     UNREFERENCED_PARAMETER(flags);
     UNREFERENCED_PARAMETER(data);
     UNREFERENCED_PARAMETER(done);
 
-    std::cout << "\n";
-    std::cout << "                              Key  Value      Max  Inner\n";
-    std::cout << "     ID            Map Type  Size   Size  Entries     ID  Pins  Name\n";
-    std::cout << "=======  ==================  ====  =====  =======  =====  ====  ========\n";
+    TAG_TYPE tags[] = {
+        {TOKEN_LEVEL, NS_REQ_ZERO, FALSE},
+    };
+    const int LEVEL_INDEX = 0;
+
+    unsigned long tag_type[_countof(tags)] = {0};
+
+    unsigned long status =
+        PreprocessCommand(nullptr, argv, current_index, argc, tags, _countof(tags), 0, _countof(tags), tag_type);
+
+    VERBOSITY_LEVEL level = VL_NORMAL;
+    for (int i = 0; (status == NO_ERROR) && ((i + current_index) < argc); i++) {
+        switch (tag_type[i]) {
+        case LEVEL_INDEX:
+            status =
+                MatchEnumTag(NULL, argv[current_index + i], _countof(g_LevelEnum), g_LevelEnum, (unsigned long*)&level);
+            if (status != NO_ERROR) {
+                status = ERROR_INVALID_PARAMETER;
+            }
+            break;
+        default:
+            status = ERROR_INVALID_SYNTAX;
+            break;
+        }
+    }
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    if (level == VL_NORMAL) {
+        std::cout << "\n";
+        std::cout << "                              Key  Value      Max  Inner\n";
+        std::cout << "     ID            Map Type  Size   Size  Entries     ID  Pins  Name\n";
+        std::cout << "=======  ==================  ====  =====  =======  =====  ====  ========\n";
+    }
 
     uint32_t map_id = 0;
     for (;;) {
@@ -53,16 +81,38 @@ handle_ebpf_show_maps(
         struct bpf_map_info info;
         uint32_t info_size = (uint32_t)sizeof(info);
         if (bpf_obj_get_info_by_fd(map_fd, &info, &info_size) == 0) {
-            printf(
-                "%7u  %18s%6u%7u%9u%7d%6u  %s\n",
-                info.id,
-                libbpf_bpf_map_type_str(info.type),
-                info.key_size,
-                info.value_size,
-                info.max_entries,
-                info.inner_map_id,
-                info.pinned_path_count,
-                info.name);
+            if (level == VL_NORMAL) {
+                printf(
+                    "%7u  %18s%6u%7u%9u%7d%6u  %s\n",
+                    info.id,
+                    libbpf_bpf_map_type_str(info.type),
+                    info.key_size,
+                    info.value_size,
+                    info.max_entries,
+                    info.inner_map_id,
+                    info.pinned_path_count,
+                    info.name);
+            } else {
+                std::cout << "\n";
+                std::cout << "ID                      : " << info.id << "\n";
+                std::cout << "Name                    : " << info.name << "\n";
+                std::cout << "Map type                : " << libbpf_bpf_map_type_str(info.type) << "\n";
+                std::cout << "Key size                : " << info.key_size << "\n";
+                std::cout << "Value size              : " << info.value_size << "\n";
+                std::cout << "Max entries             : " << info.max_entries << "\n";
+                std::cout << "Inner map ID            : " << (int32_t)info.inner_map_id << "\n";
+                std::cout << "# pinned paths          : " << info.pinned_path_count << "\n";
+                std::cout << "# lookups               : " << info.statistics.lookup_count << "\n";
+                std::cout << "# lookup hits           : " << info.statistics.lookup_hit_count << "\n";
+                std::cout << "# lookup misses         : " << info.statistics.lookup_miss_count << "\n";
+                std::cout << "# updates               : " << info.statistics.update_count << "\n";
+                std::cout << "# updates out of space  : " << info.statistics.update_out_of_space_count << "\n";
+                std::cout << "# updates out of memory : " << info.statistics.update_no_memory_count << "\n";
+                std::cout << "# deletes               : " << info.statistics.delete_count << "\n";
+                std::cout << "# LRU evictions         : " << info.statistics.lru_eviction_count << "\n";
+                std::cout << "# expired entries       : " << info.expired_entry_count << "\n";
+                std::cout << "# bucket lock contention: " << info.statistics.bucket_lock_contention_count << "\n";
+            }
         }
 
         Platform::_close(map_fd);
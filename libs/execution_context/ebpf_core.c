@@ -70,7 +70,7 @@ _ebpf_core_map_push_elem(_Inout_ ebpf_map_t* map, _In_ const uint8_t* value, uin
 static int
 _ebpf_core_map_pop_elem(_Inout_ ebpf_map_t* map, _Out_ uint8_t* value);
 static int
-_ebpf_core_map_peek_elem(_Inout_ ebpf_map_t* map, _Out_ uint8_t* value);
+_ebpf_core_map_peek_elem(_Inout_ ebpf_map_t* map, _Inout_ uint8_t* value);
 static uint64_t
 _ebpf_core_get_pid_tgid();
 static uint64_t
@@ -111,6 +111,10 @@ static int
 _ebpf_core_perf_event_output(
     _In_ void* ctx, _Inout_ ebpf_map_t* map, uint64_t flags, _In_reads_bytes_(length) uint8_t* data, size_t length);
 
+static int
+_ebpf_core_user_ring_buffer_read(
+    _Inout_ ebpf_map_t* map, _Out_writes_bytes_(length) uint8_t* data, size_t length, uint64_t flags);
+
 #define EBPF_CORE_GLOBAL_HELPER_EXTENSION_VERSION 0
 
 static ebpf_program_type_descriptor_t _ebpf_global_helper_program_descriptor = {
@@ -158,6 +162,8 @@ static const void* _ebpf_general_helpers[] = {
     (void*)&_ebpf_core_get_time_ms,
     // Perf event array (perf buffer) output.
     (void*)&_ebpf_core_perf_event_output,
+    // User ring buffer input.
+    (void*)&_ebpf_core_user_ring_buffer_read,
 };
 
 static const ebpf_helper_function_addresses_t _ebpf_global_helper_function_dispatch_table = {
@@ -283,6 +289,11 @@ ebpf_core_initiate()
         goto Done;
     }
 
+    return_value = ebpf_maps_initiate();
+    if (return_value != EBPF_SUCCESS) {
+        goto Done;
+    }
+
     return_value = ebpf_native_initiate();
     if (return_value != EBPF_SUCCESS) {
         goto Done;
@@ -332,6 +343,8 @@ ebpf_core_terminate()
     // Verify that all ebpf_core_object_t objects have been freed.
     ebpf_object_tracking_terminate();
 
+    ebpf_maps_terminate();
+
     // Shut down the epoch tracker and free any remaining memory or work items.
     // Note: Some objects may only be released on epoch termination.
     ebpf_epoch_synchronize();
@@ -962,7 +975,8 @@ _ebpf_core_protocol_map_update_element_batch(
         goto Done;
     }
 
-    key_and_value_length = (size_t)map_definition->key_size + (size_t)map_definition->value_size;
+    size_t value_length = ebpf_map_get_user_value_size(map);
+    key_and_value_length = (size_t)map_definition->key_size + value_length;
 
     if (key_and_value_length == 0) {
         retval = EBPF_INVALID_ARGUMENT;
@@ -981,7 +995,7 @@ _ebpf_core_protocol_map_update_element_batch(
             map,
             map_definition->key_size,
             request->data + output_count * key_and_value_length,
-            map_definition->value_size,
+            value_length,
             request->data + output_count * key_and_value_length + (size_t)map_definition->key_size,
             request->option,
             0);
@@ -1144,6 +1158,8 @@ _ebpf_core_protocol_map_get_next_key(
         goto Done;
     }
 
+    // Unlike the batch operations, this request carries no cursor. bpf_map_get_next_key callers only hold the
+    // previous key between calls, so each step searches for that key again.
     retval = ebpf_map_next_key(
         map, next_key_length, previous_key_length == 0 ? NULL : request->previous_key, reply->next_key);
 
@@ -1172,6 +1188,7 @@ _ebpf_core_protocol_map_get_next_key_value_batch(
     ebpf_map_t* map = NULL;
     size_t previous_key_length;
     size_t reply_data_length = 0;
+    uint64_t cursor = request->cursor;
 
     retval = EBPF_OBJECT_REFERENCE_BY_HANDLE(request->handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
     if (retval != EBPF_SUCCESS) {
@@ -1205,6 +1222,7 @@ _ebpf_core_protocol_map_get_next_key_value_batch(
         map,
         previous_key_length,
         previous_key_length == 0 ? NULL : request->previous_key,
+        &cursor,
         &reply_data_length,
         reply->data,
         request->find_and_delete ? EBPF_MAP_FIND_FLAG_DELETE : 0);
@@ -1213,6 +1231,7 @@ _ebpf_core_protocol_map_get_next_key_value_batch(
         goto Done;
     }
 
+    reply->cursor = cursor;
     reply->header.length =
         (uint16_t)(EBPF_OFFSET_OF(ebpf_operation_map_get_next_key_value_batch_reply_t, data) + reply_data_length);
 
@@ -1222,6 +1241,374 @@ Done:
     EBPF_RETURN_RESULT(retval);
 }
 
+// Size of the buffer that the *_batch_user_buffer operations copy keys and values through.
+#define EBPF_CORE_BATCH_USER_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @brief Copy data from a buffer in the address space of the process that issued the request.
+ *
+ * @param[out] destination Buffer to copy to.
+ * @param[in] source User-mode address to copy from.
+ * @param[in] length Number of bytes to copy.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_POINTER The source isn't a readable user-mode buffer.
+ */
+static ebpf_result_t
+_ebpf_core_copy_from_user(_Out_writes_bytes_(length) void* destination, uint64_t source, size_t length)
+{
+    __try {
+        ebpf_probe_for_read((const void*)(uintptr_t)source, length, 1);
+        memcpy(destination, (const void*)(uintptr_t)source, length);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        return EBPF_INVALID_POINTER;
+    }
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Copy data to a buffer in the address space of the process that issued the request.
+ *
+ * @param[in] destination User-mode address to copy to.
+ * @param[in] source Buffer to copy from.
+ * @param[in] length Number of bytes to copy.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_POINTER The destination isn't a writable user-mode buffer.
+ */
+static ebpf_result_t
+_ebpf_core_copy_to_user(uint64_t destination, _In_reads_bytes_(length) const void* source, size_t length)
+{
+    __try {
+        ebpf_probe_for_write((void*)(uintptr_t)destination, length, 1);
+        memcpy((void*)(uintptr_t)destination, source, length);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        return EBPF_INVALID_POINTER;
+    }
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Check that a whole buffer in the address space of the process that issued the request is accessible before
+ * any of it is used, so that an operation does not fail after it has changed the map.
+ *
+ * @param[in] address User-mode address of the buffer.
+ * @param[in] length Length of the buffer in bytes.
+ * @param[in] write True if the buffer is written to, false if it is only read.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_POINTER The buffer isn't an accessible user-mode buffer.
+ */
+static ebpf_result_t
+_ebpf_core_probe_user_buffer(uint64_t address, size_t length, bool write)
+{
+    __try {
+        if (write) {
+            ebpf_probe_for_write((void*)(uintptr_t)address, length, 1);
+        } else {
+            ebpf_probe_for_read((const void*)(uintptr_t)address, length, 1);
+        }
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        return EBPF_INVALID_POINTER;
+    }
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Get the number of entries to copy through the buffer of a *_batch_user_buffer operation at a time.
+ *
+ * @param[in] entry_size Size of each entry, at least 1.
+ * @param[in] count Number of entries in the request.
+ * @return Number of entries, at least 1.
+ */
+static size_t
+_ebpf_core_batch_user_buffer_count(size_t entry_size, uint64_t count)
+{
+    size_t buffer_count = max(EBPF_CORE_BATCH_USER_BUFFER_SIZE / entry_size, 1);
+    return (size_t)min(buffer_count, count);
+}
+
+static ebpf_result_t
+_ebpf_core_protocol_map_update_element_batch_user_buffer(
+    _In_ const ebpf_operation_map_update_element_batch_user_buffer_request_t* request,
+    _Inout_ ebpf_operation_map_update_element_batch_user_buffer_reply_t* reply)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_result_t retval;
+    ebpf_map_t* map = NULL;
+    uint8_t* buffer = NULL;
+    size_t output_count = 0;
+
+    retval = EBPF_OBJECT_REFERENCE_BY_HANDLE(request->handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    size_t key_size = ebpf_map_get_definition(map)->key_size;
+    size_t value_size = ebpf_map_get_user_value_size(map);
+    size_t key_and_value_length = key_size + value_size;
+    size_t keys_length;
+    size_t values_length;
+
+    if (key_and_value_length == 0 || request->count == 0) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    retval = ebpf_safe_size_t_multiply(request->count, key_size, &keys_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = ebpf_safe_size_t_multiply(request->count, value_size, &values_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = _ebpf_core_probe_user_buffer(request->keys, keys_length, false);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = _ebpf_core_probe_user_buffer(request->values, values_length, false);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    // Copy the keys and values through a bounded buffer, the caller's arrays can be any size.
+    size_t buffer_count = _ebpf_core_batch_user_buffer_count(key_and_value_length, request->count);
+    buffer = (uint8_t*)ebpf_allocate_with_tag(buffer_count * key_and_value_length, EBPF_POOL_TAG_CORE);
+    if (buffer == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Done;
+    }
+    uint8_t* values = buffer + buffer_count * key_size;
+
+    while (output_count < request->count) {
+        size_t chunk_count = (size_t)min(buffer_count, request->count - output_count);
+
+        retval = _ebpf_core_copy_from_user(buffer, request->keys + output_count * key_size, chunk_count * key_size);
+        if (retval != EBPF_SUCCESS) {
+            goto Done;
+        }
+
+        retval =
+            _ebpf_core_copy_from_user(values, request->values + output_count * value_size, chunk_count * value_size);
+        if (retval != EBPF_SUCCESS) {
+            goto Done;
+        }
+
+        for (size_t index = 0; index < chunk_count; index++) {
+            retval = ebpf_map_update_entry(
+                map, key_size, buffer + index * key_size, value_size, values + index * value_size, request->option, 0);
+            if (retval != EBPF_SUCCESS) {
+                goto Done;
+            }
+            output_count++;
+        }
+    }
+
+    reply->header.length = sizeof(ebpf_operation_map_update_element_batch_user_buffer_reply_t);
+    reply->count_of_elements_processed = output_count;
+
+Done:
+    ebpf_free(buffer);
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+    EBPF_RETURN_RESULT(retval);
+}
+
+static ebpf_result_t
+_ebpf_core_protocol_map_delete_element_batch_user_buffer(
+    _In_ const ebpf_operation_map_delete_element_batch_user_buffer_request_t* request,
+    _Inout_ ebpf_operation_map_delete_element_batch_user_buffer_reply_t* reply)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_result_t retval;
+    ebpf_map_t* map = NULL;
+    uint8_t* buffer = NULL;
+    size_t output_count = 0;
+
+    retval = EBPF_OBJECT_REFERENCE_BY_HANDLE(request->handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    size_t key_size = ebpf_map_get_definition(map)->key_size;
+    size_t keys_length;
+
+    if (key_size == 0 || request->count == 0) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    retval = ebpf_safe_size_t_multiply(request->count, key_size, &keys_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = _ebpf_core_probe_user_buffer(request->keys, keys_length, false);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    size_t buffer_count = _ebpf_core_batch_user_buffer_count(key_size, request->count);
+    buffer = (uint8_t*)ebpf_allocate_with_tag(buffer_count * key_size, EBPF_POOL_TAG_CORE);
+    if (buffer == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Done;
+    }
+
+    while (output_count < request->count) {
+        size_t chunk_count = (size_t)min(buffer_count, request->count - output_count);
+
+        retval = _ebpf_core_copy_from_user(buffer, request->keys + output_count * key_size, chunk_count * key_size);
+        if (retval != EBPF_SUCCESS) {
+            goto Done;
+        }
+
+        for (size_t index = 0; index < chunk_count; index++) {
+            retval = ebpf_map_delete_entry(map, key_size, buffer + index * key_size, 0);
+            if (retval != EBPF_SUCCESS) {
+                goto Done;
+            }
+            output_count++;
+        }
+    }
+
+    reply->header.length = sizeof(ebpf_operation_map_delete_element_batch_user_buffer_reply_t);
+    reply->count_of_elements_processed = output_count;
+
+Done:
+    ebpf_free(buffer);
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+    EBPF_RETURN_RESULT(retval);
+}
+
+static ebpf_result_t
+_ebpf_core_protocol_map_get_next_key_value_batch_user_buffer(
+    _In_ const ebpf_operation_map_get_next_key_value_batch_user_buffer_request_t* request,
+    _Inout_ ebpf_operation_map_get_next_key_value_batch_user_buffer_reply_t* reply)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_result_t retval;
+    ebpf_map_t* map = NULL;
+    uint8_t* buffer = NULL;
+    size_t previous_key_length;
+    size_t output_count = 0;
+    uint64_t cursor = request->cursor;
+
+    retval = EBPF_OBJECT_REFERENCE_BY_HANDLE(request->handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    size_t key_size = ebpf_map_get_definition(map)->key_size;
+    size_t value_size = ebpf_map_get_user_value_size(map);
+    size_t key_and_value_length = key_size + value_size;
+    size_t keys_length;
+    size_t values_length;
+
+    retval = ebpf_safe_size_t_subtract(
+        request->header.length,
+        EBPF_OFFSET_OF(ebpf_operation_map_get_next_key_value_batch_user_buffer_request_t, previous_key),
+        &previous_key_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    if (previous_key_length != 0 && previous_key_length != key_size) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    if (key_and_value_length == 0 || request->count == 0) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    retval = ebpf_safe_size_t_multiply(request->count, key_size, &keys_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = ebpf_safe_size_t_multiply(request->count, value_size, &values_length);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    // With find_and_delete, entries are deleted before they are copied out, so a bad array would lose them.
+    retval = _ebpf_core_probe_user_buffer(request->keys, keys_length, true);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    retval = _ebpf_core_probe_user_buffer(request->values, values_length, true);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    // The buffer holds the entries returned by the map followed by the key to resume after.
+    size_t buffer_count = _ebpf_core_batch_user_buffer_count(key_and_value_length, request->count);
+    buffer = (uint8_t*)ebpf_allocate_with_tag(buffer_count * key_and_value_length + key_size, EBPF_POOL_TAG_CORE);
+    if (buffer == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Done;
+    }
+    uint8_t* previous_key = buffer + buffer_count * key_and_value_length;
+    if (previous_key_length != 0) {
+        memcpy(previous_key, request->previous_key, key_size);
+    }
+
+    while (output_count < request->count) {
+        size_t requested_length = (size_t)min(buffer_count, request->count - output_count) * key_and_value_length;
+        size_t chunk_length = requested_length;
+
+        retval = ebpf_map_get_next_key_and_value_batch(
+            map,
+            previous_key_length,
+            previous_key_length == 0 ? NULL : previous_key,
+            &cursor,
+            &chunk_length,
+            buffer,
+            request->find_and_delete ? EBPF_MAP_FIND_FLAG_DELETE : 0);
+        if (retval == EBPF_NO_MORE_KEYS && output_count != 0) {
+            retval = EBPF_SUCCESS;
+            break;
+        }
+        if (retval != EBPF_SUCCESS) {
+            goto Done;
+        }
+
+        size_t chunk_count = chunk_length / key_and_value_length;
+        for (size_t index = 0; index < chunk_count; index++) {
+            const uint8_t* key = buffer + index * key_and_value_length;
+            retval = _ebpf_core_copy_to_user(request->keys + (output_count + index) * key_size, key, key_size);
+            if (retval != EBPF_SUCCESS) {
+                goto Done;
+            }
+            retval = _ebpf_core_copy_to_user(
+                request->values + (output_count + index) * value_size, key + key_size, value_size);
+            if (retval != EBPF_SUCCESS) {
+                goto Done;
+            }
+        }
+        output_count += chunk_count;
+
+        if (request->find_and_delete) {
+            // The entries returned have been deleted, so the next chunk starts from the beginning of the map.
+            previous_key_length = 0;
+        } else {
+            memcpy(previous_key, buffer + (chunk_count - 1) * key_and_value_length, key_size);
+            previous_key_length = key_size;
+        }
+
+        if (chunk_length != requested_length) {
+            // Reached the end of the map.
+            break;
+        }
+    }
+
+    reply->header.length = sizeof(ebpf_operation_map_get_next_key_value_batch_user_buffer_reply_t);
+    reply->cursor = cursor;
+    reply->count_of_elements_returned = output_count;
+
+Done:
+    ebpf_free(buffer);
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+
+    EBPF_RETURN_RESULT(retval);
+}
+
 /**
  * @brief Complete the test run of an eBPF program. This is called when a program test run has completed. This
  * function will build the reply message and send it to the client.
@@ -2183,7 +2570,9 @@ _ebpf_core_protocol_ring_buffer_map_query_buffer(
         goto Exit;
     }
 
-    if (ebpf_map_get_definition(map)->type != BPF_MAP_TYPE_RINGBUF) {
+    // User ring buffer maps are mapped the same way, with the data writable by the producer.
+    ebpf_map_type_t type = ebpf_map_get_definition(map)->type;
+    if (type != BPF_MAP_TYPE_RINGBUF && type != BPF_MAP_TYPE_USER_RINGBUF) {
         result = EBPF_INVALID_ARGUMENT;
         EBPF_LOG_MESSAGE_ERROR(
             EBPF_TRACELOG_LEVEL_ERROR,
@@ -2193,8 +2582,40 @@ _ebpf_core_protocol_ring_buffer_map_query_buffer(
         goto Exit;
     }
 
-    result =
-        ebpf_ring_buffer_map_query_buffer(map, (uint8_t**)(uintptr_t*)&reply->buffer_address, &reply->consumer_offset);
+    result = ebpf_ring_buffer_map_query_buffer(
+        map,
+        (uint8_t**)(uintptr_t*)&reply->buffer_address,
+        (ebpf_ring_buffer_offsets_t**)(uintptr_t*)&reply->offsets_address,
+        &reply->consumer_offset);
+
+Exit:
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+    EBPF_RETURN_RESULT(result);
+}
+
+static ebpf_result_t
+_ebpf_core_protocol_array_map_query_buffer(
+    _In_ const ebpf_operation_array_map_query_buffer_request_t* request,
+    _Out_ ebpf_operation_array_map_query_buffer_reply_t* reply)
+{
+    EBPF_LOG_ENTRY();
+
+    ebpf_map_t* map = NULL;
+    ebpf_result_t result =
+        EBPF_OBJECT_REFERENCE_BY_HANDLE(request->map_handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    result = ebpf_array_map_query_buffer(map, (uint8_t**)(uintptr_t*)&reply->buffer_address);
+    if (result != EBPF_SUCCESS) {
+        EBPF_LOG_MESSAGE_ERROR(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_CORE,
+            "Unable to map the values of the array map.",
+            result);
+        goto Exit;
+    }
 
 Exit:
     EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
@@ -2304,12 +2725,103 @@ _ebpf_core_protocol_ring_buffer_map_write_data(_In_ const ebpf_operation_ring_bu
     if (result != EBPF_SUCCESS) {
         goto Exit;
     }
-    result = ebpf_ring_buffer_map_output(map, (uint8_t*)request->data, data_length);
+    result = ebpf_ring_buffer_map_output(map, (uint8_t*)request->data, data_length, 0);
 Exit:
     EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
     EBPF_RETURN_RESULT(result);
 }
 
+static ebpf_result_t
+_ebpf_core_protocol_ring_buffer_map_set_wakeup(_In_ const ebpf_operation_ring_buffer_map_set_wakeup_request_t* request)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_map_t* map = NULL;
+    ebpf_result_t result =
+        EBPF_OBJECT_REFERENCE_BY_HANDLE(request->map_handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+    if (ebpf_map_get_definition(map)->type != BPF_MAP_TYPE_RINGBUF) {
+        result = EBPF_INVALID_ARGUMENT;
+        EBPF_LOG_MESSAGE_ERROR(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_CORE,
+            "set wakeup operation called on a map that is not of the ring buffer type.",
+            result);
+        goto Exit;
+    }
+    result = ebpf_ring_buffer_map_set_wakeup(
+        map, (size_t)request->wakeup_bytes, request->wakeup_records, request->max_latency_ms);
+Exit:
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+    EBPF_RETURN_RESULT(result);
+}
+
+static ebpf_result_t
+_ebpf_core_protocol_ring_buffer_map_snapshot(
+    _In_ const ebpf_operation_ring_buffer_map_snapshot_request_t* request,
+    _Inout_ ebpf_operation_ring_buffer_map_snapshot_reply_t* reply)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_map_t* map = NULL;
+    uint8_t* buffer = NULL;
+    size_t buffer_length;
+    size_t start_offset = 0;
+    size_t length = 0;
+    ebpf_result_t result =
+        EBPF_OBJECT_REFERENCE_BY_HANDLE(request->map_handle, EBPF_OBJECT_MAP, (ebpf_core_object_t**)&map);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+    if (ebpf_map_get_definition(map)->type != BPF_MAP_TYPE_RINGBUF) {
+        result = EBPF_INVALID_ARGUMENT;
+        EBPF_LOG_MESSAGE_ERROR(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_CORE,
+            "snapshot operation called on a map that is not of the ring buffer type.",
+            result);
+        goto Exit;
+    }
+
+    if (request->buffer_length == 0) {
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+
+    // The records never take more space than the ring.
+    buffer_length = (size_t)min(request->buffer_length, (uint64_t)ebpf_map_get_definition(map)->max_entries);
+    result = _ebpf_core_probe_user_buffer(request->buffer, buffer_length, true);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    // Producers may overwrite the records while they are copied, so the snapshot is taken in a kernel buffer.
+    buffer = (uint8_t*)ebpf_allocate_with_tag(buffer_length, EBPF_POOL_TAG_CORE);
+    if (buffer == NULL) {
+        result = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+
+    result = ebpf_ring_buffer_map_snapshot(map, buffer, buffer_length, &start_offset, &length);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    result = _ebpf_core_copy_to_user(request->buffer, buffer, length);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    reply->header.length = sizeof(ebpf_operation_ring_buffer_map_snapshot_reply_t);
+    reply->start_offset = start_offset;
+    reply->length = length;
+
+Exit:
+    ebpf_free(buffer);
+    EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+    EBPF_RETURN_RESULT(result);
+}
+
 static ebpf_result_t
 _ebpf_core_protocol_program_set_flags(_In_ const ebpf_operation_program_set_flags_request_t* request)
 {
@@ -2334,6 +2846,16 @@ Exit:
     EBPF_RETURN_RESULT(result);
 }
 
+static ebpf_result_t
+_ebpf_core_protocol_set_map_statistics_enabled(_In_ const ebpf_operation_set_map_statistics_enabled_request_t* request)
+{
+    EBPF_LOG_ENTRY();
+
+    ebpf_map_statistics_set_enabled(request->enabled != 0);
+
+    EBPF_RETURN_RESULT(EBPF_SUCCESS);
+}
+
 static void*
 _ebpf_core_map_find_element(ebpf_map_t* map, const uint8_t* key)
 {
@@ -2383,7 +2905,7 @@ _ebpf_core_protocol_perf_event_array_map_async_query(
     }
 
     reply->header.id = EBPF_OPERATION_PERF_EVENT_ARRAY_MAP_ASYNC_QUERY;
-    reply->header.length = sizeof(ebpf_operation_ring_buffer_map_async_query_reply_t);
+    reply->header.length = sizeof(ebpf_operation_perf_event_array_map_async_query_reply_t);
     result = ebpf_perf_event_array_map_async_query(map, request->cpu_id, &reply->async_query_result, async_context);
 
 Exit:
@@ -2703,8 +3225,7 @@ _ebpf_core_ring_buffer_output(
     _Inout_ ebpf_map_t* map, _In_reads_bytes_(length) uint8_t* data, size_t length, uint64_t flags)
 {
     // This function implements bpf_ringbuf_output helper function, which returns negative error in case of failure.
-    UNREFERENCED_PARAMETER(flags);
-    return -ebpf_ring_buffer_map_output(map, data, length);
+    return -ebpf_ring_buffer_map_output(map, data, length, flags);
 }
 
 static int
@@ -2727,11 +3248,50 @@ _ebpf_core_map_pop_elem(_Inout_ ebpf_map_t* map, _Out_ uint8_t* value)
 }
 
 static int
-_ebpf_core_map_peek_elem(_Inout_ ebpf_map_t* map, _Out_ uint8_t* value)
+_ebpf_core_map_peek_elem(_Inout_ ebpf_map_t* map, _Inout_ uint8_t* value)
 {
     return -ebpf_map_peek_entry(map, 0, value, EBPF_MAP_FLAG_HELPER);
 }
 
+typedef struct _ebpf_core_user_ring_buffer_read_context
+{
+    uint8_t* data;
+    size_t length;
+    size_t record_length;
+} ebpf_core_user_ring_buffer_read_context_t;
+
+static int
+_ebpf_core_user_ring_buffer_read_record(
+    _Inout_opt_ void* context, _In_reads_bytes_(length) const uint8_t* data, size_t length)
+{
+    ebpf_core_user_ring_buffer_read_context_t* read_context = (ebpf_core_user_ring_buffer_read_context_t*)context;
+    _Analysis_assume_(read_context != NULL);
+    memcpy(read_context->data, data, min(length, read_context->length));
+    read_context->record_length = length;
+    return 1;
+}
+
+static int
+_ebpf_core_user_ring_buffer_read(
+    _Inout_ ebpf_map_t* map, _Out_writes_bytes_(length) uint8_t* data, size_t length, uint64_t flags)
+{
+    // This function implements bpf_user_ringbuf_read helper function, which returns negative error in case of failure.
+    if (flags != 0) {
+        return -EBPF_INVALID_ARGUMENT;
+    }
+    ebpf_core_user_ring_buffer_read_context_t context = {data, length, 0};
+    size_t records_drained;
+    ebpf_result_t result =
+        ebpf_user_ring_buffer_map_drain(map, _ebpf_core_user_ring_buffer_read_record, &context, 1, &records_drained);
+    if (result != EBPF_SUCCESS) {
+        return -result;
+    }
+    if (records_drained == 0) {
+        return -EBPF_OBJECT_NOT_FOUND;
+    }
+    return (int)context.record_length;
+}
+
 static int32_t
 _ebpf_core_memcpy(
     _Out_writes_(destination_size) void* destination,
@@ -2970,9 +3530,9 @@ static ebpf_protocol_handler_t _ebpf_protocol_handlers[] = {
         get_next_pinned_program_path, start_path, next_path, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_NO_REPLY(bind_map, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(ring_buffer_map_query_buffer, PROTOCOL_ALL_MODES),
-    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(perf_event_array_map_query_buffer, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY_ASYNC(ring_buffer_map_async_query, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_VARIABLE_REQUEST_NO_REPLY(ring_buffer_map_write_data, data, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(perf_event_array_map_query_buffer, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY_ASYNC(perf_event_array_map_async_query, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_VARIABLE_REQUEST_NO_REPLY(perf_event_array_map_write_data, data, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_VARIABLE_REQUEST_FIXED_REPLY(load_native_module, data, PROTOCOL_NATIVE_MODE),
@@ -2985,6 +3545,14 @@ static ebpf_protocol_handler_t _ebpf_protocol_handlers[] = {
     DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_NO_REPLY(program_set_flags, PROTOCOL_ALL_MODES),
     DECLARE_PROTOCOL_HANDLER_VARIABLE_REQUEST_VARIABLE_REPLY(
         get_next_pinned_object_path, start_path, next_path, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_NO_REPLY(ring_buffer_map_set_wakeup, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(ring_buffer_map_snapshot, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(array_map_query_buffer, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(map_update_element_batch_user_buffer, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_FIXED_REPLY(map_delete_element_batch_user_buffer, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_VARIABLE_REQUEST_FIXED_REPLY(
+        map_get_next_key_value_batch_user_buffer, previous_key, PROTOCOL_ALL_MODES),
+    DECLARE_PROTOCOL_HANDLER_FIXED_REQUEST_NO_REPLY(set_map_statistics_enabled, PROTOCOL_ALL_MODES),
 };
 
 _Must_inspect_result_ ebpf_result_t
@@ -14,6 +14,29 @@
 #include "ebpf_program.h"
 #include "ebpf_ring_buffer.h"
 #include "ebpf_tracelog.h"
+#include "ebpf_work_queue.h"
+
+typedef enum _ebpf_map_statistic
+{
+    EBPF_MAP_STATISTIC_LOOKUP_HIT,
+    EBPF_MAP_STATISTIC_LOOKUP_MISS,
+    EBPF_MAP_STATISTIC_UPDATE,
+    EBPF_MAP_STATISTIC_UPDATE_OUT_OF_SPACE,
+    EBPF_MAP_STATISTIC_UPDATE_NO_MEMORY,
+    EBPF_MAP_STATISTIC_DELETE,
+    EBPF_MAP_STATISTIC_LRU_EVICTION,
+    EBPF_MAP_STATISTIC_COUNT,
+} ebpf_map_statistic_t;
+
+// Operation counters of a map on one CPU. Each CPU's counters are on their own cache line so that counting does not
+// false-share, and they are summed when the map information is read.
+__declspec(align(EBPF_CACHE_LINE_SIZE)) typedef struct _ebpf_map_cpu_statistics
+{
+    volatile int64_t counters[EBPF_MAP_STATISTIC_COUNT];
+} ebpf_map_cpu_statistics_t;
+
+static_assert(
+    sizeof(ebpf_map_cpu_statistics_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_map_cpu_statistics_t is not cache aligned.");
 
 typedef struct _ebpf_core_map
 {
@@ -22,8 +45,61 @@ typedef struct _ebpf_core_map
     ebpf_map_definition_in_memory_t ebpf_map_definition;
     uint32_t original_value_size;
     uint8_t* data;
+    ebpf_map_cpu_statistics_t* volatile statistics; // Operation counters, one set per CPU, or NULL until counted.
 } ebpf_core_map_t;
 
+// Set while map operations are counted. Read once per operation so that counting costs a single test when disabled.
+static volatile bool _ebpf_map_statistics_enabled = false;
+
+/**
+ * @brief Allocate the operation counters of a map when its first operation is counted, so that maps only pay for
+ * counters once statistics are enabled. Programs may still be using the map in the current epoch when the last
+ * reference is released, so the counters are freed with the epoch.
+ *
+ * @param[in, out] map Map to allocate counters for.
+ * @return Counters of the map, or NULL if they could not be allocated.
+ */
+static ebpf_map_cpu_statistics_t*
+_ebpf_map_allocate_statistics(_Inout_ ebpf_core_map_t* map)
+{
+    ebpf_map_cpu_statistics_t* statistics = ebpf_epoch_allocate_cache_aligned_with_tag(
+        ebpf_get_cpu_count() * sizeof(ebpf_map_cpu_statistics_t), EBPF_POOL_TAG_MAP);
+    if (statistics == NULL) {
+        return NULL;
+    }
+
+    ebpf_map_cpu_statistics_t* current_statistics =
+        (ebpf_map_cpu_statistics_t*)ebpf_interlocked_compare_exchange_pointer(
+            (void* volatile*)&map->statistics, statistics, NULL);
+    if (current_statistics != NULL) {
+        // Another CPU allocated the counters first.
+        ebpf_epoch_free_cache_aligned(statistics);
+        return current_statistics;
+    }
+    return statistics;
+}
+
+/**
+ * @brief Count an operation on a map in the counters of the current CPU. The caller checks that map statistics are
+ * enabled. The operation is not counted if the counters cannot be allocated.
+ *
+ * @param[in, out] map Map the operation was performed on.
+ * @param[in] statistic Counter to increment.
+ */
+static inline void
+_ebpf_map_count(_Inout_ ebpf_core_map_t* map, ebpf_map_statistic_t statistic)
+{
+    ebpf_map_cpu_statistics_t* statistics =
+        (ebpf_map_cpu_statistics_t*)ReadPointerAcquire((void* volatile*)&map->statistics);
+    if (statistics == NULL) {
+        statistics = _ebpf_map_allocate_statistics(map);
+        if (statistics == NULL) {
+            return;
+        }
+    }
+    ebpf_interlocked_increment_int64_no_fence(&statistics[ebpf_get_current_cpu()].counters[statistic]);
+}
+
 typedef struct _ebpf_core_object_map
 {
     ebpf_core_map_t core_map;
@@ -34,115 +110,74 @@ typedef struct _ebpf_core_object_map
     ebpf_program_type_t program_type;
 } ebpf_core_object_map_t;
 
-// Generations:
-// 0: Uninitialized.
-// 1 to 2^64-2: Valid generations.
-// 2^64-1: Invalid generation (being deleted).
-
-#define EBPF_LRU_INITIAL_GENERATION 1
-#define EBPF_LRU_INVALID_GENERATION 0xFFFFFFFFFFFFFFFF
+// Target number of entries on each CPU's pending and eviction lists of an LRU map. Entries move between the lists of
+// a CPU and the global list in batches of up to this many entries, so the global lock is taken once per batch.
+#define EBPF_LRU_LOCAL_LIST_TARGET 64
 
-// Define the granularity at which the LRU list is updated.
-#define EBPF_LRU_GENERATION_COUNT 10
-
-// Limit maximum number of partitions to 8 as a trade-off between memory usage and performance.
-// Fewer partitions will result in more contention on the lock, but more partitions will consume more memory.
-#define EBPF_LRU_MAXIMUM_PARTITIONS 8
+// Maximum number of referenced entries given a second chance each time a CPU refills its eviction list. Bounds the
+// time spent holding the global lock when most of the map is in use.
+#define EBPF_LRU_SECOND_CHANCE_SCAN_LIMIT (EBPF_LRU_LOCAL_LIST_TARGET * 4)
 
 // Limit maximum map allocation size to 128GB.
 #define EBPF_MAP_MAXIMUM_ALLOCATION (((uint64_t)1) << 37)
 
+// Distance between the copies of a value in a per-cpu map. Each CPU's copy starts a cache line after the previous one
+// so that programs updating the same key on different CPUs do not false-share. Per-cpu arrays and the values of
+// per-cpu hash tables are cache aligned, so every copy starts on its own cache line. User mode buffers keep the Linux
+// layout, with each copy padded to 8 bytes.
+#define EBPF_MAP_PER_CPU_VALUE_STRIDE(value_size) EBPF_PAD_CACHE((size_t)(value_size))
+
 /**
  * @brief The BPF_MAP_TYPE_LRU_HASH is a hash table that stores a limited number of entries. When the map is full, the
- * least recently used entry is removed to make room for a new entry. The map is implemented as a hash table with a pair
- * of doubly-linked lists per partition. The hot list contains entries that have been accessed in the current
- * generation (where a generation is defined as a period of time during which max_entries /
- * (EBPF_LRU_GENERATION_COUNT*partition_count) elements have been accessed in the map), and the cold list contains
- * entries that have not been accessed in the current generation. When entries in the cold list are accessed, they are
- * moved to the hot list. When the hot list reaches max_entries/EBPF_LRU_GENERATION_COUNT, the hot list is merged into
- * the cold list, a new generation is started, and the hot list is cleared. When space is needed an entry is selected
- * from a cold list and is removed from the hash table.
- *
- * key history is stored along with the value in the map. The hash table then provides callbacks to the map to update
- * the key history when an entry is accessed, updated, or deleted.
+ * least recently used entry is removed to make room for a new entry. Key history is kept in the style of the Linux
+ * bpf_lru_list: a global list ordered from oldest to newest, plus a pending list and an eviction list per CPU.
  *
- * key history can be in multiple partitions, with different generation and last-used-time values. To determine
- * the actual last used time of a key, the map must iterate over all the partitions and find the maximum last-used-time.
+ * Entries inserted on a CPU are appended to that CPU's pending list. Once the pending list holds more than
+ * local_list_target entries it is moved to the tail of the global list in one step. Accessing an entry only sets its
+ * referenced flag, so lookups take no locks.
  *
- * The link in the ebpf_lru_entry_t with the highest corresponding last-used-time is the actual last used time of the
- * key. All other links in that ebpf_lru_entry_t are considered stale and are ignored.
+ * When the map is full, the inserting CPU evicts the first entry of its eviction list. When that list is empty, the
+ * CPU takes up to local_list_target entries from the head of the global list. Referenced entries found at the head are
+ * given a second chance: the flag is cleared and they are moved to the tail instead. Entries referenced while waiting
+ * on an eviction list are moved back to the pending list instead of being evicted.
  *
- * Key history is stored in a separate partition from the value and is returned as an opaque blob of memory.
+ * Each CPU's lists are protected by the lock of its partition, and the global list by the global lock. When both are
+ * needed the partition lock is taken first.
  *
- * ebpf_lru_entry_partition_t is an untyped block of memory containing the following:
- * struct ebpf_lru_entry_t {
- *  ebpf_list_entry_t list_entry[partition_count];
- *  size_t generation[partition_count];
- *  size_t last_used_time[partition_count];
- *  uint8_t key[key_size];
- * };
- *
- * This structure is not expressible in C, so we use macros to calculate the offsets of the fields in the structure and
- * access them.
- */
-
-/**
- * @brief Opaque type for an LRU map key history entry.
- * Macros are used to access the fields in the key history entry.
- */
-typedef uint8_t* ebpf_lru_entry_t;
-
-/**
- * @brief Macro to calculate the offset of list entry in the key history entry.
- */
-#define EBPF_LRU_ENTRY_LIST_ENTRY_OFFSET(partition_count) 0
-
-/**
- * @brief Macro to calculate the offset of generation in the key history entry.
- */
-#define EBPF_LRU_ENTRY_GENERATION_OFFSET(partition_count) \
-    (EBPF_LRU_ENTRY_LIST_ENTRY_OFFSET(partition_count) + (partition_count) * sizeof(ebpf_list_entry_t))
-
-/**
- * @brief Macro to calculate the offset of last used time in the key history entry.
- */
-#define EBPF_LRU_ENTRY_LAST_USED_TIME_OFFSET(partition_count) \
-    (EBPF_LRU_ENTRY_GENERATION_OFFSET(partition_count) + (partition_count) * sizeof(size_t))
-
-/**
- * @brief Macro to calculate the offset of key in the key history entry.
- */
-#define EBPF_LRU_ENTRY_KEY_OFFSET(partition_count) \
-    (EBPF_LRU_ENTRY_LAST_USED_TIME_OFFSET(partition_count) + (partition_count) * sizeof(size_t))
-
-/**
- * @brief Macro to compute the size of the key history entry.
- */
-#define EBPF_LRU_ENTRY_SIZE(partition_count, key_size) (EBPF_LRU_ENTRY_KEY_OFFSET(partition_count) + key_size)
-
-/**
- * @brief Macro to get a pointer to an array of list entries in the key history entry.
- */
-#define EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry) \
-    ((ebpf_list_entry_t*)(((uint8_t*)entry) + EBPF_LRU_ENTRY_LIST_ENTRY_OFFSET(map->partition_count)))
-
-/**
- * @brief Macro to get a pointer to an array of generations in the key history entry.
+ * key history is stored along with the value in the map. The hash table then provides callbacks to the map to update
+ * the key history when an entry is inserted, accessed, or deleted.
  */
-#define EBPF_LRU_ENTRY_GENERATION_PTR(map, entry) \
-    ((size_t*)(((uint8_t*)entry) + EBPF_LRU_ENTRY_GENERATION_OFFSET(map->partition_count)))
 
 /**
- * @brief Macro to get a pointer to an array of last used times in the key history entry.
+ * @brief LRU keys follow a lifecycle of being uninitialized, pending, global, evicting, evicted, and deleted. Given
+ * that the keys are not directly controlled, the state of the key can transition to the deleted state at any point.
+ * Excluding transitions to the deleted state, the state transitions are as follows: Uninitialized -> Pending -> Global
+ * -> Evicting -> Evicted, where an evicting key that has been referenced goes back to Pending. The state of a key only
+ * changes while holding the lock of the list it is on.
  */
-#define EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(map, entry) \
-    ((size_t*)(((uint8_t*)entry) + EBPF_LRU_ENTRY_LAST_USED_TIME_OFFSET(map->partition_count)))
+typedef enum _ebpf_lru_key_state
+{
+    EBPF_LRU_KEY_UNINITIALIZED, //< Key is uninitialized. It has been inserted into the LRU map, but the key history has
+                                //< not been updated yet.
+    EBPF_LRU_KEY_PENDING,       //< Key is on the pending list of the partition it was inserted on.
+    EBPF_LRU_KEY_GLOBAL,        //< Key is on the global list.
+    EBPF_LRU_KEY_EVICTING,      //< Key is on the eviction list of a partition.
+    EBPF_LRU_KEY_EVICTED,       //< Key has been removed from the eviction list and is being deleted from the map.
+    EBPF_LRU_KEY_DELETED //< The key and value have been deleted from the LRU map. The backing store for this memory
+                         // will be freed when the current epoch is retired.
+} ebpf_lru_key_state_t;
 
 /**
- * @brief Macro to get a pointer to the key in the key history entry.
+ * @brief The key history of an LRU map entry, stored in the supplemental value of the hash table entry.
  */
-#define EBPF_LRU_ENTRY_KEY_PTR(map, entry) \
-    ((uint8_t*)(((uint8_t*)entry) + EBPF_LRU_ENTRY_KEY_OFFSET(map->partition_count)))
+typedef struct _ebpf_lru_entry
+{
+    ebpf_list_entry_t list_entry;        //< Link in a pending list, an eviction list, or the global list.
+    volatile ebpf_lru_key_state_t state; //< State of the key.
+    volatile uint32_t partition;         //< Partition whose lists hold the entry when pending or evicting.
+    volatile bool referenced;            //< Set when the entry is accessed, cleared when given a second chance.
+    uint8_t key[1];                      //< Copy of the key, used to delete the entry when it is evicted.
+} ebpf_lru_entry_t;
 
 #define EBPF_LOG_MAP_OPERATION(flags, operation, map, key)                                            \
     if (((flags) & EBPF_MAP_FLAG_HELPER) && (map)->ebpf_map_definition.key_size != 0) {               \
@@ -157,66 +192,126 @@ typedef uint8_t* ebpf_lru_entry_t;
     }
 
 /**
- * @brief The partition of the LRU map key history.
+ * @brief The per-CPU key history lists of an LRU map.
  */
 __declspec(align(EBPF_CACHE_LINE_SIZE)) typedef struct _ebpf_lru_partition
 {
-    ebpf_list_entry_t hot_list; //< List of ebpf_lru_entry_t containing keys accessed in the current generation.
+    ebpf_lock_t lock; //< Lock to protect access to the pending list, eviction list, and pending list size.
     ebpf_list_entry_t
-        cold_list; //< List of ebpf_lru_entry_t containing keys accessed in previous generations, sorted by generation.
-    ebpf_lock_t lock;          //< Lock to protect access to the hot, cold lists, current generation, and hot list size.
-    size_t current_generation; //< Current generation. Updated when the hot list is merged into the cold list.
-    size_t hot_list_size;      //< Current size of the hot list.
-    size_t hot_list_limit;     //< Maximum size of the hot list.
+        pending_list; //< List of ebpf_lru_entry_t inserted on this CPU that have not been moved to the global list.
+    ebpf_list_entry_t eviction_list; //< List of ebpf_lru_entry_t taken from the global list, oldest first.
+    size_t pending_list_size;        //< Current size of the pending list.
 } ebpf_lru_partition_t;
 
-static_assert(sizeof(ebpf_lru_partition_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_core_lru_map_t is not cache aligned.");
+static_assert(sizeof(ebpf_lru_partition_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_lru_partition_t is not cache aligned.");
+
+/**
+ * @brief The global key history list of an LRU map.
+ */
+__declspec(align(EBPF_CACHE_LINE_SIZE)) typedef struct _ebpf_lru_global_list
+{
+    ebpf_lock_t lock;       //< Lock to protect access to the list and list size.
+    ebpf_list_entry_t list; //< List of ebpf_lru_entry_t, ordered from oldest to newest.
+    size_t list_size;       //< Current size of the list.
+} ebpf_lru_global_list_t;
+
+static_assert(
+    sizeof(ebpf_lru_global_list_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_lru_global_list_t is not cache aligned.");
 
 /**
  * @brief The map definition for an LRU map.
  */
 typedef struct _ebpf_core_lru_map
 {
-    ebpf_core_map_t core_map; //< Core map structure.
-    size_t partition_count;   //< Number of LRU partitions. Limited to a maximum of EBPF_LRU_MAXIMUM_PARTITIONS.
-    uint8_t padding[16];      //< Required to ensure partitions are cache aligned.
-    ebpf_lru_partition_t
-        partitions[1]; //< Array of LRU partitions. Limited to a maximum of EBPF_LRU_MAXIMUM_PARTITIONS.
+    ebpf_core_map_t core_map;           //< Core map structure.
+    size_t partition_count;             //< Number of LRU partitions, one per CPU.
+    size_t local_list_target;           //< Number of entries moved between a partition and the global list at once.
+    uint8_t padding[8];                 //< Required to ensure the global list and partitions are cache aligned.
+    ebpf_lru_global_list_t global;      //< Global list of entries.
+    ebpf_lru_partition_t partitions[1]; //< Array of LRU partitions, one per CPU.
 } ebpf_core_lru_map_t;
 
+// Interval at which each CPU checks a batch of the entries of an aging hash map.
+#define EBPF_AGING_MAP_REAP_INTERVAL_MS 100
+
+// Minimum number of entries each CPU checks per interval. More are checked if needed to visit every entry of a full
+// map within half the TTL.
+#define EBPF_AGING_MAP_REAP_BATCH 64
+
+// The last access time of an entry is only written when it is older than this, so that lookups of hot entries do not
+// write to them on every call.
+#define EBPF_AGING_MAP_REFRESH_INTERVAL_MS 1000
+
 /**
- * @brief Operation being performed on the LRU maps key history.
+ * @brief A BPF_MAP_TYPE_HASH created with a non-zero map_extra is an aging hash map: an entry that has not been looked
+ * up or updated for map_extra seconds expires and is deleted. The time of the last access of each entry is kept in the
+ * supplemental value of the hash table entry.
  *
+ * The buckets of the hash table are split into one range per CPU. Each CPU has a timed work queue that checks a batch
+ * of entries in its range every EBPF_AGING_MAP_REAP_INTERVAL_MS, deleting the expired ones, and then picks up where it
+ * left off on the next interval. An entry that is used while it is being deleted may still be deleted.
  */
-typedef enum _ebpf_lru_key_operation
+typedef struct _ebpf_aging_entry
 {
-    EBPF_LRU_KEY_OPERATION_INSERT, //< Insert an uninitialized key into the LRU map key history and initialize it.
-    EBPF_LRU_KEY_OPERATION_UPDATE, //< Update an existing key in the LRU map key history.
-    EBPF_LRU_KEY_OPERATION_DELETE  //< Delete an existing key from the LRU map key history.
-} ebpf_lru_key_operation_t;
+    volatile uint64_t last_access_time; //< From cxplat_query_time_since_boot_approximate.
+} ebpf_aging_entry_t;
 
 /**
- * @brief LRU keys follow a lifecycle of being uninitialized, hot, cold, and deleted. The state of the key is used to
- * determine how to update the LRU map key history. Given that the keys are not directly controlled, the state of the
- * key can transition to the deleted state at any point. Excluding transitions to the deleted state, the state
- * transitions are as follows: Uninitialized -> Hot -> Cold -> Hot -> Cold -> ... -> Deleted.
+ * @brief The part of an aging hash map reaped by one CPU.
  */
-typedef enum _ebpf_lru_key_state
+__declspec(align(EBPF_CACHE_LINE_SIZE)) typedef struct _ebpf_aging_partition
 {
-    EBPF_LRU_KEY_UNINITIALIZED, //< Key is uninitialized. It has been inserted into the LRU map, but the key history has
-                                //< not been updated yet.
-    EBPF_LRU_KEY_COLD,          //< Key is cold. It has not been accessed in the current generation.
-    EBPF_LRU_KEY_HOT,           //< Key is hot. It has been accessed in the current generation.
-    EBPF_LRU_KEY_DELETED //< The key and value have been deleted from the LRU map. The backing store for this memory
-                         // will be freed when the current epoch is retired.
-} ebpf_lru_key_state_t;
+    ebpf_list_entry_t work_item;         //< Inserted in the work queue until the map is deleted.
+    ebpf_timed_work_queue_t* work_queue; //< Work queue that runs on the CPU of this partition.
+    ebpf_lock_t lock;                    //< Serializes re-inserting the work item with stopping the partition.
+    bool stopped;                        //< The map is being deleted, don't re-insert the work item.
+    size_t start;                        //< Cookie of the first bucket in the range, see ebpf_hash_table_iterate.
+    size_t end;                          //< Cookie of the first bucket after the range.
+    size_t cursor;                       //< Cookie of the next bucket to check.
+    size_t buffer_size;                  //< Number of keys and values that fit in the buffers.
+    const uint8_t** keys;                //< Buffer for ebpf_hash_table_iterate_range.
+    const uint8_t** values;              //< Buffer for ebpf_hash_table_iterate_range.
+} ebpf_aging_partition_t;
+
+static_assert(
+    sizeof(ebpf_aging_partition_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_aging_partition_t is not cache aligned.");
+
+typedef struct _ebpf_core_aging_map
+{
+    ebpf_core_map_t core_map;
+    uint64_t time_to_live;                  //< Idle time after which an entry expires, in 100ns units.
+    size_t reap_budget;                     //< Number of entries each partition checks per interval.
+    volatile int64_t expired_entry_count;   //< Number of entries deleted because they expired.
+    ebpf_epoch_work_item_t* free_work_item; //< Stops the work queues and frees the map.
+    size_t partition_count;                 //< Number of partitions, one per CPU.
+    ebpf_aging_partition_t partitions[1];   //< Array of partitions, one per CPU.
+} ebpf_core_aging_map_t;
+
+/**
+ * @brief A node of the path-compressed binary trie that indexes the prefixes of an LPM map. Each node covers the
+ * first prefix_length bits of prefix and its children extend it with a 0 or 1 at bit prefix_length. Intermediate
+ * nodes join two subtries that diverge at prefix_length and have no entry in the map.
+ */
+typedef struct _ebpf_core_lpm_node
+{
+    struct _ebpf_core_lpm_node* volatile children[2];
+    uint32_t prefix_length;
+    volatile bool has_entry; ///< False for intermediate nodes.
+    uint8_t prefix[1];       ///< max_prefix bits, of which the first prefix_length are significant.
+} ebpf_core_lpm_node_t;
 
+/**
+ * @brief BPF_MAP_TYPE_LPM_TRIE keeps its entries in a hash table keyed by (prefix_length, prefix), and indexes the
+ * prefixes in a trie. A lookup walks the trie to the longest matching prefix and then does one hash table lookup.
+ * Writers serialize on the lock, so that the trie and the hash table hold the same prefixes. Readers walk the trie
+ * under the epoch without the lock.
+ */
 typedef struct _ebpf_core_lpm_map
 {
     ebpf_core_map_t core_map;
     uint32_t max_prefix;
-    // Bitmap of prefix lengths inserted into the map.
-    uint64_t data[1];
+    ebpf_lock_t lock;                  ///< Serializes updates and deletes.
+    ebpf_core_lpm_node_t* volatile root; ///< Root of the trie, or NULL if the map is empty.
 } ebpf_core_lpm_map_t;
 
 typedef struct _ebpf_core_lpm_key
@@ -231,15 +326,37 @@ typedef struct _ebpf_core_ring_buffer_map
 {
     ebpf_core_map_t core_map;
     ebpf_lock_t lock;
-    // Flag that is set the first time an async operation is queued to the map.
-    // This flag only transitions from off -> on. When this flag is set,
-    // updates to the map acquire the lock and check the async_contexts list.
-    // Note that queueing an async operation thus causes a perf degradation
-    // for all subsequent updates, so should only be allowed by admin.
-    bool async_contexts_trip_wire;
+    // Set while an async query is parked on the map. Producers check this flag without the lock after each
+    // write and only acquire the lock when the wakeup policy says the query should be completed. Only modified
+    // while holding the lock.
+    volatile int32_t waiter_armed;
+    // Records waiting for the parked async query. Only counted while a query is parked and a record watermark is
+    // set, so producers don't touch it otherwise.
+    volatile int32_t pending_records;
+    // Set while the max latency timer is scheduled.
+    volatile int32_t wakeup_timer_armed;
+    // Wakeup policy set by the consumer, see ebpf_ring_buffer_map_set_wakeup. Only modified while holding the
+    // lock, producers read these without the lock.
+    size_t wakeup_bytes;
+    uint32_t wakeup_records;
+    uint32_t max_latency_ms;
+    ebpf_timer_work_item_t* wakeup_timer;
     ebpf_list_entry_t async_contexts;
+    // Frees the map once programs looking up records by the pages of the ring can no longer find it.
+    ebpf_epoch_work_item_t* free_work_item;
 } ebpf_core_ring_buffer_map_t;
 
+// Ring buffer maps that records are reserved in, keyed by each page that the data of one of their records can start
+// in. Callers can pass any value to ebpf_ring_buffer_map_submit and ebpf_ring_buffer_map_discard, so the page of the
+// address finds the only map that can own it, and the record is only released once that map confirms it is
+// reserved. Ring buffer memory is mapped in whole pages, so no two maps share a page.
+#define EBPF_RING_BUFFER_MAP_PAGE_SHIFT 12
+
+static ebpf_hash_table_t* _ebpf_ring_buffer_map_pages = NULL;
+
+// The max latency timer is scheduled in microseconds.
+#define EBPF_RING_BUFFER_MAP_MAX_LATENCY_MS (UINT32_MAX / 1000)
+
 typedef struct _ebpf_core_ring_buffer_map_async_query_context
 {
     ebpf_list_entry_t entry;
@@ -248,24 +365,19 @@ typedef struct _ebpf_core_ring_buffer_map_async_query_context
     void* async_context;
 } ebpf_core_ring_buffer_map_async_query_context_t;
 
-typedef struct _ebpf_core_perf_event_ring
+typedef __declspec(align(EBPF_CACHE_LINE_SIZE)) struct _ebpf_core_perf_event_ring
 {
     ebpf_lock_t lock;
+    // Set while an async query is parked on this ring. Producers check this flag without the lock after each
+    // write and only acquire the lock to complete the query when it is set, so rings with no waiter never touch
+    // shared state. Only modified while holding the lock.
+    volatile int32_t waiter_armed;
     ebpf_list_entry_t async_contexts;
 } ebpf_core_perf_event_ring_t;
 
 typedef struct _ebpf_core_perf_event_array_map
 {
     ebpf_core_map_t core_map;
-    ebpf_lock_t lock;
-    // Flag that is set the first time an async operation is queued to the map.
-    // This flag only transitions from off -> on. When this flag is set,
-    // updates to the map acquire the lock and check the async_contexts list.
-    // Note that queueing an async operation thus causes a perf degradation
-    // for all subsequent updates, so should only be allowed by admin.
-    // Note that we use a single trip wire for the perf array, so once
-    // one ring receives an async request the whole perf array uses async.
-    bool async_contexts_trip_wire;
     ebpf_core_perf_event_ring_t rings[1];
 } ebpf_core_perf_event_array_map_t;
 
@@ -279,120 +391,229 @@ typedef struct _ebpf_core_perf_event_array_map_async_query_context
 } ebpf_core_perf_event_array_map_async_query_context_t;
 
 /**
- * Core map structure for BPF_MAP_TYPE_QUEUE and BPF_MAP_TYPE_STACK
- * ebpf_core_circular_map_t stores an array of uint8_t* pointers. Each pointer
- * stores a version of a value that has been pushed to the queue or stack. The
- * structure can't store the map values directly as the caller expects items
- * returned from peek to remain unmodified. If items are stored directly in
- * the array, then a sequence of:
- * 1) push
- * 2) peek
- * 3) pop
- * 4) push
- * can result in aliasing the record, which would result in unexpected behavior.
+ * @brief A slot of a BPF_MAP_TYPE_QUEUE or BPF_MAP_TYPE_STACK map. Values are stored inline in the slot.
+ */
+typedef struct _ebpf_core_circular_map_slot
+{
+    // Queue only. Equal to the position of the next push that may use the slot while the slot is free, and to that
+    // position + 1 once the value has been written. Popping the value moves it to the position one lap later.
+    volatile uint64_t sequence;
+    uint8_t value[1];
+} ebpf_core_circular_map_slot_t;
+
+/**
+ * @brief A position in a BPF_MAP_TYPE_QUEUE or BPF_MAP_TYPE_STACK map, kept on its own cache line so that producers
+ * and consumers don't contend on the same line.
  */
+__declspec(align(EBPF_CACHE_LINE_SIZE)) typedef struct _ebpf_core_circular_map_position
+{
+    volatile uint64_t position; //< Monotonically increasing, the slot used is position % max_entries.
+} ebpf_core_circular_map_position_t;
+
+static_assert(
+    sizeof(ebpf_core_circular_map_position_t) % EBPF_CACHE_LINE_SIZE == 0,
+    "ebpf_core_circular_map_position_t is not cache aligned.");
 
+typedef enum _ebpf_core_circular_map_type
+{
+    EBPF_CORE_QUEUE = 1,
+    EBPF_CORE_STACK = 2,
+} ebpf_core_circular_map_type_t;
+
+/**
+ * Core map structure for BPF_MAP_TYPE_QUEUE and BPF_MAP_TYPE_STACK
+ * ebpf_core_circular_map_t stores the values in a ring of slots, with the values in [head, tail) present.
+ *
+ * Queues are a bounded multi-producer multi-consumer queue with a sequence number per slot (D. Vyukov). A push
+ * claims the tail position with a compare-exchange once the slot's sequence shows it is free, writes the value
+ * and then publishes it by advancing the sequence. A pop does the same at the head. Neither takes a lock.
+ *
+ * Peek copies the value out and then checks that the head didn't move while it was copying, so a peek never
+ * returns a value that a concurrent pop and push overwrote.
+ *
+ * Stacks push and pop at the same end, which the per-slot sequence can't order, so they serialize on the lock.
+ */
 typedef struct _ebpf_core_circular_map
 {
     ebpf_core_map_t core_map;
-    ebpf_lock_t lock;
-    size_t begin;
-    size_t end;
-    enum
-    {
-        EBPF_CORE_QUEUE = 1,
-        EBPF_CORE_STACK = 2,
-    } type;
-    uint8_t* slots[1];
+    ebpf_lock_t lock; //< Serializes stack operations. Not used by queues.
+    ebpf_core_circular_map_type_t type;
+    size_t slot_size;
+    ebpf_core_circular_map_position_t head; //< Position of the oldest value.
+    ebpf_core_circular_map_position_t tail; //< Position of the next push.
 } ebpf_core_circular_map_t;
 
-static size_t
-_ebpf_core_circular_map_add(_In_ const ebpf_core_circular_map_t* map, size_t value, int delta)
+static inline _Ret_notnull_ ebpf_core_circular_map_slot_t*
+_ebpf_core_circular_map_slot(_In_ const ebpf_core_circular_map_t* map, uint64_t position)
 {
-    return (map->core_map.ebpf_map_definition.max_entries + value + (size_t)delta) %
-           map->core_map.ebpf_map_definition.max_entries;
+    size_t index = (size_t)(position % map->core_map.ebpf_map_definition.max_entries);
+    return (ebpf_core_circular_map_slot_t*)(map->core_map.data + index * map->slot_size);
 }
 
-static uint8_t*
-_ebpf_core_circular_map_peek_or_pop(_Inout_ ebpf_core_circular_map_t* map, bool pop)
+/**
+ * @brief Pop the oldest value from a queue.
+ *
+ * @param[in, out] map Queue to pop from.
+ * @param[out] value Buffer that receives the value, or NULL to discard it.
+ * @retval true A value was popped.
+ * @retval false The queue is empty.
+ */
+static bool
+_ebpf_core_queue_map_pop(
+    _Inout_ ebpf_core_circular_map_t* map,
+    _Out_writes_opt_(map->core_map.ebpf_map_definition.value_size) uint8_t* value)
 {
-    uint8_t* return_value = NULL;
-
-    if (map->type == EBPF_CORE_QUEUE) {
-        // Remove from the beginning.
-        return_value = map->slots[map->begin];
-        if (return_value == NULL) {
-            ebpf_assert(map->begin == map->end);
-            goto Done;
+    uint64_t position = ReadULong64NoFence(&map->head.position);
+    for (;;) {
+        ebpf_core_circular_map_slot_t* slot = _ebpf_core_circular_map_slot(map, position);
+        int64_t difference = (int64_t)(ReadULong64Acquire(&slot->sequence) - (position + 1));
+        if (difference == 0) {
+            uint64_t observed = (uint64_t)ebpf_interlocked_compare_exchange_int64(
+                (volatile int64_t*)&map->head.position, (int64_t)(position + 1), (int64_t)position);
+            if (observed == position) {
+                if (value != NULL) {
+                    memcpy(value, slot->value, map->core_map.ebpf_map_definition.value_size);
+                }
+                // Hand the slot to the push one lap later.
+                WriteULong64Release(&slot->sequence, position + map->core_map.ebpf_map_definition.max_entries);
+                return true;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // The value at the head hasn't been pushed yet.
+            return false;
+        } else {
+            // Another consumer popped this position.
+            position = ReadULong64NoFence(&map->head.position);
         }
-        if (pop) {
-            map->slots[map->begin] = NULL;
-            map->begin = _ebpf_core_circular_map_add(map, map->begin, 1);
+    }
+}
+
+/**
+ * @brief Push a value to a queue.
+ *
+ * @param[in, out] map Queue to push to.
+ * @param[in] value Value to push.
+ * @retval true The value was pushed.
+ * @retval false The queue is full.
+ */
+static bool
+_ebpf_core_queue_map_push(
+    _Inout_ ebpf_core_circular_map_t* map,
+    _In_reads_(map->core_map.ebpf_map_definition.value_size) const uint8_t* value)
+{
+    uint64_t position = ReadULong64NoFence(&map->tail.position);
+    for (;;) {
+        ebpf_core_circular_map_slot_t* slot = _ebpf_core_circular_map_slot(map, position);
+        int64_t difference = (int64_t)(ReadULong64Acquire(&slot->sequence) - position);
+        if (difference == 0) {
+            uint64_t observed = (uint64_t)ebpf_interlocked_compare_exchange_int64(
+                (volatile int64_t*)&map->tail.position, (int64_t)(position + 1), (int64_t)position);
+            if (observed == position) {
+                memcpy(slot->value, value, map->core_map.ebpf_map_definition.value_size);
+                // Publish the value to consumers.
+                WriteULong64Release(&slot->sequence, position + 1);
+                return true;
+            }
+            position = observed;
+        } else if (difference < 0) {
+            // The value pushed one lap earlier hasn't been popped yet.
+            return false;
+        } else {
+            // Another producer pushed to this position.
+            position = ReadULong64NoFence(&map->tail.position);
         }
-    } else {
-        // Remove from the end.
-        size_t new_end = _ebpf_core_circular_map_add(map, map->end, -1);
-        return_value = map->slots[new_end];
-        if (return_value == NULL) {
-            ebpf_assert(map->begin == map->end);
-            goto Done;
+    }
+}
+
+/**
+ * @brief Copy the oldest value of a queue without removing it.
+ *
+ * @param[in] map Queue to peek at.
+ * @param[out] value Buffer that receives the value.
+ * @retval true The value was copied.
+ * @retval false The queue is empty.
+ */
+static bool
+_ebpf_core_queue_map_peek(
+    _In_ const ebpf_core_circular_map_t* map, _Out_writes_(map->core_map.ebpf_map_definition.value_size) uint8_t* value)
+{
+    for (;;) {
+        uint64_t position = ReadULong64Acquire(&map->head.position);
+        const ebpf_core_circular_map_slot_t* slot = _ebpf_core_circular_map_slot(map, position);
+        uint64_t sequence = ReadULong64Acquire(&slot->sequence);
+        int64_t difference = (int64_t)(sequence - (position + 1));
+        if (difference < 0) {
+            return false;
         }
-        if (pop) {
-            map->slots[new_end] = NULL;
-            map->end = new_end;
+        if (difference == 0) {
+            memcpy(value, slot->value, map->core_map.ebpf_map_definition.value_size);
+            MemoryBarrier();
+            // The slot can only be reused after a pop claims this position, which advances the head first. The
+            // sequence alone isn't enough: with one entry a pop hands the slot back with the same sequence.
+            if (ReadULong64NoFence(&map->head.position) == position) {
+                return true;
+            }
         }
+        // The value was popped while it was being read, retry with the new head.
+        YieldProcessor();
     }
-    if (pop) {
-        // The return_value is not freed until the current epoch is retired.
-        ebpf_epoch_free(return_value);
-    }
-Done:
-#pragma warning(push)
-#pragma warning(disable : 6001) // Using uninitialized memory 'return_value'.
-    return return_value;
-#pragma warning(pop)
 }
 
 static ebpf_result_t
-_ebpf_core_circular_map_push(_Inout_ ebpf_core_circular_map_t* map, _In_ const uint8_t* data, bool replace)
-{
-    ebpf_result_t return_value;
-    uint8_t* new_data = NULL;
-    uint8_t* old_data = NULL;
-    new_data = ebpf_epoch_allocate_with_tag(map->core_map.ebpf_map_definition.value_size, EBPF_POOL_TAG_MAP);
-    if (new_data == NULL) {
-        return_value = EBPF_NO_MEMORY;
+_ebpf_core_stack_map_peek_or_pop(
+    _Inout_ ebpf_core_circular_map_t* map,
+    bool pop,
+    _Out_writes_(map->core_map.ebpf_map_definition.value_size) uint8_t* value)
+{
+    ebpf_result_t result;
+    ebpf_lock_state_t state = ebpf_lock_lock(&map->lock);
+    if (map->tail.position == map->head.position) {
+        result = EBPF_OBJECT_NOT_FOUND;
         goto Done;
     }
-    memcpy(new_data, data, map->core_map.ebpf_map_definition.value_size);
 
-    if (map->slots[map->end] != NULL) {
-        ebpf_assert(map->begin == map->end);
-        if (replace) {
-            old_data = map->slots[map->end];
-            map->slots[map->end] = NULL;
-            map->begin = _ebpf_core_circular_map_add(map, map->begin, 1);
-        } else {
-            return_value = EBPF_OUT_OF_SPACE;
+    // Remove from the end.
+    uint64_t position = map->tail.position - 1;
+    memcpy(value, _ebpf_core_circular_map_slot(map, position)->value, map->core_map.ebpf_map_definition.value_size);
+    if (pop) {
+        map->tail.position = position;
+    }
+    result = EBPF_SUCCESS;
+
+Done:
+    ebpf_lock_unlock(&map->lock, state);
+    return result;
+}
+
+static ebpf_result_t
+_ebpf_core_stack_map_push(
+    _Inout_ ebpf_core_circular_map_t* map,
+    _In_reads_(map->core_map.ebpf_map_definition.value_size) const uint8_t* value,
+    bool replace)
+{
+    ebpf_result_t result;
+    ebpf_lock_state_t state = ebpf_lock_lock(&map->lock);
+    if (map->tail.position - map->head.position == map->core_map.ebpf_map_definition.max_entries) {
+        if (!replace) {
+            result = EBPF_OUT_OF_SPACE;
             goto Done;
         }
+        // Drop the oldest value, which is the slot about to be reused.
+        map->head.position++;
     }
 
     // Insert at the end.
-    map->slots[map->end] = new_data;
-    new_data = NULL;
-    map->end = _ebpf_core_circular_map_add(map, map->end, 1);
-
-    return_value = EBPF_SUCCESS;
+    memcpy(
+        _ebpf_core_circular_map_slot(map, map->tail.position)->value,
+        value,
+        map->core_map.ebpf_map_definition.value_size);
+    map->tail.position++;
+    result = EBPF_SUCCESS;
 
 Done:
-    if (new_data) {
-        ebpf_epoch_free(new_data);
-    }
-    if (old_data) {
-        ebpf_epoch_free(old_data);
-    }
-    return return_value;
+    ebpf_lock_unlock(&map->lock, state);
+    return result;
 }
 
 static ebpf_program_type_t
@@ -420,6 +641,8 @@ typedef struct _ebpf_map_metadata_table
     ebpf_result_t (*associate_program)(_Inout_ ebpf_map_t* map, _In_ const ebpf_program_t* program);
     ebpf_result_t (*find_entry)(
         _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, bool delete_on_success, _Outptr_ uint8_t** data);
+    ebpf_result_t (*peek_or_pop_entry)(
+        _Inout_ ebpf_core_map_t* map, bool pop, _Out_writes_(map->ebpf_map_definition.value_size) uint8_t* value);
     ebpf_core_object_t* (*get_object_from_entry)(_Inout_ ebpf_core_map_t* map, _In_ const uint8_t* key);
     ebpf_result_t (*update_entry)(
         _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, _In_ const uint8_t* value, ebpf_map_option_t option);
@@ -433,10 +656,19 @@ typedef struct _ebpf_map_metadata_table
         _In_ const uint8_t* previous_key,
         _Out_ uint8_t* next_key,
         _Inout_opt_ uint8_t** next_value);
+    ebpf_result_t (*next_key_and_value_with_cursor)(
+        _Inout_ ebpf_core_map_t* map,
+        _In_opt_ const uint8_t* previous_key,
+        _Inout_ uint64_t* cursor,
+        _Out_ uint8_t* next_key,
+        _Inout_opt_ uint8_t** next_value);
+    uint32_t supported_map_flags; ///< BPF_F_* flags accepted at creation.
     int zero_length_key : 1;
     int zero_length_value : 1;
     int per_cpu : 1;
     int key_history : 1;
+    int value_as_key : 1; ///< Lookups pass the value to test for in place of a key.
+    int map_extra : 1;    ///< map_extra may be non-zero at creation.
 } ebpf_map_metadata_table_t;
 
 const ebpf_map_metadata_table_t ebpf_map_metadata_tables[];
@@ -460,6 +692,15 @@ ebpf_map_get_effective_value_size(_In_ const ebpf_map_t* map)
     return map->original_value_size;
 }
 
+uint32_t
+ebpf_map_get_user_value_size(_In_ const ebpf_map_t* map)
+{
+    if (!ebpf_map_get_table(map->ebpf_map_definition.type)->per_cpu) {
+        return map->ebpf_map_definition.value_size;
+    }
+    return ebpf_get_cpu_count() * EBPF_PAD_8(map->original_value_size);
+}
+
 static ebpf_result_t
 _create_array_map_with_map_struct_size(
     size_t map_struct_size, _In_ const ebpf_map_definition_in_memory_t* map_definition, _Outptr_ ebpf_core_map_t** map)
@@ -487,7 +728,8 @@ _create_array_map_with_map_struct_size(
         goto Done;
     }
 
-    local_map = ebpf_epoch_allocate_with_tag(full_map_size, EBPF_POOL_TAG_MAP);
+    // Cache align the map so that entries of per-cpu arrays start on their own cache line.
+    local_map = ebpf_epoch_allocate_cache_aligned_with_tag(full_map_size, EBPF_POOL_TAG_MAP);
     if (local_map == NULL) {
         retval = EBPF_NO_MEMORY;
         goto Done;
@@ -503,6 +745,61 @@ Done:
     return retval;
 }
 
+/**
+ * @brief Core map structure for BPF_MAP_TYPE_ARRAY maps created with BPF_F_MMAPABLE. The values are kept in whole
+ * pages instead of following the map structure, so that they can also be mapped into user mode.
+ */
+typedef struct _ebpf_core_mmapable_array_map
+{
+    ebpf_core_map_t core_map;
+    MDL* memory_descriptor; ///< Pages holding the values.
+} ebpf_core_mmapable_array_map_t;
+
+static ebpf_result_t
+_create_mmapable_array_map(
+    _In_ const ebpf_map_definition_in_memory_t* map_definition, _Outptr_ ebpf_core_map_t** map)
+{
+    ebpf_result_t retval;
+    size_t map_data_size = 0;
+    ebpf_core_mmapable_array_map_t* mmapable_map = NULL;
+
+    *map = NULL;
+
+    retval = ebpf_safe_size_t_multiply(map_definition->max_entries, map_definition->value_size, &map_data_size);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    if (map_data_size > EBPF_MAP_MAXIMUM_ALLOCATION) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    mmapable_map = ebpf_epoch_allocate_cache_aligned_with_tag(sizeof(*mmapable_map), EBPF_POOL_TAG_MAP);
+    if (mmapable_map == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Done;
+    }
+    memset(mmapable_map, 0, sizeof(*mmapable_map));
+
+    mmapable_map->memory_descriptor = ebpf_map_memory(map_data_size);
+    if (mmapable_map->memory_descriptor == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Done;
+    }
+
+    mmapable_map->core_map.ebpf_map_definition = *map_definition;
+    mmapable_map->core_map.data = ebpf_memory_descriptor_get_base_address(mmapable_map->memory_descriptor);
+    memset(mmapable_map->core_map.data, 0, map_data_size);
+
+    *map = &mmapable_map->core_map;
+    mmapable_map = NULL;
+
+Done:
+    ebpf_epoch_free_cache_aligned(mmapable_map);
+    return retval;
+}
+
 static ebpf_result_t
 _create_array_map(
     _In_ const ebpf_map_definition_in_memory_t* map_definition,
@@ -512,13 +809,21 @@ _create_array_map(
     if (inner_map_handle != ebpf_handle_invalid) {
         return EBPF_INVALID_ARGUMENT;
     }
+    if (map_definition->map_flags & BPF_F_MMAPABLE) {
+        return _create_mmapable_array_map(map_definition, map);
+    }
     return _create_array_map_with_map_struct_size(sizeof(ebpf_core_map_t), map_definition, map);
 }
 
 static void
 _delete_array_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
 {
-    ebpf_epoch_free(map);
+    if (map->ebpf_map_definition.map_flags & BPF_F_MMAPABLE) {
+        ebpf_core_mmapable_array_map_t* mmapable_map = EBPF_FROM_FIELD(ebpf_core_mmapable_array_map_t, core_map, map);
+        // Removes the user mappings of the values before the pages are freed.
+        ebpf_unmap_memory(mmapable_map->memory_descriptor);
+    }
+    ebpf_epoch_free_cache_aligned(map);
 }
 
 static ebpf_result_t
@@ -1050,15 +1355,27 @@ _create_hash_map_internal(
     local_map->ebpf_map_definition = *map_definition;
     local_map->data = NULL;
 
+    // Unless BPF_F_NO_PREALLOC is set, storage for max_entries entries is allocated up front so that updates do not
+    // allocate memory. Otherwise start small and grow the bucket array as entries are added, up to one bucket per
+    // entry.
+    bool preallocate = !(local_map->ebpf_map_definition.map_flags & BPF_F_NO_PREALLOC);
     const ebpf_hash_table_creation_options_t options = {
         .key_size = local_map->ebpf_map_definition.key_size,
         .value_size = local_map->ebpf_map_definition.value_size,
-        .minimum_bucket_count = local_map->ebpf_map_definition.max_entries,
+        .minimum_bucket_count =
+            preallocate ? local_map->ebpf_map_definition.max_entries
+                        : min(local_map->ebpf_map_definition.max_entries, EBPF_HASH_TABLE_DEFAULT_BUCKET_COUNT),
+        .maximum_bucket_count = local_map->ebpf_map_definition.max_entries,
+        .preallocated_entry_count = preallocate ? local_map->ebpf_map_definition.max_entries : 0,
+        .update_in_place = (local_map->ebpf_map_definition.map_flags & BPF_F_UPDATE_IN_PLACE) != 0,
+        // Each CPU's copy of a per-cpu value is only on its own cache line if the value starts on one.
+        .cache_aligned_values = BPF_MAP_TYPE_PER_CPU(local_map->ebpf_map_definition.type),
         .max_entries = fixed_size_map ? local_map->ebpf_map_definition.max_entries : EBPF_HASH_TABLE_NO_LIMIT,
         .extract_function = extract_function,
         .supplemental_value_size = supplemental_value_size,
         .notification_context = local_map,
         .notification_callback = notification_callback,
+        .count_lock_contention = &_ebpf_map_statistics_enabled,
     };
 
     // Note:
@@ -1085,6 +1402,9 @@ Done:
     return retval;
 }
 
+static ebpf_result_t
+_create_aging_hash_map(_In_ const ebpf_map_definition_in_memory_t* map_definition, _Outptr_ ebpf_core_map_t** map);
+
 static ebpf_result_t
 _create_hash_map(
     _In_ const ebpf_map_definition_in_memory_t* map_definition,
@@ -1094,6 +1414,9 @@ _create_hash_map(
     if (inner_map_handle != ebpf_handle_invalid) {
         return EBPF_INVALID_ARGUMENT;
     }
+    if (map_definition->map_extra != 0) {
+        return _create_aging_hash_map(map_definition, map);
+    }
     return _create_hash_map_internal(sizeof(ebpf_core_map_t), map_definition, 0, false, NULL, NULL, map);
 }
 
@@ -1181,140 +1504,126 @@ _get_supplemental_value(_In_ const ebpf_core_map_t* map, _In_ uint8_t* value)
 }
 
 /**
- * @brief Helper function to translate generation into key state.
+ * @brief Helper function to move the pending list of a partition to the tail of the global list.
  *
- * @param[in] map Pointer to the map. Used to determine the current generation.
- * @param[in] entry LRU entry to get the key state for.
- * @return The key state.
+ * @param[in,out] map Pointer to the map.
+ * @param[in] partition Partition whose pending list is moved.
  */
-static ebpf_lru_key_state_t
-_get_key_state(_In_ const ebpf_core_lru_map_t* map, size_t partition, _In_ const ebpf_lru_entry_t* entry)
-{
-    size_t generation = EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition];
-    if (generation == 0) {
-        return EBPF_LRU_KEY_UNINITIALIZED;
-    } else if (generation == EBPF_LRU_INVALID_GENERATION) {
-        return EBPF_LRU_KEY_DELETED;
-    } else if (generation == map->partitions[partition].current_generation) {
-        return EBPF_LRU_KEY_HOT;
-    } else {
-        return EBPF_LRU_KEY_COLD;
+static _Requires_lock_held_(map->partitions[partition].lock) _Requires_lock_held_(map->global.lock) void
+    _flush_lru_pending_list(_Inout_ ebpf_core_lru_map_t* map, size_t partition)
+{
+    ebpf_lru_partition_t* local = &map->partitions[partition];
+
+    if (ebpf_list_is_empty(&local->pending_list)) {
+        return;
+    }
+
+    for (ebpf_list_entry_t* list_entry = local->pending_list.Flink; list_entry != &local->pending_list;
+         list_entry = list_entry->Flink) {
+        ebpf_lru_entry_t* entry = EBPF_FROM_FIELD(ebpf_lru_entry_t, list_entry, list_entry);
+        entry->state = EBPF_LRU_KEY_GLOBAL;
     }
+
+    ebpf_list_entry_t* first_entry = local->pending_list.Flink;
+    ebpf_list_remove_entry(&local->pending_list);
+    ebpf_list_append_tail_list(&map->global.list, first_entry);
+    ebpf_list_initialize(&local->pending_list);
+
+    map->global.list_size += local->pending_list_size;
+    local->pending_list_size = 0;
 }
 
 /**
- * @brief Helper function to merge the hot list into the cold list if the hot list size exceeds the hot list limit.
- * Resets the hot list size and increments the current generation.
+ * @brief Helper function to move up to local_list_target of the oldest entries from the global list to the eviction
+ * list of a partition. Referenced entries found at the head of the global list are given a second chance by clearing
+ * the referenced flag and moving them to the tail. Once EBPF_LRU_SECOND_CHANCE_SCAN_LIMIT entries have been given a
+ * second chance, the oldest entries are taken regardless of the flag.
  *
  * @param[in,out] map Pointer to the map.
+ * @param[in] partition Partition whose eviction list is filled.
  */
-_Requires_lock_held_(map->partitions[partition].lock) static void _merge_hot_into_cold_list_if_needed(
-    _Inout_ ebpf_core_lru_map_t* map, size_t partition)
+static _Requires_lock_held_(map->partitions[partition].lock) _Requires_lock_held_(map->global.lock) void
+    _fill_lru_eviction_list(_Inout_ ebpf_core_lru_map_t* map, size_t partition)
 {
-    if (map->partitions[partition].hot_list_size <= map->partitions[partition].hot_list_limit) {
-        return;
-    }
-
-    ebpf_list_entry_t* list_entry = map->partitions[partition].hot_list.Flink;
-    ebpf_list_remove_entry(&map->partitions[partition].hot_list);
-    ebpf_list_append_tail_list(&map->partitions[partition].cold_list, list_entry);
+    ebpf_lru_partition_t* local = &map->partitions[partition];
+    size_t second_chances = 0;
+    size_t taken = 0;
+
+    while (taken < map->local_list_target && !ebpf_list_is_empty(&map->global.list)) {
+        ebpf_lru_entry_t* entry = EBPF_FROM_FIELD(ebpf_lru_entry_t, list_entry, map->global.list.Flink);
+        ebpf_list_remove_entry(&entry->list_entry);
+
+        if (entry->referenced && second_chances < EBPF_LRU_SECOND_CHANCE_SCAN_LIMIT) {
+            entry->referenced = false;
+            ebpf_list_insert_tail(&map->global.list, &entry->list_entry);
+            second_chances++;
+            continue;
+        }
 
-    ebpf_list_initialize(&map->partitions[partition].hot_list);
-    map->partitions[partition].hot_list_size = 0;
-    map->partitions[partition].current_generation++;
+        entry->referenced = false;
+        entry->partition = (uint32_t)partition;
+        // Order the partition before the state, so that a delete holding the lock of another partition cannot see the
+        // new state together with the old partition.
+        MemoryBarrier();
+        entry->state = EBPF_LRU_KEY_EVICTING;
+        ebpf_list_insert_tail(&local->eviction_list, &entry->list_entry);
+        map->global.list_size--;
+        taken++;
+    }
 }
 
 /**
- * @brief Helper function to insert an entry into the hot list if it is in the cold list and update the hot list size.
+ * @brief Helper function to insert an entry at the tail of the pending list of a partition. Moves the pending list to
+ * the global list once it exceeds local_list_target entries.
  *
  * @param[in,out] map Pointer to the map.
  * @param[in] partition Partition to insert into.
- * @param[in,out] entry Entry to insert into the hot list.
+ * @param[in,out] entry Entry to insert.
  */
-static void
-_insert_into_hot_list(_Inout_ ebpf_core_lru_map_t* map, size_t partition, _Inout_ ebpf_lru_entry_t* entry)
+static _Requires_lock_held_(map->partitions[partition].lock) void _insert_into_pending_list(
+    _Inout_ ebpf_core_lru_map_t* map, size_t partition, _Inout_ ebpf_lru_entry_t* entry)
 {
-    ebpf_lru_key_state_t key_state = _get_key_state(map, partition, entry);
-    ebpf_lock_state_t state = 0;
-
-    switch (key_state) {
-    case EBPF_LRU_KEY_UNINITIALIZED:
-        break;
-    case EBPF_LRU_KEY_COLD:
-        break;
-    case EBPF_LRU_KEY_HOT:
-        return;
-    case EBPF_LRU_KEY_DELETED:
-        return;
-    }
-
-    state = ebpf_lock_lock(&map->partitions[partition].lock);
+    ebpf_lru_partition_t* local = &map->partitions[partition];
 
-    key_state = _get_key_state(map, partition, entry);
+    entry->partition = (uint32_t)partition;
+    entry->state = EBPF_LRU_KEY_PENDING;
+    ebpf_list_insert_tail(&local->pending_list, &entry->list_entry);
+    local->pending_list_size++;
 
-    switch (key_state) {
-    case EBPF_LRU_KEY_UNINITIALIZED:
-        EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = map->partitions[partition].current_generation;
-        EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(map, entry)[partition] = cxplat_query_time_since_boot_approximate(false);
-        ebpf_list_insert_tail(
-            &map->partitions[partition].hot_list, &EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-        map->partitions[partition].hot_list_size++;
-        break;
-    case EBPF_LRU_KEY_COLD:
-        // Remove from cold list.
-        EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = map->partitions[partition].current_generation;
-        EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(map, entry)[partition] = cxplat_query_time_since_boot_approximate(false);
-        ebpf_list_remove_entry(&EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-        ebpf_list_insert_tail(
-            &map->partitions[partition].hot_list, &EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-        map->partitions[partition].hot_list_size++;
-        break;
-    case EBPF_LRU_KEY_HOT:
-        break;
-    case EBPF_LRU_KEY_DELETED:
-        break;
+    if (local->pending_list_size > map->local_list_target) {
+        ebpf_lock_state_t state = ebpf_lock_lock(&map->global.lock);
+        _flush_lru_pending_list(map, partition);
+        ebpf_lock_unlock(&map->global.lock, state);
     }
-
-    _merge_hot_into_cold_list_if_needed(map, partition);
-    ebpf_lock_unlock(&map->partitions[partition].lock, state);
 }
 
 /**
  * @brief Helper function to initialize an LRU entry that was created when an entry was inserted into the hash table.
- * Sets the current generation, populates the key, and inserts the entry into the hot list.
+ * Populates the key and inserts the entry into the pending list of the current partition.
  *
  * @param[in,out] map Pointer to the map.
  * @param[in,out] entry Entry to initialize.
+ * @param[in] partition Partition of the current CPU.
  * @param[in] key Key to initialize the entry with.
  */
 static void
 _initialize_lru_entry(
     _Inout_ ebpf_core_lru_map_t* map, _Inout_ ebpf_lru_entry_t* entry, size_t partition, _In_ const uint8_t* key)
 {
-    memcpy(EBPF_LRU_ENTRY_KEY_PTR(map, entry), key, map->core_map.ebpf_map_definition.key_size);
+    memcpy(entry->key, key, map->core_map.ebpf_map_definition.key_size);
 
-    for (size_t current_partition = 0; current_partition < map->partition_count; current_partition++) {
-        // The ebpf_lru_entry_t should be zero initialized, so this assert should always pass.
-        ebpf_assert(_get_key_state(map, current_partition, entry) == EBPF_LRU_KEY_UNINITIALIZED);
-        ebpf_list_initialize(&EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[current_partition]);
-    }
+    // The ebpf_lru_entry_t should be zero initialized, so this assert should always pass.
+    ebpf_assert(entry->state == EBPF_LRU_KEY_UNINITIALIZED);
 
-    // Only insert into the current partition's hot list.
     ebpf_lock_state_t state = ebpf_lock_lock(&map->partitions[partition].lock);
-    EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = map->partitions[partition].current_generation;
-    EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(map, entry)[partition] = cxplat_query_time_since_boot_approximate(false);
-    ebpf_list_insert_tail(&map->partitions[partition].hot_list, &EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-    map->partitions[partition].hot_list_size++;
-
-    _merge_hot_into_cold_list_if_needed(map, partition);
-
+    _insert_into_pending_list(map, partition, entry);
     ebpf_lock_unlock(&map->partitions[partition].lock, state);
 }
 
 /**
- * @brief Helper function called when an entry is deleted from the hash table. Removes the entry from the hot or cold
- * list and sets the generation to EBPF_LRU_INVALID_GENERATION so that subsequent access doesn't reinsert it into the
- * hot list.
+ * @brief Helper function called when an entry is deleted from the hash table. Removes the entry from the list it is on
+ * and sets the state to EBPF_LRU_KEY_DELETED. The entry can move between lists until the lock of the list it is on is
+ * held, so the state is checked again after acquiring the lock.
  *
  * @param[in,out] map Pointer to the map.
  * @param[in,out] entry Entry being deleted.
@@ -1322,29 +1631,56 @@ _initialize_lru_entry(
 static void
 _uninitialize_lru_entry(_Inout_ ebpf_core_lru_map_t* map, _Inout_ ebpf_lru_entry_t* entry)
 {
-    for (size_t partition = 0; partition < map->partition_count; partition++) {
-        ebpf_lock_state_t state = ebpf_lock_lock(&map->partitions[partition].lock);
-        ebpf_lru_key_state_t key_state = _get_key_state(map, partition, entry);
+    for (;;) {
+        ebpf_lru_key_state_t key_state = entry->state;
+        ebpf_lock_state_t state;
+        bool removed = false;
 
         switch (key_state) {
         case EBPF_LRU_KEY_UNINITIALIZED:
-            EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = EBPF_LRU_INVALID_GENERATION;
-            break;
-        case EBPF_LRU_KEY_COLD:
-            ebpf_list_remove_entry(&EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-            EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = EBPF_LRU_INVALID_GENERATION;
+            entry->state = EBPF_LRU_KEY_DELETED;
+            return;
+        case EBPF_LRU_KEY_PENDING:
+        case EBPF_LRU_KEY_EVICTING:
+        case EBPF_LRU_KEY_EVICTED: {
+            uint32_t partition = entry->partition;
+            state = ebpf_lock_lock(&map->partitions[partition].lock);
+            key_state = entry->state;
+            // Pairs with the barrier in _fill_lru_eviction_list.
+            MemoryBarrier();
+            if (entry->partition == partition &&
+                (key_state == EBPF_LRU_KEY_PENDING || key_state == EBPF_LRU_KEY_EVICTING ||
+                 key_state == EBPF_LRU_KEY_EVICTED)) {
+                if (key_state == EBPF_LRU_KEY_PENDING) {
+                    map->partitions[partition].pending_list_size--;
+                }
+                if (key_state != EBPF_LRU_KEY_EVICTED) {
+                    ebpf_list_remove_entry(&entry->list_entry);
+                }
+                entry->state = EBPF_LRU_KEY_DELETED;
+                removed = true;
+            }
+            ebpf_lock_unlock(&map->partitions[partition].lock, state);
             break;
-        case EBPF_LRU_KEY_HOT:
-            ebpf_list_remove_entry(&EBPF_LRU_ENTRY_LIST_ENTRY_PTR(map, entry)[partition]);
-            EBPF_LRU_ENTRY_GENERATION_PTR(map, entry)[partition] = EBPF_LRU_INVALID_GENERATION;
-            map->partitions[partition].hot_list_size--;
+        }
+        case EBPF_LRU_KEY_GLOBAL:
+            state = ebpf_lock_lock(&map->global.lock);
+            if (entry->state == EBPF_LRU_KEY_GLOBAL) {
+                ebpf_list_remove_entry(&entry->list_entry);
+                map->global.list_size--;
+                entry->state = EBPF_LRU_KEY_DELETED;
+                removed = true;
+            }
+            ebpf_lock_unlock(&map->global.lock, state);
             break;
         case EBPF_LRU_KEY_DELETED:
             ebpf_assert(!"Key already deleted");
-            break;
+            return;
         }
 
-        ebpf_lock_unlock(&map->partitions[partition].lock, state);
+        if (removed) {
+            return;
+        }
     }
 }
 
@@ -1354,17 +1690,19 @@ _lru_hash_table_notification(
 {
     ebpf_core_lru_map_t* lru_map = (ebpf_core_lru_map_t*)context;
     ebpf_lru_entry_t* entry = (ebpf_lru_entry_t*)_get_supplemental_value(&lru_map->core_map, value);
-    // Map the current CPU to a partition.
-    uint32_t partition = ebpf_get_current_cpu() % lru_map->partition_count;
     switch (type) {
     case EBPF_HASH_TABLE_NOTIFICATION_TYPE_ALLOCATE:
-        _initialize_lru_entry(lru_map, entry, partition, key);
+        // Map the current CPU to a partition.
+        _initialize_lru_entry(lru_map, entry, ebpf_get_current_cpu() % lru_map->partition_count, key);
         break;
     case EBPF_HASH_TABLE_NOTIFICATION_TYPE_FREE:
         _uninitialize_lru_entry(lru_map, entry);
         break;
     case EBPF_HASH_TABLE_NOTIFICATION_TYPE_USE:
-        _insert_into_hot_list(lru_map, partition, entry);
+        // Only write the flag if it changes, so that hot entries are not written on every lookup.
+        if (!entry->referenced) {
+            entry->referenced = true;
+        }
         break;
     default:
         ebpf_assert(!"Invalid notification type");
@@ -1379,7 +1717,7 @@ _create_lru_hash_map(
 {
     ebpf_result_t retval = EBPF_SUCCESS;
     ebpf_core_lru_map_t* lru_map = NULL;
-    uint32_t partition_count = min(ebpf_get_cpu_count(), EBPF_LRU_MAXIMUM_PARTITIONS);
+    uint32_t partition_count = ebpf_get_cpu_count();
 
     *map = NULL;
 
@@ -1390,10 +1728,8 @@ _create_lru_hash_map(
         goto Exit;
     }
 
-    size_t lru_entry_size = EBPF_LRU_ENTRY_SIZE(partition_count, map_definition->key_size);
-
-    // Add the key size to the entry size.
-    retval = ebpf_safe_size_t_add(lru_entry_size, map_definition->key_size, &lru_entry_size);
+    size_t lru_entry_size;
+    retval = ebpf_safe_size_t_add(EBPF_OFFSET_OF(ebpf_lru_entry_t, key), map_definition->key_size, &lru_entry_size);
     if (retval != EBPF_SUCCESS) {
         goto Exit;
     }
@@ -1432,20 +1768,20 @@ _create_lru_hash_map(
 
     lru_map->partition_count = partition_count;
 
-    for (size_t partition = 0; partition < lru_map->partition_count; partition++) {
-        ebpf_list_initialize(&lru_map->partitions[partition].hot_list);
-        ebpf_list_initialize(&lru_map->partitions[partition].cold_list);
-        ebpf_lock_create(&lru_map->partitions[partition].lock);
+    // Keep the local lists of small maps to a fraction of each CPU's share of the entries, so that most entries stay
+    // on the global list where they are ordered.
+    lru_map->local_list_target =
+        max(min(EBPF_LRU_LOCAL_LIST_TARGET, map_definition->max_entries / partition_count / 4), 1);
 
-        lru_map->partitions[partition].current_generation = EBPF_LRU_INITIAL_GENERATION;
-        lru_map->partitions[partition].hot_list_size = 0;
-        // Assuming that access is randomly distributed, each partition should have the same number of entries in its
-        // cold and hot lists. Assume random distribution and divide the entries evenly among the partitions.
-        uint32_t average_entries_per_partition = map_definition->max_entries / partition_count;
+    ebpf_lock_create(&lru_map->global.lock);
+    ebpf_list_initialize(&lru_map->global.list);
+    lru_map->global.list_size = 0;
 
-        // The hot list limit is the average number of entries per partition divided by the number of generations.
-        lru_map->partitions[partition].hot_list_limit =
-            max(average_entries_per_partition / EBPF_LRU_GENERATION_COUNT, 1);
+    for (size_t partition = 0; partition < lru_map->partition_count; partition++) {
+        ebpf_lock_create(&lru_map->partitions[partition].lock);
+        ebpf_list_initialize(&lru_map->partitions[partition].pending_list);
+        ebpf_list_initialize(&lru_map->partitions[partition].eviction_list);
+        lru_map->partitions[partition].pending_list_size = 0;
     }
 
     *map = &lru_map->core_map;
@@ -1474,84 +1810,79 @@ static ebpf_result_t
 _delete_hash_map_entry(_Inout_ ebpf_core_map_t* map, _In_ const uint8_t* key);
 
 /**
- * @brief Walk the cold lists, removing secondary keys and finding the oldest primary key.
+ * @brief Remove the next entry to evict from the eviction list of a partition, refilling the eviction list from the
+ * global list when it is empty. Entries referenced since they were taken from the global list are moved to the
+ * pending list instead of being returned.
  *
- * @param[in] lru_map
- * @return Either the oldest primary key or NULL if no primary keys are present.
+ * @param[in,out] lru_map Pointer to the map.
+ * @param[in] partition Partition of the current CPU.
+ * @return The entry to evict, or NULL if neither the partition nor the global list has an entry to evict.
  */
-static ebpf_lru_entry_t*
-_reap_lru_cold_lists(ebpf_core_lru_map_t* lru_map)
-{
-    ebpf_lru_entry_t* oldest_entry = NULL;
-    uint64_t oldest_timestamp = UINT64_MAX;
-    bool non_empty_partition_found = true;
-
-    // Scan all partitions until we find a non-empty cold list or we have an oldest entry.
-    while (!oldest_entry && non_empty_partition_found) {
-        non_empty_partition_found = false;
-        // Scan each partition, removing secondary entries with higher timestamps until we find the oldest entry.
-        for (size_t partition = 0; partition < lru_map->partition_count; partition++) {
-            // If this cold list is empty, skip it.
-            if (ebpf_list_is_empty(&lru_map->partitions[partition].cold_list)) {
-                continue;
-            }
-
-            // Found a non-empty partition.
-            non_empty_partition_found = true;
-
-            // Lock the partition.
-            ebpf_lock_state_t state = ebpf_lock_lock(&lru_map->partitions[partition].lock);
+static _Ret_maybenull_ ebpf_lru_entry_t*
+_take_lru_eviction_candidate(_Inout_ ebpf_core_lru_map_t* lru_map, size_t partition)
+{
+    ebpf_lru_partition_t* local = &lru_map->partitions[partition];
+    ebpf_lru_entry_t* entry = NULL;
+    ebpf_lock_state_t state = ebpf_lock_lock(&local->lock);
 
-            // Check again after acquiring the lock.
-            // If the cold list is empty, skip it.
-            if (ebpf_list_is_empty(&lru_map->partitions[partition].cold_list)) {
-                ebpf_lock_unlock(&lru_map->partitions[partition].lock, state);
-                continue;
+    for (;;) {
+        if (ebpf_list_is_empty(&local->eviction_list)) {
+            ebpf_lock_state_t global_state = ebpf_lock_lock(&lru_map->global.lock);
+            // Entries inserted on this CPU are candidates too.
+            _flush_lru_pending_list(lru_map, partition);
+            _fill_lru_eviction_list(lru_map, partition);
+            ebpf_lock_unlock(&lru_map->global.lock, global_state);
+
+            if (ebpf_list_is_empty(&local->eviction_list)) {
+                break;
             }
+        }
 
-            // Compute the start of the entry from the cold list entry.
-            ebpf_list_entry_t* list_entry = lru_map->partitions[partition].cold_list.Flink - partition;
-            ebpf_lru_entry_t* entry = (ebpf_lru_entry_t*)list_entry;
+        entry = EBPF_FROM_FIELD(ebpf_lru_entry_t, list_entry, local->eviction_list.Flink);
+        ebpf_list_remove_entry(&entry->list_entry);
 
-            // The effective age of an entry is the maximum of the last used time of all partitions.
-            // Compute the highest timestamp for this entry.
-            size_t highest_timestamp = 0;
-            for (size_t inner_partition = 0; inner_partition < lru_map->partition_count; inner_partition++) {
-                if (EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(lru_map, entry)[inner_partition] > highest_timestamp) {
-                    highest_timestamp = EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(lru_map, entry)[inner_partition];
-                }
-            }
+        if (!entry->referenced) {
+            entry->state = EBPF_LRU_KEY_EVICTED;
+            break;
+        }
 
-            // If this key is present in another partitions's cold list with a higher timestamp and is therefore
-            // redundant, remove it. This prevents this code from examining the same key multiple times.
-            if (highest_timestamp != EBPF_LRU_ENTRY_LAST_USED_TIME_PTR(lru_map, entry)[partition]) {
-                ebpf_lru_key_state_t key_state = _get_key_state(lru_map, partition, entry);
-                switch (key_state) {
-                case EBPF_LRU_KEY_UNINITIALIZED:
-                    break;
-                case EBPF_LRU_KEY_COLD:
-                    ebpf_list_remove_entry(&EBPF_LRU_ENTRY_LIST_ENTRY_PTR(lru_map, entry)[partition]);
-                    EBPF_LRU_ENTRY_GENERATION_PTR(lru_map, entry)[partition] = EBPF_LRU_KEY_UNINITIALIZED;
-                    break;
-                case EBPF_LRU_KEY_HOT:
-                    ebpf_assert(!"Key should not be in the hot list");
-                    break;
-                case EBPF_LRU_KEY_DELETED:
-                    break;
-                }
-                ebpf_lock_unlock(&lru_map->partitions[partition].lock, state);
-                continue;
-            }
+        // The entry was used after it was taken from the global list, so keep it.
+        entry->referenced = false;
+        _insert_into_pending_list(lru_map, partition, entry);
+        entry = NULL;
+    }
 
-            // Check if the highest timestamp is the oldest.
-            if (highest_timestamp < oldest_timestamp) {
-                oldest_timestamp = highest_timestamp;
-                oldest_entry = entry;
-            }
-            ebpf_lock_unlock(&lru_map->partitions[partition].lock, state);
+    ebpf_lock_unlock(&local->lock, state);
+    return entry;
+}
+
+/**
+ * @brief Move the pending and eviction lists of every partition to the global list. Used when the map is full and all
+ * of its entries are on the lists of other CPUs.
+ *
+ * @param[in,out] lru_map Pointer to the map.
+ */
+static void
+_drain_lru_partitions(_Inout_ ebpf_core_lru_map_t* lru_map)
+{
+    for (size_t partition = 0; partition < lru_map->partition_count; partition++) {
+        ebpf_lru_partition_t* local = &lru_map->partitions[partition];
+        ebpf_lock_state_t state = ebpf_lock_lock(&local->lock);
+        ebpf_lock_state_t global_state = ebpf_lock_lock(&lru_map->global.lock);
+
+        // The global list is empty or only holds entries newer than these, so appending keeps it ordered.
+        while (!ebpf_list_is_empty(&local->eviction_list)) {
+            ebpf_lru_entry_t* entry =
+                EBPF_FROM_FIELD(ebpf_lru_entry_t, list_entry, ebpf_list_remove_head_entry(&local->eviction_list));
+            entry->state = EBPF_LRU_KEY_GLOBAL;
+            ebpf_list_insert_tail(&lru_map->global.list, &entry->list_entry);
+            lru_map->global.list_size++;
         }
+        _flush_lru_pending_list(lru_map, partition);
+
+        ebpf_lock_unlock(&lru_map->global.lock, global_state);
+        ebpf_lock_unlock(&local->lock, state);
     }
-    return oldest_entry;
 }
 
 /**
@@ -1566,14 +1897,290 @@ _reap_oldest_map_entry(_Inout_ ebpf_core_map_t* map)
 
     lru_map = EBPF_FROM_FIELD(ebpf_core_lru_map_t, core_map, map);
 
-    ebpf_lru_entry_t* entry = _reap_lru_cold_lists(lru_map);
+    uint32_t partition = ebpf_get_current_cpu() % lru_map->partition_count;
+    ebpf_lru_entry_t* entry = _take_lru_eviction_candidate(lru_map, partition);
+    if (!entry) {
+        _drain_lru_partitions(lru_map);
+        entry = _take_lru_eviction_candidate(lru_map, partition);
+    }
+
+    if (!entry) {
+        // Every entry is being deleted. The caller will attempt to reap again if the next insert fails.
+        return;
+    }
+
+    // The entry may already have been deleted or replaced, which is okay as the caller will attempt to reap again if
+    // the next insert fails.
+    ebpf_result_t result = _delete_hash_map_entry(map, entry->key);
+    if (result == EBPF_SUCCESS && _ebpf_map_statistics_enabled) {
+        _ebpf_map_count(map, EBPF_MAP_STATISTIC_LRU_EVICTION);
+    }
+    if (result != EBPF_SUCCESS && result != EBPF_KEY_NOT_FOUND) {
+        // The entry is still in the map, so put it back in the key history unless it was deleted in the meantime.
+        ebpf_lock_state_t state = ebpf_lock_lock(&lru_map->partitions[partition].lock);
+        if (entry->state == EBPF_LRU_KEY_EVICTED) {
+            _insert_into_pending_list(lru_map, partition, entry);
+        }
+        ebpf_lock_unlock(&lru_map->partitions[partition].lock, state);
+    }
+}
+
+static void
+_aging_hash_table_notification(
+    _In_ void* context, _In_ ebpf_hash_table_notification_type_t type, _In_ const uint8_t* key, _In_ uint8_t* value)
+{
+    UNREFERENCED_PARAMETER(key);
+    ebpf_core_aging_map_t* aging_map = (ebpf_core_aging_map_t*)context;
+    ebpf_aging_entry_t* entry = (ebpf_aging_entry_t*)_get_supplemental_value(&aging_map->core_map, value);
+    uint64_t now;
+    switch (type) {
+    case EBPF_HASH_TABLE_NOTIFICATION_TYPE_ALLOCATE:
+        entry->last_access_time = cxplat_query_time_since_boot_approximate(false);
+        break;
+    case EBPF_HASH_TABLE_NOTIFICATION_TYPE_FREE:
+        break;
+    case EBPF_HASH_TABLE_NOTIFICATION_TYPE_USE:
+        // Only write the time if it is stale, so that hot entries are not written on every lookup.
+        now = cxplat_query_time_since_boot_approximate(false);
+        if (now > entry->last_access_time + EBPF_AGING_MAP_REFRESH_INTERVAL_MS * EBPF_FILETIME_PER_MS) {
+            entry->last_access_time = now;
+        }
+        break;
+    default:
+        ebpf_assert(!"Invalid notification type");
+    }
+}
+
+/**
+ * @brief Replace the buffers a partition passes to ebpf_hash_table_iterate_range with larger ones.
+ *
+ * @param[in,out] partition Partition to update.
+ * @param[in] buffer_size Number of keys and values the new buffers must hold.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+ */
+static ebpf_result_t
+_grow_aging_partition_buffers(_Inout_ ebpf_aging_partition_t* partition, size_t buffer_size)
+{
+    // The keys and the values share one allocation.
+    size_t allocation_size;
+    ebpf_result_t result = ebpf_safe_size_t_multiply(buffer_size, 2 * sizeof(const uint8_t*), &allocation_size);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    const uint8_t** buffer = (const uint8_t**)ebpf_allocate_with_tag(allocation_size, EBPF_POOL_TAG_MAP);
+    if (buffer == NULL) {
+        return EBPF_NO_MEMORY;
+    }
+
+    ebpf_free((void*)partition->keys);
+    partition->keys = buffer;
+    partition->values = buffer + buffer_size;
+    partition->buffer_size = buffer_size;
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Work queue callback that checks the next batch of entries in the range of a partition and deletes the ones
+ * that expired. The work item is re-inserted to check the next batch on the next interval, until the map is deleted.
+ *
+ * @param[in,out] context Pointer to the map.
+ * @param[in] cpu_id CPU of the partition.
+ * @param[in,out] work_item Work item of the partition.
+ */
+_IRQL_requires_(DISPATCH_LEVEL) static void _aging_map_reap(
+    _Inout_ void* context, uint32_t cpu_id, _Inout_ ebpf_list_entry_t* work_item)
+{
+    UNREFERENCED_PARAMETER(work_item);
+    ebpf_core_aging_map_t* aging_map = (ebpf_core_aging_map_t*)context;
+    ebpf_aging_partition_t* partition = &aging_map->partitions[cpu_id];
+    ebpf_hash_table_t* hash_table = (ebpf_hash_table_t*)aging_map->core_map.data;
+    uint64_t now = cxplat_query_time_since_boot_approximate(false);
+    size_t checked_count = 0;
+    ebpf_epoch_state_t epoch_state;
+
+    // Keys returned by ebpf_hash_table_iterate_range stay valid until the epoch is exited.
+    ebpf_epoch_enter(&epoch_state);
+    while (checked_count < aging_map->reap_budget) {
+        size_t count = partition->buffer_size;
+        ebpf_result_t result = ebpf_hash_table_iterate_range(
+            hash_table, &partition->cursor, partition->end, &count, partition->keys, partition->values);
+        if (result == EBPF_INSUFFICIENT_BUFFER) {
+            // The next bucket holds more entries than fit in the buffers. Retry on the next interval if the buffers
+            // can't be grown.
+            if (_grow_aging_partition_buffers(partition, count) != EBPF_SUCCESS) {
+                break;
+            }
+            continue;
+        }
+        if (result != EBPF_SUCCESS) {
+            // Every entry in the range has been checked, start over on the next interval.
+            partition->cursor = partition->start;
+            break;
+        }
+
+        for (size_t index = 0; index < count; index++) {
+            ebpf_aging_entry_t* entry = (ebpf_aging_entry_t*)_get_supplemental_value(
+                &aging_map->core_map, (uint8_t*)partition->values[index]);
+            if (entry->last_access_time + aging_map->time_to_live > now) {
+                continue;
+            }
+
+            // The entry may have been deleted or replaced since it was returned, which is okay.
+            if (ebpf_hash_table_delete(hash_table, partition->keys[index]) == EBPF_SUCCESS) {
+                ebpf_interlocked_increment_int64(&aging_map->expired_entry_count);
+            }
+        }
+        checked_count += count;
+    }
+    ebpf_epoch_exit(&epoch_state);
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&partition->lock);
+    if (!partition->stopped) {
+        ebpf_timed_work_queue_insert(partition->work_queue, &partition->work_item, EBPF_WORK_QUEUE_WAKEUP_DEFERRED);
+    }
+    ebpf_lock_unlock(&partition->lock, state);
+}
+
+static void
+_ebpf_aging_map_free(_Inout_ void* work_item_context)
+{
+    ebpf_core_aging_map_t* aging_map = (ebpf_core_aging_map_t*)work_item_context;
+
+    // Wait for the work queues to stop running before freeing the hash table they check.
+    for (size_t partition = 0; partition < aging_map->partition_count; partition++) {
+        ebpf_timed_work_queue_destroy(aging_map->partitions[partition].work_queue);
+        ebpf_free((void*)aging_map->partitions[partition].keys);
+    }
+
+    ebpf_hash_table_destroy((ebpf_hash_table_t*)aging_map->core_map.data);
+    ebpf_epoch_free_cache_aligned(aging_map);
+}
+
+static ebpf_result_t
+_create_aging_hash_map(_In_ const ebpf_map_definition_in_memory_t* map_definition, _Outptr_ ebpf_core_map_t** map)
+{
+    ebpf_result_t retval = EBPF_SUCCESS;
+    ebpf_core_aging_map_t* aging_map = NULL;
+    uint32_t partition_count = ebpf_get_cpu_count();
+
+    *map = NULL;
+
+    EBPF_LOG_ENTRY();
+
+    // map_extra is the TTL in seconds.
+    if (map_definition->map_extra > UINT32_MAX) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+
+    // Align the supplemental value to 8 byte boundary.
+    size_t supplemental_value_size =
+        sizeof(ebpf_aging_entry_t) + EBPF_PAD_8(map_definition->value_size) - map_definition->value_size;
+
+    size_t aging_map_size;
+    retval = ebpf_safe_size_t_multiply(sizeof(ebpf_aging_partition_t), partition_count, &aging_map_size);
+    if (retval != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    retval = ebpf_safe_size_t_add(aging_map_size, EBPF_OFFSET_OF(ebpf_core_aging_map_t, partitions), &aging_map_size);
+    if (retval != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    retval = _create_hash_map_internal(
+        aging_map_size,
+        map_definition,
+        supplemental_value_size,
+        false,
+        NULL,
+        _aging_hash_table_notification,
+        (ebpf_core_map_t**)&aging_map);
+    if (retval != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    aging_map->time_to_live = map_definition->map_extra * 1000 * EBPF_FILETIME_PER_MS;
+    aging_map->partition_count = partition_count;
+
+    // Check enough entries per interval to visit every entry of a full map within half the TTL.
+    uint64_t intervals_per_pass = max(map_definition->map_extra * 1000 / 2 / EBPF_AGING_MAP_REAP_INTERVAL_MS, 1);
+    uint64_t entries_per_partition = ((uint64_t)map_definition->max_entries + partition_count - 1) / partition_count;
+    aging_map->reap_budget =
+        (size_t)max((entries_per_partition + intervals_per_pass - 1) / intervals_per_pass, EBPF_AGING_MAP_REAP_BATCH);
+
+    aging_map->free_work_item = ebpf_epoch_allocate_work_item(aging_map, _ebpf_aging_map_free);
+    if (aging_map->free_work_item == NULL) {
+        retval = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = EBPF_AGING_MAP_REAP_INTERVAL_MS * EBPF_FILETIME_PER_MS;
+    for (uint32_t cpu_id = 0; cpu_id < partition_count; cpu_id++) {
+        ebpf_aging_partition_t* partition = &aging_map->partitions[cpu_id];
+        partition->start = (size_t)((uint64_t)EBPF_HASH_TABLE_ITERATE_END * cpu_id / partition_count);
+        partition->end = (size_t)((uint64_t)EBPF_HASH_TABLE_ITERATE_END * (cpu_id + 1) / partition_count);
+        partition->cursor = partition->start;
+        ebpf_lock_create(&partition->lock);
+        ebpf_list_initialize(&partition->work_item);
+
+        retval = _grow_aging_partition_buffers(partition, EBPF_AGING_MAP_REAP_BATCH);
+        if (retval != EBPF_SUCCESS) {
+            goto Exit;
+        }
+
+        retval = ebpf_timed_work_queue_create(&partition->work_queue, cpu_id, &interval, _aging_map_reap, aging_map);
+        if (retval != EBPF_SUCCESS) {
+            goto Exit;
+        }
+    }
+
+    for (size_t partition = 0; partition < partition_count; partition++) {
+        ebpf_timed_work_queue_insert(
+            aging_map->partitions[partition].work_queue,
+            &aging_map->partitions[partition].work_item,
+            EBPF_WORK_QUEUE_WAKEUP_DEFERRED);
+    }
+
+    *map = &aging_map->core_map;
+    aging_map = NULL;
+
+Exit:
+    if (aging_map) {
+        ebpf_epoch_cancel_work_item(aging_map->free_work_item);
+        _ebpf_aging_map_free(aging_map);
+    }
+
+    EBPF_RETURN_RESULT(retval);
+}
+
+/**
+ * @brief Delete a BPF_MAP_TYPE_HASH map, which is an aging hash map if map_extra is non-zero.
+ *
+ * @param[in] map Pointer to the map.
+ */
+static void
+_delete_hash_map_with_aging(_In_ _Post_invalid_ ebpf_core_map_t* map)
+{
+    if (map->ebpf_map_definition.map_extra == 0) {
+        _delete_hash_map(map);
+        return;
+    }
+
+    ebpf_core_aging_map_t* aging_map = EBPF_FROM_FIELD(ebpf_core_aging_map_t, core_map, map);
 
-    if (entry) {
-        // Attempt to delete the entry from the cold list.
-        // This may fail if the entry has already been freed, but that's okay as the caller will
-        // attempt to reap again if the next insert fails.
-        (void)_delete_hash_map_entry(map, EBPF_LRU_ENTRY_KEY_PTR(lru_map, entry));
+    // Stop the partitions from re-inserting their work items, then stop the work queues at passive level once the
+    // current epoch ends.
+    for (size_t partition = 0; partition < aging_map->partition_count; partition++) {
+        ebpf_lock_state_t state = ebpf_lock_lock(&aging_map->partitions[partition].lock);
+        aging_map->partitions[partition].stopped = true;
+        ebpf_lock_unlock(&aging_map->partitions[partition].lock, state);
     }
+
+    ebpf_epoch_schedule_work_item(aging_map->free_work_item);
 }
 
 static ebpf_result_t
@@ -1668,8 +2275,8 @@ _update_hash_map_entry(
         }
 
         // Reap the oldest entry and try again.
-        // Data from measurements shows that reaping one entry or many entries doesn't materially affect performance.
-        // To make this simple, reap one entry at a time.
+        // Candidates are taken from the global list in batches, but only one entry is evicted per failed insert so
+        // that the map stays full.
         _reap_oldest_map_entry(map);
     }
 
@@ -1822,6 +2429,22 @@ _next_hash_map_key_and_value(
     return result;
 }
 
+static ebpf_result_t
+_next_hash_map_key_and_value_with_cursor(
+    _Inout_ ebpf_core_map_t* map,
+    _In_opt_ const uint8_t* previous_key,
+    _Inout_ uint64_t* cursor,
+    _Inout_ uint8_t* next_key,
+    _Inout_opt_ uint8_t** next_value)
+{
+    if (!map || !cursor || !next_key) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    return ebpf_hash_table_next_key_and_value_with_cursor(
+        (ebpf_hash_table_t*)map->data, previous_key, cursor, next_key, next_value);
+}
+
 static __forceinline ebpf_result_t
 _ebpf_adjust_value_pointer(_In_ const ebpf_map_t* map, _Inout_ uint8_t** value)
 {
@@ -1833,7 +2456,7 @@ _ebpf_adjust_value_pointer(_In_ const ebpf_map_t* map, _Inout_ uint8_t** value)
 
     current_cpu = ebpf_get_current_cpu();
 
-    (*value) += EBPF_PAD_8((size_t)map->original_value_size) * current_cpu;
+    (*value) += EBPF_MAP_PER_CPU_VALUE_STRIDE(map->original_value_size) * current_cpu;
     return EBPF_SUCCESS;
 }
 
@@ -1885,6 +2508,210 @@ _lpm_extract(_In_ const uint8_t* value, _Outptr_ const uint8_t** data, _Out_ siz
     *length_in_bits = sizeof(uint32_t) * 8 + key->prefix_length;
 }
 
+/**
+ * @brief Get bit index of a prefix, counting from the most significant bit of the first byte.
+ */
+static __forceinline uint8_t
+_lpm_prefix_bit(_In_ const uint8_t* prefix, uint32_t index)
+{
+    return (prefix[index / 8] >> (7 - (index % 8))) & 1;
+}
+
+/**
+ * @brief Get the number of leading bits that a trie node has in common with a prefix.
+ *
+ * @param[in] node Trie node.
+ * @param[in] prefix Prefix to compare with.
+ * @param[in] prefix_length Length of prefix in bits.
+ * @return Number of matching bits, at most the shorter of the two lengths.
+ */
+static uint32_t
+_lpm_match_length(_In_ const ebpf_core_lpm_node_t* node, _In_ const uint8_t* prefix, uint32_t prefix_length)
+{
+    uint32_t limit = min(node->prefix_length, prefix_length);
+    uint32_t length = 0;
+
+    for (uint32_t index = 0; length < limit; index++) {
+        uint8_t difference = node->prefix[index] ^ prefix[index];
+        if (difference) {
+            while (!(difference & 0x80)) {
+                difference <<= 1;
+                length++;
+            }
+            break;
+        }
+        length += 8;
+    }
+    return min(length, limit);
+}
+
+static ebpf_core_lpm_node_t*
+_lpm_allocate_node(_In_ const ebpf_core_lpm_map_t* trie_map)
+{
+    size_t node_size = EBPF_OFFSET_OF(ebpf_core_lpm_node_t, prefix) +
+                       trie_map->core_map.ebpf_map_definition.key_size - sizeof(uint32_t);
+    ebpf_core_lpm_node_t* node = ebpf_epoch_allocate_with_tag(node_size, EBPF_POOL_TAG_MAP);
+    if (node) {
+        memset(node, 0, node_size);
+    }
+    return node;
+}
+
+/**
+ * @brief Find where a prefix belongs in the trie. The caller must hold the map lock.
+ *
+ * @param[in] trie_map LPM map.
+ * @param[in] key Key to find.
+ * @param[out] node Node in the slot, or NULL if the prefix belongs in an empty slot.
+ * @param[out] match_length Number of leading bits that the node has in common with the key.
+ * @return Slot that the prefix belongs in.
+ */
+static ebpf_core_lpm_node_t* volatile*
+_lpm_trie_find_slot(
+    _In_ ebpf_core_lpm_map_t* trie_map,
+    _In_ const ebpf_core_lpm_key_t* key,
+    _Outptr_result_maybenull_ ebpf_core_lpm_node_t** node,
+    _Out_ uint32_t* match_length)
+{
+    ebpf_core_lpm_node_t* volatile* slot = &trie_map->root;
+
+    // Find the deepest node that the new prefix extends.
+    *match_length = 0;
+    while ((*node = *slot) != NULL) {
+        *match_length = _lpm_match_length(*node, key->prefix, key->prefix_length);
+        if (*match_length != (*node)->prefix_length || (*node)->prefix_length == key->prefix_length) {
+            break;
+        }
+        slot = &(*node)->children[_lpm_prefix_bit(key->prefix, (*node)->prefix_length)];
+    }
+    return slot;
+}
+
+/**
+ * @brief Get the number of nodes that adding a prefix to the trie takes. The caller must hold the map lock.
+ *
+ * @param[in] trie_map LPM map.
+ * @param[in] key Key to add.
+ * @return 0 if the prefix is already in the trie, 2 if it needs an intermediate node, otherwise 1.
+ */
+static size_t
+_lpm_trie_insert_node_count(_In_ ebpf_core_lpm_map_t* trie_map, _In_ const ebpf_core_lpm_key_t* key)
+{
+    ebpf_core_lpm_node_t* node;
+    uint32_t match_length;
+    (void)_lpm_trie_find_slot(trie_map, key, &node, &match_length);
+
+    if (!node || match_length == key->prefix_length) {
+        return (node && node->prefix_length == key->prefix_length && node->has_entry) ? 0 : 1;
+    }
+    return 2;
+}
+
+/**
+ * @brief Add a prefix to the trie. The caller must hold the map lock.
+ *
+ * @param[in, out] trie_map LPM map.
+ * @param[in] key Key of the entry that was added to the hash table.
+ * @param[in, out] nodes Nodes allocated by the caller, at least _lpm_trie_insert_node_count of them. Nodes used by
+ * the trie are set to NULL.
+ */
+static void
+_lpm_trie_insert(
+    _Inout_ ebpf_core_lpm_map_t* trie_map, _In_ const ebpf_core_lpm_key_t* key, _Inout_ ebpf_core_lpm_node_t* nodes[2])
+{
+    size_t prefix_size = trie_map->core_map.ebpf_map_definition.key_size - sizeof(uint32_t);
+    ebpf_core_lpm_node_t* node;
+    uint32_t match_length;
+    ebpf_core_lpm_node_t* volatile* slot = _lpm_trie_find_slot(trie_map, key, &node, &match_length);
+
+    if (node && node->prefix_length == key->prefix_length && match_length == key->prefix_length && node->has_entry) {
+        // The prefix is already in the trie, only its value changed.
+        return;
+    }
+
+    ebpf_core_lpm_node_t* replaced_node = NULL;
+    ebpf_core_lpm_node_t* new_node = nodes[0];
+    nodes[0] = NULL;
+    new_node->prefix_length = key->prefix_length;
+    new_node->has_entry = true;
+    memcpy(new_node->prefix, key->prefix, prefix_size);
+
+    if (!node) {
+        // The new node is a leaf.
+    } else if (node->prefix_length == key->prefix_length && match_length == key->prefix_length) {
+        // Replace the intermediate node for this prefix.
+        new_node->children[0] = node->children[0];
+        new_node->children[1] = node->children[1];
+        replaced_node = node;
+    } else if (match_length == key->prefix_length) {
+        // The new prefix is a prefix of the node.
+        new_node->children[_lpm_prefix_bit(node->prefix, key->prefix_length)] = node;
+    } else {
+        // The new prefix and the node diverge at match_length; join them with an intermediate node.
+        ebpf_core_lpm_node_t* intermediate_node = nodes[1];
+        nodes[1] = NULL;
+        intermediate_node->prefix_length = match_length;
+        intermediate_node->has_entry = false;
+        memcpy(intermediate_node->prefix, key->prefix, prefix_size);
+        intermediate_node->children[_lpm_prefix_bit(node->prefix, match_length)] = node;
+        intermediate_node->children[_lpm_prefix_bit(key->prefix, match_length)] = new_node;
+        new_node = intermediate_node;
+    }
+
+    // Publish the new subtrie after its nodes are initialized.
+    WritePointerRelease((void* volatile*)slot, new_node);
+    ebpf_epoch_free(replaced_node);
+}
+
+/**
+ * @brief Remove a prefix from the trie. The caller must hold the map lock.
+ *
+ * @param[in, out] trie_map LPM map.
+ * @param[in] key Key of the entry that was removed from the hash table.
+ */
+static void
+_lpm_trie_delete(_Inout_ ebpf_core_lpm_map_t* trie_map, _In_ const ebpf_core_lpm_key_t* key)
+{
+    ebpf_core_lpm_node_t* volatile* slot = &trie_map->root;
+    ebpf_core_lpm_node_t* volatile* parent_slot = NULL;
+    ebpf_core_lpm_node_t* parent = NULL;
+    ebpf_core_lpm_node_t* node;
+
+    while ((node = *slot) != NULL) {
+        uint32_t match_length = _lpm_match_length(node, key->prefix, key->prefix_length);
+        if (match_length != node->prefix_length) {
+            return;
+        }
+        if (node->prefix_length == key->prefix_length) {
+            break;
+        }
+        parent_slot = slot;
+        parent = node;
+        slot = &node->children[_lpm_prefix_bit(key->prefix, node->prefix_length)];
+    }
+
+    if (!node || !node->has_entry) {
+        return;
+    }
+
+    if (node->children[0] && node->children[1]) {
+        // The node still joins two subtries.
+        node->has_entry = false;
+        return;
+    }
+
+    ebpf_core_lpm_node_t* child = node->children[0] ? node->children[0] : node->children[1];
+    if (!child && parent && !parent->has_entry) {
+        // Removing a leaf leaves its intermediate parent with one child, which takes the parent's place.
+        WritePointerRelease(
+            (void* volatile*)parent_slot, parent->children[parent->children[0] == node ? 1 : 0]);
+        ebpf_epoch_free(parent);
+    } else {
+        WritePointerRelease((void* volatile*)slot, child);
+    }
+    ebpf_epoch_free(node);
+}
+
 static ebpf_result_t
 _create_lpm_map(
     _In_ const ebpf_map_definition_in_memory_t* map_definition,
@@ -1894,32 +2721,27 @@ _create_lpm_map(
     ebpf_result_t result = EBPF_SUCCESS;
     // Key is uint32_t prefix length plus space for a max length prefix.
     // - Only the prefix length plus prefix_length bits are actually used in an lpm key.
-    size_t max_prefix_length = (map_definition->key_size - sizeof(uint32_t)) * 8;
+    size_t max_prefix_length;
     ebpf_core_lpm_map_t* lpm_map = NULL;
 
     EBPF_LOG_ENTRY();
 
     *map = NULL;
 
-    if (inner_map_handle != ebpf_handle_invalid) {
+    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size < sizeof(uint32_t)) {
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
+    max_prefix_length = (map_definition->key_size - sizeof(uint32_t)) * 8;
 
     result = _create_hash_map_internal(
-        EBPF_OFFSET_OF(ebpf_core_lpm_map_t, data) + ebpf_bitmap_size(max_prefix_length + 1),
-        map_definition,
-        0,
-        false,
-        _lpm_extract,
-        NULL,
-        (ebpf_core_map_t**)&lpm_map);
+        sizeof(ebpf_core_lpm_map_t), map_definition, 0, false, _lpm_extract, NULL, (ebpf_core_map_t**)&lpm_map);
     if (result != EBPF_SUCCESS) {
         goto Exit;
     }
     lpm_map->max_prefix = (uint32_t)max_prefix_length;
-    // Add one to max_prefix_length to account for max length prefixes in the prefix_length bitmap.
-    ebpf_bitmap_initialize((ebpf_bitmap_t*)lpm_map->data, max_prefix_length + 1);
+    ebpf_lock_create(&lpm_map->lock);
+    lpm_map->root = NULL;
 
     *map = &lpm_map->core_map;
 
@@ -1927,9 +2749,33 @@ Exit:
     EBPF_RETURN_RESULT(result);
 }
 
-static ebpf_result_t
-_find_lpm_map_entry(
-    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, bool delete_on_success, _Outptr_ uint8_t** data)
+static void
+_delete_lpm_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
+{
+    ebpf_core_lpm_map_t* trie_map = EBPF_FROM_FIELD(ebpf_core_lpm_map_t, core_map, map);
+
+    // Free the trie without recursion by rotating left children up until each node has none.
+    ebpf_core_lpm_node_t* node = trie_map->root;
+    while (node) {
+        ebpf_core_lpm_node_t* left = node->children[0];
+        if (left) {
+            node->children[0] = left->children[1];
+            left->children[1] = node;
+            node = left;
+        } else {
+            ebpf_core_lpm_node_t* right = node->children[1];
+            ebpf_epoch_free(node);
+            node = right;
+        }
+    }
+    trie_map->root = NULL;
+
+    _delete_hash_map(map);
+}
+
+static ebpf_result_t
+_find_lpm_map_entry(
+    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, bool delete_on_success, _Outptr_ uint8_t** data)
 {
     if (!map || !key || delete_on_success) {
         return EBPF_INVALID_ARGUMENT;
@@ -1941,28 +2787,42 @@ _find_lpm_map_entry(
         return EBPF_INVALID_ARGUMENT;
     }
     uint32_t original_prefix_length = lpm_key->prefix_length;
+    ebpf_result_t result;
     uint8_t* value = NULL;
 
-    ebpf_bitmap_cursor_t cursor;
-    // Start the key size search from the size of the passed in key.
-    // Iterate down through the inserted key lengths until we find a match.
-    // - Uses the passed in key for iteration by overwriting the prefix length.
-    ebpf_bitmap_start_reverse_search_at((ebpf_bitmap_t*)trie_map->data, &cursor, original_prefix_length);
-    lpm_key->prefix_length = (uint32_t)ebpf_bitmap_reverse_search_next_bit(&cursor);
-    while (lpm_key->prefix_length != MAXUINT32) {
-        if (_find_hash_map_entry(map, key, false, &value) == EBPF_SUCCESS) {
-            break;
+    for (;;) {
+        // Walk down the trie, remembering the longest prefix with an entry that matches the key.
+        uint32_t best_prefix_length = MAXUINT32;
+        ebpf_core_lpm_node_t* node = (ebpf_core_lpm_node_t*)ReadPointerAcquire((void* volatile*)&trie_map->root);
+        while (node) {
+            if (_lpm_match_length(node, lpm_key->prefix, original_prefix_length) != node->prefix_length) {
+                break;
+            }
+            if (node->has_entry) {
+                best_prefix_length = node->prefix_length;
+            }
+            if (node->prefix_length == original_prefix_length) {
+                break;
+            }
+            node = (ebpf_core_lpm_node_t*)ReadPointerAcquire(
+                (void* volatile*)&node->children[_lpm_prefix_bit(lpm_key->prefix, node->prefix_length)]);
         }
-        lpm_key->prefix_length = (uint32_t)ebpf_bitmap_reverse_search_next_bit(&cursor);
-    }
 
-    // Restore the original prefix length.
-    lpm_key->prefix_length = original_prefix_length;
-    if (!value) {
-        return EBPF_KEY_NOT_FOUND;
-    } else {
-        *data = value;
-        return EBPF_SUCCESS;
+        if (best_prefix_length == MAXUINT32) {
+            return EBPF_KEY_NOT_FOUND;
+        }
+
+        // Look up the value of the matching prefix.
+        // - Uses the passed in key for the lookup by overwriting the prefix length.
+        lpm_key->prefix_length = best_prefix_length;
+        result = _find_hash_map_entry(map, key, false, &value);
+        lpm_key->prefix_length = original_prefix_length;
+        if (result == EBPF_SUCCESS) {
+            *data = value;
+            return EBPF_SUCCESS;
+        }
+
+        // The entry was deleted after the trie walk found it, so walk the updated trie again.
     }
 }
 
@@ -1975,7 +2835,13 @@ _delete_lpm_map_entry(_In_ ebpf_core_map_t* map, _Inout_ const uint8_t* key)
         return EBPF_INVALID_ARGUMENT;
     }
 
-    return _delete_hash_map_entry(map, key);
+    ebpf_lock_state_t state = ebpf_lock_lock(&trie_map->lock);
+    ebpf_result_t result = _delete_hash_map_entry(map, key);
+    if (result == EBPF_SUCCESS) {
+        _lpm_trie_delete(trie_map, (const ebpf_core_lpm_key_t*)key);
+    }
+    ebpf_lock_unlock(&trie_map->lock, state);
+    return result;
 }
 
 static ebpf_result_t
@@ -1991,13 +2857,36 @@ _update_lpm_map_entry(
         return EBPF_INVALID_ARGUMENT;
     }
 
-    ebpf_result_t result = _update_hash_map_entry(map, key, data, option);
-    if (result == EBPF_SUCCESS) {
-        // Test if the bit is set before setting it. This avoids the overhead of a the interlocked operation.
-        if (!ebpf_bitmap_test_bit((ebpf_bitmap_t*)trie_map->data, lpm_key->prefix_length)) {
-            ebpf_bitmap_set_bit((ebpf_bitmap_t*)trie_map->data, lpm_key->prefix_length, true);
+    // Adding a prefix takes at most a leaf and an intermediate node, and updating an existing prefix takes none.
+    // Allocate only the nodes that the trie needs, outside the lock, and check again once they are allocated.
+    ebpf_result_t result;
+    ebpf_core_lpm_node_t* nodes[2] = {NULL, NULL};
+    size_t allocated_count = 0;
+    for (;;) {
+        ebpf_lock_state_t state = ebpf_lock_lock(&trie_map->lock);
+        size_t needed_count = _lpm_trie_insert_node_count(trie_map, lpm_key);
+        if (needed_count <= allocated_count) {
+            result = _update_hash_map_entry(map, key, data, option);
+            if (result == EBPF_SUCCESS) {
+                _lpm_trie_insert(trie_map, lpm_key, nodes);
+            }
+            ebpf_lock_unlock(&trie_map->lock, state);
+            break;
+        }
+        ebpf_lock_unlock(&trie_map->lock, state);
+
+        for (; allocated_count < needed_count; allocated_count++) {
+            nodes[allocated_count] = _lpm_allocate_node(trie_map);
+            if (!nodes[allocated_count]) {
+                result = EBPF_NO_MEMORY;
+                goto Done;
+            }
         }
     }
+
+Done:
+    ebpf_epoch_free(nodes[0]);
+    ebpf_epoch_free(nodes[1]);
     return result;
 }
 
@@ -2025,61 +2914,117 @@ _next_lpm_map_key_and_value(
 }
 
 static ebpf_result_t
-_create_queue_map(
+_create_circular_map(
     _In_ const ebpf_map_definition_in_memory_t* map_definition,
     ebpf_handle_t inner_map_handle,
+    ebpf_core_circular_map_type_t type,
     _Outptr_ ebpf_core_map_t** map)
 {
     ebpf_result_t result;
+    ebpf_core_circular_map_t* circular_map = NULL;
+
+    *map = NULL;
+
     if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0) {
         return EBPF_INVALID_ARGUMENT;
     }
-    size_t circular_map_size =
-        EBPF_OFFSET_OF(ebpf_core_circular_map_t, slots) + map_definition->max_entries * sizeof(uint8_t*);
-    result = _create_array_map_with_map_struct_size(circular_map_size, map_definition, map);
-    if (result == EBPF_SUCCESS) {
-        ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, *map);
-        circular_map->type = EBPF_CORE_QUEUE;
+
+    size_t slot_size;
+    result = ebpf_safe_size_t_add(
+        EBPF_OFFSET_OF(ebpf_core_circular_map_slot_t, value), map_definition->value_size, &slot_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
     }
+    // Keep the sequence of each slot 8-byte aligned.
+    slot_size = EBPF_PAD_8(slot_size);
+
+    size_t circular_map_size;
+    result = ebpf_safe_size_t_multiply(map_definition->max_entries, slot_size, &circular_map_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    result = ebpf_safe_size_t_add(
+        EBPF_PAD_CACHE(sizeof(ebpf_core_circular_map_t)), circular_map_size, &circular_map_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    // Prevent allocation larger than 128GB (default maximum non-paged pool size).
+    if (circular_map_size > EBPF_MAP_MAXIMUM_ALLOCATION) {
+        result = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    // Cache align the map so that the head and tail are on their own cache lines.
+    circular_map = ebpf_epoch_allocate_cache_aligned_with_tag(circular_map_size, EBPF_POOL_TAG_MAP);
+    if (circular_map == NULL) {
+        result = EBPF_NO_MEMORY;
+        goto Done;
+    }
+    memset(circular_map, 0, circular_map_size);
+
+    circular_map->core_map.ebpf_map_definition = *map_definition;
+    circular_map->core_map.data = ((uint8_t*)circular_map) + EBPF_PAD_CACHE(sizeof(ebpf_core_circular_map_t));
+    circular_map->type = type;
+    circular_map->slot_size = slot_size;
+    ebpf_lock_create(&circular_map->lock);
+
+    // Each slot starts out free for the first push to its position.
+    for (uint32_t index = 0; index < map_definition->max_entries; index++) {
+        _ebpf_core_circular_map_slot(circular_map, index)->sequence = index;
+    }
+
+    *map = &circular_map->core_map;
+
+Done:
     return result;
 }
 
+static ebpf_result_t
+_create_queue_map(
+    _In_ const ebpf_map_definition_in_memory_t* map_definition,
+    ebpf_handle_t inner_map_handle,
+    _Outptr_ ebpf_core_map_t** map)
+{
+    return _create_circular_map(map_definition, inner_map_handle, EBPF_CORE_QUEUE, map);
+}
+
 static ebpf_result_t
 _create_stack_map(
     _In_ const ebpf_map_definition_in_memory_t* map_definition,
     ebpf_handle_t inner_map_handle,
     _Outptr_ ebpf_core_map_t** map)
 {
-    ebpf_result_t result;
-    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0) {
-        return EBPF_INVALID_ARGUMENT;
-    }
-    size_t circular_map_size =
-        EBPF_OFFSET_OF(ebpf_core_circular_map_t, slots) + map_definition->max_entries * sizeof(uint8_t*);
-    result = _create_array_map_with_map_struct_size(circular_map_size, map_definition, map);
-    if (result == EBPF_SUCCESS) {
-        ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, *map);
-        circular_map->type = EBPF_CORE_STACK;
-    }
-    return result;
+    return _create_circular_map(map_definition, inner_map_handle, EBPF_CORE_STACK, map);
 }
 
 static void
 _delete_circular_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
 {
     ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, map);
-    // Free all the elements stored in the stack.
-    for (size_t i = 0; i < circular_map->core_map.ebpf_map_definition.max_entries; i++) {
-        ebpf_epoch_free(circular_map->slots[i]);
+    ebpf_epoch_free_cache_aligned(circular_map);
+}
+
+static ebpf_result_t
+_peek_or_pop_circular_map_entry(
+    _Inout_ ebpf_core_map_t* map, bool pop, _Out_writes_(map->ebpf_map_definition.value_size) uint8_t* value)
+{
+    ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, map);
+
+    if (circular_map->type == EBPF_CORE_STACK) {
+        return _ebpf_core_stack_map_peek_or_pop(circular_map, pop, value);
     }
-    ebpf_epoch_free(circular_map);
+
+    bool found = pop ? _ebpf_core_queue_map_pop(circular_map, value) : _ebpf_core_queue_map_peek(circular_map, value);
+    return found ? EBPF_SUCCESS : EBPF_OBJECT_NOT_FOUND;
 }
 
 static ebpf_result_t
-_find_circular_map_entry(
-    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, bool delete_on_success, _Outptr_ uint8_t** data)
+_update_circular_map_entry(
+    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, _In_opt_ const uint8_t* data, ebpf_map_option_t option)
 {
-    if (!map) {
+    if (!map || !data) {
         return EBPF_INVALID_ARGUMENT;
     }
 
@@ -2088,41 +3033,194 @@ _find_circular_map_entry(
     UNREFERENCED_PARAMETER(key);
 
     ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, map);
-    ebpf_lock_state_t state = ebpf_lock_lock(&circular_map->lock);
-    *data = _ebpf_core_circular_map_peek_or_pop(circular_map, delete_on_success);
-    ebpf_lock_unlock(&circular_map->lock, state);
-    return *data == NULL ? EBPF_OBJECT_NOT_FOUND : EBPF_SUCCESS;
+    bool replace = (option & BPF_EXIST) != 0;
+
+    if (circular_map->type == EBPF_CORE_STACK) {
+        return _ebpf_core_stack_map_push(circular_map, data, replace);
+    }
+
+    while (!_ebpf_core_queue_map_push(circular_map, data)) {
+        if (!replace) {
+            return EBPF_OUT_OF_SPACE;
+        }
+        // Drop the oldest value to make room. Another producer may claim the freed slot first, in which case this
+        // drops another value and tries again.
+        (void)_ebpf_core_queue_map_pop(circular_map, NULL);
+    }
+    return EBPF_SUCCESS;
 }
 
+// Number of hash functions a bloom filter uses when map_extra doesn't set one, matching Linux.
+#define EBPF_BLOOM_FILTER_DEFAULT_HASH_COUNT 5
+
+// The low 4 bits of map_extra hold the number of hash functions of a bloom filter.
+#define EBPF_BLOOM_FILTER_HASH_COUNT_MASK 0xF
+
+/**
+ * @brief A bloom filter stores a set of values in a bit array. Each value sets hash_count bits, chosen by double
+ * hashing a single hash of the value, so a lookup hashes the value once and then tests hash_count bits with plain
+ * loads. Bits are only ever set, with an atomic OR that is skipped when the bit is already set, so neither adding
+ * nor testing a value takes a lock.
+ */
+typedef struct _ebpf_core_bloom_filter_map
+{
+    ebpf_core_map_t core_map;
+    uint32_t hash_count; ///< Number of bits set for each value.
+    uint32_t seed;       ///< Seed of the value hash.
+    uint32_t bit_mask;   ///< Number of bits in the filter less one. The number of bits is a power of two.
+    volatile int64_t bits[1];
+} ebpf_core_bloom_filter_map_t;
+
 static ebpf_result_t
-_update_circular_map_entry(
-    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, _In_opt_ const uint8_t* data, ebpf_map_option_t option)
+_create_bloom_filter_map(
+    _In_ const ebpf_map_definition_in_memory_t* map_definition,
+    ebpf_handle_t inner_map_handle,
+    _Outptr_ ebpf_core_map_t** map)
 {
     ebpf_result_t result;
+    ebpf_core_bloom_filter_map_t* bloom_filter_map = NULL;
+    uint64_t hash_count = map_definition->map_extra & EBPF_BLOOM_FILTER_HASH_COUNT_MASK;
 
-    if (!map || !data) {
+    *map = NULL;
+
+    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0 ||
+        (map_definition->map_extra & ~(uint64_t)EBPF_BLOOM_FILTER_HASH_COUNT_MASK)) {
         return EBPF_INVALID_ARGUMENT;
     }
 
-    // Queue uses no key, but the caller always passes in a non-null pointer (with a 0 key size)
-    // so we cannot require key to be null.
+    if (hash_count == 0) {
+        hash_count = EBPF_BLOOM_FILTER_DEFAULT_HASH_COUNT;
+    }
+
+    // Size the filter at about max_entries * hash_count / ln(2) bits, which gives the lowest false positive rate for
+    // max_entries values, rounded up to a power of two so that a bit index is a hash masked by bit_mask.
+    uint64_t bit_count = (uint64_t)map_definition->max_entries * hash_count / 5 * 7;
+    uint64_t rounded_bit_count = 64;
+    while (rounded_bit_count < bit_count && rounded_bit_count < ((uint64_t)UINT32_MAX + 1)) {
+        rounded_bit_count <<= 1;
+    }
+
+    size_t bloom_filter_map_size;
+    result = ebpf_safe_size_t_add(
+        EBPF_OFFSET_OF(ebpf_core_bloom_filter_map_t, bits), rounded_bit_count / 8, &bloom_filter_map_size);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    if (bloom_filter_map_size > EBPF_MAP_MAXIMUM_ALLOCATION) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    bloom_filter_map = ebpf_epoch_allocate_cache_aligned_with_tag(bloom_filter_map_size, EBPF_POOL_TAG_MAP);
+    if (bloom_filter_map == NULL) {
+        return EBPF_NO_MEMORY;
+    }
+    memset(bloom_filter_map, 0, bloom_filter_map_size);
+
+    bloom_filter_map->core_map.ebpf_map_definition = *map_definition;
+    bloom_filter_map->core_map.data = (uint8_t*)bloom_filter_map->bits;
+    bloom_filter_map->hash_count = (uint32_t)hash_count;
+    bloom_filter_map->seed = ebpf_random_uint32();
+    bloom_filter_map->bit_mask = (uint32_t)(rounded_bit_count - 1);
+
+    *map = &bloom_filter_map->core_map;
+    return EBPF_SUCCESS;
+}
+
+static void
+_delete_bloom_filter_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
+{
+    ebpf_epoch_free_cache_aligned(EBPF_FROM_FIELD(ebpf_core_bloom_filter_map_t, core_map, map));
+}
+
+/**
+ * @brief Compute the index of the first bit a value sets and the stride to each following bit.
+ *
+ * @param[in] bloom_filter_map Bloom filter the value belongs to.
+ * @param[in] value Value to hash.
+ * @param[out] stride Odd stride between the bits the value sets, so that they are distinct.
+ * @return Index of the first bit.
+ */
+static inline uint32_t
+_bloom_filter_hash(
+    _In_ const ebpf_core_bloom_filter_map_t* bloom_filter_map, _In_ const uint8_t* value, _Out_ uint32_t* stride)
+{
+    uint32_t hash = ebpf_hash_table_hash_buffer(
+        value, bloom_filter_map->core_map.ebpf_map_definition.value_size, bloom_filter_map->seed);
+
+    // Derive the stride with the murmur3 finalizer so that values whose first bit collides still set different bits.
+    uint32_t mixed = hash;
+    mixed ^= mixed >> 16;
+    mixed *= 0x85ebca6b;
+    mixed ^= mixed >> 13;
+    mixed *= 0xc2b2ae35;
+    mixed ^= mixed >> 16;
+    *stride = mixed | 1;
+    return hash;
+}
+
+static ebpf_result_t
+_find_bloom_filter_map_entry(
+    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, bool delete_on_success, _Outptr_ uint8_t** data)
+{
+    // Values can't be removed from a bloom filter.
+    if (delete_on_success) {
+        return EBPF_OPERATION_NOT_SUPPORTED;
+    }
+
+    // The value to test for is passed in place of the key.
+    if (!map || !key) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    ebpf_core_bloom_filter_map_t* bloom_filter_map = EBPF_FROM_FIELD(ebpf_core_bloom_filter_map_t, core_map, map);
+    uint32_t stride;
+    uint32_t bit = _bloom_filter_hash(bloom_filter_map, key, &stride);
+    for (uint32_t i = 0; i < bloom_filter_map->hash_count; i++, bit += stride) {
+        uint32_t index = bit & bloom_filter_map->bit_mask;
+        if (!(bloom_filter_map->bits[index / 64] & (int64_t)(1ull << (index % 64)))) {
+            return EBPF_KEY_NOT_FOUND;
+        }
+    }
+
+    *data = (uint8_t*)key;
+    return EBPF_SUCCESS;
+}
+
+static ebpf_result_t
+_update_bloom_filter_map_entry(
+    _Inout_ ebpf_core_map_t* map, _In_opt_ const uint8_t* key, _In_opt_ const uint8_t* data, ebpf_map_option_t option)
+{
+    // Values can only be added, so BPF_EXIST can't be met. Pushes from programs carry EBPF_MAP_FLAG_HELPER in the bit
+    // BPF_NOEXIST uses, so that flag can't be told apart and is accepted.
+    if (!map || !data || (option & BPF_EXIST)) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    // Bloom filter uses no key, but the caller may pass in a non-null pointer (with a 0 key size).
     UNREFERENCED_PARAMETER(key);
 
-    ebpf_core_circular_map_t* circular_map = EBPF_FROM_FIELD(ebpf_core_circular_map_t, core_map, map);
-    ebpf_lock_state_t state = ebpf_lock_lock(&circular_map->lock);
-    result = _ebpf_core_circular_map_push(circular_map, data, option & BPF_EXIST);
-    ebpf_lock_unlock(&circular_map->lock, state);
-    return result;
+    ebpf_core_bloom_filter_map_t* bloom_filter_map = EBPF_FROM_FIELD(ebpf_core_bloom_filter_map_t, core_map, map);
+    uint32_t stride;
+    uint32_t bit = _bloom_filter_hash(bloom_filter_map, data, &stride);
+    for (uint32_t i = 0; i < bloom_filter_map->hash_count; i++, bit += stride) {
+        uint32_t index = bit & bloom_filter_map->bit_mask;
+        int64_t mask = (int64_t)(1ull << (index % 64));
+        // Skip the atomic when the bit is already set, so that adding common values doesn't bounce the cache line.
+        if (!(bloom_filter_map->bits[index / 64] & mask)) {
+            ebpf_interlocked_or_int64(&bloom_filter_map->bits[index / 64], mask);
+        }
+    }
+    return EBPF_SUCCESS;
 }
 
 static _Requires_lock_held_(ring_buffer_map->lock) void _ebpf_ring_buffer_map_signal_async_query_complete(
     _Inout_ ebpf_core_ring_buffer_map_t* ring_buffer_map)
 {
     EBPF_LOG_ENTRY();
-    // Skip if no async_contexts have ever been queued.
-    if (!ring_buffer_map->async_contexts_trip_wire) {
-        return;
-    }
+    // Disarm before completing so that producers stop acquiring the lock until the consumer parks again.
+    ring_buffer_map->waiter_armed = 0;
+    ring_buffer_map->pending_records = 0;
 
     ebpf_core_map_t* map = &ring_buffer_map->core_map;
     while (!ebpf_list_is_empty(&ring_buffer_map->async_contexts)) {
@@ -2140,99 +3238,490 @@ static _Requires_lock_held_(ring_buffer_map->lock) void _ebpf_ring_buffer_map_si
     }
 }
 
+/**
+ * @brief Check the wakeup policy of the ring buffer map.
+ *
+ * @param[in, out] ring_buffer_map Ring buffer map to check.
+ * @param[in] count_record Account for a newly written record.
+ * @retval true The parked async query should be completed now.
+ * @retval false The wakeup should be deferred.
+ */
+static bool
+_ebpf_ring_buffer_map_wakeup_due(_Inout_ ebpf_core_ring_buffer_map_t* ring_buffer_map, bool count_record)
+{
+    size_t wakeup_bytes = ring_buffer_map->wakeup_bytes;
+    uint32_t wakeup_records = ring_buffer_map->wakeup_records;
+
+    if (wakeup_bytes == 0 && wakeup_records == 0) {
+        return true;
+    }
+
+    if (wakeup_records != 0) {
+        int32_t pending_records = count_record ? ebpf_interlocked_increment_int32(&ring_buffer_map->pending_records)
+                                               : ring_buffer_map->pending_records;
+        if ((uint32_t)pending_records >= wakeup_records) {
+            return true;
+        }
+    }
+
+    if (wakeup_bytes != 0) {
+        size_t consumer;
+        size_t producer;
+        ebpf_ring_buffer_query((ebpf_ring_buffer_t*)ring_buffer_map->core_map.data, &consumer, &producer);
+        if (producer - consumer >= wakeup_bytes) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Schedule the max latency timer if the policy has one and it is not already scheduled.
+ */
 static void
-_delete_ring_buffer_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
+_ebpf_ring_buffer_map_arm_wakeup_timer(_Inout_ ebpf_core_ring_buffer_map_t* ring_buffer_map)
+{
+    uint32_t max_latency_ms = ring_buffer_map->max_latency_ms;
+    if (max_latency_ms == 0 || ring_buffer_map->wakeup_timer == NULL || ring_buffer_map->wakeup_timer_armed) {
+        return;
+    }
+    if (ebpf_interlocked_compare_exchange_int32(&ring_buffer_map->wakeup_timer_armed, 1, 0) == 0) {
+        ebpf_schedule_timer_work_item(ring_buffer_map->wakeup_timer, max_latency_ms * 1000);
+    }
+}
+
+static void
+_ebpf_ring_buffer_map_wakeup_timer_routine(_Inout_opt_ void* context)
+{
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = (ebpf_core_ring_buffer_map_t*)context;
+    _Analysis_assume_(ring_buffer_map != NULL);
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&ring_buffer_map->lock);
+    ring_buffer_map->wakeup_timer_armed = 0;
+    if (ring_buffer_map->waiter_armed) {
+        size_t consumer;
+        size_t producer;
+        ebpf_ring_buffer_query((ebpf_ring_buffer_t*)ring_buffer_map->core_map.data, &consumer, &producer);
+        if (producer != consumer) {
+            _ebpf_ring_buffer_map_signal_async_query_complete(ring_buffer_map);
+        }
+    }
+    ebpf_lock_unlock(&ring_buffer_map->lock, state);
+}
+
+/**
+ * @brief Get the pages that the data of a record in a ring buffer map can start in.
+ *
+ * Records start in the first of the two back to back mappings of the ring, and the data follows the record header,
+ * so it can start in the first page of the second mapping too.
+ */
+static void
+_ebpf_ring_buffer_map_page_range(
+    _In_ const ebpf_core_ring_buffer_map_t* ring_buffer_map, _Out_ uintptr_t* first_page, _Out_ uintptr_t* last_page)
+{
+    const ebpf_ring_buffer_t* ring = (const ebpf_ring_buffer_t*)ring_buffer_map->core_map.data;
+    *first_page = (uintptr_t)ring->shared_buffer >> EBPF_RING_BUFFER_MAP_PAGE_SHIFT;
+    *last_page = ((uintptr_t)ring->shared_buffer + ring->length) >> EBPF_RING_BUFFER_MAP_PAGE_SHIFT;
+}
+
+static void
+_ebpf_ring_buffer_map_pages_remove(_In_ const ebpf_core_ring_buffer_map_t* ring_buffer_map)
+{
+    uintptr_t first_page;
+    uintptr_t last_page;
+    _ebpf_ring_buffer_map_page_range(ring_buffer_map, &first_page, &last_page);
+    for (uintptr_t page = first_page; page <= last_page; page++) {
+        uint8_t* value;
+        // Only remove pages this map inserted.
+        if (ebpf_hash_table_find(_ebpf_ring_buffer_map_pages, (const uint8_t*)&page, &value) == EBPF_SUCCESS &&
+            *(ebpf_core_ring_buffer_map_t**)value == ring_buffer_map) {
+            (void)ebpf_hash_table_delete(_ebpf_ring_buffer_map_pages, (const uint8_t*)&page);
+        }
+    }
+}
+
+static ebpf_result_t
+_ebpf_ring_buffer_map_pages_insert(_In_ ebpf_core_ring_buffer_map_t* ring_buffer_map)
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    uintptr_t first_page;
+    uintptr_t last_page;
+
+    if (_ebpf_ring_buffer_map_pages == NULL) {
+        return EBPF_INVALID_STATE;
+    }
+
+    _ebpf_ring_buffer_map_page_range(ring_buffer_map, &first_page, &last_page);
+    for (uintptr_t page = first_page; page <= last_page; page++) {
+        result = ebpf_hash_table_update(
+            _ebpf_ring_buffer_map_pages,
+            (const uint8_t*)&page,
+            (const uint8_t*)&ring_buffer_map,
+            EBPF_HASH_TABLE_OPERATION_INSERT);
+        if (result != EBPF_SUCCESS) {
+            _ebpf_ring_buffer_map_pages_remove(ring_buffer_map);
+            break;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Find the ring buffer map holding a reserved record. Must be called within an epoch.
+ *
+ * @param[in] data Address passed by the program as the record data.
+ * @return Pointer to the ring buffer map, or NULL if the address is not a reserved record.
+ */
+static _Ret_maybenull_ ebpf_core_ring_buffer_map_t*
+_ebpf_ring_buffer_map_find_record(_In_ const uint8_t* data)
+{
+    uintptr_t page = (uintptr_t)data >> EBPF_RING_BUFFER_MAP_PAGE_SHIFT;
+    uint8_t* value;
+    if (ebpf_hash_table_find(_ebpf_ring_buffer_map_pages, (const uint8_t*)&page, &value) != EBPF_SUCCESS) {
+        return NULL;
+    }
+
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = *(ebpf_core_ring_buffer_map_t**)value;
+    if (!ebpf_ring_buffer_is_reserved_record((ebpf_ring_buffer_t*)ring_buffer_map->core_map.data, data)) {
+        return NULL;
+    }
+    return ring_buffer_map;
+}
+
+static void
+_ebpf_ring_buffer_map_free(_Inout_ void* work_item_context)
 {
     EBPF_LOG_ENTRY();
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = (ebpf_core_ring_buffer_map_t*)work_item_context;
+    ebpf_core_map_t* map = &ring_buffer_map->core_map;
+
+    // Stop the latency timer before the ring buffer it reads goes away.
+    ebpf_free_timer_work_item(ring_buffer_map->wakeup_timer);
+
     // Free the ring buffer.
     ebpf_ring_buffer_destroy((ebpf_ring_buffer_t*)map->data);
 
-    ebpf_core_ring_buffer_map_t* ring_buffer_map = EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_t, core_map, map);
     // Snap the async context list.
     ebpf_list_entry_t temp_list;
     ebpf_list_initialize(&temp_list);
     ebpf_lock_state_t state = ebpf_lock_lock(&ring_buffer_map->lock);
-    ebpf_list_entry_t* first_entry = ring_buffer_map->async_contexts.Flink;
-    if (!ebpf_list_is_empty(&ring_buffer_map->async_contexts)) {
-        ebpf_list_remove_entry(&ring_buffer_map->async_contexts);
-        ebpf_list_append_tail_list(&temp_list, first_entry);
+    ebpf_list_entry_t* first_entry = ring_buffer_map->async_contexts.Flink;
+    if (!ebpf_list_is_empty(&ring_buffer_map->async_contexts)) {
+        ebpf_list_remove_entry(&ring_buffer_map->async_contexts);
+        ebpf_list_append_tail_list(&temp_list, first_entry);
+    }
+    ebpf_lock_unlock(&ring_buffer_map->lock, state);
+    // Cancel all pending async query operations.
+    for (ebpf_list_entry_t* temp_entry = temp_list.Flink; temp_entry != &temp_list; temp_entry = temp_entry->Flink) {
+        ebpf_core_ring_buffer_map_async_query_context_t* context =
+            EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_async_query_context_t, entry, temp_entry);
+        ebpf_async_complete(context->async_context, 0, EBPF_CANCELED);
+    }
+    ebpf_epoch_free(ring_buffer_map);
+    EBPF_RETURN_VOID();
+}
+
+static void
+_delete_ring_buffer_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_t, core_map, map);
+
+    // A program passing a stale record address may have found the map by one of its pages, so the map is only freed
+    // once the current epoch ends.
+    _ebpf_ring_buffer_map_pages_remove(ring_buffer_map);
+    ebpf_epoch_schedule_work_item(ring_buffer_map->free_work_item);
+    EBPF_RETURN_VOID();
+}
+
+static ebpf_result_t
+_create_ring_buffer_map(
+    _In_ const ebpf_map_definition_in_memory_t* map_definition,
+    ebpf_handle_t inner_map_handle,
+    _Outptr_ ebpf_core_map_t** map)
+{
+    ebpf_result_t result;
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = NULL;
+    ebpf_ring_buffer_t* ring_buffer = NULL;
+
+    EBPF_LOG_ENTRY();
+
+    *map = NULL;
+
+    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0) {
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+
+    ring_buffer_map = ebpf_epoch_allocate_with_tag(sizeof(ebpf_core_ring_buffer_map_t), EBPF_POOL_TAG_MAP);
+    if (ring_buffer_map == NULL) {
+        result = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+    memset(ring_buffer_map, 0, sizeof(ebpf_core_ring_buffer_map_t));
+
+    ring_buffer_map->core_map.ebpf_map_definition = *map_definition;
+    if (map_definition->map_flags & BPF_F_RINGBUF_OVERWRITE) {
+        result = ebpf_ring_buffer_create_overwrite(
+            (ebpf_ring_buffer_t**)&ring_buffer_map->core_map.data, map_definition->max_entries);
+    } else {
+        result =
+            ebpf_ring_buffer_create((ebpf_ring_buffer_t**)&ring_buffer_map->core_map.data, map_definition->max_entries);
+    }
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+    ring_buffer = (ebpf_ring_buffer_t*)ring_buffer_map->core_map.data;
+
+    ebpf_lock_create(&ring_buffer_map->lock);
+    ebpf_list_initialize(&ring_buffer_map->async_contexts);
+
+    ring_buffer_map->free_work_item = ebpf_epoch_allocate_work_item(ring_buffer_map, _ebpf_ring_buffer_map_free);
+    if (ring_buffer_map->free_work_item == NULL) {
+        result = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+
+    result = _ebpf_ring_buffer_map_pages_insert(ring_buffer_map);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    *map = &ring_buffer_map->core_map;
+    ring_buffer = NULL;
+    ring_buffer_map = NULL;
+
+Exit:
+    if (ring_buffer_map != NULL) {
+        ebpf_epoch_cancel_work_item(ring_buffer_map->free_work_item);
+    }
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ebpf_epoch_free(ring_buffer_map);
+
+    EBPF_RETURN_RESULT(result);
+}
+
+static void
+_delete_user_ring_buffer_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
+{
+    EBPF_LOG_ENTRY();
+    ebpf_ring_buffer_destroy((ebpf_ring_buffer_t*)map->data);
+    ebpf_epoch_free(map);
+    EBPF_RETURN_VOID();
+}
+
+static ebpf_result_t
+_create_user_ring_buffer_map(
+    _In_ const ebpf_map_definition_in_memory_t* map_definition,
+    ebpf_handle_t inner_map_handle,
+    _Outptr_ ebpf_core_map_t** map)
+{
+    ebpf_result_t result;
+    ebpf_core_map_t* user_ring_buffer_map = NULL;
+
+    EBPF_LOG_ENTRY();
+
+    *map = NULL;
+
+    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0) {
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+
+    user_ring_buffer_map = ebpf_epoch_allocate_with_tag(sizeof(ebpf_core_map_t), EBPF_POOL_TAG_MAP);
+    if (user_ring_buffer_map == NULL) {
+        result = EBPF_NO_MEMORY;
+        goto Exit;
+    }
+    memset(user_ring_buffer_map, 0, sizeof(ebpf_core_map_t));
+
+    user_ring_buffer_map->ebpf_map_definition = *map_definition;
+    result = ebpf_ring_buffer_create_user_producer(
+        (ebpf_ring_buffer_t**)&user_ring_buffer_map->data, map_definition->max_entries);
+    if (result != EBPF_SUCCESS) {
+        goto Exit;
+    }
+
+    *map = user_ring_buffer_map;
+    user_ring_buffer_map = NULL;
+
+Exit:
+    ebpf_epoch_free(user_ring_buffer_map);
+
+    EBPF_RETURN_RESULT(result);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_user_ring_buffer_map_drain(
+    _Inout_ ebpf_map_t* map,
+    _In_ ebpf_ring_buffer_drain_callback_t callback,
+    _Inout_opt_ void* context,
+    size_t max_records,
+    _Out_ size_t* records_drained)
+{
+    *records_drained = 0;
+    // Programs can pass any map to the drain helper.
+    if (map->ebpf_map_definition.type != BPF_MAP_TYPE_USER_RINGBUF) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+    return ebpf_ring_buffer_drain((ebpf_ring_buffer_t*)map->data, callback, context, max_records, records_drained);
+}
+
+static bool
+_ebpf_ring_buffer_map_wakeup_flags_valid(uint64_t flags)
+{
+    return (flags & ~(BPF_RB_NO_WAKEUP | BPF_RB_FORCE_WAKEUP)) == 0 &&
+           (flags & (BPF_RB_NO_WAKEUP | BPF_RB_FORCE_WAKEUP)) != (BPF_RB_NO_WAKEUP | BPF_RB_FORCE_WAKEUP);
+}
+
+/**
+ * @brief Wake the consumer of a ring buffer map after a record is published, following the wakeup flags of the
+ * producer and the wakeup policy of the consumer.
+ *
+ * @param[in, out] ring_buffer_map Ring buffer map the record was published in.
+ * @param[in] flags BPF_RB_NO_WAKEUP, BPF_RB_FORCE_WAKEUP or 0.
+ */
+static void
+_ebpf_ring_buffer_map_notify(_Inout_ ebpf_core_ring_buffer_map_t* ring_buffer_map, uint64_t flags)
+{
+    if (flags & BPF_RB_NO_WAKEUP) {
+        return;
+    }
+
+    // Order the record publication before reading waiter_armed. This pairs with the interlocked arm in
+    // ebpf_ring_buffer_map_async_query, so either the producer sees the waiter or the waiter sees the record.
+    MemoryBarrier();
+    if (!ring_buffer_map->waiter_armed) {
+        return;
+    }
+
+    bool wakeup = (flags & BPF_RB_FORCE_WAKEUP) || _ebpf_ring_buffer_map_wakeup_due(ring_buffer_map, true);
+
+    if (!wakeup) {
+        // Coalesce this record with later ones, bounded by the max latency timer.
+        _ebpf_ring_buffer_map_arm_wakeup_timer(ring_buffer_map);
+        return;
+    }
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&ring_buffer_map->lock);
+    if (ring_buffer_map->waiter_armed) {
+        _ebpf_ring_buffer_map_signal_async_query_complete(ring_buffer_map);
     }
     ebpf_lock_unlock(&ring_buffer_map->lock, state);
-    // Cancel all pending async query operations.
-    for (ebpf_list_entry_t* temp_entry = temp_list.Flink; temp_entry != &temp_list; temp_entry = temp_entry->Flink) {
-        ebpf_core_ring_buffer_map_async_query_context_t* context =
-            EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_async_query_context_t, entry, temp_entry);
-        ebpf_async_complete(context->async_context, 0, EBPF_CANCELED);
-    }
-    ebpf_epoch_free(ring_buffer_map);
 }
 
-static ebpf_result_t
-_create_ring_buffer_map(
-    _In_ const ebpf_map_definition_in_memory_t* map_definition,
-    ebpf_handle_t inner_map_handle,
-    _Outptr_ ebpf_core_map_t** map)
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_output(
+    _Inout_ ebpf_core_map_t* map, _In_reads_bytes_(length) uint8_t* data, size_t length, uint64_t flags)
 {
-    ebpf_result_t result;
-    ebpf_core_ring_buffer_map_t* ring_buffer_map = NULL;
-    ebpf_ring_buffer_t* ring_buffer = NULL;
+    ebpf_result_t result = EBPF_SUCCESS;
 
     EBPF_LOG_ENTRY();
 
-    *map = NULL;
-
-    if (inner_map_handle != ebpf_handle_invalid || map_definition->key_size != 0) {
+    if (!_ebpf_ring_buffer_map_wakeup_flags_valid(flags)) {
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
 
-    ring_buffer_map = ebpf_epoch_allocate_with_tag(sizeof(ebpf_core_ring_buffer_map_t), EBPF_POOL_TAG_MAP);
-    if (ring_buffer_map == NULL) {
-        result = EBPF_NO_MEMORY;
+    result = ebpf_ring_buffer_output((ebpf_ring_buffer_t*)map->data, data, length);
+    if (result != EBPF_SUCCESS) {
         goto Exit;
     }
-    memset(ring_buffer_map, 0, sizeof(ebpf_core_ring_buffer_map_t));
 
-    ring_buffer_map->core_map.ebpf_map_definition = *map_definition;
-    result =
-        ebpf_ring_buffer_create((ebpf_ring_buffer_t**)&ring_buffer_map->core_map.data, map_definition->max_entries);
-    if (result != EBPF_SUCCESS) {
-        goto Exit;
+    _ebpf_ring_buffer_map_notify(EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_t, core_map, map), flags);
+
+Exit:
+    EBPF_RETURN_RESULT(result);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_reserve(
+    _Inout_ ebpf_core_map_t* map, size_t length, uint64_t flags, _Outptr_result_bytebuffer_(length) uint8_t** data)
+{
+    // High volume call - Skip entry/exit logging.
+    *data = NULL;
+
+    // Programs can pass any map, and the verifier bounds accesses to the record by the value size of the map.
+    if (map->ebpf_map_definition.type != BPF_MAP_TYPE_RINGBUF || flags != 0 || length == 0 ||
+        length != map->ebpf_map_definition.value_size) {
+        return EBPF_INVALID_ARGUMENT;
     }
-    ring_buffer = (ebpf_ring_buffer_t*)ring_buffer_map->core_map.data;
 
-    ebpf_list_initialize(&ring_buffer_map->async_contexts);
+    return ebpf_ring_buffer_reserve((ebpf_ring_buffer_t*)map->data, data, length);
+}
 
-    *map = &ring_buffer_map->core_map;
-    ring_buffer = NULL;
-    ring_buffer_map = NULL;
+static _Must_inspect_result_ ebpf_result_t
+_ebpf_ring_buffer_map_release_record(_In_ uint8_t* data, uint64_t flags, bool discard)
+{
+    if (!_ebpf_ring_buffer_map_wakeup_flags_valid(flags)) {
+        return EBPF_INVALID_ARGUMENT;
+    }
 
-Exit:
-    ebpf_ring_buffer_destroy(ring_buffer);
-    ebpf_epoch_free(ring_buffer_map);
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = _ebpf_ring_buffer_map_find_record(data);
+    if (ring_buffer_map == NULL) {
+        return EBPF_INVALID_ARGUMENT;
+    }
 
-    EBPF_RETURN_RESULT(result);
+    ebpf_result_t result = discard ? ebpf_ring_buffer_discard(data) : ebpf_ring_buffer_submit(data);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    _ebpf_ring_buffer_map_notify(ring_buffer_map, flags);
+    return EBPF_SUCCESS;
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_submit(_In_ uint8_t* data, uint64_t flags)
+{
+    return _ebpf_ring_buffer_map_release_record(data, flags, false);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_discard(_In_ uint8_t* data, uint64_t flags)
+{
+    return _ebpf_ring_buffer_map_release_record(data, flags, true);
 }
 
 _Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_map_output(_Inout_ ebpf_core_map_t* map, _In_reads_bytes_(length) uint8_t* data, size_t length)
+ebpf_ring_buffer_map_set_wakeup(
+    _Inout_ ebpf_map_t* map, size_t wakeup_bytes, uint32_t wakeup_records, uint32_t max_latency_ms)
 {
     ebpf_result_t result = EBPF_SUCCESS;
+    ebpf_timer_work_item_t* wakeup_timer = NULL;
 
     EBPF_LOG_ENTRY();
 
-    result = ebpf_ring_buffer_output((ebpf_ring_buffer_t*)map->data, data, length);
-    if (result != EBPF_SUCCESS) {
+    ebpf_core_ring_buffer_map_t* ring_buffer_map = EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_t, core_map, map);
+
+    if (max_latency_ms > EBPF_RING_BUFFER_MAP_MAX_LATENCY_MS) {
+        result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
 
-    ebpf_core_ring_buffer_map_t* ring_buffer_map = EBPF_FROM_FIELD(ebpf_core_ring_buffer_map_t, core_map, map);
+    // The timer is allocated on first use and kept until the map is deleted.
+    if (max_latency_ms != 0 && ring_buffer_map->wakeup_timer == NULL) {
+        result =
+            ebpf_allocate_timer_work_item(&wakeup_timer, _ebpf_ring_buffer_map_wakeup_timer_routine, ring_buffer_map);
+        if (result != EBPF_SUCCESS) {
+            goto Exit;
+        }
+    }
 
     ebpf_lock_state_t state = ebpf_lock_lock(&ring_buffer_map->lock);
-    _ebpf_ring_buffer_map_signal_async_query_complete(ring_buffer_map);
+    if (wakeup_timer != NULL && ring_buffer_map->wakeup_timer == NULL) {
+        ring_buffer_map->wakeup_timer = wakeup_timer;
+        wakeup_timer = NULL;
+    }
+    ring_buffer_map->wakeup_bytes = wakeup_bytes;
+    ring_buffer_map->wakeup_records = wakeup_records;
+    ring_buffer_map->max_latency_ms = max_latency_ms;
+    ring_buffer_map->pending_records = 0;
     ebpf_lock_unlock(&ring_buffer_map->lock, state);
 
 Exit:
+    ebpf_free_timer_work_item(wakeup_timer);
     EBPF_RETURN_RESULT(result);
 }
 
@@ -2245,6 +3734,9 @@ _ebpf_ring_buffer_map_cancel_async_query(_In_ _Frees_ptr_ void* cancel_context)
     ebpf_core_ring_buffer_map_t* ring_buffer_map = context->ring_buffer_map;
     ebpf_lock_state_t state = ebpf_lock_lock(&ring_buffer_map->lock);
     ebpf_list_remove_entry(&context->entry);
+    if (ebpf_list_is_empty(&ring_buffer_map->async_contexts)) {
+        ring_buffer_map->waiter_armed = 0;
+    }
     ebpf_lock_unlock(&ring_buffer_map->lock, state);
     ebpf_async_complete(context->async_context, 0, EBPF_CANCELED);
     ebpf_free(context);
@@ -2252,11 +3744,41 @@ _ebpf_ring_buffer_map_cancel_async_query(_In_ _Frees_ptr_ void* cancel_context)
 }
 
 _Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_map_query_buffer(_In_ const ebpf_map_t* map, _Outptr_ uint8_t** buffer, _Out_ size_t* consumer_offset)
+ebpf_array_map_query_buffer(_In_ const ebpf_map_t* map, _Outptr_ uint8_t** buffer)
+{
+    *buffer = NULL;
+    if (map->ebpf_map_definition.type != BPF_MAP_TYPE_ARRAY ||
+        !(map->ebpf_map_definition.map_flags & BPF_F_MMAPABLE)) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    ebpf_core_mmapable_array_map_t* mmapable_map = EBPF_FROM_FIELD(ebpf_core_mmapable_array_map_t, core_map, map);
+    *buffer = ebpf_map_memory_user(mmapable_map->memory_descriptor);
+    return (*buffer == NULL) ? EBPF_NO_MEMORY : EBPF_SUCCESS;
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_query_buffer(
+    _In_ const ebpf_map_t* map,
+    _Outptr_ uint8_t** buffer,
+    _Outptr_ ebpf_ring_buffer_offsets_t** offsets,
+    _Out_ size_t* consumer_offset)
 {
     size_t producer_offset;
+    *buffer = NULL;
+    *offsets = NULL;
+    *consumer_offset = 0;
+    // Producers of an overwrite ring move the consumer offset past records that a subscriber may still be reading,
+    // so these maps are only read with snapshots.
+    if (map->ebpf_map_definition.map_flags & BPF_F_RINGBUF_OVERWRITE) {
+        return EBPF_OPERATION_NOT_SUPPORTED;
+    }
     ebpf_ring_buffer_query((ebpf_ring_buffer_t*)map->data, consumer_offset, &producer_offset);
-    return ebpf_ring_buffer_map_buffer((ebpf_ring_buffer_t*)map->data, buffer);
+    ebpf_result_t result = ebpf_ring_buffer_map_buffer((ebpf_ring_buffer_t*)map->data, buffer);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+    return ebpf_ring_buffer_map_offsets((ebpf_ring_buffer_t*)map->data, offsets);
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -2276,6 +3798,17 @@ Exit:
     EBPF_RETURN_RESULT(result);
 }
 
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_snapshot(
+    _In_ const ebpf_map_t* map,
+    _Out_writes_to_(buffer_length, *length) uint8_t* buffer,
+    size_t buffer_length,
+    _Out_ size_t* start_offset,
+    _Out_ size_t* length)
+{
+    return ebpf_ring_buffer_snapshot((ebpf_ring_buffer_t*)map->data, buffer, buffer_length, start_offset, length);
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_map_async_query(
     _Inout_ ebpf_map_t* map,
@@ -2311,14 +3844,38 @@ ebpf_ring_buffer_map_async_query(
         ebpf_async_set_cancel_callback(async_context, context, _ebpf_ring_buffer_map_cancel_async_query));
 
     ebpf_list_insert_tail(&ring_buffer_map->async_contexts, &context->entry);
-    ring_buffer_map->async_contexts_trip_wire = true;
+    // The interlocked operation is a full barrier, so the offsets queried below are read after the waiter is armed.
+    ebpf_interlocked_or_int32(&ring_buffer_map->waiter_armed, 1);
 
-    // If there is already some data available in the ring buffer, indicate the results right away.
+    // If enough data is already available in the ring buffer, indicate the results right away.
     ebpf_ring_buffer_query(
         (ebpf_ring_buffer_t*)map->data, &async_query_result->consumer, &async_query_result->producer);
 
     if (async_query_result->producer != async_query_result->consumer) {
-        _ebpf_ring_buffer_map_signal_async_query_complete(ring_buffer_map);
+        // Producers only count records while a query is parked, so add the ones that were already waiting. Records
+        // published since the waiter was armed may be counted twice, which only completes the query early.
+        uint32_t wakeup_records = ring_buffer_map->wakeup_records;
+        if (wakeup_records != 0) {
+            int32_t waiting_records = (int32_t)ebpf_ring_buffer_count_records(
+                (ebpf_ring_buffer_t*)map->data,
+                async_query_result->consumer,
+                async_query_result->producer,
+                wakeup_records);
+            int32_t pending_records = ring_buffer_map->pending_records;
+            for (;;) {
+                int32_t observed = ebpf_interlocked_compare_exchange_int32(
+                    &ring_buffer_map->pending_records, pending_records + waiting_records, pending_records);
+                if (observed == pending_records) {
+                    break;
+                }
+                pending_records = observed;
+            }
+        }
+        if (_ebpf_ring_buffer_map_wakeup_due(ring_buffer_map, false)) {
+            _ebpf_ring_buffer_map_signal_async_query_complete(ring_buffer_map);
+        } else {
+            _ebpf_ring_buffer_map_arm_wakeup_timer(ring_buffer_map);
+        }
     }
 
 Exit:
@@ -2333,25 +3890,28 @@ _ebpf_perf_event_array_map_cancel_async_query(_In_ _Frees_ptr_ void* cancel_cont
     EBPF_LOG_ENTRY();
     ebpf_core_perf_event_array_map_async_query_context_t* context =
         (ebpf_core_perf_event_array_map_async_query_context_t*)cancel_context;
-    ebpf_core_perf_event_array_map_t* perf_event_array_map = context->perf_event_array_map;
-    ebpf_lock_state_t state = ebpf_lock_lock(&perf_event_array_map->lock);
+    ebpf_core_perf_event_ring_t* ring = &context->perf_event_array_map->rings[context->cpu_id];
+    ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
     ebpf_list_remove_entry(&context->entry);
-    ebpf_lock_unlock(&perf_event_array_map->lock, state);
+    if (ebpf_list_is_empty(&ring->async_contexts)) {
+        ring->waiter_armed = 0;
+    }
+    ebpf_lock_unlock(&ring->lock, state);
     ebpf_async_complete(context->async_context, 0, EBPF_CANCELED);
     ebpf_free(context);
     EBPF_LOG_EXIT();
 }
 
-static _Requires_lock_held_(perf_event_array_map->lock) void _ebpf_perf_event_array_map_signal_async_query_complete(
-    _Inout_ ebpf_core_perf_event_array_map_t* perf_event_array_map, uint32_t cpu_id)
+static _Requires_lock_held_(perf_event_array_map->rings[cpu_id].lock) void
+    _ebpf_perf_event_array_map_signal_async_query_complete(
+        _Inout_ ebpf_core_perf_event_array_map_t* perf_event_array_map, uint32_t cpu_id)
 {
     EBPF_LOG_ENTRY();
-    // Skip if no async_contexts have ever been queued.
-    if (!perf_event_array_map->async_contexts_trip_wire) {
-        return;
-    }
     ebpf_core_perf_event_ring_t* ring = &perf_event_array_map->rings[cpu_id];
 
+    // Disarm before completing so that producers stop acquiring the lock until the consumer parks again.
+    ring->waiter_armed = 0;
+
     ebpf_core_map_t* map = &perf_event_array_map->core_map;
     while (!ebpf_list_is_empty(&ring->async_contexts)) {
         ebpf_core_perf_event_array_map_async_query_context_t* context =
@@ -2404,7 +3964,7 @@ _delete_perf_event_array_map(_In_ _Post_invalid_ ebpf_core_map_t* map)
             ebpf_async_complete(context->async_context, 0, EBPF_CANCELED);
         }
     }
-    ebpf_epoch_free(perf_event_array_map);
+    ebpf_epoch_free_cache_aligned(perf_event_array_map);
 }
 
 static ebpf_result_t
@@ -2430,7 +3990,7 @@ _create_perf_event_array_map(
     size_t perf_event_array_map_size =
         EBPF_OFFSET_OF(ebpf_core_perf_event_array_map_t, rings) + cpu_count * sizeof(ebpf_core_perf_event_ring_t);
 
-    perf_event_array_map = ebpf_epoch_allocate_with_tag(perf_event_array_map_size, EBPF_POOL_TAG_MAP);
+    perf_event_array_map = ebpf_epoch_allocate_cache_aligned_with_tag(perf_event_array_map_size, EBPF_POOL_TAG_MAP);
     if (perf_event_array_map == NULL) {
         result = EBPF_NO_MEMORY;
         goto Exit;
@@ -2459,7 +4019,7 @@ _create_perf_event_array_map(
 
 Exit:
     ebpf_perf_event_array_destroy(perf_event_array);
-    ebpf_epoch_free(perf_event_array_map);
+    ebpf_epoch_free_cache_aligned(perf_event_array_map);
 
     EBPF_RETURN_RESULT(result);
 }
@@ -2485,10 +4045,18 @@ ebpf_perf_event_output(
 
     ebpf_core_perf_event_array_map_t* perf_event_array_map =
         EBPF_FROM_FIELD(ebpf_core_perf_event_array_map_t, core_map, map);
+    ebpf_core_perf_event_ring_t* ring = &perf_event_array_map->rings[cpu_id];
 
-    ebpf_lock_state_t state = ebpf_lock_lock(&perf_event_array_map->lock);
-    _ebpf_perf_event_array_map_signal_async_query_complete(perf_event_array_map, cpu_id);
-    ebpf_lock_unlock(&perf_event_array_map->lock, state);
+    // Order the record publication before reading waiter_armed. This pairs with the interlocked arm in
+    // ebpf_perf_event_array_map_async_query, so either the producer sees the waiter or the waiter sees the record.
+    MemoryBarrier();
+    if (ring->waiter_armed) {
+        ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
+        if (ring->waiter_armed) {
+            _ebpf_perf_event_array_map_signal_async_query_complete(perf_event_array_map, cpu_id);
+        }
+        ebpf_lock_unlock(&ring->lock, state);
+    }
 
 Exit:
     EBPF_RETURN_RESULT(result);
@@ -2551,7 +4119,8 @@ ebpf_perf_event_array_map_async_query(
         ebpf_async_set_cancel_callback(async_context, context, _ebpf_perf_event_array_map_cancel_async_query));
 
     ebpf_list_insert_tail(&ring->async_contexts, &context->entry);
-    perf_event_array_map->async_contexts_trip_wire = true;
+    // The interlocked operation is a full barrier, so the offsets queried below are read after the waiter is armed.
+    ebpf_interlocked_or_int32(&ring->waiter_armed, 1);
 
     // If there is already some data available in the cpu ring, indicate the results right away.
     ebpf_perf_event_array_query(
@@ -2575,11 +4144,14 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
     {
         .map_type = BPF_MAP_TYPE_HASH,
         .create_map = _create_hash_map,
-        .delete_map = _delete_hash_map,
+        .delete_map = _delete_hash_map_with_aging,
         .find_entry = _find_hash_map_entry,
         .update_entry = _update_hash_map_entry,
         .delete_entry = _delete_hash_map_entry,
         .next_key_and_value = _next_hash_map_key_and_value,
+        .next_key_and_value_with_cursor = _next_hash_map_key_and_value_with_cursor,
+        .supported_map_flags = BPF_F_NO_PREALLOC | BPF_F_UPDATE_IN_PLACE,
+        .map_extra = true, // TTL of the entries in seconds.
     },
     {
         .map_type = BPF_MAP_TYPE_ARRAY,
@@ -2589,6 +4161,7 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .update_entry = _update_array_map_entry,
         .delete_entry = _delete_array_map_entry,
         .next_key_and_value = _next_array_map_key_and_value,
+        .supported_map_flags = BPF_F_MMAPABLE,
     },
     {
         .map_type = BPF_MAP_TYPE_PROG_ARRAY,
@@ -2610,6 +4183,8 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .update_entry_per_cpu = _update_entry_per_cpu,
         .delete_entry = _delete_hash_map_entry,
         .next_key_and_value = _next_hash_map_key_and_value,
+        .next_key_and_value_with_cursor = _next_hash_map_key_and_value_with_cursor,
+        .supported_map_flags = BPF_F_NO_PREALLOC,
         .per_cpu = true,
     },
     {
@@ -2632,6 +4207,8 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .update_entry_with_handle = _update_map_hash_map_entry_with_handle,
         .delete_entry = _delete_map_hash_map_entry,
         .next_key_and_value = _next_hash_map_key_and_value,
+        .next_key_and_value_with_cursor = _next_hash_map_key_and_value_with_cursor,
+        .supported_map_flags = BPF_F_NO_PREALLOC,
     },
     {
         .map_type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
@@ -2651,23 +4228,27 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .update_entry = _update_hash_map_entry,
         .delete_entry = _delete_hash_map_entry,
         .next_key_and_value = _next_hash_map_key_and_value,
+        .next_key_and_value_with_cursor = _next_hash_map_key_and_value_with_cursor,
+        // LRU maps evict to stay within max_entries, so they always preallocate and reject BPF_F_NO_PREALLOC.
+        .supported_map_flags = BPF_F_UPDATE_IN_PLACE,
         .key_history = true,
     },
-    // LPM_TRIE is currently a hash-map with special behavior for find.
+    // LPM_TRIE is a hash-map indexed by a trie for longest prefix lookups.
     {
         .map_type = BPF_MAP_TYPE_LPM_TRIE,
         .create_map = _create_lpm_map,
-        .delete_map = _delete_hash_map,
+        .delete_map = _delete_lpm_map,
         .find_entry = _find_lpm_map_entry,
         .update_entry = _update_lpm_map_entry,
         .delete_entry = _delete_lpm_map_entry,
         .next_key_and_value = _next_lpm_map_key_and_value,
+        .supported_map_flags = BPF_F_NO_PREALLOC,
     },
     {
         .map_type = BPF_MAP_TYPE_QUEUE,
         .create_map = _create_queue_map,
         .delete_map = _delete_circular_map,
-        .find_entry = _find_circular_map_entry,
+        .peek_or_pop_entry = _peek_or_pop_circular_map_entry,
         .update_entry = _update_circular_map_entry,
         .zero_length_key = true,
     },
@@ -2680,6 +4261,7 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .update_entry_per_cpu = _update_entry_per_cpu,
         .delete_entry = _delete_hash_map_entry,
         .next_key_and_value = _next_hash_map_key_and_value,
+        .next_key_and_value_with_cursor = _next_hash_map_key_and_value_with_cursor,
         .per_cpu = true,
         .key_history = true,
     },
@@ -2687,7 +4269,7 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .map_type = BPF_MAP_TYPE_STACK,
         .create_map = _create_stack_map,
         .delete_map = _delete_circular_map,
-        .find_entry = _find_circular_map_entry,
+        .peek_or_pop_entry = _peek_or_pop_circular_map_entry,
         .update_entry = _update_circular_map_entry,
         .zero_length_key = true,
     },
@@ -2695,6 +4277,7 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         BPF_MAP_TYPE_RINGBUF,
         .create_map = _create_ring_buffer_map,
         .delete_map = _delete_ring_buffer_map,
+        .supported_map_flags = BPF_F_RINGBUF_OVERWRITE,
         .zero_length_key = true,
         .zero_length_value = true,
     },
@@ -2706,6 +4289,23 @@ const ebpf_map_metadata_table_t ebpf_map_metadata_tables[] = {
         .zero_length_value = true,
         .per_cpu = true,
     },
+    {
+        .map_type = BPF_MAP_TYPE_USER_RINGBUF,
+        .create_map = _create_user_ring_buffer_map,
+        .delete_map = _delete_user_ring_buffer_map,
+        .zero_length_key = true,
+        .zero_length_value = true,
+    },
+    {
+        .map_type = BPF_MAP_TYPE_BLOOM_FILTER,
+        .create_map = _create_bloom_filter_map,
+        .delete_map = _delete_bloom_filter_map,
+        .find_entry = _find_bloom_filter_map_entry,
+        .update_entry = _update_bloom_filter_map_entry,
+        .zero_length_key = true,
+        .value_as_key = true,
+        .map_extra = true,
+    },
 };
 
 // ebpf_map_get_table(type) - get the metadata table for the given map type.
@@ -2726,6 +4326,7 @@ _ebpf_map_delete(_In_ _Post_invalid_ ebpf_core_object_t* object)
     ebpf_map_t* map = (ebpf_map_t*)object;
 
     ebpf_free(map->name.value);
+    ebpf_epoch_free_cache_aligned(map->statistics);
     ebpf_map_get_table(map->ebpf_map_definition.type)->delete_map(map);
     EBPF_RETURN_VOID();
 }
@@ -2768,9 +4369,34 @@ ebpf_map_create(
         result = EBPF_INVALID_ARGUMENT;
         goto Exit;
     }
+    if (ebpf_map_definition->map_flags & ~table->supported_map_flags) {
+        EBPF_LOG_MESSAGE_UINT64(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_MAP,
+            "Unsupported map flags",
+            ebpf_map_definition->map_flags);
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
+    if (ebpf_map_definition->map_extra != 0 && !(table->map_extra)) {
+        EBPF_LOG_MESSAGE_UINT64(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_MAP,
+            "Unsupported map extra",
+            ebpf_map_definition->map_extra);
+        result = EBPF_INVALID_ARGUMENT;
+        goto Exit;
+    }
 
     if (table->per_cpu) {
-        local_map_definition.value_size = cpu_count * EBPF_PAD_8(local_map_definition.value_size);
+        size_t per_cpu_value_size;
+        result = ebpf_safe_size_t_multiply(
+            cpu_count, EBPF_MAP_PER_CPU_VALUE_STRIDE(local_map_definition.value_size), &per_cpu_value_size);
+        if (result != EBPF_SUCCESS || per_cpu_value_size > UINT32_MAX) {
+            result = EBPF_INVALID_ARGUMENT;
+            goto Exit;
+        }
+        local_map_definition.value_size = (uint32_t)per_cpu_value_size;
     }
 
     if (map_name->length >= BPF_OBJ_NAME_LEN) {
@@ -2819,8 +4445,73 @@ Exit:
     EBPF_RETURN_RESULT(result);
 }
 
-_Must_inspect_result_ ebpf_result_t
-ebpf_map_find_entry(
+/**
+ * @brief Copy the per-cpu copies of a value to a user mode buffer, packing them at 8 byte alignment.
+ *
+ * @param[in] map Per-cpu map the value belongs to.
+ * @param[in] value Value to copy.
+ * @param[out] copy Buffer of ebpf_map_get_user_value_size bytes to copy the value to.
+ */
+static void
+_copy_per_cpu_value_to_user(_In_ const ebpf_core_map_t* map, _In_ const uint8_t* value, _Out_ uint8_t* copy)
+{
+    size_t value_size = map->original_value_size;
+    size_t user_stride = EBPF_PAD_8(value_size);
+    size_t stride = EBPF_MAP_PER_CPU_VALUE_STRIDE(value_size);
+    uint32_t cpu_count = ebpf_get_cpu_count();
+
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        memcpy(copy + cpu * user_stride, value + cpu * stride, value_size);
+        memset(copy + cpu * user_stride + value_size, 0, user_stride - value_size);
+    }
+}
+
+/**
+ * @brief Spread a value from a user mode buffer, packed at 8 byte alignment, to the per-cpu copies of a value.
+ *
+ * @param[in] map Per-cpu map the value belongs to.
+ * @param[in] user_value Buffer of ebpf_map_get_user_value_size bytes.
+ * @param[out] value Buffer of value_size bytes to write the per-cpu copies to.
+ */
+static void
+_copy_per_cpu_value_from_user(_In_ const ebpf_core_map_t* map, _In_ const uint8_t* user_value, _Out_ uint8_t* value)
+{
+    size_t value_size = map->original_value_size;
+    size_t user_stride = EBPF_PAD_8(value_size);
+    size_t stride = EBPF_MAP_PER_CPU_VALUE_STRIDE(value_size);
+    uint32_t cpu_count = ebpf_get_cpu_count();
+
+    memset(value, 0, map->ebpf_map_definition.value_size);
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        memcpy(value + cpu * stride, user_value + cpu * user_stride, value_size);
+    }
+}
+
+/**
+ * @brief Copy a value out of a map to a user mode buffer. Hash maps that update values in place are copied under the
+ * value's sequence lock so that the copy does not tear with a concurrent update.
+ *
+ * @param[in] map Map the value belongs to.
+ * @param[in] value Value to copy.
+ * @param[out] copy Buffer of ebpf_map_get_user_value_size bytes to copy the value to.
+ */
+static void
+_copy_map_value(_In_ const ebpf_core_map_t* map, _In_ const uint8_t* value, _Out_ uint8_t* copy)
+{
+    if (ebpf_map_get_table(map->ebpf_map_definition.type)->per_cpu) {
+        _copy_per_cpu_value_to_user(map, value, copy);
+    } else if (map->ebpf_map_definition.map_flags & BPF_F_UPDATE_IN_PLACE) {
+        ebpf_hash_table_copy_value((const ebpf_hash_table_t*)map->data, value, copy);
+    } else {
+        memcpy(copy, value, map->ebpf_map_definition.value_size);
+    }
+}
+
+/**
+ * @brief Find an entry in a map. See ebpf_map_find_entry, which counts the result.
+ */
+static ebpf_result_t
+_ebpf_map_find_entry(
     _Inout_ ebpf_map_t* map,
     size_t key_size,
     _In_reads_(key_size) const uint8_t* key,
@@ -2828,8 +4519,24 @@ ebpf_map_find_entry(
     _Out_writes_(value_size) uint8_t* value,
     int flags)
 {
-    // High volume call - Skip entry/exit logging.
     uint8_t* return_value = NULL;
+    ebpf_map_type_t type = map->ebpf_map_definition.type;
+    const ebpf_map_metadata_table_t* table = ebpf_map_get_table(type);
+
+    if (table->value_as_key) {
+        // The caller passes the value to test for as the key. Programs test for values with peek instead.
+        if ((flags & (EBPF_MAP_FLAG_HELPER | EBPF_MAP_FIND_FLAG_DELETE)) || table->find_entry == NULL) {
+            return EBPF_OPERATION_NOT_SUPPORTED;
+        }
+        if (key_size != map->ebpf_map_definition.value_size || value_size != map->ebpf_map_definition.value_size) {
+            return EBPF_INVALID_ARGUMENT;
+        }
+        ebpf_result_t result = table->find_entry(map, key, false, &return_value);
+        if (result == EBPF_SUCCESS) {
+            memcpy(value, key, value_size);
+        }
+        return result;
+    }
 
     if (!(flags & EBPF_MAP_FLAG_HELPER) && (key_size != map->ebpf_map_definition.key_size)) {
         EBPF_LOG_MESSAGE_UINT64_UINT64(
@@ -2841,18 +4548,24 @@ ebpf_map_find_entry(
         return EBPF_INVALID_ARGUMENT;
     }
 
-    if (!(flags & EBPF_MAP_FLAG_HELPER) && (value_size != map->ebpf_map_definition.value_size)) {
+    if (!(flags & EBPF_MAP_FLAG_HELPER) && (value_size != ebpf_map_get_user_value_size(map))) {
         EBPF_LOG_MESSAGE_UINT64_UINT64(
             EBPF_TRACELOG_LEVEL_ERROR,
             EBPF_TRACELOG_KEYWORD_MAP,
             "Incorrect map value size",
             value_size,
-            map->ebpf_map_definition.value_size);
+            ebpf_map_get_user_value_size(map));
         return EBPF_INVALID_ARGUMENT;
     }
 
-    ebpf_map_type_t type = map->ebpf_map_definition.type;
-    const ebpf_map_metadata_table_t* table = ebpf_map_get_table(type);
+    if (table->peek_or_pop_entry != NULL) {
+        // Values are copied out of these maps, there is no stable pointer to hand to a program.
+        if (flags & EBPF_MAP_FLAG_HELPER) {
+            return EBPF_OPERATION_NOT_SUPPORTED;
+        }
+        EBPF_LOG_MAP_OPERATION(flags, "find", map, key);
+        return table->peek_or_pop_entry(map, flags & EBPF_MAP_FIND_FLAG_DELETE ? true : false, value);
+    }
 
     if (table->find_entry == NULL) {
         EBPF_LOG_MESSAGE_UINT64(
@@ -2893,11 +4606,32 @@ ebpf_map_find_entry(
 
         *(uint8_t**)value = return_value;
     } else {
-        memcpy(value, return_value, map->ebpf_map_definition.value_size);
+        _copy_map_value(map, return_value, value);
     }
     return EBPF_SUCCESS;
 }
 
+_Must_inspect_result_ ebpf_result_t
+ebpf_map_find_entry(
+    _Inout_ ebpf_map_t* map,
+    size_t key_size,
+    _In_reads_(key_size) const uint8_t* key,
+    size_t value_size,
+    _Out_writes_(value_size) uint8_t* value,
+    int flags)
+{
+    // High volume call - Skip entry/exit logging.
+    ebpf_result_t result = _ebpf_map_find_entry(map, key_size, key, value_size, value, flags);
+    if (_ebpf_map_statistics_enabled) {
+        if (result == EBPF_SUCCESS) {
+            _ebpf_map_count(map, EBPF_MAP_STATISTIC_LOOKUP_HIT);
+        } else if (result == EBPF_KEY_NOT_FOUND || result == EBPF_OBJECT_NOT_FOUND) {
+            _ebpf_map_count(map, EBPF_MAP_STATISTIC_LOOKUP_MISS);
+        }
+    }
+    return result;
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_map_associate_program(_Inout_ ebpf_map_t* map, _In_ const ebpf_program_t* program)
 {
@@ -2938,6 +4672,27 @@ ebpf_map_get_program_from_entry(_Inout_ ebpf_map_t* map, size_t key_size, _In_re
     return (ebpf_program_t*)_get_object_from_array_map_entry(map, key);
 }
 
+/**
+ * @brief Count the result of an update of a map, if map statistics are enabled.
+ *
+ * @param[in, out] map Map that was updated.
+ * @param[in] result Result of the update.
+ */
+static inline void
+_ebpf_map_count_update(_Inout_ ebpf_core_map_t* map, ebpf_result_t result)
+{
+    if (!_ebpf_map_statistics_enabled) {
+        return;
+    }
+    if (result == EBPF_SUCCESS) {
+        _ebpf_map_count(map, EBPF_MAP_STATISTIC_UPDATE);
+    } else if (result == EBPF_OUT_OF_SPACE) {
+        _ebpf_map_count(map, EBPF_MAP_STATISTIC_UPDATE_OUT_OF_SPACE);
+    } else if (result == EBPF_NO_MEMORY) {
+        _ebpf_map_count(map, EBPF_MAP_STATISTIC_UPDATE_NO_MEMORY);
+    }
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_map_update_entry(
     _Inout_ ebpf_map_t* map,
@@ -2974,13 +4729,13 @@ ebpf_map_update_entry(
         }
     }
 
-    if (!(flags & EBPF_MAP_FLAG_HELPER) && (value_size != map->ebpf_map_definition.value_size)) {
+    if (!(flags & EBPF_MAP_FLAG_HELPER) && (value_size != ebpf_map_get_user_value_size(map))) {
         EBPF_LOG_MESSAGE_UINT64_UINT64(
             EBPF_TRACELOG_LEVEL_ERROR,
             EBPF_TRACELOG_KEYWORD_MAP,
             "Incorrect map value size",
             value_size,
-            map->ebpf_map_definition.value_size);
+            ebpf_map_get_user_value_size(map));
         return EBPF_INVALID_ARGUMENT;
     }
 
@@ -2998,9 +4753,20 @@ ebpf_map_update_entry(
 
     if ((flags & EBPF_MAP_FLAG_HELPER) && (table->update_entry_per_cpu != NULL)) {
         result = table->update_entry_per_cpu(map, key, value, option);
+    } else if (table->per_cpu && value != NULL) {
+        // Lay out the user mode value with one cache line per CPU.
+        uint8_t* per_cpu_value = ebpf_allocate_with_tag(map->ebpf_map_definition.value_size, EBPF_POOL_TAG_MAP);
+        if (per_cpu_value == NULL) {
+            result = EBPF_NO_MEMORY;
+        } else {
+            _copy_per_cpu_value_from_user(map, value, per_cpu_value);
+            result = table->update_entry(map, key, per_cpu_value, option);
+            ebpf_free(per_cpu_value);
+        }
     } else {
         result = table->update_entry(map, key, value, option);
     }
+    _ebpf_map_count_update(map, result);
     return result;
 }
 
@@ -3033,7 +4799,9 @@ ebpf_map_update_entry_with_handle(
             map->ebpf_map_definition.type);
         return EBPF_OPERATION_NOT_SUPPORTED;
     }
-    return table->update_entry_with_handle(map, key, value_handle, option);
+    ebpf_result_t result = table->update_entry_with_handle(map, key, value_handle, option);
+    _ebpf_map_count_update(map, result);
+    return result;
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -3064,6 +4832,9 @@ ebpf_map_delete_entry(_In_ ebpf_map_t* map, size_t key_size, _In_reads_(key_size
     EBPF_LOG_MAP_OPERATION(flags, "delete", map, key);
 
     ebpf_result_t result = table->delete_entry(map, key);
+    if (result == EBPF_SUCCESS && _ebpf_map_statistics_enabled) {
+        _ebpf_map_count(map, EBPF_MAP_STATISTIC_DELETE);
+    }
     return result;
 }
 
@@ -3097,6 +4868,59 @@ ebpf_map_next_key(
     return table->next_key_and_value(map, previous_key, next_key, NULL);
 }
 
+/**
+ * @brief Sum the per-CPU operation counters of a map.
+ *
+ * @param[in] map Map to query.
+ * @param[out] statistics Counters of the operations on the map.
+ */
+static void
+_ebpf_map_get_statistics(_In_ const ebpf_core_map_t* map, _Out_ ebpf_map_statistics_t* statistics)
+{
+    int64_t counters[EBPF_MAP_STATISTIC_COUNT] = {0};
+    uint32_t cpu_count = ebpf_get_cpu_count();
+
+    // Maps that have not had an operation counted have no counters yet.
+    const ebpf_map_cpu_statistics_t* map_statistics =
+        (const ebpf_map_cpu_statistics_t*)ReadPointerAcquire((void* volatile*)&map->statistics);
+    for (uint32_t cpu = 0; map_statistics && cpu < cpu_count; cpu++) {
+        for (size_t statistic = 0; statistic < EBPF_MAP_STATISTIC_COUNT; statistic++) {
+            counters[statistic] += map_statistics[cpu].counters[statistic];
+        }
+    }
+
+    statistics->lookup_hit_count = (uint64_t)counters[EBPF_MAP_STATISTIC_LOOKUP_HIT];
+    statistics->lookup_miss_count = (uint64_t)counters[EBPF_MAP_STATISTIC_LOOKUP_MISS];
+    statistics->lookup_count = statistics->lookup_hit_count + statistics->lookup_miss_count;
+    statistics->update_count = (uint64_t)counters[EBPF_MAP_STATISTIC_UPDATE];
+    statistics->update_out_of_space_count = (uint64_t)counters[EBPF_MAP_STATISTIC_UPDATE_OUT_OF_SPACE];
+    statistics->update_no_memory_count = (uint64_t)counters[EBPF_MAP_STATISTIC_UPDATE_NO_MEMORY];
+    statistics->delete_count = (uint64_t)counters[EBPF_MAP_STATISTIC_DELETE];
+    statistics->lru_eviction_count = (uint64_t)counters[EBPF_MAP_STATISTIC_LRU_EVICTION];
+
+    // Maps backed by a hash table count the updates that found their bucket lock held.
+    switch (map->ebpf_map_definition.type) {
+    case BPF_MAP_TYPE_HASH:
+    case BPF_MAP_TYPE_PERCPU_HASH:
+    case BPF_MAP_TYPE_HASH_OF_MAPS:
+    case BPF_MAP_TYPE_LRU_HASH:
+    case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+    case BPF_MAP_TYPE_LPM_TRIE:
+        statistics->bucket_lock_contention_count =
+            (uint64_t)ebpf_hash_table_lock_contention_count((const ebpf_hash_table_t*)map->data);
+        break;
+    default:
+        statistics->bucket_lock_contention_count = 0;
+        break;
+    }
+}
+
+void
+ebpf_map_statistics_set_enabled(bool enabled)
+{
+    _ebpf_map_statistics_enabled = enabled;
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_map_get_info(
     _In_ const ebpf_map_t* map, _Out_writes_to_(*info_size, *info_size) uint8_t* buffer, _Inout_ uint16_t* info_size)
@@ -3119,7 +4943,8 @@ ebpf_map_get_info(
     info->key_size = map->ebpf_map_definition.key_size;
     info->value_size = map->original_value_size;
     info->max_entries = map->ebpf_map_definition.max_entries;
-    info->map_flags = 0;
+    info->map_flags = map->ebpf_map_definition.map_flags;
+    info->map_extra = map->ebpf_map_definition.map_extra;
     if (info->type == BPF_MAP_TYPE_ARRAY_OF_MAPS || info->type == BPF_MAP_TYPE_HASH_OF_MAPS) {
         ebpf_core_object_map_t* object_map = EBPF_FROM_FIELD(ebpf_core_object_map_t, core_map, map);
         info->inner_map_id = object_map->core_map.ebpf_map_definition.inner_map_id
@@ -3129,6 +4954,13 @@ ebpf_map_get_info(
         info->inner_map_id = EBPF_ID_NONE;
     }
     info->pinned_path_count = map->object.pinned_path_count;
+    if (info->type == BPF_MAP_TYPE_HASH && info->map_extra != 0) {
+        ebpf_core_aging_map_t* aging_map = EBPF_FROM_FIELD(ebpf_core_aging_map_t, core_map, map);
+        info->expired_entry_count = (uint64_t)aging_map->expired_entry_count;
+    } else {
+        info->expired_entry_count = 0;
+    }
+    _ebpf_map_get_statistics(map, &info->statistics);
     strncpy_s(info->name, sizeof(info->name), (char*)map->name.value, map->name.length);
 
     *info_size = sizeof(*info);
@@ -3166,6 +4998,10 @@ ebpf_map_pop_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(valu
 
     const ebpf_map_metadata_table_t* table = ebpf_map_get_table(map->ebpf_map_definition.type);
 
+    if (table->peek_or_pop_entry != NULL) {
+        return table->peek_or_pop_entry(map, true, value);
+    }
+
     if (table->find_entry == NULL) {
         EBPF_LOG_MESSAGE_UINT64(
             EBPF_TRACELOG_LEVEL_ERROR,
@@ -3185,7 +5021,7 @@ ebpf_map_pop_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(valu
 }
 
 _Must_inspect_result_ ebpf_result_t
-ebpf_map_peek_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(value_size) uint8_t* value, int flags)
+ebpf_map_peek_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Inout_updates_(value_size) uint8_t* value, int flags)
 {
     uint8_t* return_value;
     if (!(flags & EBPF_MAP_FLAG_HELPER) && (value_size != map->ebpf_map_definition.value_size)) {
@@ -3194,6 +5030,10 @@ ebpf_map_peek_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(val
 
     const ebpf_map_metadata_table_t* table = ebpf_map_get_table(map->ebpf_map_definition.type);
 
+    if (table->peek_or_pop_entry != NULL) {
+        return table->peek_or_pop_entry(map, false, value);
+    }
+
     if (table->find_entry == NULL) {
         EBPF_LOG_MESSAGE_UINT64(
             EBPF_TRACELOG_LEVEL_ERROR,
@@ -3203,6 +5043,11 @@ ebpf_map_peek_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(val
         return EBPF_OPERATION_NOT_SUPPORTED;
     }
 
+    if (table->value_as_key) {
+        // Test for the value passed in, which is left as is.
+        return table->find_entry(map, value, false, &return_value);
+    }
+
     ebpf_result_t result = table->find_entry(map, NULL, false, &return_value);
     if (result != EBPF_SUCCESS) {
         return result;
@@ -3223,13 +5068,14 @@ ebpf_map_get_next_key_and_value_batch(
     _Inout_ ebpf_map_t* map,
     size_t previous_key_length,
     _In_reads_bytes_opt_(previous_key_length) const uint8_t* previous_key,
+    _Inout_opt_ uint64_t* cursor,
     _Inout_ size_t* key_and_value_length,
     _Out_writes_bytes_to_(*key_and_value_length, *key_and_value_length) uint8_t* key_and_value,
     int flags)
 {
     ebpf_result_t result = EBPF_SUCCESS;
     size_t key_size = map->ebpf_map_definition.key_size;
-    size_t value_size = map->ebpf_map_definition.value_size;
+    size_t value_size = ebpf_map_get_user_value_size(map);
     size_t output_length = 0;
     size_t maximum_output_length = *key_and_value_length;
 
@@ -3273,14 +5119,19 @@ ebpf_map_get_next_key_and_value_batch(
 
         uint8_t* next_value = NULL;
 
-        // Get the next key and value.
-        result = table->next_key_and_value(map, previous_key, key_and_value + output_length, &next_value);
+        // Get the next key and value, resuming from the cursor of the previous key if the map supports it.
+        if (cursor && table->next_key_and_value_with_cursor) {
+            result = table->next_key_and_value_with_cursor(
+                map, previous_key, cursor, key_and_value + output_length, &next_value);
+        } else {
+            result = table->next_key_and_value(map, previous_key, key_and_value + output_length, &next_value);
+        }
 
         if (result != EBPF_SUCCESS) {
             break;
         }
 
-        memcpy(key_and_value + output_length + key_size, next_value, value_size);
+        _copy_map_value(map, next_value, key_and_value + output_length + key_size);
 
         if ((flags & EBPF_MAP_FIND_FLAG_DELETE) && (previous_key != NULL)) {
             // If the caller requested deletion, delete the previous entry.
@@ -3329,3 +5180,22 @@ ebpf_map_get_value_address(_In_ const ebpf_map_t* map, _Out_ uintptr_t* value_ad
     }
     return EBPF_SUCCESS;
 }
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_maps_initiate()
+{
+    const ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(uintptr_t),
+        .value_size = sizeof(ebpf_core_ring_buffer_map_t*),
+        .maximum_bucket_count = EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT,
+    };
+
+    return ebpf_hash_table_create(&_ebpf_ring_buffer_map_pages, &options);
+}
+
+void
+ebpf_maps_terminate()
+{
+    ebpf_hash_table_destroy(_ebpf_ring_buffer_map_pages);
+    _ebpf_ring_buffer_map_pages = NULL;
+}
@@ -7,6 +7,7 @@
 #include "cxplat.h"
 #include "ebpf_core_structs.h"
 #include "ebpf_platform.h"
+#include "ebpf_ring_buffer.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -18,6 +19,22 @@ extern "C"
 
     typedef struct _ebpf_core_map ebpf_map_t;
 
+    /**
+     * @brief Initialize global state for the eBPF map module.
+     *
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_NO_MEMORY Unable to allocate resources for this
+     *  operation.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_maps_initiate();
+
+    /**
+     * @brief Uninitialize the eBPF map module. All maps must have been freed.
+     */
+    void
+    ebpf_maps_terminate();
+
     /**
      * @brief Allocate a new map.
      *
@@ -56,6 +73,16 @@ extern "C"
     uint32_t
     ebpf_map_get_effective_value_size(_In_ const ebpf_map_t* map);
 
+    /**
+     * @brief Get the size of a value as passed to and from user mode. For per-cpu maps this is the value of each CPU
+     * padded to 8 bytes, for all CPUs, which differs from the size stored in the map.
+     *
+     * @param[in] map Map to query
+     * @return Size of a value in user mode buffers.
+     */
+    uint32_t
+    ebpf_map_get_user_value_size(_In_ const ebpf_map_t* map);
+
     /**
      * @brief Get a pointer to an entry in the map.
      *
@@ -192,18 +219,46 @@ extern "C"
         _Out_writes_to_(*info_size, *info_size) uint8_t* buffer,
         _Inout_ uint16_t* info_size);
 
+    /**
+     * @brief Enable or disable counting the operations on all maps. The counters are reported in the statistics field
+     * of bpf_map_info and are kept while counting is disabled.
+     *
+     * @param[in] enabled True to count map operations, false to stop counting.
+     */
+    void
+    ebpf_map_statistics_set_enabled(bool enabled);
+
+    /**
+     * @brief Map the values of an array map created with BPF_F_MMAPABLE into the calling process. Value i is at
+     * offset i * value_size. Later calls from the same process return the same mapping, which is removed when the
+     * process exits or the map is freed.
+     *
+     * @param[in] map Array map to query.
+     * @param[out] buffer Pointer to the values in the calling process.
+     * @retval EBPF_SUCCESS Successfully mapped the values.
+     * @retval EBPF_INVALID_ARGUMENT The map is not a memory-mappable array map.
+     * @retval EBPF_NO_MEMORY Unable to map the values.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_array_map_query_buffer(_In_ const ebpf_map_t* map, _Outptr_ uint8_t** buffer);
+
     /**
      * @brief Get pointer to the ring buffer map's shared data.
      *
      * @param[in] map Ring buffer map to query.
      * @param[out] buffer Pointer to ring buffer data.
+     * @param[out] offsets Pointer to the writable producer and consumer offsets page.
      * @param[out] consumer_offset Offset of consumer in ring buffer data.
      * @retval EBPF_SUCCESS Successfully mapped the ring buffer.
      * @retval EBPF_INVALID_ARGUMENT Unable to map the ring buffer.
+     * @retval EBPF_OPERATION_NOT_SUPPORTED The map was created with BPF_F_RINGBUF_OVERWRITE.
      */
     _Must_inspect_result_ ebpf_result_t
     ebpf_ring_buffer_map_query_buffer(
-        _In_ const ebpf_map_t* map, _Outptr_ uint8_t** buffer, _Out_ size_t* consumer_offset);
+        _In_ const ebpf_map_t* map,
+        _Outptr_ uint8_t** buffer,
+        _Outptr_ ebpf_ring_buffer_offsets_t** offsets,
+        _Out_ size_t* consumer_offset);
 
     /**
      * @brief Return consumed buffer back to the ring buffer map.
@@ -216,6 +271,45 @@ extern "C"
     _Must_inspect_result_ ebpf_result_t
     ebpf_ring_buffer_map_return_buffer(_In_ const ebpf_map_t* map, size_t length);
 
+    /**
+     * @brief Copy the newest records that fit in a buffer out of a ring buffer map without consuming them.
+     *
+     * @param[in] map Ring buffer map.
+     * @param[out] buffer Buffer to copy the records into.
+     * @param[in] buffer_length Size of the buffer in bytes.
+     * @param[out] start_offset Ring offset of the first record copied.
+     * @param[out] length Number of bytes copied.
+     * @retval EBPF_SUCCESS The records were copied.
+     * @retval EBPF_TIMEOUT Producers kept overwriting the records being copied.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_snapshot(
+        _In_ const ebpf_map_t* map,
+        _Out_writes_to_(buffer_length, *length) uint8_t* buffer,
+        size_t buffer_length,
+        _Out_ size_t* start_offset,
+        _Out_ size_t* length);
+
+    /**
+     * @brief Consume records that user mode wrote into a user ring buffer map.
+     *
+     * @param[in, out] map Pointer to map of type BPF_MAP_TYPE_USER_RINGBUF.
+     * @param[in] callback Function called for each record.
+     * @param[in, out] context Context passed to callback.
+     * @param[in] max_records Maximum number of records to pass to callback.
+     * @param[out] records_drained Number of records passed to callback.
+     * @retval EBPF_SUCCESS Drained the records that were ready.
+     * @retval EBPF_INVALID_ARGUMENT The map is not a user ring buffer map.
+     * @retval EBPF_INVALID_STATE The producer published an invalid offset or record.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_user_ring_buffer_map_drain(
+        _Inout_ ebpf_map_t* map,
+        _In_ ebpf_ring_buffer_drain_callback_t callback,
+        _Inout_opt_ void* context,
+        size_t max_records,
+        _Out_ size_t* records_drained);
+
     /**
      * @brief Issue an asynchronous query to ring buffer map.
      *
@@ -237,12 +331,78 @@ extern "C"
      * @param[in, out] map Pointer to map of type EBPF_MAP_TYPE_RINGBUF.
      * @param[in] data Data of record to write into ring buffer map.
      * @param[in] length Length of data.
+     * @param[in] flags BPF_RB_NO_WAKEUP to never notify the consumer of this record, BPF_RB_FORCE_WAKEUP to notify
+     * the consumer regardless of the wakeup policy, or 0 to apply the wakeup policy of the map.
      * @retval EBPF_SUCCESS Successfully wrote record into ring buffer.
      * @retval EBPF_OUT_OF_SPACE Unable to output to ring buffer due to inadequate space.
+     * @retval EBPF_INVALID_ARGUMENT The flags are invalid.
      */
     EBPF_INLINE_HINT
     _Must_inspect_result_ ebpf_result_t
-    ebpf_ring_buffer_map_output(_Inout_ ebpf_map_t* map, _In_reads_bytes_(length) uint8_t* data, size_t length);
+    ebpf_ring_buffer_map_output(
+        _Inout_ ebpf_map_t* map, _In_reads_bytes_(length) uint8_t* data, size_t length, uint64_t flags);
+
+    /**
+     * @brief Reserve a record in a ring buffer map for a program to write in place. The record is only visible to
+     * the consumer once it is passed to ebpf_ring_buffer_map_submit, and holds back records reserved after it until
+     * it is submitted or discarded. This is not registered as a program helper yet, since the verifier can't
+     * require a program to release every record it reserves and a leaked record would stall the ring.
+     *
+     * @param[in, out] map Pointer to map of type EBPF_MAP_TYPE_RINGBUF.
+     * @param[in] length Length of the record. Must be the value size of the map, which is how much of the record
+     * the verifier lets the program access.
+     * @param[in] flags Must be 0.
+     * @param[out] data Pointer to the record data on success.
+     * @retval EBPF_SUCCESS Successfully reserved the record.
+     * @retval EBPF_OUT_OF_SPACE Not enough free space in the ring buffer.
+     * @retval EBPF_INVALID_ARGUMENT The map is not a ring buffer map, or the length or flags are invalid.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_reserve(
+        _Inout_ ebpf_map_t* map, size_t length, uint64_t flags, _Outptr_result_bytebuffer_(length) uint8_t** data);
+
+    /**
+     * @brief Publish a record reserved with ebpf_ring_buffer_map_reserve. Programs can pass any value, so the
+     * record is only published if it is still reserved in one of the ring buffer maps. Must be called within an
+     * epoch.
+     *
+     * @param[in] data Pointer to the record data.
+     * @param[in] flags BPF_RB_NO_WAKEUP, BPF_RB_FORCE_WAKEUP or 0, as for ebpf_ring_buffer_map_output.
+     * @retval EBPF_SUCCESS Successfully published the record.
+     * @retval EBPF_INVALID_ARGUMENT The data is not a reserved record, or the flags are invalid.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_submit(_In_ uint8_t* data, uint64_t flags);
+
+    /**
+     * @brief Discard a record reserved with ebpf_ring_buffer_map_reserve. The consumer skips discarded records.
+     * Must be called within an epoch.
+     *
+     * @param[in] data Pointer to the record data.
+     * @param[in] flags BPF_RB_NO_WAKEUP, BPF_RB_FORCE_WAKEUP or 0, as for ebpf_ring_buffer_map_output.
+     * @retval EBPF_SUCCESS Successfully discarded the record.
+     * @retval EBPF_INVALID_ARGUMENT The data is not a reserved record, or the flags are invalid.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_discard(_In_ uint8_t* data, uint64_t flags);
+
+    /**
+     * @brief Set the policy that decides when a parked async query on the ring buffer map is completed. A query is
+     * completed as soon as either watermark is reached, or once the oldest pending record has waited for
+     * max_latency_ms. With both watermarks set to 0 every record completes the query.
+     *
+     * @param[in, out] map Pointer to map of type EBPF_MAP_TYPE_RINGBUF.
+     * @param[in] wakeup_bytes Number of pending bytes that completes the query, 0 to disable.
+     * @param[in] wakeup_records Number of pending records that completes the query, 0 to disable.
+     * @param[in] max_latency_ms Maximum time in milliseconds a pending record waits for the query to complete,
+     * 0 to disable. At most UINT32_MAX / 1000.
+     * @retval EBPF_SUCCESS The policy was set.
+     * @retval EBPF_INVALID_ARGUMENT The max latency is too large.
+     * @retval EBPF_NO_MEMORY Unable to allocate the latency timer.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_ring_buffer_map_set_wakeup(
+        _Inout_ ebpf_map_t* map, size_t wakeup_bytes, uint32_t wakeup_records, uint32_t max_latency_ms);
 
     /**
      * @brief Get pointer to the perf event array's shared data for a specific cpu.
@@ -263,12 +423,13 @@ extern "C"
      *
      * @param[in] map Perf event array map.
      * @param[in] cpu_id CPU ID to return buffer space to.
-     * @param[in] length Length of bytes to return to the perf event array.
+     * @param[in] consumer_offset New consumer offset of the CPU ring. Must be on a record boundary at or after the
+     * current consumer offset, and must not pass a record that is still being written.
      * @retval EBPF_SUCCESS Successfully returned records to the perf event array.
      * @retval EBPF_INVALID_ARGUMENT Unable to return records to the perf event array.
      */
     _Must_inspect_result_ ebpf_result_t
-    ebpf_perf_event_array_map_return_buffer(_In_ const ebpf_map_t* map, uint32_t cpu_id, size_t length);
+    ebpf_perf_event_array_map_return_buffer(_In_ const ebpf_map_t* map, uint32_t cpu_id, size_t consumer_offset);
 
     /**
      * @brief Issue an asynchronous query to perf event array map.
@@ -302,15 +463,14 @@ extern "C"
         _In_ void* ctx, _Inout_ ebpf_map_t* map, uint64_t flags, _In_reads_bytes_(length) uint8_t* data, size_t length);
 
     /**
-     * @brief Insert an element at the end of the map (only valid for stack and queue).
+     * @brief Insert an element at the end of the map (only valid for stack and queue), or add a value to a bloom
+     * filter.
      *
      * @param[in, out] map Map to update.
      * @param[in] value_size Size of value to insert into the map.
      * @param[in] value Value to insert into the map.
      * @param[in] flags Map flags - BPF_EXIST: If the map is full, the entry at the start of the map is discarded.
      * @retval EBPF_SUCCESS The operation was successful.
-     * @retval EBPF_NO_MEMORY Unable to allocate resources for this
-     *  entry.
      * @retval EBPF_OUT_OF_SPACE Map is full and BPF_EXIST was not supplied.
      */
     EBPF_INLINE_HINT
@@ -337,16 +497,19 @@ extern "C"
      * @brief Copy an entry from the map (only valid for stack and queue).
      * Queue peeks at the beginning of the map.
      * Stack peeks at the end of the map.
+     * Bloom filter tests for the value passed in and leaves it unchanged.
      *
      * @param[in, out] map Map to search and update metadata on.
      * @param[in] value_size Size of the value buffer to copy value from map into.
-     * @param[out] value Value buffer to copy value from map into.
+     * @param[in, out] value Value buffer to copy value from map into, or value to test for.
      * @retval EBPF_SUCCESS The operation was successful.
      * @retval EBPF_OBJECT_NOT_FOUND The map is empty.
+     * @retval EBPF_KEY_NOT_FOUND The value is not in the bloom filter.
      */
     EBPF_INLINE_HINT
     _Must_inspect_result_ ebpf_result_t
-    ebpf_map_peek_entry(_Inout_ ebpf_map_t* map, size_t value_size, _Out_writes_(value_size) uint8_t* value, int flags);
+    ebpf_map_peek_entry(
+        _Inout_ ebpf_map_t* map, size_t value_size, _Inout_updates_(value_size) uint8_t* value, int flags);
 
     /**
      * @brief Get the ID of a given map.
@@ -363,6 +526,8 @@ extern "C"
      * @param[in, out] map Map to search and update metadata on.
      * @param[in] previous_key_length The length of the previous key.
      * @param[in] previous_key The previous key need not be present. This is the key to start the search from.
+     * @param[in, out] cursor If not NULL, the cursor returned with the previous key, or zero. Lets maps that support it
+     * resume after the previous key without searching for it. Updated to the cursor of the last key returned.
      * @param[in,out] key_and_value_length Length of the key and value buffer on input. On output, the number of bytes
      * actually written.
      * @param[out] key_and_value Buffer to write the keys and values into.
@@ -376,6 +541,7 @@ extern "C"
         _Inout_ ebpf_map_t* map,
         size_t previous_key_length,
         _In_reads_bytes_opt_(previous_key_length) const uint8_t* previous_key,
+        _Inout_opt_ uint64_t* cursor,
         _Inout_ size_t* key_and_value_length,
         _Out_writes_bytes_to_(*key_and_value_length, *key_and_value_length) uint8_t* key_and_value,
         int flags);
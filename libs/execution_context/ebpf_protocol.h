@@ -51,6 +51,13 @@ typedef enum _ebpf_operation_id
     EBPF_OPERATION_MAP_GET_NEXT_KEY_VALUE_BATCH,
     EBPF_OPERATION_PROGRAM_SET_FLAGS,
     EBPF_OPERATION_GET_NEXT_PINNED_OBJECT_PATH,
+    EBPF_OPERATION_RING_BUFFER_MAP_SET_WAKEUP,
+    EBPF_OPERATION_RING_BUFFER_MAP_SNAPSHOT,
+    EBPF_OPERATION_ARRAY_MAP_QUERY_BUFFER,
+    EBPF_OPERATION_MAP_UPDATE_ELEMENT_BATCH_USER_BUFFER,
+    EBPF_OPERATION_MAP_DELETE_ELEMENT_BATCH_USER_BUFFER,
+    EBPF_OPERATION_MAP_GET_NEXT_KEY_VALUE_BATCH_USER_BUFFER,
+    EBPF_OPERATION_SET_MAP_STATISTICS_ENABLED,
 } ebpf_operation_id_t;
 
 typedef enum _ebpf_code_type
@@ -400,6 +407,9 @@ typedef struct _ebpf_operation_ring_buffer_map_query_buffer_reply
     struct _ebpf_operation_header header;
     // Address to user-space read-only buffer for the ring-buffer records.
     uint64_t buffer_address;
+    // Address to user-space ebpf_ring_buffer_offsets_t page. The consumer reads the producer offset and advances
+    // the consumer offset here instead of returning space through the async query.
+    uint64_t offsets_address;
     // The current consumer offset, so that subsequent reads can start from here.
     size_t consumer_offset;
 } ebpf_operation_ring_buffer_map_query_buffer_reply_t;
@@ -425,6 +435,48 @@ typedef struct _ebpf_operation_ring_buffer_map_write_data_request
     uint8_t data[1];
 } ebpf_operation_ring_buffer_map_write_data_request_t;
 
+typedef struct _ebpf_operation_ring_buffer_map_set_wakeup_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t map_handle;
+    // Number of pending bytes that completes the async query, 0 to disable.
+    uint64_t wakeup_bytes;
+    // Number of pending records that completes the async query, 0 to disable.
+    uint32_t wakeup_records;
+    // Maximum time in milliseconds a pending record waits for the async query to complete, 0 to disable.
+    uint32_t max_latency_ms;
+} ebpf_operation_ring_buffer_map_set_wakeup_request_t;
+
+// The records are copied to the caller's buffer instead of the reply, so a snapshot isn't limited by the 16-bit length
+// in the header. The address must be a user-mode address in the process that issues the request.
+typedef struct _ebpf_operation_ring_buffer_map_snapshot_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t map_handle;
+    uint64_t buffer;        // Address of the buffer that receives the records, oldest first.
+    uint64_t buffer_length; // Length of the buffer in bytes.
+} ebpf_operation_ring_buffer_map_snapshot_request_t;
+
+typedef struct _ebpf_operation_ring_buffer_map_snapshot_reply
+{
+    struct _ebpf_operation_header header;
+    uint64_t start_offset; // Ring offset of the first record in the buffer.
+    uint64_t length;       // Length of the records copied to the buffer.
+} ebpf_operation_ring_buffer_map_snapshot_reply_t;
+
+typedef struct _ebpf_operation_array_map_query_buffer_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t map_handle;
+} ebpf_operation_array_map_query_buffer_request_t;
+
+typedef struct _ebpf_operation_array_map_query_buffer_reply
+{
+    struct _ebpf_operation_header header;
+    // Address to the user-space read-write mapping of the array values.
+    uint64_t buffer_address;
+} ebpf_operation_array_map_query_buffer_reply_t;
+
 typedef struct _ebpf_operation_perf_event_array_map_query_buffer_request
 {
     struct _ebpf_operation_header header;
@@ -573,17 +625,78 @@ typedef struct _ebpf_operation_map_get_next_key_value_batch_request
     struct _ebpf_operation_header header;
     ebpf_handle_t handle;
     bool find_and_delete;
+    uint64_t cursor; // Cursor returned with previous_key, or zero.
     uint8_t previous_key[1];
 } ebpf_operation_map_get_next_key_value_batch_request_t;
 
 typedef struct _ebpf_operation_map_get_next_key_value_batch_reply
 {
     struct _ebpf_operation_header header;
+    uint64_t cursor; // Cursor of the last key returned, to pass with it in the next request.
     // Count of elements is derived from the length of the reply.
     // Data is a concatenation of key+value.
     uint8_t data[1];
 } ebpf_operation_map_get_next_key_value_batch_reply_t;
 
+// The *_batch_user_buffer operations pass the keys and values by the address of the caller's arrays instead of in
+// the request or reply, so a single request isn't limited by the 16-bit length in the header. The addresses must be
+// user-mode addresses in the process that issues the request.
+
+typedef struct _ebpf_operation_map_update_element_batch_user_buffer_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t handle;
+    ebpf_map_option_t option;
+    uint64_t count;  // Number of keys and values.
+    uint64_t keys;   // Address of count keys.
+    uint64_t values; // Address of count values.
+} ebpf_operation_map_update_element_batch_user_buffer_request_t;
+
+typedef struct _ebpf_operation_map_update_element_batch_user_buffer_reply
+{
+    struct _ebpf_operation_header header;
+    uint64_t count_of_elements_processed;
+} ebpf_operation_map_update_element_batch_user_buffer_reply_t;
+
+typedef struct _ebpf_operation_map_delete_element_batch_user_buffer_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t handle;
+    uint64_t count; // Number of keys.
+    uint64_t keys;  // Address of count keys.
+} ebpf_operation_map_delete_element_batch_user_buffer_request_t;
+
+typedef struct _ebpf_operation_map_delete_element_batch_user_buffer_reply
+{
+    struct _ebpf_operation_header header;
+    uint64_t count_of_elements_processed;
+} ebpf_operation_map_delete_element_batch_user_buffer_reply_t;
+
+typedef struct _ebpf_operation_map_get_next_key_value_batch_user_buffer_request
+{
+    struct _ebpf_operation_header header;
+    ebpf_handle_t handle;
+    bool find_and_delete;
+    uint64_t cursor; // Cursor returned with previous_key, or zero.
+    uint64_t count;  // Maximum number of keys and values to return.
+    uint64_t keys;   // Address of an array of count keys.
+    uint64_t values; // Address of an array of count values.
+    uint8_t previous_key[1];
+} ebpf_operation_map_get_next_key_value_batch_user_buffer_request_t;
+
+typedef struct _ebpf_operation_map_get_next_key_value_batch_user_buffer_reply
+{
+    struct _ebpf_operation_header header;
+    uint64_t cursor; // Cursor of the last key returned, to pass with it in the next request.
+    uint64_t count_of_elements_returned;
+} ebpf_operation_map_get_next_key_value_batch_user_buffer_reply_t;
+
+typedef struct _ebpf_operation_set_map_statistics_enabled_request
+{
+    struct _ebpf_operation_header header;
+    uint32_t enabled; // Non-zero to count the operations on all maps.
+} ebpf_operation_set_map_statistics_enabled_request_t;
+
 typedef struct _ebpf_operation_program_set_flags_request
 {
     struct _ebpf_operation_header header;
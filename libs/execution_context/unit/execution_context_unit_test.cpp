@@ -14,10 +14,13 @@
 #include "helpers.h"
 #include "test_helper.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <optional>
 #include <set>
+#include <thread>
 
 #if !defined(CONFIG_BPF_JIT_DISABLED)
 typedef struct _free_trampoline_table
@@ -170,7 +173,9 @@ _test_crud_operations(ebpf_map_type_t map_type)
         is_array = false;
         supports_find_and_delete = true;
         behavior_on_max_entries = MAP_BEHAVIOR_REPLACE;
-        run_at_dpc = false;
+        // Entries are ordered per CPU until they are moved to the global list, so stay on one CPU to make the evicted
+        // entry deterministic.
+        run_at_dpc = true;
         error_on_full = EBPF_OUT_OF_SPACE;
         break;
     case BPF_MAP_TYPE_LRU_PERCPU_HASH:
@@ -198,7 +203,7 @@ _test_crud_operations(ebpf_map_type_t map_type)
             ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
         map.reset(local_map);
     }
-    std::vector<uint8_t> value(ebpf_map_get_definition(map.get())->value_size);
+    std::vector<uint8_t> value(ebpf_map_get_user_value_size(map.get()));
     for (uint32_t key = 0; key < _test_map_size; key++) {
         *reinterpret_cast<uint64_t*>(value.data()) = static_cast<uint64_t>(key) * static_cast<uint64_t>(key);
         REQUIRE(
@@ -284,46 +289,51 @@ _test_crud_operations(ebpf_map_type_t map_type)
         _test_map_size,
         _test_map_size * 2,
     };
-    for (size_t batch_count : batch_test_sizes) {
-
-        keys.clear();
-        size_t effective_key_size = ebpf_map_get_definition(map.get())->key_size;
-        size_t effective_value_size = ebpf_map_get_definition(map.get())->value_size;
-        std::vector<uint8_t> batch_data(batch_count * (effective_key_size + effective_value_size));
-        ebpf_result_t return_value = EBPF_SUCCESS;
-
-        for (uint32_t index = 0; return_value == EBPF_SUCCESS; index++) {
-            size_t batch_data_size = batch_data.size();
-            return_value = ebpf_map_get_next_key_and_value_batch(
-                map.get(),
-                sizeof(previous_key),
-                index == 0 ? nullptr : reinterpret_cast<uint8_t*>(&previous_key),
-                &batch_data_size,
-                batch_data.data(),
-                0);
-
-            if (return_value == EBPF_NO_MORE_KEYS) {
-                break;
-            }
-
-            REQUIRE(return_value == EBPF_SUCCESS);
-
-            REQUIRE(batch_data_size <= batch_data.size());
-            size_t returned_batch_count = batch_data_size / (effective_key_size + effective_value_size);
-
-            // Verify that all keys are returned.
-            for (uint32_t batch_index = 0; batch_index < returned_batch_count; batch_index++) {
-                uint32_t current_key = *reinterpret_cast<uint32_t*>(
-                    &batch_data[batch_index * (effective_key_size + effective_value_size)]);
-                uint64_t current_value = *reinterpret_cast<uint64_t*>(
-                    &batch_data[batch_index * (effective_key_size + effective_value_size) + effective_key_size]);
-                keys.insert(current_key);
-                REQUIRE(current_value == current_key * current_key);
+    // Walk the map with and without a cursor to resume each batch from.
+    for (bool use_cursor : {false, true}) {
+        for (size_t batch_count : batch_test_sizes) {
+
+            keys.clear();
+            uint64_t cursor = 0;
+            size_t effective_key_size = ebpf_map_get_definition(map.get())->key_size;
+            size_t effective_value_size = ebpf_map_get_user_value_size(map.get());
+            std::vector<uint8_t> batch_data(batch_count * (effective_key_size + effective_value_size));
+            ebpf_result_t return_value = EBPF_SUCCESS;
+
+            for (uint32_t index = 0; return_value == EBPF_SUCCESS; index++) {
+                size_t batch_data_size = batch_data.size();
+                return_value = ebpf_map_get_next_key_and_value_batch(
+                    map.get(),
+                    sizeof(previous_key),
+                    index == 0 ? nullptr : reinterpret_cast<uint8_t*>(&previous_key),
+                    use_cursor ? &cursor : nullptr,
+                    &batch_data_size,
+                    batch_data.data(),
+                    0);
+
+                if (return_value == EBPF_NO_MORE_KEYS) {
+                    break;
+                }
+
+                REQUIRE(return_value == EBPF_SUCCESS);
+
+                REQUIRE(batch_data_size <= batch_data.size());
+                size_t returned_batch_count = batch_data_size / (effective_key_size + effective_value_size);
+
+                // Verify that all keys are returned.
+                for (uint32_t batch_index = 0; batch_index < returned_batch_count; batch_index++) {
+                    uint32_t current_key = *reinterpret_cast<uint32_t*>(
+                        &batch_data[batch_index * (effective_key_size + effective_value_size)]);
+                    uint64_t current_value = *reinterpret_cast<uint64_t*>(
+                        &batch_data[batch_index * (effective_key_size + effective_value_size) + effective_key_size]);
+                    keys.insert(current_key);
+                    REQUIRE(current_value == current_key * current_key);
+                }
+                previous_key = *reinterpret_cast<uint32_t*>(
+                    &batch_data[(returned_batch_count - 1) * (effective_key_size + effective_value_size)]);
             }
-            previous_key = *reinterpret_cast<uint32_t*>(
-                &batch_data[(returned_batch_count - 1) * (effective_key_size + effective_value_size)]);
+            REQUIRE(keys.size() == _test_map_size);
         }
-        REQUIRE(keys.size() == _test_map_size);
     }
 
     for (const auto key : keys) {
@@ -394,6 +404,151 @@ MAP_TEST(BPF_MAP_TYPE_PERCPU_ARRAY);
 MAP_TEST(BPF_MAP_TYPE_LRU_HASH);
 MAP_TEST(BPF_MAP_TYPE_LRU_PERCPU_HASH);
 
+TEST_CASE("map_percpu_value_layout", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+
+    // Hash values come from the value pool, or are allocated on each update with BPF_F_NO_PREALLOC.
+    std::vector<std::pair<ebpf_map_type_t, uint32_t>> map_types = {
+        {BPF_MAP_TYPE_PERCPU_ARRAY, 0}, {BPF_MAP_TYPE_PERCPU_HASH, 0}, {BPF_MAP_TYPE_PERCPU_HASH, BPF_F_NO_PREALLOC}};
+    for (auto [map_type, map_flags] : map_types) {
+        ebpf_map_definition_in_memory_t map_definition{
+            map_type, sizeof(uint32_t), sizeof(uint64_t), 1, 0, LIBBPF_PIN_NONE, map_flags};
+        map_ptr map;
+        {
+            ebpf_map_t* local_map;
+            cxplat_utf8_string_t map_name = {0};
+            REQUIRE(
+                ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) ==
+                EBPF_SUCCESS);
+            map.reset(local_map);
+        }
+
+        // User mode sees the value of each CPU packed at 8 byte alignment.
+        uint32_t cpu_count = ebpf_get_cpu_count();
+        REQUIRE(ebpf_map_get_user_value_size(map.get()) == cpu_count * sizeof(uint64_t));
+
+        std::vector<uint64_t> values(cpu_count);
+        for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+            values[cpu] = 0x1000 + cpu;
+        }
+        uint32_t key = 0;
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<const uint8_t*>(&key),
+                values.size() * sizeof(uint64_t),
+                reinterpret_cast<const uint8_t*>(values.data()),
+                EBPF_ANY,
+                0) == EBPF_SUCCESS);
+
+        // Programs see their own CPU's copy, starting on its own cache line.
+        std::set<uintptr_t> cache_lines;
+        for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+            emulate_dpc_t dpc(cpu);
+            uint64_t* value = nullptr;
+            REQUIRE(
+                ebpf_map_find_entry(
+                    map.get(),
+                    sizeof(key),
+                    reinterpret_cast<const uint8_t*>(&key),
+                    sizeof(value),
+                    reinterpret_cast<uint8_t*>(&value),
+                    EBPF_MAP_FLAG_HELPER) == EBPF_SUCCESS);
+            REQUIRE(*value == 0x1000 + cpu);
+            REQUIRE(reinterpret_cast<uintptr_t>(value) % EBPF_CACHE_LINE_SIZE == 0);
+            REQUIRE(cache_lines.insert(reinterpret_cast<uintptr_t>(value) / EBPF_CACHE_LINE_SIZE).second);
+            *value = 0x2000 + cpu;
+        }
+
+        std::vector<uint64_t> read_values(cpu_count);
+        REQUIRE(
+            ebpf_map_find_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<const uint8_t*>(&key),
+                read_values.size() * sizeof(uint64_t),
+                reinterpret_cast<uint8_t*>(read_values.data()),
+                0) == EBPF_SUCCESS);
+        for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+            REQUIRE(read_values[cpu] == 0x2000 + cpu);
+        }
+    }
+}
+
+TEST_CASE("map_lru_eviction_across_cpus", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+
+    ebpf_map_definition_in_memory_t map_definition{
+        BPF_MAP_TYPE_LRU_HASH, sizeof(uint32_t), sizeof(uint64_t), _test_map_size};
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    auto update = [&](uint32_t key) {
+        uint64_t value = key;
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<const uint8_t*>(&key),
+                sizeof(value),
+                reinterpret_cast<const uint8_t*>(&value),
+                EBPF_ANY,
+                0) == EBPF_SUCCESS);
+    };
+    auto find = [&](uint32_t key) {
+        uint64_t value = 0;
+        return ebpf_map_find_entry(
+                   map.get(),
+                   sizeof(key),
+                   reinterpret_cast<const uint8_t*>(&key),
+                   sizeof(value),
+                   reinterpret_cast<uint8_t*>(&value),
+                   0) == EBPF_SUCCESS;
+    };
+
+    // Fill the map from every CPU, so that entries are spread over the lists of all the CPUs.
+    uint32_t cpu_count = ebpf_get_cpu_count();
+    for (uint32_t key = 0; key < _test_map_size; key++) {
+        emulate_dpc_t dpc(key % cpu_count);
+        update(key);
+    }
+
+    // Use the first quarter of the keys, then insert as many new keys from a single CPU.
+    const uint32_t used_key_count = _test_map_size / 4;
+    for (uint32_t key = 0; key < used_key_count; key++) {
+        REQUIRE(find(key));
+    }
+    {
+        emulate_dpc_t dpc(0);
+        for (uint32_t key = _test_map_size; key < _test_map_size + used_key_count; key++) {
+            update(key);
+        }
+    }
+
+    // The map is still full, and only entries that were not used have been evicted.
+    size_t present_count = 0;
+    for (uint32_t key = 0; key < _test_map_size + used_key_count; key++) {
+        if (find(key)) {
+            present_count++;
+        } else {
+            REQUIRE(key >= used_key_count);
+            REQUIRE(key < _test_map_size);
+        }
+    }
+    REQUIRE(present_count == _test_map_size);
+}
+
 TEST_CASE("map_create_invalid", "[execution_context][negative]")
 {
     _ebpf_core_initializer core;
@@ -448,6 +603,65 @@ TEST_CASE("map_create_invalid", "[execution_context][negative]")
                 1,
             },
         },
+        {
+            "BPF_MAP_TYPE_BLOOM_FILTER",
+            {
+                BPF_MAP_TYPE_BLOOM_FILTER,
+                4, // Key size must be 0 for bloom filter.
+                20,
+                20,
+            },
+        },
+        {
+            "BPF_MAP_TYPE_BLOOM_FILTER map_extra",
+            {
+                BPF_MAP_TYPE_BLOOM_FILTER,
+                0,
+                20,
+                20,
+                0,
+                LIBBPF_PIN_NONE,
+                0,
+                0x10, // Only the low 4 bits of map_extra are defined.
+            },
+        },
+        {
+            "BPF_MAP_TYPE_HASH BPF_F_MMAPABLE",
+            {
+                BPF_MAP_TYPE_HASH,
+                4,
+                20,
+                20,
+                0,
+                LIBBPF_PIN_NONE,
+                BPF_F_MMAPABLE, // Only array maps can be memory mapped.
+            },
+        },
+        {
+            "BPF_MAP_TYPE_LRU_HASH BPF_F_NO_PREALLOC",
+            {
+                BPF_MAP_TYPE_LRU_HASH,
+                4,
+                20,
+                20,
+                0,
+                LIBBPF_PIN_NONE,
+                BPF_F_NO_PREALLOC, // LRU maps always preallocate.
+            },
+        },
+        {
+            "BPF_MAP_TYPE_HASH map_extra too large",
+            {
+                BPF_MAP_TYPE_HASH,
+                4,
+                20,
+                20,
+                0,
+                LIBBPF_PIN_NONE,
+                0,
+                (uint64_t)UINT32_MAX + 1, // The TTL of a hash map must fit in 32 bits.
+            },
+        },
     };
 
     for (const auto& [name, def] : invalid_map_definitions) {
@@ -578,6 +792,56 @@ TEST_CASE("map_crud_operations_lpm_trie_32", "[execution_context]")
         CHECK(return_value == correct_value);
     }
 
+    // Deleting a prefix makes lookups fall back to the next shorter matching prefix.
+    std::vector<std::pair<lpm_trie_32_key_t, std::vector<std::pair<lpm_trie_32_key_t, std::string>>>> delete_tests{
+        {{31, 192, 168, 14, 0},
+         {{{32, 192, 168, 14, 1}, "192.168.14.0/30"}, {{32, 192, 168, 14, 4}, "192.168.14.0/29"}}},
+        {{30, 192, 168, 14, 0},
+         {{{32, 192, 168, 14, 1}, "192.168.14.0/29"}, {{32, 192, 168, 14, 9}, "192.168.0.0/16"}}},
+        {{24, 192, 168, 15, 0},
+         {{{32, 192, 168, 15, 1}, "192.168.0.0/16"}, {{32, 192, 168, 15, 7}, "192.168.15.7/32"}}},
+        {{16, 10, 10, 0, 0},
+         {{{32, 10, 10, 10, 10}, "10.0.0.0/8"}, {{32, 10, 10, 255, 255}, "10.10.255.255/32"}}},
+        {{8, 10, 0, 0, 0},
+         {{{32, 10, 10, 10, 10}, "0.0.0.0/0"}, {{32, 10, 10, 255, 255}, "10.10.255.255/32"}}},
+    };
+    for (const auto& [deleted_key, lookups] : delete_tests) {
+        std::string deleted_key_string = _ip32_prefix_string(deleted_key.prefix_length, deleted_key.value);
+        CAPTURE(deleted_key_string);
+        REQUIRE(
+            ebpf_map_delete_entry(map.get(), 0, reinterpret_cast<const uint8_t*>(&deleted_key), EBPF_MAP_FLAG_HELPER) ==
+            EBPF_SUCCESS);
+        for (const auto& [key, correct_value] : lookups) {
+            std::string key_string = _ip32_prefix_string(key.prefix_length, key.value);
+            CAPTURE(key_string, correct_value);
+            char* return_value = nullptr;
+            CHECK(
+                ebpf_map_find_entry(
+                    map.get(),
+                    0,
+                    reinterpret_cast<const uint8_t*>(&key),
+                    0,
+                    reinterpret_cast<uint8_t*>(&return_value),
+                    EBPF_MAP_FLAG_HELPER) == EBPF_SUCCESS);
+            CHECK(return_value == correct_value);
+        }
+    }
+
+    // Restore the deleted prefixes.
+    for (auto [key, key_string] : keys) {
+        key_string.resize(max_string);
+        CAPTURE(key_string);
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                0,
+                reinterpret_cast<const uint8_t*>(&key),
+                0,
+                reinterpret_cast<const uint8_t*>(key_string.c_str()),
+                EBPF_ANY,
+                EBPF_MAP_FLAG_HELPER) == EBPF_SUCCESS);
+    }
+
     {
         // Insert a new key.
         lpm_trie_32_key_t key = {32, 192, 168, 15, 1};
@@ -1076,6 +1340,390 @@ TEST_CASE("map_crud_operations_stack", "[execution_context]")
         EBPF_OBJECT_NOT_FOUND);
 }
 
+TEST_CASE("map_queue_concurrent_push_pop", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    // Use a small queue so that producers wrap around it many times.
+    ebpf_map_definition_in_memory_t map_definition{BPF_MAP_TYPE_QUEUE, 0, sizeof(uint64_t), 16};
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    const uint32_t producer_count = 4;
+    const uint32_t values_per_producer = 10000;
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < producer_count; producer++) {
+        producers.emplace_back([&, producer]() {
+            for (uint32_t sequence = 0; sequence < values_per_producer; sequence++) {
+                uint64_t value = ((uint64_t)producer << 32) | sequence;
+                while (ebpf_map_push_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0) ==
+                       EBPF_OUT_OF_SPACE) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // Values from each producer are popped in the order they were pushed, and with a single consumer a peek returns
+    // the value that the following pop removes.
+    std::vector<uint32_t> next_sequence(producer_count);
+    for (uint32_t received = 0; received < producer_count * values_per_producer;) {
+        uint64_t peeked_value;
+        if (ebpf_map_peek_entry(map.get(), sizeof(peeked_value), reinterpret_cast<uint8_t*>(&peeked_value), 0) !=
+            EBPF_SUCCESS) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t value;
+        REQUIRE(ebpf_map_pop_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0) == EBPF_SUCCESS);
+        REQUIRE(value == peeked_value);
+        uint32_t producer = (uint32_t)(value >> 32);
+        REQUIRE(producer < producer_count);
+        REQUIRE((uint32_t)value == next_sequence[producer]);
+        next_sequence[producer]++;
+        received++;
+    }
+
+    for (auto& producer : producers) {
+        producer.join();
+    }
+
+    uint64_t value;
+    REQUIRE(
+        ebpf_map_pop_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0) == EBPF_OBJECT_NOT_FOUND);
+}
+
+TEST_CASE("map_mmapable_array", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    ebpf_map_definition_in_memory_t map_definition{
+        BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(uint64_t), _test_map_size, 0, LIBBPF_PIN_NONE, BPF_F_MMAPABLE};
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    uint8_t* buffer;
+    REQUIRE(ebpf_array_map_query_buffer(map.get(), &buffer) == EBPF_SUCCESS);
+    uint64_t* values = reinterpret_cast<uint64_t*>(buffer);
+
+    // Mapping again returns the existing mapping.
+    uint8_t* second_buffer;
+    REQUIRE(ebpf_array_map_query_buffer(map.get(), &second_buffer) == EBPF_SUCCESS);
+    REQUIRE(second_buffer == buffer);
+
+    // Values start zeroed.
+    for (uint32_t key = 0; key < _test_map_size; key++) {
+        REQUIRE(values[key] == 0);
+    }
+
+    // Updates through the map are visible in the mapping.
+    for (uint32_t key = 0; key < _test_map_size; key++) {
+        uint64_t value = static_cast<uint64_t>(key) * 3;
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<const uint8_t*>(&key),
+                sizeof(value),
+                reinterpret_cast<const uint8_t*>(&value),
+                EBPF_ANY,
+                0) == EBPF_SUCCESS);
+        REQUIRE(values[key] == value);
+    }
+
+    // Writes through the mapping are visible to lookups.
+    for (uint32_t key = 0; key < _test_map_size; key++) {
+        values[key] = static_cast<uint64_t>(key) + 1;
+        uint64_t value = 0;
+        REQUIRE(
+            ebpf_map_find_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<const uint8_t*>(&key),
+                sizeof(value),
+                reinterpret_cast<uint8_t*>(&value),
+                0) == EBPF_SUCCESS);
+        REQUIRE(value == static_cast<uint64_t>(key) + 1);
+    }
+
+    // Arrays created without BPF_F_MMAPABLE can't be mapped.
+    map_definition.map_flags = 0;
+    map_ptr unmappable_map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        unmappable_map.reset(local_map);
+    }
+    REQUIRE(ebpf_array_map_query_buffer(unmappable_map.get(), &buffer) == EBPF_INVALID_ARGUMENT);
+}
+
+TEST_CASE("map_crud_operations_bloom_filter", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    ebpf_map_definition_in_memory_t map_definition{BPF_MAP_TYPE_BLOOM_FILTER, 0, sizeof(uint64_t), _test_map_size};
+    map_definition.map_extra = 3;
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    // Should be empty.
+    for (uint64_t value = 0; value < _test_map_size; value++) {
+        REQUIRE(
+            ebpf_map_peek_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0) ==
+            EBPF_KEY_NOT_FOUND);
+    }
+
+    for (uint64_t value = 0; value < _test_map_size; value++) {
+        REQUIRE(ebpf_map_push_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0) == EBPF_SUCCESS);
+    }
+
+    // No false negatives, and the value tested for is left as is.
+    for (uint64_t value = 0; value < _test_map_size; value++) {
+        uint64_t test_value = value;
+        REQUIRE(
+            ebpf_map_peek_entry(map.get(), sizeof(test_value), reinterpret_cast<uint8_t*>(&test_value), 0) ==
+            EBPF_SUCCESS);
+        REQUIRE(test_value == value);
+    }
+
+    // Lookups from user mode pass the value to test for in place of the key.
+    uint64_t value = 7;
+    uint64_t return_value = 0;
+    REQUIRE(
+        ebpf_map_find_entry(
+            map.get(),
+            sizeof(value),
+            reinterpret_cast<uint8_t*>(&value),
+            sizeof(return_value),
+            reinterpret_cast<uint8_t*>(&return_value),
+            0) == EBPF_SUCCESS);
+    REQUIRE(return_value == value);
+
+    // False positives should be rare.
+    size_t false_positives = 0;
+    for (uint64_t absent_value = _test_map_size; absent_value < _test_map_size * 9; absent_value++) {
+        if (ebpf_map_peek_entry(map.get(), sizeof(absent_value), reinterpret_cast<uint8_t*>(&absent_value), 0) ==
+            EBPF_SUCCESS) {
+            false_positives++;
+        }
+    }
+    REQUIRE(false_positives < _test_map_size * 8 / 10);
+
+    // Values can't be removed.
+    REQUIRE(
+        ebpf_map_pop_entry(map.get(), sizeof(return_value), reinterpret_cast<uint8_t*>(&return_value), 0) ==
+        EBPF_OPERATION_NOT_SUPPORTED);
+    REQUIRE(
+        ebpf_map_find_entry(
+            map.get(),
+            sizeof(value),
+            reinterpret_cast<uint8_t*>(&value),
+            sizeof(return_value),
+            reinterpret_cast<uint8_t*>(&return_value),
+            EBPF_MAP_FIND_FLAG_DELETE) == EBPF_OPERATION_NOT_SUPPORTED);
+    REQUIRE(ebpf_map_delete_entry(map.get(), 0, nullptr, 0) == EBPF_OPERATION_NOT_SUPPORTED);
+
+    // Values can only be added.
+    REQUIRE(
+        ebpf_map_push_entry(map.get(), sizeof(value), reinterpret_cast<uint8_t*>(&value), BPF_EXIST) ==
+        EBPF_INVALID_ARGUMENT);
+
+    // Wrong value size.
+    REQUIRE(
+        ebpf_map_peek_entry(map.get(), sizeof(value) - 1, reinterpret_cast<uint8_t*>(&value), 0) ==
+        EBPF_INVALID_ARGUMENT);
+
+    bpf_map_info info;
+    uint16_t info_size = sizeof(info);
+    REQUIRE(ebpf_map_get_info(map.get(), (uint8_t*)&info, &info_size) == EBPF_SUCCESS);
+    REQUIRE(info.type == BPF_MAP_TYPE_BLOOM_FILTER);
+    REQUIRE(info.map_extra == 3);
+}
+
+TEST_CASE("map_hash_aging", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    // Entries expire after 1 second without being looked up or updated.
+    ebpf_map_definition_in_memory_t map_definition{
+        BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint64_t), _test_map_size};
+    map_definition.map_extra = 1;
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    for (uint32_t key = 0; key < _test_map_size; key++) {
+        uint64_t value = key;
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                sizeof(key),
+                reinterpret_cast<uint8_t*>(&key),
+                sizeof(value),
+                reinterpret_cast<uint8_t*>(&value),
+                EBPF_ANY,
+                0) == EBPF_SUCCESS);
+    }
+
+    // Keep updating key 0 until every other entry has expired.
+    uint32_t live_key = 0;
+    bpf_map_info info;
+    uint16_t info_size;
+    for (size_t attempt = 0; attempt < 100; attempt++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t value = attempt;
+        REQUIRE(
+            ebpf_map_update_entry(
+                map.get(),
+                sizeof(live_key),
+                reinterpret_cast<uint8_t*>(&live_key),
+                sizeof(value),
+                reinterpret_cast<uint8_t*>(&value),
+                EBPF_ANY,
+                0) == EBPF_SUCCESS);
+        info_size = sizeof(info);
+        REQUIRE(ebpf_map_get_info(map.get(), (uint8_t*)&info, &info_size) == EBPF_SUCCESS);
+        if (info.expired_entry_count == _test_map_size - 1) {
+            break;
+        }
+    }
+    REQUIRE(info.type == BPF_MAP_TYPE_HASH);
+    REQUIRE(info.map_extra == 1);
+    REQUIRE(info.expired_entry_count == _test_map_size - 1);
+
+    // Only the entry that was kept in use is left.
+    uint32_t key = 0;
+    uint32_t next_key;
+    REQUIRE(
+        ebpf_map_next_key(map.get(), sizeof(key), nullptr, reinterpret_cast<uint8_t*>(&next_key)) == EBPF_SUCCESS);
+    REQUIRE(next_key == live_key);
+    REQUIRE(
+        ebpf_map_next_key(
+            map.get(), sizeof(key), reinterpret_cast<uint8_t*>(&next_key), reinterpret_cast<uint8_t*>(&key)) ==
+        EBPF_NO_MORE_KEYS);
+
+    // Hash maps without a TTL don't expire entries.
+    map_definition.map_extra = 0;
+    map_ptr plain_map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        plain_map.reset(local_map);
+    }
+    info_size = sizeof(info);
+    REQUIRE(ebpf_map_get_info(plain_map.get(), (uint8_t*)&info, &info_size) == EBPF_SUCCESS);
+    REQUIRE(info.expired_entry_count == 0);
+}
+
+TEST_CASE("map_statistics", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    auto create_map = [](ebpf_map_type_t type, uint32_t max_entries) {
+        ebpf_map_definition_in_memory_t map_definition{type, sizeof(uint32_t), sizeof(uint64_t), max_entries};
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        return map_ptr(local_map);
+    };
+    auto update = [](ebpf_map_t* map, uint32_t key) {
+        uint64_t value = key;
+        return ebpf_map_update_entry(
+            map,
+            sizeof(key),
+            reinterpret_cast<uint8_t*>(&key),
+            sizeof(value),
+            reinterpret_cast<uint8_t*>(&value),
+            EBPF_ANY,
+            0);
+    };
+    auto find = [](ebpf_map_t* map, uint32_t key) {
+        uint64_t value;
+        return ebpf_map_find_entry(
+            map, sizeof(key), reinterpret_cast<uint8_t*>(&key), sizeof(value), reinterpret_cast<uint8_t*>(&value), 0);
+    };
+    auto get_statistics = [](ebpf_map_t* map) {
+        bpf_map_info info;
+        uint16_t info_size = sizeof(info);
+        REQUIRE(ebpf_map_get_info(map, (uint8_t*)&info, &info_size) == EBPF_SUCCESS);
+        return info.statistics;
+    };
+
+    map_ptr hash_map = create_map(BPF_MAP_TYPE_HASH, _test_map_size);
+    map_ptr lru_map = create_map(BPF_MAP_TYPE_LRU_HASH, _test_map_size);
+
+    // Maps have no counters until an operation is counted, and report zero until then.
+    REQUIRE(update(hash_map.get(), 0) == EBPF_SUCCESS);
+    REQUIRE(get_statistics(hash_map.get()).update_count == 0);
+
+    ebpf_map_statistics_set_enabled(true);
+
+    uint32_t key = 0;
+    REQUIRE(update(hash_map.get(), 0) == EBPF_SUCCESS);
+    REQUIRE(update(hash_map.get(), 1) == EBPF_SUCCESS);
+    REQUIRE(find(hash_map.get(), 0) == EBPF_SUCCESS);
+    REQUIRE(find(hash_map.get(), 1) == EBPF_SUCCESS);
+    REQUIRE(find(hash_map.get(), 2) == EBPF_OBJECT_NOT_FOUND);
+    REQUIRE(ebpf_map_delete_entry(hash_map.get(), sizeof(key), reinterpret_cast<uint8_t*>(&key), 0) == EBPF_SUCCESS);
+    REQUIRE(
+        ebpf_map_delete_entry(hash_map.get(), sizeof(key), reinterpret_cast<uint8_t*>(&key), 0) ==
+        EBPF_KEY_NOT_FOUND);
+
+    ebpf_map_statistics_t statistics = get_statistics(hash_map.get());
+    REQUIRE(statistics.lookup_count == 3);
+    REQUIRE(statistics.lookup_hit_count == 2);
+    REQUIRE(statistics.lookup_miss_count == 1);
+    REQUIRE(statistics.update_count == 2);
+    REQUIRE(statistics.update_out_of_space_count == 0);
+    REQUIRE(statistics.update_no_memory_count == 0);
+    REQUIRE(statistics.delete_count == 1);
+    REQUIRE(statistics.lru_eviction_count == 0);
+
+    // Inserting more keys than an LRU map holds evicts the least recently used ones.
+    for (key = 0; key < _test_map_size * 2; key++) {
+        REQUIRE(update(lru_map.get(), key) == EBPF_SUCCESS);
+    }
+    statistics = get_statistics(lru_map.get());
+    REQUIRE(statistics.update_count == _test_map_size * 2);
+    REQUIRE(statistics.lru_eviction_count >= _test_map_size);
+
+    // Counters are kept, but not incremented, while statistics are disabled.
+    ebpf_map_statistics_set_enabled(false);
+    REQUIRE(update(hash_map.get(), 0) == EBPF_SUCCESS);
+    REQUIRE(find(hash_map.get(), 0) == EBPF_SUCCESS);
+    statistics = get_statistics(hash_map.get());
+    REQUIRE(statistics.lookup_count == 3);
+    REQUIRE(statistics.update_count == 2);
+}
+
 #define TEST_FUNCTION_RETURN 42
 #define TOTAL_HELPER_COUNT 3
 
@@ -1324,13 +1972,16 @@ TEST_CASE("ring_buffer_async_query", "[execution_context]")
     struct _completion
     {
         uint8_t* buffer = nullptr;
+        ebpf_ring_buffer_offsets_t* offsets = nullptr;
         size_t consumer_offset = 0;
         ebpf_ring_buffer_map_async_query_result_t async_query_result = {};
         uint64_t value{};
     } completion;
 
     REQUIRE(
-        ebpf_ring_buffer_map_query_buffer(map.get(), &completion.buffer, &completion.consumer_offset) == EBPF_SUCCESS);
+        ebpf_ring_buffer_map_query_buffer(
+            map.get(), &completion.buffer, &completion.offsets, &completion.consumer_offset) == EBPF_SUCCESS);
+    REQUIRE(completion.offsets != nullptr);
 
     REQUIRE(
         ebpf_async_set_completion_callback(
@@ -1351,7 +2002,8 @@ TEST_CASE("ring_buffer_async_query", "[execution_context]")
     REQUIRE(result == EBPF_PENDING);
 
     uint64_t value = 1;
-    REQUIRE(ebpf_ring_buffer_map_output(map.get(), reinterpret_cast<uint8_t*>(&value), sizeof(value)) == EBPF_SUCCESS);
+    REQUIRE(
+        ebpf_ring_buffer_map_output(map.get(), reinterpret_cast<uint8_t*>(&value), sizeof(value), 0) == EBPF_SUCCESS);
 
     REQUIRE(completion.value == value);
 
@@ -1389,6 +2041,225 @@ TEST_CASE("ring_buffer_async_query", "[execution_context]")
     }
 }
 
+TEST_CASE("ring_buffer_wakeup_policy", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    ebpf_map_definition_in_memory_t map_definition{BPF_MAP_TYPE_RINGBUF, 0, 0, 64 * 1024};
+    map_ptr map;
+    {
+        ebpf_map_t* local_map;
+        cxplat_utf8_string_t map_name = {0};
+        REQUIRE(
+            ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+        map.reset(local_map);
+    }
+
+    struct _completion
+    {
+        std::atomic<bool> completed = false;
+        ebpf_ring_buffer_map_async_query_result_t async_query_result = {};
+    } completion;
+
+    // Park an async query on the map after returning everything written so far.
+    auto park = [&]() {
+        REQUIRE(ebpf_ring_buffer_map_return_buffer(map.get(), completion.async_query_result.producer) == EBPF_SUCCESS);
+        completion.completed = false;
+        REQUIRE(
+            ebpf_async_set_completion_callback(
+                &completion, [](_Inout_ void* context, size_t output_buffer_length, ebpf_result_t result) {
+                    UNREFERENCED_PARAMETER(output_buffer_length);
+                    REQUIRE(result == EBPF_SUCCESS);
+                    reinterpret_cast<_completion*>(context)->completed = true;
+                }) == EBPF_SUCCESS);
+        ebpf_result_t result = ebpf_ring_buffer_map_async_query(map.get(), &completion.async_query_result, &completion);
+        if (result != EBPF_PENDING) {
+            REQUIRE(ebpf_async_reset_completion_callback(&completion) == EBPF_SUCCESS);
+        }
+        REQUIRE(result == EBPF_PENDING);
+        REQUIRE(!completion.completed);
+    };
+    auto output = [&](uint64_t flags) {
+        uint64_t value = 0;
+        return ebpf_ring_buffer_map_output(map.get(), reinterpret_cast<uint8_t*>(&value), sizeof(value), flags);
+    };
+
+    // Invalid flags.
+    REQUIRE(output(BPF_RB_NO_WAKEUP | BPF_RB_FORCE_WAKEUP) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(output(1ULL << 2) == EBPF_INVALID_ARGUMENT);
+
+    // Record watermark.
+    REQUIRE(ebpf_ring_buffer_map_set_wakeup(map.get(), 0, 3, 0) == EBPF_SUCCESS);
+    park();
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(!completion.completed);
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(completion.completed);
+
+    // Records written while no query is parked count once one parks.
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    park();
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(completion.completed);
+
+    // BPF_RB_NO_WAKEUP never completes the query, BPF_RB_FORCE_WAKEUP always does.
+    park();
+    REQUIRE(output(BPF_RB_NO_WAKEUP) == EBPF_SUCCESS);
+    REQUIRE(output(BPF_RB_NO_WAKEUP) == EBPF_SUCCESS);
+    REQUIRE(output(BPF_RB_NO_WAKEUP) == EBPF_SUCCESS);
+    REQUIRE(!completion.completed);
+    REQUIRE(output(BPF_RB_FORCE_WAKEUP) == EBPF_SUCCESS);
+    REQUIRE(completion.completed);
+
+    // Byte watermark. Each record is an 8 byte header followed by 8 bytes of data.
+    REQUIRE(ebpf_ring_buffer_map_set_wakeup(map.get(), 64, 0, 0) == EBPF_SUCCESS);
+    park();
+    for (int i = 0; i < 3; i++) {
+        REQUIRE(output(0) == EBPF_SUCCESS);
+    }
+    REQUIRE(!completion.completed);
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(completion.completed);
+
+    // Max latency timer completes the query even though the watermark is not reached. The timer is scheduled in
+    // microseconds, so the latency is bounded.
+    REQUIRE(ebpf_ring_buffer_map_set_wakeup(map.get(), 0, 100, UINT32_MAX) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_set_wakeup(map.get(), 0, 100, 10) == EBPF_SUCCESS);
+    park();
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    for (int i = 0; i < 1000 && !completion.completed; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(completion.completed);
+
+    // Without a policy every record completes the query.
+    REQUIRE(ebpf_ring_buffer_map_set_wakeup(map.get(), 0, 0, 0) == EBPF_SUCCESS);
+    park();
+    REQUIRE(output(0) == EBPF_SUCCESS);
+    REQUIRE(completion.completed);
+}
+
+TEST_CASE("ring_buffer_overwrite_flag", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    cxplat_utf8_string_t map_name = {0};
+    ebpf_map_t* local_map;
+
+    // Only ring buffer maps accept the overwrite flag.
+    ebpf_map_definition_in_memory_t hash_map_definition{
+        BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint32_t), 10, 0, LIBBPF_PIN_NONE, BPF_F_RINGBUF_OVERWRITE};
+    REQUIRE(
+        ebpf_map_create(&map_name, &hash_map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) ==
+        EBPF_INVALID_ARGUMENT);
+
+    ebpf_map_definition_in_memory_t map_definition{
+        BPF_MAP_TYPE_RINGBUF, 0, 0, 64 * 1024, 0, LIBBPF_PIN_NONE, BPF_F_RINGBUF_OVERWRITE};
+    map_ptr map;
+    REQUIRE(ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+    map.reset(local_map);
+
+    bpf_map_info info;
+    uint16_t info_size = sizeof(info);
+    REQUIRE(ebpf_map_get_info(map.get(), (uint8_t*)&info, &info_size) == EBPF_SUCCESS);
+    REQUIRE(info.map_flags == BPF_F_RINGBUF_OVERWRITE);
+
+    // Overwrite rings are only read with snapshots, they can't be mapped by a subscriber.
+    uint8_t* buffer;
+    ebpf_ring_buffer_offsets_t* offsets;
+    size_t consumer_offset;
+    REQUIRE(
+        ebpf_ring_buffer_map_query_buffer(map.get(), &buffer, &offsets, &consumer_offset) ==
+        EBPF_OPERATION_NOT_SUPPORTED);
+
+    // The map keeps accepting records once full.
+    std::vector<uint8_t> data(1000);
+    for (uint32_t sequence = 0; sequence < 200; sequence++) {
+        memcpy(data.data(), &sequence, sizeof(sequence));
+        REQUIRE(ebpf_ring_buffer_map_output(map.get(), data.data(), data.size(), 0) == EBPF_SUCCESS);
+    }
+
+    // The snapshot ends with the newest record.
+    std::vector<uint8_t> snapshot(4 * 1024);
+    size_t start_offset;
+    size_t length;
+    REQUIRE(
+        ebpf_ring_buffer_map_snapshot(map.get(), snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    size_t record_length = data.size() + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    REQUIRE(length == (snapshot.size() / record_length) * record_length);
+    auto record = (const ebpf_ring_buffer_record_t*)(snapshot.data() + length - record_length);
+    REQUIRE(*(uint32_t*)record->data == 199);
+}
+
+TEST_CASE("ring_buffer_reserve_submit", "[execution_context]")
+{
+    _ebpf_core_initializer core;
+    core.initialize();
+    cxplat_utf8_string_t map_name = {0};
+    ebpf_map_t* local_map;
+    uint64_t value = 0;
+    uint8_t* data;
+
+    ebpf_map_definition_in_memory_t map_definition{BPF_MAP_TYPE_RINGBUF, 0, sizeof(uint64_t), 64 * 1024};
+    map_ptr map;
+    REQUIRE(ebpf_map_create(&map_name, &map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+    map.reset(local_map);
+
+    ebpf_map_definition_in_memory_t hash_map_definition{BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint64_t), 10};
+    map_ptr hash_map;
+    REQUIRE(
+        ebpf_map_create(&map_name, &hash_map_definition, (uintptr_t)ebpf_handle_invalid, &local_map) == EBPF_SUCCESS);
+    hash_map.reset(local_map);
+
+    // Records are the value size of a ring buffer map.
+    REQUIRE(ebpf_ring_buffer_map_reserve(hash_map.get(), sizeof(uint64_t), 0, &data) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_reserve(map.get(), sizeof(uint32_t), 0, &data) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_reserve(map.get(), sizeof(uint64_t), 1, &data) == EBPF_INVALID_ARGUMENT);
+
+    // A record holds back the records reserved after it until it is submitted.
+    uint8_t* first;
+    uint8_t* second;
+    REQUIRE(ebpf_ring_buffer_map_reserve(map.get(), sizeof(uint64_t), 0, &first) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_reserve(map.get(), sizeof(uint64_t), 0, &second) == EBPF_SUCCESS);
+    *(uint64_t*)first = 1;
+    *(uint64_t*)second = 2;
+    REQUIRE(ebpf_ring_buffer_map_submit(second, 0) == EBPF_SUCCESS);
+
+    std::vector<uint8_t> snapshot(1024);
+    size_t start_offset;
+    size_t length;
+    REQUIRE(
+        ebpf_ring_buffer_map_snapshot(map.get(), snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    REQUIRE(length == 0);
+
+    REQUIRE(ebpf_ring_buffer_map_submit(first, BPF_RB_NO_WAKEUP | BPF_RB_FORCE_WAKEUP) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_submit(first, BPF_RB_FORCE_WAKEUP) == EBPF_SUCCESS);
+    REQUIRE(
+        ebpf_ring_buffer_map_snapshot(map.get(), snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    size_t record_length = sizeof(uint64_t) + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    REQUIRE(length == 2 * record_length);
+    REQUIRE(*(uint64_t*)((const ebpf_ring_buffer_record_t*)snapshot.data())->data == 1);
+    REQUIRE(*(uint64_t*)((const ebpf_ring_buffer_record_t*)(snapshot.data() + record_length))->data == 2);
+
+    // Only records that are still reserved can be submitted or discarded.
+    REQUIRE(ebpf_ring_buffer_map_submit(first, 0) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_discard(second, 0) == EBPF_INVALID_ARGUMENT);
+    REQUIRE(ebpf_ring_buffer_map_submit((uint8_t*)&value, 0) == EBPF_INVALID_ARGUMENT);
+
+    REQUIRE(ebpf_ring_buffer_map_reserve(map.get(), sizeof(uint64_t), 0, &data) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_discard(data, 0) == EBPF_SUCCESS);
+    REQUIRE(
+        ebpf_ring_buffer_map_snapshot(map.get(), snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    REQUIRE(length == 3 * record_length);
+    REQUIRE(((const ebpf_ring_buffer_record_t*)(snapshot.data() + 2 * record_length))->header.discarded);
+}
+
 TEST_CASE("perf_event_array_unsupported_ops", "[execution_context][perf_event_array][negative]")
 {
     _ebpf_core_initializer core;
@@ -166,6 +166,7 @@ typedef enum _ebpf_epoch_allocation_type
     EBPF_EPOCH_ALLOCATION_WORK_ITEM,            ///< Work item.
     EBPF_EPOCH_ALLOCATION_SYNCHRONIZATION,      ///< Synchronization object.
     EBPF_EPOCH_ALLOCATION_MEMORY_CACHE_ALIGNED, ///< Memory allocation that is cache aligned.
+    EBPF_EPOCH_ALLOCATION_MEMORY_POOL,          ///< Element of an ebpf_epoch_pool_t.
 } ebpf_epoch_allocation_type_t;
 
 /**
@@ -194,6 +195,50 @@ typedef struct _ebpf_epoch_work_item
     const void (*callback)(_Inout_ void* context);         ///< Callback to invoke.
 } ebpf_epoch_work_item_t;
 
+/**
+ * @brief Per-CPU list of free elements in an ebpf_epoch_pool_t.
+ */
+typedef __declspec(align(EBPF_CACHE_LINE_SIZE)) struct _ebpf_epoch_pool_cache
+{
+    ebpf_lock_t lock;            ///< Lock protecting the free list.
+    ebpf_list_entry_t free_list; ///< Free elements, linked through their allocation header.
+} ebpf_epoch_pool_cache_t;
+
+/**
+ * @brief Pool of fixed size elements carved out of one allocation. Freed elements are returned to the pool of the
+ * CPU that releases them once the epoch ends, instead of to the memory pool.
+ */
+struct _ebpf_epoch_pool
+{
+    volatile int64_t reference_count; ///< One for the owner and one for each element waiting for the epoch to end.
+    size_t element_size;              ///< Size of each element, not including the header.
+    uint32_t tag;                     ///< Pool tag used if the pool is empty.
+    bool cache_aligned;               ///< Each element starts on a cache line boundary.
+    volatile int64_t fallback_count;  ///< Number of allocations made while the pool was exhausted.
+    uint8_t* elements;                ///< Storage for all elements.
+    uint32_t cache_count;             ///< Number of per-CPU free lists.
+    _Field_size_(cache_count) ebpf_epoch_pool_cache_t caches[1]; ///< Per-CPU free lists.
+};
+
+/**
+ * @brief Header of each element of an ebpf_epoch_pool_t. The allocation header is placed right before the element so
+ * that ebpf_epoch_free can handle elements and regular allocations alike.
+ */
+typedef struct _ebpf_epoch_pool_element_header
+{
+    ebpf_epoch_pool_t* pool;               ///< Pool the element belongs to.
+    ebpf_epoch_allocation_header_t header; ///< Header used to insert the item into the free list.
+} ebpf_epoch_pool_element_header_t;
+
+static_assert(
+    sizeof(ebpf_epoch_pool_element_header_t) ==
+        EBPF_OFFSET_OF(ebpf_epoch_pool_element_header_t, header) + sizeof(ebpf_epoch_allocation_header_t),
+    "Allocation header must be right before the element");
+
+static_assert(
+    sizeof(ebpf_epoch_pool_element_header_t) < EBPF_CACHE_LINE_SIZE,
+    "Element header must fit in the cache line before a cache aligned element");
+
 typedef struct _ebpf_epoch_synchronization
 {
     ebpf_epoch_allocation_header_t header; ///< Header used to insert the item into the free list.
@@ -228,6 +273,9 @@ static _IRQL_requires_(DISPATCH_LEVEL) void _ebpf_epoch_arm_timer_if_needed(ebpf
 static void
 _ebpf_epoch_work_item_callback(_In_ cxplat_preemptible_work_item_t* preemptible_work_item, void* context);
 
+static void
+_ebpf_epoch_pool_release(_Inout_ ebpf_epoch_allocation_header_t* header);
+
 /**
  * @brief Raise the CPU's IRQL to DISPATCH_LEVEL if it is below DISPATCH_LEVEL.
  * First check if the IRQL is below DISPATCH_LEVEL to avoid the overhead of
@@ -447,6 +495,7 @@ __drv_allocatesMem(Mem) _Must_inspect_result_
     size += sizeof(ebpf_epoch_allocation_header_t);
     header = (ebpf_epoch_allocation_header_t*)ebpf_allocate_with_tag(size, tag);
     if (header) {
+        header->entry_type = EBPF_EPOCH_ALLOCATION_MEMORY;
         header++;
     }
 
@@ -465,10 +514,14 @@ _Ret_writes_maybenull_(size) void* ebpf_epoch_allocate_cache_aligned_with_tag(si
     ebpf_assert(size);
     ebpf_epoch_allocation_header_t* header;
 
+    // The header is placed at the end of the cache line before the memory, right before it as for other
+    // allocations, so that ebpf_epoch_free can find it.
     size += EBPF_CACHE_LINE_SIZE;
     header = (ebpf_epoch_allocation_header_t*)ebpf_allocate_cache_aligned_with_tag(size, tag);
     if (header) {
-        header = (ebpf_epoch_allocation_header_t*)((uint8_t*)header + EBPF_CACHE_LINE_SIZE);
+        header = (ebpf_epoch_allocation_header_t*)((uint8_t*)header + EBPF_CACHE_LINE_SIZE) - 1;
+        header->entry_type = EBPF_EPOCH_ALLOCATION_MEMORY_CACHE_ALIGNED;
+        header++;
     }
 
     return header;
@@ -487,7 +540,14 @@ ebpf_epoch_free(_Frees_ptr_opt_ void* memory)
 
     // Pool corruption or double free.
     EBPF_EPOCH_FAIL_FAST(FAST_FAIL_HEAP_METADATA_CORRUPTION, header->freed_epoch == 0);
-    header->entry_type = EBPF_EPOCH_ALLOCATION_MEMORY;
+
+    // Allocations keep the type they were allocated with, so regular, cache aligned and pool memory are all freed
+    // here. Elements of an ebpf_epoch_pool_t hold a reference on the pool until they are returned.
+    if (header->entry_type == EBPF_EPOCH_ALLOCATION_MEMORY_POOL) {
+        ebpf_epoch_pool_element_header_t* element =
+            CONTAINING_RECORD(header, ebpf_epoch_pool_element_header_t, header);
+        ebpf_interlocked_increment_int64(&element->pool->reference_count);
+    }
 
     _ebpf_epoch_insert_in_free_list(header);
 }
@@ -501,7 +561,7 @@ ebpf_epoch_free_cache_aligned(_Frees_ptr_opt_ void* memory)
         return;
     }
 
-    header = (ebpf_epoch_allocation_header_t*)((uint8_t*)header - EBPF_CACHE_LINE_SIZE);
+    header--;
 
     // Pool corruption or double free.
     EBPF_EPOCH_FAIL_FAST(FAST_FAIL_HEAP_METADATA_CORRUPTION, header->freed_epoch == 0);
@@ -510,6 +570,222 @@ ebpf_epoch_free_cache_aligned(_Frees_ptr_opt_ void* memory)
     _ebpf_epoch_insert_in_free_list(header);
 }
 
+/**
+ * @brief Free the storage of the elements of a pool.
+ *
+ * @param[in, out] pool Pool whose element storage is freed.
+ */
+static void
+_ebpf_epoch_pool_free_elements(_Inout_ ebpf_epoch_pool_t* pool)
+{
+    if (pool->cache_aligned) {
+        ebpf_free_cache_aligned(pool->elements);
+    } else {
+        ebpf_free(pool->elements);
+    }
+    pool->elements = NULL;
+}
+
+/**
+ * @brief Create a pool of fixed size elements.
+ *
+ * @param[out] pool Pointer to memory that will contain the pool on success.
+ * @param[in] element_size Size of each element.
+ * @param[in] element_count Number of elements to preallocate.
+ * @param[in] cache_aligned Start each element on a cache line boundary instead of an 8 byte boundary.
+ * @param[in] tag Pool tag to use.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_INVALID_ARGUMENT The element size is zero.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+ */
+static _Must_inspect_result_ ebpf_result_t
+_ebpf_epoch_pool_create(
+    _Outptr_ ebpf_epoch_pool_t** pool, size_t element_size, size_t element_count, bool cache_aligned, uint32_t tag)
+{
+    ebpf_result_t result;
+    ebpf_epoch_pool_t* local_pool = NULL;
+    uint32_t cache_count = ebpf_get_cpu_count();
+    size_t pool_size;
+    size_t element_stride;
+    size_t elements_size;
+    // Element headers sit right before their element. Cache aligned elements start one cache line into the storage,
+    // with the header of the first element at the end of that line and each later header in the padding before its
+    // element.
+    size_t first_element_offset =
+        cache_aligned ? EBPF_CACHE_LINE_SIZE - sizeof(ebpf_epoch_pool_element_header_t) : 0;
+    size_t element_alignment = cache_aligned ? EBPF_CACHE_LINE_SIZE : 8;
+
+    if (element_size == 0) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    result = ebpf_safe_size_t_multiply(sizeof(ebpf_epoch_pool_cache_t), cache_count, &pool_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+    result = ebpf_safe_size_t_add(pool_size, EBPF_OFFSET_OF(ebpf_epoch_pool_t, caches), &pool_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    result = ebpf_safe_size_t_add(
+        element_size, sizeof(ebpf_epoch_pool_element_header_t) + element_alignment - 1, &element_stride);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+    element_stride &= ~(element_alignment - 1);
+    result = ebpf_safe_size_t_multiply(element_stride, element_count, &elements_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+    result = ebpf_safe_size_t_add(elements_size, first_element_offset, &elements_size);
+    if (result != EBPF_SUCCESS) {
+        goto Done;
+    }
+
+    local_pool = ebpf_allocate_cache_aligned_with_tag(pool_size, tag);
+    if (!local_pool) {
+        result = EBPF_NO_MEMORY;
+        goto Done;
+    }
+
+    local_pool->reference_count = 1;
+    local_pool->element_size = element_size;
+    local_pool->tag = tag;
+    local_pool->cache_aligned = cache_aligned;
+    local_pool->cache_count = cache_count;
+    for (uint32_t cache = 0; cache < cache_count; cache++) {
+        ebpf_lock_create(&local_pool->caches[cache].lock);
+        ebpf_list_initialize(&local_pool->caches[cache].free_list);
+    }
+
+    if (element_count) {
+        local_pool->elements = cache_aligned ? ebpf_allocate_cache_aligned_with_tag(elements_size, tag)
+                                             : ebpf_allocate_with_tag(elements_size, tag);
+        if (!local_pool->elements) {
+            result = EBPF_NO_MEMORY;
+            goto Done;
+        }
+    }
+
+    // Spread the elements across the per-CPU free lists.
+    for (size_t index = 0; index < element_count; index++) {
+        ebpf_epoch_pool_element_header_t* element =
+            (ebpf_epoch_pool_element_header_t*)(local_pool->elements + first_element_offset + index * element_stride);
+        element->pool = local_pool;
+        element->header.entry_type = EBPF_EPOCH_ALLOCATION_MEMORY_POOL;
+        ebpf_list_insert_tail(&local_pool->caches[index % cache_count].free_list, &element->header.list_entry);
+    }
+
+    *pool = local_pool;
+    local_pool = NULL;
+    result = EBPF_SUCCESS;
+
+Done:
+    if (local_pool) {
+        _ebpf_epoch_pool_free_elements(local_pool);
+        ebpf_free_cache_aligned(local_pool);
+    }
+    return result;
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_epoch_pool_create(_Outptr_ ebpf_epoch_pool_t** pool, size_t element_size, size_t element_count, uint32_t tag)
+{
+    return _ebpf_epoch_pool_create(pool, element_size, element_count, false, tag);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_epoch_pool_create_cache_aligned(
+    _Outptr_ ebpf_epoch_pool_t** pool, size_t element_size, size_t element_count, uint32_t tag)
+{
+    return _ebpf_epoch_pool_create(pool, element_size, element_count, true, tag);
+}
+
+/**
+ * @brief Release a reference on a pool, freeing it once the owner and all elements waiting for the epoch to end have
+ * released theirs.
+ *
+ * @param[in] pool Pool to release.
+ */
+static void
+_ebpf_epoch_pool_release_reference(_Inout_ ebpf_epoch_pool_t* pool)
+{
+    if (ebpf_interlocked_decrement_int64(&pool->reference_count) == 0) {
+        for (uint32_t cache = 0; cache < pool->cache_count; cache++) {
+            ebpf_lock_destroy(&pool->caches[cache].lock);
+        }
+        _ebpf_epoch_pool_free_elements(pool);
+        ebpf_free_cache_aligned(pool);
+    }
+}
+
+void
+ebpf_epoch_pool_destroy(_In_opt_ _Frees_ptr_opt_ ebpf_epoch_pool_t* pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    _ebpf_epoch_pool_release_reference(pool);
+}
+
+_Must_inspect_result_ void*
+ebpf_epoch_pool_allocate(_Inout_ ebpf_epoch_pool_t* pool)
+{
+    uint32_t current_cpu = ebpf_get_current_cpu();
+    ebpf_epoch_pool_element_header_t* element = NULL;
+
+    // Take an element from the current CPU's free list, or from another CPU's if it is empty.
+    for (uint32_t offset = 0; offset < pool->cache_count && !element; offset++) {
+        ebpf_epoch_pool_cache_t* cache = &pool->caches[(current_cpu + offset) % pool->cache_count];
+        ebpf_lock_state_t state = ebpf_lock_lock(&cache->lock);
+        if (!ebpf_list_is_empty(&cache->free_list)) {
+            ebpf_list_entry_t* entry = cache->free_list.Flink;
+            ebpf_list_remove_entry(entry);
+            element = CONTAINING_RECORD(entry, ebpf_epoch_pool_element_header_t, header.list_entry);
+        }
+        ebpf_lock_unlock(&cache->lock, state);
+    }
+
+    // The pool is exhausted, fall back to a regular allocation.
+    if (!element) {
+        ebpf_interlocked_increment_int64(&pool->fallback_count);
+        return pool->cache_aligned ? ebpf_epoch_allocate_cache_aligned_with_tag(pool->element_size, pool->tag)
+                                   : ebpf_epoch_allocate_with_tag(pool->element_size, pool->tag);
+    }
+
+    memset(&element->header.list_entry, 0, sizeof(element->header.list_entry));
+    memset(element + 1, 0, pool->element_size);
+    return element + 1;
+}
+
+int64_t
+ebpf_epoch_pool_fallback_count(_In_ const ebpf_epoch_pool_t* pool)
+{
+    return pool->fallback_count;
+}
+
+/**
+ * @brief Return an element of an ebpf_epoch_pool_t to the free list of the current CPU once the epoch has ended.
+ *
+ * @param[in, out] header Allocation header of the element.
+ */
+static void
+_ebpf_epoch_pool_release(_Inout_ ebpf_epoch_allocation_header_t* header)
+{
+    ebpf_epoch_pool_element_header_t* element = CONTAINING_RECORD(header, ebpf_epoch_pool_element_header_t, header);
+    ebpf_epoch_pool_t* pool = element->pool;
+    ebpf_epoch_pool_cache_t* cache = &pool->caches[ebpf_get_current_cpu() % pool->cache_count];
+
+    header->freed_epoch = 0;
+    ebpf_lock_state_t state = ebpf_lock_lock(&cache->lock);
+    ebpf_list_insert_tail(&cache->free_list, &header->list_entry);
+    ebpf_lock_unlock(&cache->lock, state);
+
+    _ebpf_epoch_pool_release_reference(pool);
+}
+
 ebpf_epoch_work_item_t*
 ebpf_epoch_allocate_work_item(_In_ void* callback_context, _In_ const void (*callback)(_Inout_ void* context))
 {
@@ -630,7 +906,10 @@ _ebpf_epoch_release_free_list(_Inout_ ebpf_epoch_cpu_entry_t* cpu_entry, int64_t
                 break;
             }
             case EBPF_EPOCH_ALLOCATION_MEMORY_CACHE_ALIGNED:
-                ebpf_free_cache_aligned(header);
+                ebpf_free_cache_aligned((uint8_t*)(header + 1) - EBPF_CACHE_LINE_SIZE);
+                break;
+            case EBPF_EPOCH_ALLOCATION_MEMORY_POOL:
+                _ebpf_epoch_pool_release(header);
                 break;
             default:
                 // Pool corruption or internal error.
@@ -11,6 +11,7 @@ extern "C"
 #endif
 
     typedef struct _ebpf_epoch_work_item ebpf_epoch_work_item_t;
+    typedef struct _ebpf_epoch_pool ebpf_epoch_pool_t;
     typedef struct _ebpf_epoch_state
     {
         LIST_ENTRY epoch_list_entry; /// List entry for the epoch list.
@@ -76,7 +77,8 @@ extern "C"
         _Ret_writes_maybenull_(size) void* ebpf_epoch_allocate_with_tag(size_t size, uint32_t tag);
 
     /**
-     * @brief Free memory under epoch control.
+     * @brief Free memory under epoch control, including cache aligned memory. Elements of an ebpf_epoch_pool_t are
+     * returned to their pool instead.
      * @param[in] memory Allocation to be freed once epoch ends.
      */
     void
@@ -89,6 +91,67 @@ extern "C"
     void
     ebpf_epoch_free_cache_aligned(_Frees_ptr_opt_ void* memory);
 
+    /**
+     * @brief Create a pool of fixed size elements under epoch control, carved out of one allocation and spread
+     * across per-CPU free lists. Elements are freed with ebpf_epoch_free and return to the pool once the epoch ends.
+     *
+     * @param[out] pool Pointer to memory that will contain the pool on success.
+     * @param[in] element_size Size of each element.
+     * @param[in] element_count Number of elements to preallocate.
+     * @param[in] tag Pool tag to use.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_INVALID_ARGUMENT The element size is zero.
+     * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_epoch_pool_create(
+        _Outptr_ ebpf_epoch_pool_t** pool, size_t element_size, size_t element_count, uint32_t tag);
+
+    /**
+     * @brief Create a pool like ebpf_epoch_pool_create, with each element starting on a cache line boundary.
+     * Each element takes its size plus its header, rounded up to a multiple of the cache line size.
+     *
+     * @param[out] pool Pointer to memory that will contain the pool on success.
+     * @param[in] element_size Size of each element.
+     * @param[in] element_count Number of elements to preallocate.
+     * @param[in] tag Pool tag to use.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_INVALID_ARGUMENT The element size is zero.
+     * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_epoch_pool_create_cache_aligned(
+        _Outptr_ ebpf_epoch_pool_t** pool, size_t element_size, size_t element_count, uint32_t tag);
+
+    /**
+     * @brief Release the pool. Its storage is freed once all elements freed with ebpf_epoch_free have returned to it.
+     * All elements must be freed before this call.
+     *
+     * @param[in] pool Pool to destroy.
+     */
+    void
+    ebpf_epoch_pool_destroy(_In_opt_ _Frees_ptr_opt_ ebpf_epoch_pool_t* pool);
+
+    /**
+     * @brief Allocate a zeroed element from the pool, preferring the current CPU's free list. If the pool is
+     * exhausted, the element is allocated with ebpf_epoch_allocate_with_tag, or
+     * ebpf_epoch_allocate_cache_aligned_with_tag for a cache aligned pool, instead.
+     *
+     * @param[in, out] pool Pool to allocate from.
+     * @returns Pointer to the element, or NULL if the pool is exhausted and the fallback allocation failed.
+     */
+    _Must_inspect_result_ void*
+    ebpf_epoch_pool_allocate(_Inout_ ebpf_epoch_pool_t* pool);
+
+    /**
+     * @brief Get the number of allocations that fell back to the memory pool because the pool was exhausted.
+     *
+     * @param[in] pool Pool to query.
+     * @return Number of fallback allocations.
+     */
+    int64_t
+    ebpf_epoch_pool_fallback_count(_In_ const ebpf_epoch_pool_t* pool);
+
     /**
      * @brief Wait for the current epoch to end.
      */
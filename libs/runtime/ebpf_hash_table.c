@@ -6,17 +6,28 @@
 #include "ebpf_random.h"
 
 #include <intrin.h>
+#if defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 // Buckets contain an array of pointers to value and keys.
 // Buckets are immutable once inserted in to the hash-table and replaced when
 // modified.
 
 // Layout is:
-// ebpf_hash_table_t.buckets->ebpf_hash_bucket_header_t.entries->data
+// ebpf_hash_table_t.buckets->ebpf_hash_table_buckets_t.buckets->ebpf_hash_bucket_header_t.entries->data
 // Keys are stored contiguously in ebpf_hash_bucket_header_t for fast
 // searching, data is stored separately to prevent read-copy-update semantics
 // from causing loss of updates.
 
+// Each bucket also stores a one byte tag per entry after its entries, taken from the high-order bits of the hash of
+// the key. Lookups compare the tags of all entries at once and only compare the keys of entries whose tag matches.
+
+// The bucket array is resized incrementally. Once the load factor crosses a threshold, a bucket array of twice or
+// half the size is linked from the current one, and updates each move a bounded number of buckets to it. A moved
+// bucket is replaced by a marker, which sends lookups and updates to the next bucket array. Once all buckets are
+// moved, the next bucket array becomes the current one and the old one is freed.
+
 /**
  * @brief Each bucket entry contains a pointer to the value, the key, and a pointer to pre-allocated memory that can be
  * used to replace the current bucket with a bucket one entry smaller.
@@ -38,6 +49,13 @@ typedef struct _ebpf_hash_bucket_header
     _Field_size_(count) ebpf_hash_bucket_entry_t entries[1];
 } ebpf_hash_bucket_header_t;
 
+/**
+ * @brief Marker for a bucket whose entries have been moved to the next bucket array. It is an empty bucket, so code
+ * that does not follow the marker sees no entries.
+ */
+static const ebpf_hash_bucket_header_t _ebpf_hash_bucket_migrated = {0};
+#define EBPF_HASH_BUCKET_MIGRATED ((ebpf_hash_bucket_header_t*)&_ebpf_hash_bucket_migrated)
+
 /**
  * @brief This structure contains the pointer to the bucket and a lock to synchronize replacing the bucket.
  */
@@ -48,15 +66,34 @@ typedef struct _ebpf_hash_bucket_header_and_lock
 } ebpf_hash_bucket_header_and_lock_t;
 
 /**
- * @brief The ebpf_hash_table_t structure represents a hash table. It contains an array of pointers to buckets and a
- * a per bucket lock.
+ * @brief An array of buckets and a per bucket lock. While the hash table is being resized, the entries are moved
+ * from the current bucket array to the next one.
+ */
+typedef struct _ebpf_hash_table_buckets
+{
+    size_t bucket_count;        // Count of buckets.
+    size_t bucket_count_mask;   // Mask to use to get bucket index from hash.
+    uint32_t bucket_count_log2; // Log2 of the count of buckets.
+    struct _ebpf_hash_table_buckets* volatile next; // Bucket array being resized to, or NULL.
+    size_t migration_index; // Next bucket to move to the next bucket array. Only used by the thread resizing the table.
+    _Field_size_(bucket_count) ebpf_hash_bucket_header_and_lock_t buckets[1]; // Array of buckets.
+} ebpf_hash_table_buckets_t;
+
+// Buckets with up to this many entries are taken from the preallocated bucket pools.
+#define EBPF_HASH_TABLE_POOLED_BUCKET_SIZES 4
+
+/**
+ * @brief The ebpf_hash_table_t structure represents a hash table. It contains a pointer to the current bucket array,
+ * which is replaced when the hash table is resized.
  */
 struct _ebpf_hash_table
 {
-    size_t bucket_count;      // Count of buckets.
-    size_t bucket_count_mask; // Mask to use to get bucket index from hash.
-    volatile size_t
-        entry_count; // Count of entries in the hash table. Only valid if max_entry_count != EBPF_HASH_TABLE_NO_LIMIT.
+    ebpf_hash_table_buckets_t* volatile buckets; // Current bucket array.
+    size_t minimum_bucket_count;                 // Bucket count the table does not shrink below.
+    size_t maximum_bucket_count;                 // Bucket count the table does not grow above.
+    volatile int32_t resize_active;              // Set while a thread starts or advances a resize.
+    volatile uint32_t generation;                // Incremented when a resize starts or finishes.
+    volatile size_t entry_count;                 // Count of entries in the hash table.
     size_t max_entry_count;         // Maximum number of entries allowed or EBPF_HASH_TABLE_NO_LIMIT if no maximum.
     uint32_t seed;                  // Seed used for hashing.
     size_t key_size;                // Size of key.
@@ -71,9 +108,41 @@ struct _ebpf_hash_table
 
     void* notification_context; //< Context to pass to notification functions.
     ebpf_hash_table_notification_function notification_callback;
-    _Field_size_(bucket_count) ebpf_hash_bucket_header_and_lock_t buckets[1]; // Pointer to array of buckets.
+
+    const volatile bool* count_lock_contention; // Enables counting contended bucket locks, or NULL.
+    volatile int64_t lock_contention_count;     // Count of bucket locks found held by another operation.
+
+    bool update_in_place;          // Values of existing keys are overwritten in place under a sequence lock.
+    ebpf_epoch_pool_t* value_pool; // Preallocated values, or NULL if values are allocated on each update.
+    bool cache_aligned_values;     // Values start on a cache line boundary.
+    ebpf_epoch_pool_t* bucket_pools[EBPF_HASH_TABLE_POOLED_BUCKET_SIZES]; // Preallocated buckets by entry count.
 };
 
+// Number of tags compared at once. The tags of a bucket are padded to a multiple of this, so that they can be read a
+// block at a time.
+#define EBPF_HASH_TABLE_TAG_BLOCK_SIZE 16
+
+/**
+ * @brief Layout of ebpf_hash_table_cursor_t. A cursor of zero is not valid, as the index of a returned entry is
+ * stored plus one.
+ */
+typedef struct _ebpf_hash_table_cursor_internal
+{
+    uint32_t position;   // Position of the bucket in the bit-reversed walk, scaled to 32 bits.
+    uint16_t index;      // Index of the returned entry in the bucket plus one.
+    uint16_t generation; // Low bits of the generation of the hash table when the entry was returned.
+} ebpf_hash_table_cursor_internal_t;
+
+static_assert(
+    sizeof(ebpf_hash_table_cursor_internal_t) == sizeof(ebpf_hash_table_cursor_t), "Size mismatch of cursor types.");
+
+// Grow the bucket array when there are more entries than this many per bucket.
+#define EBPF_HASH_TABLE_GROW_LOAD_FACTOR 1
+// Shrink the bucket array when there are fewer entries than one per this many buckets.
+#define EBPF_HASH_TABLE_SHRINK_LOAD_DIVISOR 4
+// Maximum number of buckets moved to the next bucket array by each update while resizing.
+#define EBPF_HASH_TABLE_MIGRATION_BUCKETS_PER_UPDATE 8
+
 typedef enum _ebpf_hash_bucket_operation
 {
     EBPF_HASH_BUCKET_OPERATION_INSERT_OR_UPDATE, // Insert or update a key-value pair.
@@ -301,33 +370,55 @@ _ebpf_hash_table_compare(_In_ const ebpf_hash_table_t* hash_table, _In_ const ui
 
 /**
  * @brief Given a potentially non-comparable key value, extract the key and
- * compute the hash and convert it to a bucket index.
+ * compute the hash. The bucket index is the hash masked by the bucket count mask.
  *
  * @param[in] hash_table Hash table the keys belong to.
  * @param[in] key Key to hash.
- * @return Bucket index.
+ * @return Hash of the key.
  */
 static uint32_t
-_ebpf_hash_table_compute_bucket_index(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* key)
+_ebpf_hash_table_compute_hash(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* key)
 {
     if (!hash_table->extract) {
 #if defined(_M_X64)
         if (ebpf_processor_supports_sse42) {
-            return _ebpf_compute_crc32(key, hash_table->key_size, hash_table->seed) & hash_table->bucket_count_mask;
+            return _ebpf_compute_crc32(key, hash_table->key_size, hash_table->seed);
         } else {
-            return _ebpf_murmur3_32(key, hash_table->key_size * 8, hash_table->seed) & hash_table->bucket_count_mask;
+            return _ebpf_murmur3_32(key, hash_table->key_size * 8, hash_table->seed);
         }
 #else
-        return _ebpf_murmur3_32(key, hash_table->key_size * 8, hash_table->seed) & hash_table->bucket_count_mask;
+        return _ebpf_murmur3_32(key, hash_table->key_size * 8, hash_table->seed);
 #endif
     } else {
         uint8_t* data;
         size_t length;
         hash_table->extract(key, &data, &length);
-        return _ebpf_murmur3_32(data, length, hash_table->seed) & hash_table->bucket_count_mask;
+        return _ebpf_murmur3_32(data, length, hash_table->seed);
     }
 }
 
+/**
+ * @brief Map a bucket index to its position when walking the buckets in bit-reversed order, or a position back to
+ * its bucket index. When the bucket array doubles, bucket i splits into buckets i and i + bucket_count, which are
+ * adjacent in this order and come after all buckets that preceded bucket i. So a walk in this order does not skip
+ * buckets if the table is resized between steps.
+ *
+ * @param[in] buckets Bucket array to walk.
+ * @param[in] index Bucket index or position.
+ * @return Position or bucket index.
+ */
+static size_t
+_ebpf_hash_table_reverse_bucket_index(_In_ const ebpf_hash_table_buckets_t* buckets, size_t index)
+{
+    uint32_t value = (uint32_t)index;
+    value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+    value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+    value = ((value >> 4) & 0x0f0f0f0f) | ((value & 0x0f0f0f0f) << 4);
+    value = ((value >> 8) & 0x00ff00ff) | ((value & 0x00ff00ff) << 8);
+    value = (value >> 16) | (value << 16);
+    return (size_t)((uint64_t)value >> (32 - buckets->bucket_count_log2));
+}
+
 /**
  * @brief Given a pointer to a bucket, compute the offset of a bucket entry.
  *
@@ -346,30 +437,419 @@ _ebpf_hash_table_bucket_entry(size_t key_size, _In_ const ebpf_hash_bucket_heade
 }
 
 /**
- * @brief Helper function to ensure correct memory ordering when reading a bucket from the hash table.
+ * @brief Compute the size of the header and entries of a bucket.
+ *
+ * @param[in] key_size Size of key.
+ * @param[in] entry_count Number of entries in the bucket.
+ * @return Size of the header and entries, which is the offset of the tags.
+ */
+static __forceinline size_t
+_ebpf_hash_table_bucket_entries_size(size_t key_size, size_t entry_count)
+{
+    size_t entry_size = EBPF_OFFSET_OF(ebpf_hash_bucket_entry_t, key) + key_size;
+    return EBPF_OFFSET_OF(ebpf_hash_bucket_header_t, entries) + entry_count * entry_size;
+}
+
+/**
+ * @brief Compute the size of a bucket, including its tags.
+ *
+ * @param[in] key_size Size of key.
+ * @param[in] entry_count Number of entries in the bucket.
+ * @return Size of the bucket.
+ */
+static __forceinline size_t
+_ebpf_hash_table_bucket_size(size_t key_size, size_t entry_count)
+{
+    size_t tags_size =
+        (entry_count + EBPF_HASH_TABLE_TAG_BLOCK_SIZE - 1) & ~((size_t)EBPF_HASH_TABLE_TAG_BLOCK_SIZE - 1);
+    return _ebpf_hash_table_bucket_entries_size(key_size, entry_count) + tags_size;
+}
+
+/**
+ * @brief Get the tags of a bucket with the given number of entries.
+ *
+ * @param[in] key_size Size of key.
+ * @param[in] bucket Pointer to start of the bucket.
+ * @param[in] entry_count Number of entries in the bucket.
+ * @return Pointer to the tags.
+ */
+static __forceinline uint8_t*
+_ebpf_hash_table_bucket_tags(size_t key_size, _In_ const ebpf_hash_bucket_header_t* bucket, size_t entry_count)
+{
+    return (uint8_t*)bucket + _ebpf_hash_table_bucket_entries_size(key_size, entry_count);
+}
+
+/**
+ * @brief Compute the tag of a key from its hash. The bucket index is taken from the low-order bits of the hash, so
+ * the tag is taken from the high-order bits.
+ *
+ * @param[in] hash Hash of the key.
+ * @return Tag of the key.
+ */
+static __forceinline uint8_t
+_ebpf_hash_table_tag(uint32_t hash)
+{
+    return (uint8_t)(hash >> 24);
+}
+
+/**
+ * @brief Compare a block of EBPF_HASH_TABLE_TAG_BLOCK_SIZE tags with a tag.
+ *
+ * @param[in] tags Block of tags to compare.
+ * @param[in] tag Tag to compare with.
+ * @return Mask with bit N set if tag N of the block matches.
+ */
+static __forceinline uint32_t
+_ebpf_hash_table_match_tags(_In_reads_(EBPF_HASH_TABLE_TAG_BLOCK_SIZE) const uint8_t* tags, uint8_t tag)
+{
+#if defined(_M_X64)
+    __m128i matches = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)tags), _mm_set1_epi8((char)tag));
+    return (uint32_t)_mm_movemask_epi8(matches);
+#elif defined(_M_ARM64)
+    // Keep one distinct bit per matching lane, then add the lanes of each half to form the mask.
+    static const uint8_t lane_bits[EBPF_HASH_TABLE_TAG_BLOCK_SIZE] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t matches = vandq_u8(vceqq_u8(vld1q_u8(tags), vdupq_n_u8(tag)), vld1q_u8(lane_bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(matches)) | ((uint32_t)vaddv_u8(vget_high_u8(matches)) << 8);
+#else
+    uint32_t matches = 0;
+    for (size_t index = 0; index < EBPF_HASH_TABLE_TAG_BLOCK_SIZE; index++) {
+        matches |= (uint32_t)(tags[index] == tag) << index;
+    }
+    return matches;
+#endif
+}
+
+/**
+ * @brief Get the offset of the sequence counter that follows the value and supplemental value of a hash table that
+ * updates values in place.
+ *
+ * @param[in] hash_table Hash table.
+ * @return Offset of the sequence counter.
+ */
+static __forceinline size_t
+_ebpf_hash_table_value_sequence_offset(_In_ const ebpf_hash_table_t* hash_table)
+{
+    return EBPF_PAD_8(hash_table->value_size + hash_table->supplemental_value_size);
+}
+
+/**
+ * @brief Get the size of the storage for a value, its supplemental value and, if the hash table updates values in
+ * place, its sequence counter.
+ *
+ * @param[in] hash_table Hash table.
+ * @return Size of the value storage.
+ */
+static size_t
+_ebpf_hash_table_value_allocation_size(_In_ const ebpf_hash_table_t* hash_table)
+{
+    if (hash_table->update_in_place) {
+        return _ebpf_hash_table_value_sequence_offset(hash_table) + sizeof(uint64_t);
+    }
+    return hash_table->value_size + hash_table->supplemental_value_size;
+}
+
+/**
+ * @brief Get the sequence counter of a value of a hash table that updates values in place. The counter is odd while
+ * the value is being overwritten.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in] data Value storage.
+ * @return Pointer to the sequence counter.
+ */
+static __forceinline volatile uint64_t*
+_ebpf_hash_table_value_sequence(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* data)
+{
+    return (volatile uint64_t*)(data + _ebpf_hash_table_value_sequence_offset(hash_table));
+}
+
+/**
+ * @brief Allocate storage for a value and its supplemental value, from the value pool if the table is preallocated.
+ *
+ * @param[in] hash_table Hash table.
+ * @return Pointer to the zeroed value, or NULL on failure.
+ */
+static uint8_t*
+_ebpf_hash_table_allocate_value(_In_ const ebpf_hash_table_t* hash_table)
+{
+    if (hash_table->value_pool) {
+        return ebpf_epoch_pool_allocate(hash_table->value_pool);
+    }
+    // Cache aligned values are freed with ebpf_epoch_free, which is the default free function.
+    if (hash_table->cache_aligned_values) {
+        return ebpf_epoch_allocate_cache_aligned_with_tag(
+            _ebpf_hash_table_value_allocation_size(hash_table), EBPF_POOL_TAG_EPOCH);
+    }
+    return hash_table->allocate(_ebpf_hash_table_value_allocation_size(hash_table));
+}
+
+/**
+ * @brief Overwrite the value of an existing entry in place. The caller must hold the lock of the bucket that holds
+ * the entry, which serializes writers. The sequence counter is odd while the value is written, so that
+ * ebpf_hash_table_copy_value can detect and retry a torn copy. Aligned 64 bit words are written with single stores,
+ * so that programs reading the value through the pointer returned by ebpf_hash_table_find never see a torn word.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in, out] data Value storage to overwrite.
+ * @param[in] value Value to write, or NULL to zero the value.
+ */
+static void
+_ebpf_hash_table_write_value(
+    _In_ const ebpf_hash_table_t* hash_table, _Inout_ uint8_t* data, _In_opt_ const uint8_t* value)
+{
+    volatile uint64_t* sequence = _ebpf_hash_table_value_sequence(hash_table, data);
+    size_t word_count = hash_table->value_size / sizeof(uint64_t);
+    size_t offset;
+
+    // Values are allocated on an 8 byte boundary.
+    ebpf_assert(((uintptr_t)data % sizeof(uint64_t)) == 0);
+
+    // The full barriers order the counter updates with the stores to the value.
+    ebpf_interlocked_increment_int64((volatile int64_t*)sequence);
+
+    for (offset = 0; offset < word_count * sizeof(uint64_t); offset += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        if (value) {
+            memcpy(&word, value + offset, sizeof(word));
+        }
+        WriteULong64NoFence((volatile uint64_t*)(data + offset), word);
+    }
+    for (; offset < hash_table->value_size; offset++) {
+        ((volatile uint8_t*)data)[offset] = value ? value[offset] : 0;
+    }
+
+    ebpf_interlocked_increment_int64((volatile int64_t*)sequence);
+}
+
+/**
+ * @brief Allocate a bucket, from the bucket pool for its size if the table is preallocated. Larger buckets, and
+ * buckets whose pool is exhausted, are allocated on demand.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in] entry_count Number of entries in the bucket.
+ * @return Pointer to the zeroed bucket, or NULL on failure.
+ */
+static ebpf_hash_bucket_header_t*
+_ebpf_hash_table_allocate_bucket(_In_ const ebpf_hash_table_t* hash_table, size_t entry_count)
+{
+    if (entry_count <= EBPF_HASH_TABLE_POOLED_BUCKET_SIZES && hash_table->bucket_pools[entry_count - 1]) {
+        return ebpf_epoch_pool_allocate(hash_table->bucket_pools[entry_count - 1]);
+    }
+    return hash_table->allocate(_ebpf_hash_table_bucket_size(hash_table->key_size, entry_count));
+}
+
+/**
+ * @brief Helper function to ensure correct memory ordering when reading the current bucket array of the hash table.
  *
  * @param[in] hash_table Pointer to the hash table.
+ * @return Pointer to the current bucket array.
+ */
+static inline ebpf_hash_table_buckets_t*
+_ebpf_hash_table_get_buckets(_In_ const ebpf_hash_table_t* hash_table)
+{
+    return (ebpf_hash_table_buckets_t*)ReadSizeTAcquire((ULONG_PTR*)&(hash_table->buckets));
+}
+
+/**
+ * @brief Helper function to ensure correct memory ordering when reading the bucket array that a bucket array is
+ * being resized to.
+ *
+ * @param[in] buckets Pointer to the bucket array.
+ * @return Pointer to the next bucket array or NULL if the bucket array is not being resized.
+ */
+static inline ebpf_hash_table_buckets_t*
+_ebpf_hash_table_get_next_buckets(_In_ const ebpf_hash_table_buckets_t* buckets)
+{
+    return (ebpf_hash_table_buckets_t*)ReadSizeTAcquire((ULONG_PTR*)&(buckets->next));
+}
+
+/**
+ * @brief Helper function to ensure correct memory ordering when reading a bucket from a bucket array.
+ *
+ * @param[in] buckets Pointer to the bucket array.
  * @param[in] bucket_index Index of the bucket to read.
- * @return Pointer to the bucket or NULL if the bucket is empty.
+ * @return Pointer to the bucket, EBPF_HASH_BUCKET_MIGRATED if the bucket has been moved to the next bucket array, or
+ * NULL if the bucket is empty.
  */
 static inline ebpf_hash_bucket_header_t*
-_ebpf_hash_table_get_bucket(_In_ const ebpf_hash_table_t* hash_table, size_t bucket_index)
+_ebpf_hash_table_get_bucket(_In_ const ebpf_hash_table_buckets_t* buckets, size_t bucket_index)
 {
-    return (ebpf_hash_bucket_header_t*)ReadSizeTAcquire((ULONG_PTR*)&(hash_table->buckets[bucket_index].header));
+    return (ebpf_hash_bucket_header_t*)ReadSizeTAcquire((ULONG_PTR*)&(buckets->buckets[bucket_index].header));
 }
 
 /**
- * @brief Helper function to ensure correct memory ordering when writing a bucket to the hash table.
+ * @brief Helper function to ensure correct memory ordering when writing a bucket to a bucket array.
  *
- * @param[in] hash_table Pointer to the hash table.
+ * @param[in] buckets Pointer to the bucket array.
  * @param[in] bucket_index Index of the bucket to write.
  * @param[in] bucket Bucket pointer to write.
  */
 static inline void
 _ebpf_hash_table_set_bucket(
-    _In_ ebpf_hash_table_t* hash_table, size_t bucket_index, _In_opt_ ebpf_hash_bucket_header_t* bucket)
+    _Inout_ ebpf_hash_table_buckets_t* buckets, size_t bucket_index, _In_opt_ ebpf_hash_bucket_header_t* bucket)
+{
+    WriteSizeTRelease((ULONG_PTR*)&(buckets->buckets[bucket_index].header), (ULONG_PTR)bucket);
+}
+
+/**
+ * @brief Find the bucket holding the entries with the given hash, following moved buckets to the next bucket array.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] hash Hash of the key.
+ * @return Pointer to the bucket or NULL if the bucket is empty.
+ */
+static inline ebpf_hash_bucket_header_t*
+_ebpf_hash_table_find_bucket(_In_ const ebpf_hash_table_t* hash_table, uint32_t hash)
+{
+    const ebpf_hash_table_buckets_t* buckets = _ebpf_hash_table_get_buckets(hash_table);
+    for (;;) {
+        ebpf_hash_bucket_header_t* bucket = _ebpf_hash_table_get_bucket(buckets, hash & buckets->bucket_count_mask);
+        if (bucket != EBPF_HASH_BUCKET_MIGRATED) {
+            return bucket;
+        }
+        buckets = _ebpf_hash_table_get_next_buckets(buckets);
+    }
+}
+
+/**
+ * @brief Find the entry with the given key in a bucket. Only the keys of entries whose tag matches are compared.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] bucket Bucket to search.
+ * @param[in] key Key to find.
+ * @param[in] tag Tag of the key.
+ * @return Index of the entry, or the count of entries in the bucket if the key is not found.
+ */
+static size_t
+_ebpf_hash_table_bucket_find_entry(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_ const ebpf_hash_bucket_header_t* bucket,
+    _In_ const uint8_t* key,
+    uint8_t tag)
+{
+    size_t count = bucket->count;
+    const uint8_t* tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, bucket, count);
+
+    for (size_t block = 0; block < count; block += EBPF_HASH_TABLE_TAG_BLOCK_SIZE) {
+        uint32_t matches = _ebpf_hash_table_match_tags(tags + block, tag);
+        // Ignore the padding after the last tag.
+        if (count - block < EBPF_HASH_TABLE_TAG_BLOCK_SIZE) {
+            matches &= (1u << (count - block)) - 1;
+        }
+        while (matches) {
+            unsigned long bit;
+            _BitScanForward(&bit, matches);
+            size_t index = block + bit;
+            ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, index);
+            if (_ebpf_hash_table_compare(hash_table, key, entry->key) == 0) {
+                return index;
+            }
+            matches &= matches - 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Function called for each entry visited by _ebpf_hash_table_visit_bucket.
+ *
+ * @param[in, out] context Context passed to _ebpf_hash_table_visit_bucket.
+ * @param[in] entry Entry being visited.
+ * @retval true Continue visiting entries.
+ * @retval false Stop visiting entries.
+ */
+typedef bool (*ebpf_hash_table_entry_visitor_t)(_Inout_ void* context, _In_ ebpf_hash_bucket_entry_t* entry);
+
+/**
+ * @brief Visit the entries of the hash table whose hash matches a bucket of a bucket array. If the bucket has been
+ * moved to the next bucket array, the buckets it was moved to are visited instead, skipping entries that came from
+ * other buckets when the table shrank.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] buckets Bucket array to visit.
+ * @param[in] bucket_index Index of the bucket to visit.
+ * @param[in] hash_mask Bucket count mask of the bucket array the walk started in.
+ * @param[in] hash_index Index of the bucket the walk started in.
+ * @param[in] visitor Function to call for each entry.
+ * @param[in, out] context Context to pass to the visitor.
+ * @retval true All entries were visited.
+ * @retval false The visitor stopped the walk.
+ */
+static bool
+_ebpf_hash_table_visit_bucket(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_ const ebpf_hash_table_buckets_t* buckets,
+    size_t bucket_index,
+    size_t hash_mask,
+    size_t hash_index,
+    _In_ ebpf_hash_table_entry_visitor_t visitor,
+    _Inout_ void* context)
+{
+    const ebpf_hash_bucket_header_t* bucket = _ebpf_hash_table_get_bucket(buckets, bucket_index);
+    if (bucket == NULL) {
+        return true;
+    }
+
+    if (bucket != EBPF_HASH_BUCKET_MIGRATED) {
+        // In a bucket array at least as large as the one the walk started in, all entries of a bucket match the same
+        // bucket there. In a smaller one, a bucket also holds the entries of the buckets it was merged with.
+        bool filter = buckets->bucket_count_mask < hash_mask;
+        if (!filter && (bucket_index & hash_mask) != hash_index) {
+            return true;
+        }
+        for (size_t index = 0; index < bucket->count; index++) {
+            ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, index);
+            if (filter && (_ebpf_hash_table_compute_hash(hash_table, entry->key) & hash_mask) != hash_index) {
+                continue;
+            }
+            if (!visitor(context, entry)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const ebpf_hash_table_buckets_t* next = _ebpf_hash_table_get_next_buckets(buckets);
+    if (next->bucket_count > buckets->bucket_count) {
+        // The bucket was split between the two buckets of the next bucket array that share its low-order bits.
+        return _ebpf_hash_table_visit_bucket(
+                   hash_table, next, bucket_index, hash_mask, hash_index, visitor, context) &&
+               _ebpf_hash_table_visit_bucket(
+                   hash_table,
+                   next,
+                   bucket_index + buckets->bucket_count,
+                   hash_mask,
+                   hash_index,
+                   visitor,
+                   context);
+    } else {
+        // The bucket was merged with its sibling in one bucket of the next bucket array.
+        return _ebpf_hash_table_visit_bucket(
+            hash_table, next, bucket_index & next->bucket_count_mask, hash_mask, hash_index, visitor, context);
+    }
+}
+
+/**
+ * @brief Visit the entries of the hash table whose hash matches a bucket of the given bucket array.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] buckets Bucket array the walk starts in.
+ * @param[in] bucket_index Index of the bucket to visit.
+ * @param[in] visitor Function to call for each entry.
+ * @param[in, out] context Context to pass to the visitor.
+ * @retval true All entries were visited.
+ * @retval false The visitor stopped the walk.
+ */
+static inline bool
+_ebpf_hash_table_visit_entries(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_ const ebpf_hash_table_buckets_t* buckets,
+    size_t bucket_index,
+    _In_ ebpf_hash_table_entry_visitor_t visitor,
+    _Inout_ void* context)
 {
-    WriteSizeTRelease((ULONG_PTR*)&(hash_table->buckets[bucket_index].header), (ULONG_PTR)bucket);
+    return _ebpf_hash_table_visit_bucket(
+        hash_table, buckets, bucket_index, buckets->bucket_count_mask, bucket_index, visitor, context);
 }
 
 /**
@@ -380,6 +860,7 @@ _ebpf_hash_table_set_bucket(
  * @param[in] hash_table The hash table.
  * @param[in] old_bucket The immutable bucket to copy.
  * @param[in] key The key to insert.
+ * @param[in] tag The tag of the key.
  * @param[in, out] data The copy of the value to insert. On success the new_bucket owns this memory.
  * @param[out] new_bucket The new bucket with the entry inserted. On success the caller owns this memory.
  * @retval EBPF_SUCCESS The operation was successful.
@@ -390,46 +871,49 @@ _ebpf_hash_table_bucket_insert(
     _Inout_ ebpf_hash_table_t* hash_table,
     _In_opt_ const ebpf_hash_bucket_header_t* old_bucket,
     _In_ const uint8_t* key,
+    uint8_t tag,
     _Inout_opt_ uint8_t* data,
     _Outptr_ ebpf_hash_bucket_header_t** new_bucket)
 {
     ebpf_result_t result;
-    size_t entry_size = EBPF_OFFSET_OF(ebpf_hash_bucket_entry_t, key) + hash_table->key_size;
-    size_t old_bucket_size = old_bucket ? entry_size * old_bucket->count + sizeof(ebpf_hash_bucket_header_t) : 0;
-    size_t new_bucket_size =
-        entry_size * ((old_bucket ? old_bucket->count : 0) + 1) + sizeof(ebpf_hash_bucket_header_t);
+    size_t old_bucket_count = old_bucket ? old_bucket->count : 0;
+    size_t old_bucket_size =
+        old_bucket ? _ebpf_hash_table_bucket_entries_size(hash_table->key_size, old_bucket_count) : 0;
     ebpf_hash_bucket_header_t* local_new_bucket = NULL;
     ebpf_hash_bucket_header_t* backup_bucket = NULL;
 
-    if (hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT) {
-        size_t new_entry_count = ebpf_interlocked_increment_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
-        if (new_entry_count > hash_table->max_entry_count) {
-            result = EBPF_OUT_OF_SPACE;
-            goto Done;
-        }
+    size_t new_entry_count = ebpf_interlocked_increment_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
+    if (hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT && new_entry_count > hash_table->max_entry_count) {
+        result = EBPF_OUT_OF_SPACE;
+        goto Done;
     }
 
     // Allocate new bucket.
-    local_new_bucket = hash_table->allocate(new_bucket_size);
+    local_new_bucket = _ebpf_hash_table_allocate_bucket(hash_table, old_bucket_count + 1);
     if (!local_new_bucket) {
         result = EBPF_NO_MEMORY;
         goto Done;
     }
 
     // Allocate a new backup bucket.
-    if (old_bucket_size) {
-        backup_bucket = hash_table->allocate(old_bucket_size);
+    if (old_bucket_count) {
+        backup_bucket = _ebpf_hash_table_allocate_bucket(hash_table, old_bucket_count);
         if (!backup_bucket) {
             result = EBPF_NO_MEMORY;
             goto Done;
         }
-        backup_bucket->count = old_bucket->count;
+        backup_bucket->count = old_bucket_count;
     }
 
-    // Copy old bucket into new bucket.
+    // Copy the entries of the old bucket into new bucket. The tags follow the entries, so they move.
     memcpy(local_new_bucket, old_bucket, old_bucket_size);
+    uint8_t* tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, local_new_bucket, old_bucket_count + 1);
+    if (old_bucket) {
+        const uint8_t* old_tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, old_bucket, old_bucket_count);
+        memcpy(tags, old_tags, old_bucket_count);
+    }
 
-    // Append new key, data, and backup bucket.
+    // Append new key, tag, data, and backup bucket.
     ebpf_hash_bucket_entry_t* entry =
         _ebpf_hash_table_bucket_entry(hash_table->key_size, local_new_bucket, local_new_bucket->count);
 
@@ -437,6 +921,7 @@ _ebpf_hash_table_bucket_insert(
     backup_bucket = NULL;
     entry->data = data;
     memcpy(entry->key, key, hash_table->key_size);
+    tags[old_bucket_count] = tag;
     local_new_bucket->count++;
 
     *new_bucket = local_new_bucket;
@@ -448,10 +933,8 @@ Done:
     hash_table->free(local_new_bucket);
     hash_table->free(backup_bucket);
 
-    if (hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT) {
-        if (result != EBPF_SUCCESS) {
-            ebpf_interlocked_decrement_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
-        }
+    if (result != EBPF_SUCCESS) {
+        ebpf_interlocked_decrement_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
     }
 
     return result;
@@ -487,10 +970,13 @@ _ebpf_hash_table_bucket_delete(
     }
     ebpf_assert(backup_bucket->count == old_bucket->count - 1);
 
+    const uint8_t* old_tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, old_bucket, old_bucket->count);
+    uint8_t* new_tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, backup_bucket, old_bucket->count - 1);
+
     // Reset bucket entry count.
     backup_bucket->count = 0;
 
-    // Copy key and value from each entry into the backup bucket.
+    // Copy key, tag, and value from each entry into the backup bucket.
     for (size_t index = 0; index < old_bucket->count; index++) {
         if (index == key_index) {
             continue;
@@ -502,6 +988,7 @@ _ebpf_hash_table_bucket_delete(
 
         new_entry->data = old_entry->data;
         memcpy(new_entry->key, old_entry->key, hash_table->key_size);
+        new_tags[backup_bucket->count] = old_tags[index];
         backup_bucket->count++;
     }
 
@@ -519,9 +1006,7 @@ _ebpf_hash_table_bucket_delete(
     *new_bucket = backup_bucket;
 
 Done:
-    if (hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT) {
-        ebpf_interlocked_decrement_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
-    }
+    ebpf_interlocked_decrement_int64_no_fence((volatile int64_t*)&hash_table->entry_count);
 
     return;
 }
@@ -549,18 +1034,17 @@ _ebpf_hash_table_bucket_update(
     _Outptr_ ebpf_hash_bucket_header_t** new_bucket)
 {
     ebpf_result_t result;
-    size_t entry_size = EBPF_OFFSET_OF(ebpf_hash_bucket_entry_t, key) + hash_table->key_size;
-    size_t old_bucket_size = entry_size * old_bucket->count + sizeof(ebpf_hash_bucket_header_t);
+    size_t old_bucket_size = _ebpf_hash_table_bucket_size(hash_table->key_size, old_bucket->count);
     ebpf_hash_bucket_header_t* local_new_bucket = NULL;
 
     // Allocate new bucket.
-    local_new_bucket = hash_table->allocate(old_bucket_size);
+    local_new_bucket = _ebpf_hash_table_allocate_bucket(hash_table, old_bucket->count);
     if (!local_new_bucket) {
         result = EBPF_NO_MEMORY;
         goto Done;
     }
 
-    // Copy old bucket into new bucket.
+    // Copy old bucket, including its tags, into new bucket.
     memcpy(local_new_bucket, old_bucket, old_bucket_size);
 
     ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, local_new_bucket, key_index);
@@ -577,74 +1061,412 @@ Done:
 }
 
 /**
- * @brief Perform an atomic replacement of a bucket in the hash table.
- * Operations include insert, update and delete of elements.
+ * @brief Free a bucket that is no longer in the hash table, along with the backup buckets of its entries. The values
+ * are not freed.
  *
- * @param[in] hash_table Hash table to update.
- * @param[in] key Key to operate on.
- * @param[in] value Value to be inserted or NULL.
- * @param[in] operation Operation to perform.
- * @retval EBPF_SUCCESS The operation succeeded.
- * @retval EBPF_KEY_NOT_FOUND The specified key is not present in the bucket.
- * @retval EBPF_NO_MEMORY Insufficient memory to construct new bucket or value.
- * @retval EBPF_OUT_OF_SPACE Maximum number of entries reached.
+ * @param[in] hash_table Hash table.
+ * @param[in] bucket Bucket to free.
+ */
+static void
+_ebpf_hash_table_bucket_free(
+    _Inout_ ebpf_hash_table_t* hash_table, _In_opt_ _Frees_ptr_opt_ ebpf_hash_bucket_header_t* bucket)
+{
+    if (!bucket) {
+        return;
+    }
+    for (size_t index = 0; index < bucket->count; index++) {
+        hash_table->free(_ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, index)->backup_bucket);
+    }
+    hash_table->free(bucket);
+}
+
+/**
+ * @brief Build the bucket of the next bucket array that receives the entries of the given buckets whose hash
+ * matches it. Entries keep their relative order, and the values are shared with the old buckets.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in] old_buckets Buckets to take the entries from.
+ * @param[in] old_bucket_count Number of buckets to take the entries from.
+ * @param[in] next Bucket array the new bucket is built for.
+ * @param[in] bucket_index Index of the new bucket in the next bucket array.
+ * @param[out] new_bucket The new bucket, or NULL if no entry matches it. On success the caller owns this memory.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
  */
 static ebpf_result_t
-_ebpf_hash_table_replace_bucket(
+_ebpf_hash_table_bucket_build(
     _Inout_ ebpf_hash_table_t* hash_table,
-    _In_ const uint8_t* key,
-    _In_opt_ const uint8_t* value,
-    ebpf_hash_bucket_operation_t operation)
+    _In_reads_(old_bucket_count) ebpf_hash_bucket_header_t* const* old_buckets,
+    size_t old_bucket_count,
+    _In_ const ebpf_hash_table_buckets_t* next,
+    size_t bucket_index,
+    _Outptr_result_maybenull_ ebpf_hash_bucket_header_t** new_bucket)
 {
-    ebpf_result_t result = EBPF_SUCCESS;
-    size_t index;
-    uint32_t bucket_index;
-    uint8_t* old_data = NULL;
-    uint8_t* new_data = NULL;
-    ebpf_hash_bucket_header_t* old_bucket = NULL;
-    ebpf_hash_bucket_header_t* new_bucket = NULL;
-
-    bucket_index = _ebpf_hash_table_compute_bucket_index(hash_table, key);
+    size_t new_bucket_count = 0;
+    ebpf_hash_bucket_header_t* local_new_bucket = NULL;
 
-    // Lock the bucket.
-    ebpf_lock_state_t state = ebpf_lock_lock(&hash_table->buckets[bucket_index].lock);
+    *new_bucket = NULL;
 
-    // Make a copy of the value to insert.
-    if (operation != EBPF_HASH_BUCKET_OPERATION_DELETE) {
-        new_data = hash_table->allocate(hash_table->value_size + hash_table->supplemental_value_size);
-        if (!new_data) {
-            result = EBPF_NO_MEMORY;
-            goto Done;
-        }
-        // If the value is NULL, then the caller wants to insert a zeroed value.
-        if (value) {
-            memcpy(new_data, value, hash_table->value_size);
-        } else {
-            memset(new_data, 0, hash_table->value_size + hash_table->supplemental_value_size);
-        }
-        if (hash_table->notification_callback) {
-            hash_table->notification_callback(
-                hash_table->notification_context, EBPF_HASH_TABLE_NOTIFICATION_TYPE_ALLOCATE, key, new_data);
+    for (size_t bucket = 0; bucket < old_bucket_count; bucket++) {
+        for (size_t index = 0; old_buckets[bucket] && index < old_buckets[bucket]->count; index++) {
+            ebpf_hash_bucket_entry_t* entry =
+                _ebpf_hash_table_bucket_entry(hash_table->key_size, old_buckets[bucket], index);
+            if ((_ebpf_hash_table_compute_hash(hash_table, entry->key) & next->bucket_count_mask) == bucket_index) {
+                new_bucket_count++;
+            }
         }
     }
+    if (new_bucket_count == 0) {
+        return EBPF_SUCCESS;
+    }
 
-    // Find the old bucket.
-    old_bucket = _ebpf_hash_table_get_bucket(hash_table, bucket_index);
-    size_t old_bucket_count = old_bucket ? old_bucket->count : 0;
+    local_new_bucket = _ebpf_hash_table_allocate_bucket(hash_table, new_bucket_count);
+    if (!local_new_bucket) {
+        return EBPF_NO_MEMORY;
+    }
+    local_new_bucket->count = 0;
+    uint8_t* new_tags = _ebpf_hash_table_bucket_tags(hash_table->key_size, local_new_bucket, new_bucket_count);
+
+    for (size_t bucket = 0; bucket < old_bucket_count; bucket++) {
+        for (size_t index = 0; old_buckets[bucket] && index < old_buckets[bucket]->count; index++) {
+            ebpf_hash_bucket_entry_t* old_entry =
+                _ebpf_hash_table_bucket_entry(hash_table->key_size, old_buckets[bucket], index);
+            uint32_t hash = _ebpf_hash_table_compute_hash(hash_table, old_entry->key);
+            if ((hash & next->bucket_count_mask) != bucket_index) {
+                continue;
+            }
 
-    // Find the entry in the bucket, if any.
+            ebpf_hash_bucket_entry_t* new_entry =
+                _ebpf_hash_table_bucket_entry(hash_table->key_size, local_new_bucket, local_new_bucket->count);
+            new_entry->backup_bucket = NULL;
+            // Bucket at index N > 0 needs a backup bucket of size N - 1, as built by _ebpf_hash_table_bucket_insert.
+            if (local_new_bucket->count > 0) {
+                new_entry->backup_bucket = _ebpf_hash_table_allocate_bucket(hash_table, local_new_bucket->count);
+                if (!new_entry->backup_bucket) {
+                    _ebpf_hash_table_bucket_free(hash_table, local_new_bucket);
+                    return EBPF_NO_MEMORY;
+                }
+                new_entry->backup_bucket->count = local_new_bucket->count;
+            }
+            new_entry->data = old_entry->data;
+            memcpy(new_entry->key, old_entry->key, hash_table->key_size);
+            new_tags[local_new_bucket->count] = _ebpf_hash_table_tag(hash);
+            local_new_bucket->count++;
+        }
+    }
+
+    *new_bucket = local_new_bucket;
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Allocate an empty bucket array.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in] bucket_count Number of buckets, must be a power of 2.
+ * @param[out] buckets The new bucket array. On success the caller owns this memory.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+ */
+static ebpf_result_t
+_ebpf_hash_table_allocate_buckets(
+    _In_ const ebpf_hash_table_t* hash_table, size_t bucket_count, _Outptr_ ebpf_hash_table_buckets_t** buckets)
+{
+    ebpf_result_t result;
+    size_t buckets_size;
+    unsigned long bucket_count_log2;
+
+    result = ebpf_safe_size_t_multiply(sizeof(ebpf_hash_bucket_header_and_lock_t), bucket_count, &buckets_size);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+    result = ebpf_safe_size_t_add(buckets_size, EBPF_OFFSET_OF(ebpf_hash_table_buckets_t, buckets), &buckets_size);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    ebpf_hash_table_buckets_t* local_buckets = hash_table->allocate(buckets_size);
+    if (!local_buckets) {
+        return EBPF_NO_MEMORY;
+    }
+
+    _BitScanReverse64(&bucket_count_log2, bucket_count);
+    local_buckets->bucket_count = bucket_count;
+    local_buckets->bucket_count_mask = bucket_count - 1;
+    local_buckets->bucket_count_log2 = bucket_count_log2;
+    local_buckets->next = NULL;
+    local_buckets->migration_index = 0;
+
+    *buckets = local_buckets;
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Move the entries of one bucket to the next bucket array when growing, or of two sibling buckets when
+ * shrinking. The moved buckets are replaced by EBPF_HASH_BUCKET_MIGRATED.
+ *
+ * @param[in, out] hash_table Hash table.
+ * @param[in, out] buckets Bucket array being resized.
+ * @param[in] migration_index Index of the bucket to move, or of the lower sibling when shrinking.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation, nothing was moved.
+ */
+static ebpf_result_t
+_ebpf_hash_table_migrate_bucket(
+    _Inout_ ebpf_hash_table_t* hash_table, _Inout_ ebpf_hash_table_buckets_t* buckets, size_t migration_index)
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    ebpf_hash_table_buckets_t* next = buckets->next;
+    bool grow = next->bucket_count > buckets->bucket_count;
+    size_t old_bucket_count = grow ? 1 : 2;
+    size_t new_bucket_count = grow ? 2 : 1;
+    size_t old_bucket_index[2] = {migration_index, migration_index + next->bucket_count};
+    size_t new_bucket_index[2] = {migration_index, migration_index + buckets->bucket_count};
+    ebpf_hash_bucket_header_t* old_buckets[2] = {NULL, NULL};
+    ebpf_hash_bucket_header_t* new_buckets[2] = {NULL, NULL};
+    ebpf_lock_state_t state[2] = {0};
+    size_t index;
+
+    // Lock the old buckets in index order. Updates hold a single bucket lock at a time, and do not use the new
+    // buckets until the old ones are marked as moved, so the new buckets need no lock.
+    for (index = 0; index < old_bucket_count; index++) {
+        state[index] = ebpf_lock_lock(&buckets->buckets[old_bucket_index[index]].lock);
+        old_buckets[index] = _ebpf_hash_table_get_bucket(buckets, old_bucket_index[index]);
+        ebpf_assert(old_buckets[index] != EBPF_HASH_BUCKET_MIGRATED);
+    }
+
+    for (index = 0; index < new_bucket_count; index++) {
+        ebpf_assert(_ebpf_hash_table_get_bucket(next, new_bucket_index[index]) == NULL);
+        result = _ebpf_hash_table_bucket_build(
+            hash_table, old_buckets, old_bucket_count, next, new_bucket_index[index], &new_buckets[index]);
+        if (result != EBPF_SUCCESS) {
+            goto Done;
+        }
+    }
+
+    // Publish the new buckets before sending lookups to them.
+    for (index = 0; index < new_bucket_count; index++) {
+        _ebpf_hash_table_set_bucket(next, new_bucket_index[index], new_buckets[index]);
+        new_buckets[index] = NULL;
+    }
     for (index = 0; index < old_bucket_count; index++) {
-        ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, old_bucket, index);
-        if (_ebpf_hash_table_compare(hash_table, key, entry->key) == 0) {
-            old_data = entry->data;
+        _ebpf_hash_table_set_bucket(buckets, old_bucket_index[index], EBPF_HASH_BUCKET_MIGRATED);
+    }
+
+Done:
+    for (index = old_bucket_count; index > 0; index--) {
+        ebpf_lock_unlock(&buckets->buckets[old_bucket_index[index - 1]].lock, state[index - 1]);
+    }
+
+    for (index = 0; index < new_bucket_count; index++) {
+        _ebpf_hash_table_bucket_free(hash_table, new_buckets[index]);
+    }
+    // The values now belong to the new buckets, so only the old buckets are freed.
+    if (result == EBPF_SUCCESS) {
+        for (index = 0; index < old_bucket_count; index++) {
+            _ebpf_hash_table_bucket_free(hash_table, old_buckets[index]);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Get the bucket count the load factor of the hash table calls for.
+ *
+ * @param[in] hash_table Hash table.
+ * @param[in] buckets Current bucket array of the hash table.
+ * @return The bucket count to resize to, or 0 if the bucket array should keep its size.
+ */
+static size_t
+_ebpf_hash_table_next_bucket_count(
+    _In_ const ebpf_hash_table_t* hash_table, _In_ const ebpf_hash_table_buckets_t* buckets)
+{
+    size_t entry_count = hash_table->entry_count;
+    if (entry_count > buckets->bucket_count * EBPF_HASH_TABLE_GROW_LOAD_FACTOR &&
+        buckets->bucket_count < hash_table->maximum_bucket_count) {
+        return buckets->bucket_count * 2;
+    } else if (
+        entry_count < buckets->bucket_count / EBPF_HASH_TABLE_SHRINK_LOAD_DIVISOR &&
+        buckets->bucket_count > hash_table->minimum_bucket_count) {
+        return buckets->bucket_count / 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Start resizing the hash table if its load factor calls for it, or move a bounded number of buckets if a
+ * resize is in progress. Called after each update, so the cost of a resize is spread across updates. Lookups are not
+ * blocked while resizing.
+ *
+ * @param[in, out] hash_table Hash table.
+ */
+static void
+_ebpf_hash_table_resize(_Inout_ ebpf_hash_table_t* hash_table)
+{
+    if (hash_table->minimum_bucket_count == hash_table->maximum_bucket_count) {
+        return;
+    }
+
+    // Check with plain reads first, so that updates only write the shared flag when there is resize work to do.
+    ebpf_hash_table_buckets_t* buckets = hash_table->buckets;
+    if (hash_table->resize_active ||
+        (buckets->next == NULL && _ebpf_hash_table_next_bucket_count(hash_table, buckets) == 0)) {
+        return;
+    }
+
+    // Only one thread resizes the hash table at a time, other updates do not wait for it.
+    if (ebpf_interlocked_compare_exchange_int32(&hash_table->resize_active, 1, 0) != 0) {
+        return;
+    }
+
+    // Another thread may have resized the hash table since the check.
+    buckets = hash_table->buckets;
+    ebpf_hash_table_buckets_t* next = buckets->next;
+    if (next == NULL) {
+        size_t next_bucket_count = _ebpf_hash_table_next_bucket_count(hash_table, buckets);
+
+        // If the allocation fails, the table keeps its size and the resize is attempted again on a later update.
+        if (next_bucket_count != 0 &&
+            _ebpf_hash_table_allocate_buckets(hash_table, next_bucket_count, &next) == EBPF_SUCCESS) {
+            WriteSizeTRelease((ULONG_PTR*)&(buckets->next), (ULONG_PTR)next);
+            hash_table->generation++;
+        }
+    } else {
+        // Growing moves each bucket, shrinking moves each pair of sibling buckets.
+        size_t migration_count = min(buckets->bucket_count, next->bucket_count);
+        for (size_t count = 0;
+             count < EBPF_HASH_TABLE_MIGRATION_BUCKETS_PER_UPDATE && buckets->migration_index < migration_count;
+             count++) {
+            if (_ebpf_hash_table_migrate_bucket(hash_table, buckets, buckets->migration_index) != EBPF_SUCCESS) {
+                break;
+            }
+            buckets->migration_index++;
+        }
+
+        if (buckets->migration_index == migration_count) {
+            // All entries are in the next bucket array. Lookups that still use the old bucket array follow the
+            // moved buckets until it is freed.
+            WriteSizeTRelease((ULONG_PTR*)&(hash_table->buckets), (ULONG_PTR)next);
+            hash_table->generation++;
+            hash_table->free(buckets);
+        }
+    }
+
+    ebpf_interlocked_compare_exchange_int32(&hash_table->resize_active, 0, 1);
+}
+
+/**
+ * @brief Perform an atomic replacement of a bucket in the hash table.
+ * Operations include insert, update and delete of elements.
+ *
+ * @param[in] hash_table Hash table to update.
+ * @param[in] key Key to operate on.
+ * @param[in] value Value to be inserted or NULL.
+ * @param[in] operation Operation to perform.
+ * @retval EBPF_SUCCESS The operation succeeded.
+ * @retval EBPF_KEY_NOT_FOUND The specified key is not present in the bucket.
+ * @retval EBPF_NO_MEMORY Insufficient memory to construct new bucket or value.
+ * @retval EBPF_OUT_OF_SPACE Maximum number of entries reached.
+ */
+static ebpf_result_t
+_ebpf_hash_table_replace_bucket(
+    _Inout_ ebpf_hash_table_t* hash_table,
+    _In_ const uint8_t* key,
+    _In_opt_ const uint8_t* value,
+    ebpf_hash_bucket_operation_t operation)
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    size_t index;
+    size_t bucket_index;
+    uint32_t hash;
+    uint8_t tag;
+    uint8_t* old_data = NULL;
+    uint8_t* new_data = NULL;
+    ebpf_hash_bucket_header_t* old_bucket = NULL;
+    ebpf_hash_bucket_header_t* new_bucket = NULL;
+    ebpf_hash_table_buckets_t* buckets;
+    ebpf_lock_state_t state;
+    bool count_lock_contention = hash_table->count_lock_contention && *hash_table->count_lock_contention;
+
+    hash = _ebpf_hash_table_compute_hash(hash_table, key);
+    tag = _ebpf_hash_table_tag(hash);
+    buckets = _ebpf_hash_table_get_buckets(hash_table);
+
+    // Lock the bucket. If it was moved to the next bucket array, lock the bucket it was moved to instead.
+    for (;;) {
+        bucket_index = hash & buckets->bucket_count_mask;
+        // A non-zero lock word means another operation holds the lock, so this acquisition will spin.
+        if (count_lock_contention && *(volatile const ebpf_lock_t*)&buckets->buckets[bucket_index].lock != 0) {
+            ebpf_interlocked_increment_int64(&hash_table->lock_contention_count);
+        }
+        state = ebpf_lock_lock(&buckets->buckets[bucket_index].lock);
+        if (_ebpf_hash_table_get_bucket(buckets, bucket_index) != EBPF_HASH_BUCKET_MIGRATED) {
             break;
         }
+        ebpf_lock_unlock(&buckets->buckets[bucket_index].lock, state);
+        buckets = _ebpf_hash_table_get_next_buckets(buckets);
+    }
+
+    // Find the old bucket.
+    old_bucket = _ebpf_hash_table_get_bucket(buckets, bucket_index);
+    size_t old_bucket_count = old_bucket ? old_bucket->count : 0;
+
+    // Find the entry in the bucket, if any.
+    index = old_bucket ? _ebpf_hash_table_bucket_find_entry(hash_table, old_bucket, key, tag) : 0;
+    if (index != old_bucket_count) {
+        old_data = _ebpf_hash_table_bucket_entry(hash_table->key_size, old_bucket, index)->data;
+    }
+
+    // If the key exists and the hash table updates values in place, overwrite the value instead of replacing the
+    // bucket. Only inserts and deletes replace the bucket.
+    if (hash_table->update_in_place && old_data &&
+        (operation == EBPF_HASH_BUCKET_OPERATION_INSERT_OR_UPDATE ||
+         operation == EBPF_HASH_BUCKET_OPERATION_UPDATE)) {
+        _ebpf_hash_table_write_value(hash_table, old_data, value);
+        if (hash_table->notification_callback) {
+            hash_table->notification_callback(
+                hash_table->notification_context, EBPF_HASH_TABLE_NOTIFICATION_TYPE_USE, key, old_data);
+        }
+        old_data = NULL;
+        old_bucket = NULL;
+        goto Done;
+    }
+
+    // Reject an insert into a full hash table before allocating a value for it. The entry count is checked again
+    // when the entry is inserted, since other buckets can be updated concurrently.
+    if (index == old_bucket_count &&
+        (operation == EBPF_HASH_BUCKET_OPERATION_INSERT_OR_UPDATE || operation == EBPF_HASH_BUCKET_OPERATION_INSERT) &&
+        hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT &&
+        hash_table->entry_count >= hash_table->max_entry_count) {
+        result = EBPF_OUT_OF_SPACE;
+        old_data = NULL;
+        old_bucket = NULL;
+        goto Done;
+    }
+
+    // Make a copy of the value to insert.
+    if (operation != EBPF_HASH_BUCKET_OPERATION_DELETE) {
+        new_data = _ebpf_hash_table_allocate_value(hash_table);
+        if (!new_data) {
+            result = EBPF_NO_MEMORY;
+            goto Done;
+        }
+        // If the value is NULL, then the caller wants to insert a zeroed value.
+        if (value) {
+            memcpy(new_data, value, hash_table->value_size);
+        } else {
+            memset(new_data, 0, hash_table->value_size + hash_table->supplemental_value_size);
+        }
+        if (hash_table->notification_callback) {
+            hash_table->notification_callback(
+                hash_table->notification_context, EBPF_HASH_TABLE_NOTIFICATION_TYPE_ALLOCATE, key, new_data);
+        }
     }
 
     switch (operation) {
     case EBPF_HASH_BUCKET_OPERATION_INSERT_OR_UPDATE:
         if (index == old_bucket_count) {
-            result = _ebpf_hash_table_bucket_insert(hash_table, old_bucket, key, new_data, &new_bucket);
+            result = _ebpf_hash_table_bucket_insert(hash_table, old_bucket, key, tag, new_data, &new_bucket);
         } else {
             result = _ebpf_hash_table_bucket_update(hash_table, old_bucket, index, new_data, &new_bucket);
         }
@@ -653,7 +1475,7 @@ _ebpf_hash_table_replace_bucket(
         if (index != old_bucket_count) {
             result = EBPF_OBJECT_ALREADY_EXISTS;
         } else {
-            result = _ebpf_hash_table_bucket_insert(hash_table, old_bucket, key, new_data, &new_bucket);
+            result = _ebpf_hash_table_bucket_insert(hash_table, old_bucket, key, tag, new_data, &new_bucket);
         }
         break;
     case EBPF_HASH_BUCKET_OPERATION_UPDATE:
@@ -685,12 +1507,12 @@ _ebpf_hash_table_replace_bucket(
 
     // Update the bucket in the hash table.
     // From this point on the new bucket is immutable.
-    _ebpf_hash_table_set_bucket(hash_table, bucket_index, new_bucket);
+    _ebpf_hash_table_set_bucket(buckets, bucket_index, new_bucket);
     new_data = NULL;
     new_bucket = NULL;
 
 Done:
-    ebpf_lock_unlock(&hash_table->buckets[bucket_index].lock, state);
+    ebpf_lock_unlock(&buckets->buckets[bucket_index].lock, state);
 
     if (hash_table->notification_callback) {
         if (new_data) {
@@ -711,39 +1533,143 @@ Done:
     ebpf_assert(new_bucket == NULL);
     // Free the old bucket if any. This occurs if a insert, delete, or update succeeded.
     hash_table->free(old_bucket);
+
+    if (result == EBPF_SUCCESS) {
+        _ebpf_hash_table_resize(hash_table);
+    }
     return result;
 }
 
+/**
+ * @brief Round a bucket count up to the next power of 2.
+ *
+ * @param[in] bucket_count Bucket count to round up.
+ * @return Rounded bucket count.
+ */
+static size_t
+_ebpf_hash_table_round_bucket_count(size_t bucket_count)
+{
+    unsigned long msb_index;
+    _BitScanReverse64(&msb_index, bucket_count);
+
+    if (bucket_count != (1ull << msb_index)) {
+        bucket_count = 1ull << (msb_index + 1ull);
+    }
+    return bucket_count;
+}
+
+/**
+ * @brief Release the preallocated values and buckets of a hash table.
+ *
+ * @param[in, out] hash_table Hash table.
+ */
+static void
+_ebpf_hash_table_destroy_pools(_Inout_ ebpf_hash_table_t* hash_table)
+{
+    ebpf_epoch_pool_destroy(hash_table->value_pool);
+    hash_table->value_pool = NULL;
+    for (size_t index = 0; index < EBPF_HASH_TABLE_POOLED_BUCKET_SIZES; index++) {
+        ebpf_epoch_pool_destroy(hash_table->bucket_pools[index]);
+        hash_table->bucket_pools[index] = NULL;
+    }
+}
+
+/**
+ * @brief Preallocate the values and buckets of a hash table. Buckets of more entries are less common, so each bucket
+ * size gets half as many buckets as the next smaller one.
+ *
+ * Replaced values and buckets only return to their pools once the epoch ends, so each pool holds twice what
+ * entry_count entries need. A full hash table can then have every entry replaced within one epoch without falling
+ * back to the memory pool.
+ *
+ * @param[in, out] hash_table Hash table.
+ * @param[in] entry_count Number of entries to preallocate for.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_NO_MEMORY Unable to allocate resources for this operation.
+ */
+static ebpf_result_t
+_ebpf_hash_table_create_pools(_Inout_ ebpf_hash_table_t* hash_table, size_t entry_count)
+{
+    ebpf_result_t result;
+    size_t value_size = _ebpf_hash_table_value_allocation_size(hash_table);
+
+    result = ebpf_safe_size_t_multiply(entry_count, 2, &entry_count);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    if (value_size) {
+        if (hash_table->cache_aligned_values) {
+            result = ebpf_epoch_pool_create_cache_aligned(
+                &hash_table->value_pool, value_size, entry_count, EBPF_POOL_TAG_MAP);
+        } else {
+            result = ebpf_epoch_pool_create(&hash_table->value_pool, value_size, entry_count, EBPF_POOL_TAG_MAP);
+        }
+        if (result != EBPF_SUCCESS) {
+            return result;
+        }
+    }
+
+    for (size_t index = 0; index < EBPF_HASH_TABLE_POOLED_BUCKET_SIZES && (entry_count >> index); index++) {
+        result = ebpf_epoch_pool_create(
+            &hash_table->bucket_pools[index],
+            _ebpf_hash_table_bucket_size(hash_table->key_size, index + 1),
+            entry_count >> index,
+            EBPF_POOL_TAG_MAP);
+        if (result != EBPF_SUCCESS) {
+            return result;
+        }
+    }
+
+    return EBPF_SUCCESS;
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_hash_table_create(_Out_ ebpf_hash_table_t** hash_table, _In_ const ebpf_hash_table_creation_options_t* options)
 {
     ebpf_result_t retval;
     ebpf_hash_table_t* table = NULL;
-    size_t table_size = 0;
+    ebpf_hash_table_buckets_t* buckets = NULL;
     // Select default values for the hash table.
-    size_t bucket_count =
+    size_t minimum_bucket_count =
         options->minimum_bucket_count ? options->minimum_bucket_count : EBPF_HASH_TABLE_DEFAULT_BUCKET_COUNT;
+    size_t maximum_bucket_count = options->maximum_bucket_count;
     void* (*allocate)(size_t size) = options->allocate ? options->allocate : ebpf_epoch_allocate;
     void (*free)(void* memory) = options->free ? options->free : ebpf_epoch_free;
 
-    // Increase bucket_count to next power of 2.
-    unsigned long msb_index;
-    _BitScanReverse64(&msb_index, bucket_count);
-
-    if (bucket_count != (1ull << msb_index)) {
-        bucket_count = 1ull << (msb_index + 1ull);
+    // Bucket indices are taken from a 32 bit hash.
+    if (minimum_bucket_count > EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT ||
+        maximum_bucket_count > EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT) {
+        retval = EBPF_INVALID_ARGUMENT;
+        goto Done;
     }
 
-    retval = ebpf_safe_size_t_multiply(sizeof(ebpf_hash_bucket_header_and_lock_t), bucket_count, &table_size);
-    if (retval != EBPF_SUCCESS) {
+    // Cache aligned values can only be freed with ebpf_epoch_free.
+    if (options->cache_aligned_values && (options->allocate || options->free)) {
+        retval = EBPF_INVALID_ARGUMENT;
         goto Done;
     }
-    retval = ebpf_safe_size_t_add(table_size, EBPF_OFFSET_OF(ebpf_hash_table_t, buckets), &table_size);
-    if (retval != EBPF_SUCCESS) {
-        goto Done;
+
+    if (options->preallocated_entry_count) {
+        // Preallocated values and buckets are returned to their pools by ebpf_epoch_free.
+        if (options->allocate || options->free) {
+            retval = EBPF_INVALID_ARGUMENT;
+            goto Done;
+        }
+        // Resizing would allocate bucket arrays on the update path.
+        maximum_bucket_count = minimum_bucket_count;
+    }
+
+    // Increase the bucket counts to the next power of 2. The hash table is not resized if the maximum is not above
+    // the minimum.
+    minimum_bucket_count = _ebpf_hash_table_round_bucket_count(minimum_bucket_count);
+    if (maximum_bucket_count < minimum_bucket_count) {
+        maximum_bucket_count = minimum_bucket_count;
+    } else {
+        maximum_bucket_count = _ebpf_hash_table_round_bucket_count(maximum_bucket_count);
     }
 
-    table = allocate(table_size);
+    table = allocate(sizeof(ebpf_hash_table_t));
     if (table == NULL) {
         retval = EBPF_NO_MEMORY;
         goto Done;
@@ -753,25 +1679,43 @@ ebpf_hash_table_create(_Out_ ebpf_hash_table_t** hash_table, _In_ const ebpf_has
     table->value_size = options->value_size;
     table->allocate = allocate;
     table->free = free;
-    table->bucket_count = bucket_count;
-    table->bucket_count_mask = bucket_count - 1;
+    table->minimum_bucket_count = minimum_bucket_count;
+    table->maximum_bucket_count = maximum_bucket_count;
+    table->resize_active = 0;
+    table->generation = 0;
     table->entry_count = 0;
     table->seed = ebpf_random_uint32();
     table->extract = options->extract_function;
-#if defined(NDEBUG)
     table->max_entry_count = options->max_entries;
-#else
-    // If debug mode, treat EBPF_HASH_TABLE_NO_LIMIT as -1 to ensure that entries are counted.
-    table->max_entry_count = options->max_entries == EBPF_HASH_TABLE_NO_LIMIT ? -1 : options->max_entries;
-#endif
 
     table->supplemental_value_size = options->supplemental_value_size;
+    table->update_in_place = options->update_in_place;
+    table->cache_aligned_values = options->cache_aligned_values;
     table->notification_context = options->notification_context;
     table->notification_callback = options->notification_callback;
+    table->count_lock_contention = options->count_lock_contention;
+
+    if (options->preallocated_entry_count) {
+        retval = _ebpf_hash_table_create_pools(table, options->preallocated_entry_count);
+        if (retval != EBPF_SUCCESS) {
+            goto Done;
+        }
+    }
+
+    retval = _ebpf_hash_table_allocate_buckets(table, minimum_bucket_count, &buckets);
+    if (retval != EBPF_SUCCESS) {
+        goto Done;
+    }
+    table->buckets = buckets;
 
     *hash_table = table;
+    table = NULL;
     retval = EBPF_SUCCESS;
 Done:
+    if (table) {
+        _ebpf_hash_table_destroy_pools(table);
+        free(table);
+    }
     return retval;
 }
 
@@ -783,20 +1727,29 @@ ebpf_hash_table_destroy(_In_opt_ _Post_ptr_invalid_ ebpf_hash_table_t* hash_tabl
         return;
     }
 
-    for (index = 0; index < hash_table->bucket_count; index++) {
-        ebpf_hash_bucket_header_t* bucket = (ebpf_hash_bucket_header_t*)hash_table->buckets[index].header;
-        if (bucket) {
-            size_t inner_index;
-            for (inner_index = 0; inner_index < bucket->count; inner_index++) {
-                ebpf_hash_bucket_entry_t* entry =
-                    _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, inner_index);
-                hash_table->free(entry->data);
-                hash_table->free(entry->backup_bucket);
+    // If a resize is in progress, the entries are split between the current bucket array and the next one.
+    ebpf_hash_table_buckets_t* buckets = hash_table->buckets;
+    while (buckets) {
+        ebpf_hash_table_buckets_t* next = buckets->next;
+        for (index = 0; index < buckets->bucket_count; index++) {
+            ebpf_hash_bucket_header_t* bucket = (ebpf_hash_bucket_header_t*)buckets->buckets[index].header;
+            if (bucket && bucket != EBPF_HASH_BUCKET_MIGRATED) {
+                size_t inner_index;
+                for (inner_index = 0; inner_index < bucket->count; inner_index++) {
+                    ebpf_hash_bucket_entry_t* entry =
+                        _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, inner_index);
+                    hash_table->free(entry->data);
+                    hash_table->free(entry->backup_bucket);
+                }
+                hash_table->free(bucket);
+                buckets->buckets[index].header = NULL;
             }
-            hash_table->free(bucket);
-            hash_table->buckets[index].header = NULL;
         }
+        hash_table->free(buckets);
+        buckets = next;
     }
+    // Values and buckets freed above return to the pools, which are freed once the last of them has returned.
+    _ebpf_hash_table_destroy_pools(hash_table);
     hash_table->free(hash_table);
 }
 
@@ -804,8 +1757,8 @@ _Must_inspect_result_ ebpf_result_t
 ebpf_hash_table_find(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* key, _Outptr_ uint8_t** value)
 {
     ebpf_result_t retval;
-    uint32_t bucket_index;
     uint8_t* data = NULL;
+    uint32_t hash;
     size_t index;
     ebpf_hash_bucket_header_t* bucket;
 
@@ -814,19 +1767,16 @@ ebpf_hash_table_find(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_
         goto Done;
     }
 
-    bucket_index = _ebpf_hash_table_compute_bucket_index(hash_table, key);
-    bucket = _ebpf_hash_table_get_bucket(hash_table, bucket_index);
+    hash = _ebpf_hash_table_compute_hash(hash_table, key);
+    bucket = _ebpf_hash_table_find_bucket(hash_table, hash);
     if (!bucket) {
         retval = EBPF_KEY_NOT_FOUND;
         goto Done;
     }
 
-    for (index = 0; index < bucket->count; index++) {
-        ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, index);
-        if (_ebpf_hash_table_compare(hash_table, key, entry->key) == 0) {
-            data = entry->data;
-            break;
-        }
+    index = _ebpf_hash_table_bucket_find_entry(hash_table, bucket, key, _ebpf_hash_table_tag(hash));
+    if (index != bucket->count) {
+        data = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, index)->data;
     }
 
     if (!data) {
@@ -846,6 +1796,29 @@ Done:
     return retval;
 }
 
+void
+ebpf_hash_table_copy_value(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* value, _Out_ uint8_t* copy)
+{
+    if (!hash_table->update_in_place) {
+        memcpy(copy, value, hash_table->value_size);
+        return;
+    }
+
+    // Retry the copy until no update overlapped with it.
+    volatile uint64_t* sequence = _ebpf_hash_table_value_sequence(hash_table, value);
+    for (;;) {
+        uint64_t start_sequence = ReadULong64Acquire(sequence);
+        if ((start_sequence & 1) == 0) {
+            memcpy(copy, value, hash_table->value_size);
+            MemoryBarrier();
+            if (ReadULong64NoFence(sequence) == start_sequence) {
+                break;
+            }
+        }
+        YieldProcessor();
+    }
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_hash_table_update(
     _Inout_ ebpf_hash_table_t* hash_table,
@@ -897,90 +1870,233 @@ Done:
     return retval;
 }
 
-_Must_inspect_result_ ebpf_result_t
-ebpf_hash_table_next_key_pointer_and_value(
-    _In_ const ebpf_hash_table_t* hash_table,
-    _In_opt_ const uint8_t* previous_key,
-    _Outptr_ uint8_t** next_key_pointer,
-    _Outptr_opt_ uint8_t** value)
+typedef struct _ebpf_hash_table_next_key_context
 {
-    ebpf_result_t result = EBPF_SUCCESS;
-    uint32_t starting_bucket_index;
-    ebpf_hash_bucket_entry_t* next_entry = NULL;
-    size_t bucket_index;
-    size_t data_index;
-    bool found_entry = false;
+    const ebpf_hash_table_t* hash_table;
+    const uint8_t* previous_key;
+    bool found_previous_key;
+    ebpf_hash_bucket_entry_t* next_entry;
+    size_t index; // Count of entries visited in the bucket before the next entry.
+} ebpf_hash_table_next_key_context_t;
+
+static bool
+_ebpf_hash_table_next_key_visitor(_Inout_ void* context, _In_ ebpf_hash_bucket_entry_t* entry)
+{
+    ebpf_hash_table_next_key_context_t* next_key_context = (ebpf_hash_table_next_key_context_t*)context;
 
-    if (!hash_table || !next_key_pointer) {
-        result = EBPF_INVALID_ARGUMENT;
-        goto Done;
+    // Pick the first entry if there is no previous key, otherwise the entry after the previous key.
+    if (!next_key_context->previous_key || next_key_context->found_previous_key) {
+        next_key_context->next_entry = entry;
+        return false;
     }
 
-    starting_bucket_index =
-        (previous_key != NULL) ? _ebpf_hash_table_compute_bucket_index(hash_table, previous_key) : 0;
+    // Is this the previous key?
+    if (_ebpf_hash_table_compare(next_key_context->hash_table, next_key_context->previous_key, entry->key) == 0) {
+        // Yes, record its location.
+        next_key_context->found_previous_key = true;
+    }
+    next_key_context->index++;
+    return true;
+}
 
-    for (bucket_index = starting_bucket_index; bucket_index < hash_table->bucket_count; bucket_index++) {
-        ebpf_hash_bucket_header_t* bucket = _ebpf_hash_table_get_bucket(hash_table, bucket_index);
-        // Skip empty buckets.
-        if (!bucket) {
-            continue;
-        }
+typedef struct _ebpf_hash_table_cursor_context
+{
+    size_t index;                             // Index of the entry after the previous key.
+    size_t count;                             // Count of entries visited.
+    ebpf_hash_bucket_entry_t* previous_entry; // Entry at index - 1.
+    ebpf_hash_bucket_entry_t* next_entry;     // Entry at index.
+} ebpf_hash_table_cursor_context_t;
+
+static bool
+_ebpf_hash_table_cursor_visitor(_Inout_ void* context, _In_ ebpf_hash_bucket_entry_t* entry)
+{
+    ebpf_hash_table_cursor_context_t* cursor_context = (ebpf_hash_table_cursor_context_t*)context;
+    size_t count = cursor_context->count++;
+
+    if (count + 1 == cursor_context->index) {
+        cursor_context->previous_entry = entry;
+    } else if (count == cursor_context->index) {
+        cursor_context->next_entry = entry;
+        return false;
+    }
+    return true;
+}
 
-        // Pick first entry if no previous key.
-        if (!previous_key) {
-            next_entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, 0);
-            break;
-        }
+/**
+ * @brief Resume a walk of the hash table from a cursor. The cursor is only used if the hash table was not resized
+ * since it was returned and the entry it points at still holds the previous key, otherwise the caller must find the
+ * previous key by its hash.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] buckets Current bucket array.
+ * @param[in] previous_key Key returned with the cursor.
+ * @param[in] cursor Cursor returned with the previous key.
+ * @param[out] context Walk state to resume from.
+ * @param[out] position Position of the bucket holding the previous key.
+ * @retval true The walk was resumed.
+ * @retval false The cursor is stale.
+ */
+static bool
+_ebpf_hash_table_resume_from_cursor(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_ const ebpf_hash_table_buckets_t* buckets,
+    _In_ const uint8_t* previous_key,
+    _In_ const ebpf_hash_table_cursor_internal_t* cursor,
+    _Out_ ebpf_hash_table_next_key_context_t* context,
+    _Out_ size_t* position)
+{
+    ebpf_hash_table_cursor_context_t cursor_context = {cursor->index, 0, NULL, NULL};
+    size_t local_position = (size_t)((uint64_t)cursor->position >> (32 - buckets->bucket_count_log2));
 
-        for (data_index = 0; data_index < bucket->count; data_index++) {
-            ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket, data_index);
-            if (!entry) {
-                result = EBPF_INVALID_ARGUMENT;
-                goto Done;
-            }
-            // Do we have the previous key?
-            if (found_entry) {
-                // Yes, then this is the next key.
-                next_entry = entry;
-                break;
-            }
+    if (cursor->index == 0 || cursor->generation != (uint16_t)hash_table->generation ||
+        local_position >= buckets->bucket_count) {
+        return false;
+    }
+
+    _ebpf_hash_table_visit_entries(
+        hash_table,
+        buckets,
+        _ebpf_hash_table_reverse_bucket_index(buckets, local_position),
+        _ebpf_hash_table_cursor_visitor,
+        &cursor_context);
+    if (!cursor_context.previous_entry ||
+        _ebpf_hash_table_compare(hash_table, previous_key, cursor_context.previous_entry->key) != 0) {
+        return false;
+    }
+
+    context->hash_table = hash_table;
+    context->previous_key = previous_key;
+    context->found_previous_key = true;
+    context->next_entry = cursor_context.next_entry;
+    context->index = cursor->index;
+    *position = local_position;
+    return true;
+}
 
-            // Is this the previous key?
-            if (_ebpf_hash_table_compare(hash_table, previous_key, entry->key) == 0) {
-                // Yes, record its location.
-                found_entry = true;
+/**
+ * @brief Find the entry after the previous key in the walk of the hash table, resuming from a cursor if one is given.
+ *
+ * @param[in] hash_table Pointer to the hash table.
+ * @param[in] previous_key Previous key or NULL to restart.
+ * @param[in, out] cursor Cursor returned with the previous key, or NULL. Updated to point at the returned entry.
+ * @param[out] next_entry Entry after the previous key.
+ * @retval EBPF_SUCCESS The operation was successful.
+ * @retval EBPF_KEY_NOT_FOUND The previous key was not found.
+ * @retval EBPF_NO_MORE_KEYS No more keys exist in the hash table.
+ */
+static ebpf_result_t
+_ebpf_hash_table_next_entry(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_opt_ const uint8_t* previous_key,
+    _Inout_opt_ ebpf_hash_table_cursor_internal_t* cursor,
+    _Outptr_ ebpf_hash_bucket_entry_t** next_entry)
+{
+    const ebpf_hash_table_buckets_t* buckets;
+    size_t position = 0;
+    ebpf_hash_table_next_key_context_t context = {hash_table, previous_key, false, NULL, 0};
+
+    // Buckets are walked in bit-reversed order, so that keys are not skipped if the table is resized between calls.
+    buckets = _ebpf_hash_table_get_buckets(hash_table);
+    if (previous_key != NULL) {
+        if (!cursor || !_ebpf_hash_table_resume_from_cursor(
+                           hash_table, buckets, previous_key, cursor, &context, &position)) {
+            size_t bucket_index =
+                _ebpf_hash_table_compute_hash(hash_table, previous_key) & buckets->bucket_count_mask;
+            _ebpf_hash_table_visit_entries(
+                hash_table, buckets, bucket_index, _ebpf_hash_table_next_key_visitor, &context);
+
+            // If we were given a previous key, and the searched key was not found in the hash table, we return
+            // EBPF_KEY_NOT_FOUND, so that the caller can detect that the key is missing, and return the first key
+            // (as per 'bpf_map_get_next_key' specs).
+            if (!context.found_previous_key) {
+                return EBPF_KEY_NOT_FOUND;
             }
+            position = _ebpf_hash_table_reverse_bucket_index(buckets, bucket_index);
+        }
+        if (!context.next_entry) {
+            position++;
         }
+    }
 
-        if (next_entry) {
+    for (; !context.next_entry && position < buckets->bucket_count; position++) {
+        context.index = 0;
+        _ebpf_hash_table_visit_entries(
+            hash_table,
+            buckets,
+            _ebpf_hash_table_reverse_bucket_index(buckets, position),
+            _ebpf_hash_table_next_key_visitor,
+            &context);
+        if (context.next_entry) {
             break;
         }
     }
 
-    // If we were given a previous key, and the searched key was not found in the hash table, we return
-    // EBPF_KEY_NOT_FOUND, so that the caller can detect that the key is missing, and return the first key (as per
-    // 'bpf_map_get_next_key' specs).
-    if (!found_entry && previous_key != NULL) {
-        result = EBPF_KEY_NOT_FOUND;
-        goto Done;
+    if (!context.next_entry) {
+        return EBPF_NO_MORE_KEYS;
     }
 
-    if (!next_entry) {
-        result = EBPF_NO_MORE_KEYS;
-        goto Done;
+    if (cursor) {
+        // Entries too far into a bucket for the cursor to hold are found by their hash instead.
+        cursor->position = (uint32_t)((uint64_t)position << (32 - buckets->bucket_count_log2));
+        cursor->index = context.index < UINT16_MAX ? (uint16_t)(context.index + 1) : 0;
+        cursor->generation = (uint16_t)hash_table->generation;
     }
+    *next_entry = context.next_entry;
+    return EBPF_SUCCESS;
+}
 
-    result = EBPF_SUCCESS;
+_Must_inspect_result_ ebpf_result_t
+ebpf_hash_table_next_key_pointer_and_value(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_opt_ const uint8_t* previous_key,
+    _Outptr_ uint8_t** next_key_pointer,
+    _Outptr_opt_ uint8_t** value)
+{
+    ebpf_result_t result;
+    ebpf_hash_bucket_entry_t* next_entry;
+
+    if (!hash_table || !next_key_pointer) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    result = _ebpf_hash_table_next_entry(hash_table, previous_key, NULL, &next_entry);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
 
     if (value) {
         *value = next_entry->data;
     }
-
     *next_key_pointer = next_entry->key;
+    return EBPF_SUCCESS;
+}
 
-Done:
+_Must_inspect_result_ ebpf_result_t
+ebpf_hash_table_next_key_and_value_with_cursor(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _In_opt_ const uint8_t* previous_key,
+    _Inout_ ebpf_hash_table_cursor_t* cursor,
+    _Out_ uint8_t* next_key,
+    _Inout_opt_ uint8_t** next_value)
+{
+    ebpf_result_t result;
+    ebpf_hash_bucket_entry_t* next_entry;
 
-    return result;
+    if (!hash_table || !cursor || !next_key) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    result = _ebpf_hash_table_next_entry(
+        hash_table, previous_key, (ebpf_hash_table_cursor_internal_t*)cursor, &next_entry);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    if (next_value) {
+        *next_value = next_entry->data;
+    }
+    memcpy(next_key, next_entry->key, hash_table->key_size);
+    return EBPF_SUCCESS;
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -1009,20 +2125,48 @@ ebpf_hash_table_next_key(
 size_t
 ebpf_hash_table_key_count(_In_ const ebpf_hash_table_t* hash_table)
 {
-    // If max_entry_count is being enforced, return the current count.
-    if (hash_table->max_entry_count != EBPF_HASH_TABLE_NO_LIMIT) {
-        return hash_table->entry_count;
-    } else {
-        // Otherwise, count the keys in the hash table.
-        size_t count = 0;
-        for (size_t i = 0; i < hash_table->bucket_count; i++) {
-            ebpf_hash_bucket_header_t* bucket = hash_table->buckets[i].header;
-            if (bucket) {
-                count += bucket->count;
-            }
+    return hash_table->entry_count;
+}
+
+int64_t
+ebpf_hash_table_lock_contention_count(_In_ const ebpf_hash_table_t* hash_table)
+{
+    return hash_table->lock_contention_count;
+}
+
+int64_t
+ebpf_hash_table_pool_fallback_count(_In_ const ebpf_hash_table_t* hash_table)
+{
+    int64_t fallback_count = 0;
+    if (hash_table->value_pool) {
+        fallback_count += ebpf_epoch_pool_fallback_count(hash_table->value_pool);
+    }
+    for (size_t index = 0; index < EBPF_HASH_TABLE_POOLED_BUCKET_SIZES; index++) {
+        if (hash_table->bucket_pools[index]) {
+            fallback_count += ebpf_epoch_pool_fallback_count(hash_table->bucket_pools[index]);
         }
-        return count;
     }
+    return fallback_count;
+}
+
+typedef struct _ebpf_hash_table_iterate_context
+{
+    size_t count;
+    size_t capacity;
+    const uint8_t** keys;
+    const uint8_t** values;
+} ebpf_hash_table_iterate_context_t;
+
+static bool
+_ebpf_hash_table_iterate_visitor(_Inout_ void* context, _In_ ebpf_hash_bucket_entry_t* entry)
+{
+    ebpf_hash_table_iterate_context_t* iterate_context = (ebpf_hash_table_iterate_context_t*)context;
+    if (iterate_context->count < iterate_context->capacity) {
+        iterate_context->keys[iterate_context->count] = entry->key;
+        iterate_context->values[iterate_context->count] = entry->data;
+    }
+    iterate_context->count++;
+    return true;
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -1033,54 +2177,86 @@ ebpf_hash_table_iterate(
     _Out_writes_(*count) const uint8_t** keys,
     _Out_writes_(*count) const uint8_t** values)
 {
-    size_t bucket_index = *bucket;
+    return ebpf_hash_table_iterate_range(hash_table, bucket, EBPF_HASH_TABLE_ITERATE_END, count, keys, values);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_hash_table_iterate_range(
+    _In_ const ebpf_hash_table_t* hash_table,
+    _Inout_ size_t* bucket,
+    size_t end_bucket,
+    _Inout_ size_t* count,
+    _Out_writes_(*count) const uint8_t** keys,
+    _Out_writes_(*count) const uint8_t** values)
+{
+    const ebpf_hash_table_buckets_t* buckets = _ebpf_hash_table_get_buckets(hash_table);
+    // The cookie is the walk position scaled to 32 bits, so that it stays valid if the table is resized.
+    size_t position_shift = 32 - buckets->bucket_count_log2;
+    size_t position = (size_t)((uint64_t)*bucket >> position_shift);
+    // Positions are rounded down on both ends of the range, so that adjacent ranges visit each bucket once.
+    size_t end_position = (size_t)min((uint64_t)end_bucket >> position_shift, buckets->bucket_count);
+    size_t start_position = position;
     size_t index = 0;
     size_t remaining_space = *count;
     size_t next_bucket_count = 0;
-    if (bucket_index >= hash_table->bucket_count) {
+    if (position >= end_position) {
         return EBPF_NO_MORE_KEYS;
     }
 
     while (remaining_space > 0) {
-        if (bucket_index >= hash_table->bucket_count) {
+        if (position >= end_position) {
             break;
         }
-        ebpf_hash_bucket_header_t* bucket_header = _ebpf_hash_table_get_bucket(hash_table, bucket_index);
-        // Check if the bucket is empty.
-        if (!bucket_header) {
-            bucket_index++;
-            continue;
-        }
-        // Check if the next bucket will fit in the remaining space.
-        next_bucket_count = bucket_header->count;
+        size_t bucket_index = _ebpf_hash_table_reverse_bucket_index(buckets, position);
+        ebpf_hash_table_iterate_context_t context = {0, remaining_space, keys + index, values + index};
+        _ebpf_hash_table_visit_entries(hash_table, buckets, bucket_index, _ebpf_hash_table_iterate_visitor, &context);
+        // Check if the bucket fit in the remaining space.
+        next_bucket_count = context.count;
         if (remaining_space < next_bucket_count) {
             break;
         }
-        // Copy the keys and values.
-        for (size_t i = 0; i < next_bucket_count; i++) {
-            ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket_header, i);
-            if (!entry) {
-                return EBPF_INVALID_ARGUMENT;
-            }
-            keys[index] = entry->key;
-            values[index] = entry->data;
-            index++;
-            remaining_space--;
-        }
-        bucket_index++;
+        index += next_bucket_count;
+        remaining_space -= next_bucket_count;
+        position++;
     }
 
-    // If the bucket_index did not change, then there wasn't enough space to copy the next bucket.
-    if (*bucket == bucket_index) {
+    // If the position did not change, then there wasn't enough space to copy the next bucket.
+    if (start_position == position) {
         *count = next_bucket_count;
         return EBPF_INSUFFICIENT_BUFFER;
     }
 
-    *bucket = bucket_index;
+    *bucket = (size_t)((uint64_t)position << position_shift);
     *count = index;
     return EBPF_SUCCESS;
 }
 
+typedef struct _ebpf_hash_table_sorted_context
+{
+    int (*compare)(_In_ const uint8_t* key1, _In_ const uint8_t* key2);
+    void* filter_context;
+    bool (*filter)(_In_opt_ void* filter_context, _In_ const uint8_t* key, _In_ const uint8_t* value);
+    const uint8_t* previous_key;
+    uint8_t* next_key_pointer;
+    uint8_t* next_value_pointer;
+} ebpf_hash_table_sorted_context_t;
+
+static bool
+_ebpf_hash_table_sorted_visitor(_Inout_ void* context, _In_ ebpf_hash_bucket_entry_t* entry)
+{
+    ebpf_hash_table_sorted_context_t* sorted_context = (ebpf_hash_table_sorted_context_t*)context;
+    if (sorted_context->previous_key == NULL || sorted_context->compare(sorted_context->previous_key, entry->key) < 0) {
+        if (sorted_context->next_key_pointer == NULL ||
+            sorted_context->compare(sorted_context->next_key_pointer, entry->key) > 0) {
+            if (sorted_context->filter(sorted_context->filter_context, entry->key, entry->data)) {
+                sorted_context->next_key_pointer = entry->key;
+                sorted_context->next_value_pointer = entry->data;
+            }
+        }
+    }
+    return true;
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_hash_table_next_key_and_value_sorted(
     _In_ const ebpf_hash_table_t* hash_table,
@@ -1091,36 +2267,30 @@ ebpf_hash_table_next_key_and_value_sorted(
     _Out_ uint8_t* next_key,
     _Inout_opt_ uint8_t** next_value)
 {
-    uint8_t* next_key_pointer = NULL;
-    uint8_t* next_value_pointer = NULL;
-    for (size_t bucket_index = 0; bucket_index < hash_table->bucket_count; bucket_index++) {
-        ebpf_hash_bucket_header_t* bucket_header = _ebpf_hash_table_get_bucket(hash_table, bucket_index);
-        if (!bucket_header) {
-            continue;
-        }
-        for (size_t i = 0; i < bucket_header->count; i++) {
-            ebpf_hash_bucket_entry_t* entry = _ebpf_hash_table_bucket_entry(hash_table->key_size, bucket_header, i);
-            if (!entry) {
-                return EBPF_INVALID_ARGUMENT;
-            }
-            if (previous_key == NULL || compare(previous_key, entry->key) < 0) {
-                if (next_key_pointer == NULL || compare(next_key_pointer, entry->key) > 0) {
-                    if (filter(filter_context, entry->key, entry->data)) {
-                        next_key_pointer = entry->key;
-                        next_value_pointer = entry->data;
-                    }
-                }
-            }
-        }
+    const ebpf_hash_table_buckets_t* buckets = _ebpf_hash_table_get_buckets(hash_table);
+    ebpf_hash_table_sorted_context_t context = {compare, filter_context, filter, previous_key, NULL, NULL};
+    for (size_t bucket_index = 0; bucket_index < buckets->bucket_count; bucket_index++) {
+        _ebpf_hash_table_visit_entries(hash_table, buckets, bucket_index, _ebpf_hash_table_sorted_visitor, &context);
     }
-    if (next_key_pointer == NULL) {
+    if (context.next_key_pointer == NULL) {
         return EBPF_NO_MORE_KEYS;
     }
 
-    memcpy(next_key, next_key_pointer, hash_table->key_size);
+    memcpy(next_key, context.next_key_pointer, hash_table->key_size);
     if (next_value) {
-        *next_value = next_value_pointer;
+        *next_value = context.next_value_pointer;
     }
 
     return EBPF_SUCCESS;
 }
+
+uint32_t
+ebpf_hash_table_hash_buffer(_In_reads_(length) const uint8_t* data, size_t length, uint32_t seed)
+{
+#if defined(_M_X64)
+    if (ebpf_processor_supports_sse42) {
+        return _ebpf_compute_crc32(data, length, seed);
+    }
+#endif
+    return _ebpf_murmur3_32(data, length * 8, seed);
+}
@@ -11,6 +11,8 @@ extern "C"
 
 #define EBPF_HASH_TABLE_NO_LIMIT 0
 #define EBPF_HASH_TABLE_DEFAULT_BUCKET_COUNT 64
+#define EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT ((size_t)1 << 32)
+#define EBPF_HASH_TABLE_ITERATE_END ((size_t)1 << 32) // Cookie past the last bucket, see ebpf_hash_table_iterate.
 
     typedef enum _ebpf_hash_table_operations
     {
@@ -38,6 +40,9 @@ extern "C"
 
     typedef void (*ebpf_hash_table_free)(_Frees_ptr_opt_ void* memory);
 
+    // Opaque position in a walk of the hash table, returned with each key. Zero is not a valid cursor.
+    typedef uint64_t ebpf_hash_table_cursor_t;
+
     typedef void (*ebpf_hash_table_extract_function)(
         _In_ const uint8_t* value,
         _Outptr_result_buffer_((*length_in_bits + 7) / 8) const uint8_t** data,
@@ -60,11 +65,21 @@ extern "C"
         ebpf_hash_table_free free;         //< Function to free memory - defaults to ebpf_epoch_free.
         size_t minimum_bucket_count;       //< Minimum number of buckets to use - defaults to
                                            // EBPF_HASH_TABLE_DEFAULT_BUCKET_COUNT.
+        size_t maximum_bucket_count;       //< Maximum number of buckets the hash table grows to - defaults to
+                                           // minimum_bucket_count, which disables resizing.
         size_t max_entries; //< Maximum number of entries in the hash table - defaults to EBPF_HASH_TABLE_NO_LIMIT.
-        size_t supplemental_value_size; //< Size of supplemental value to store in each entry - defaults to 0.
-        void* notification_context;     //< Context to pass to notification functions.
+        size_t supplemental_value_size;  //< Size of supplemental value to store in each entry - defaults to 0.
+        size_t preallocated_entry_count; //< Number of entries to preallocate values and buckets for - defaults to 0.
+                                         // Requires the default allocator and disables resizing.
+        bool update_in_place; //< Overwrite the values of existing keys in place instead of replacing the bucket -
+                              // defaults to false. Values must then be copied with ebpf_hash_table_copy_value.
+        bool cache_aligned_values; //< Start each value on a cache line boundary - defaults to false. Requires the
+                                   // default allocator.
+        void* notification_context;      //< Context to pass to notification functions.
         ebpf_hash_table_notification_function
             notification_callback; //< Function to call when value storage is allocated or freed.
+        const volatile bool* count_lock_contention; //< Flag read on each update that enables counting bucket locks
+                                                    // found held - defaults to NULL, which never counts.
     } ebpf_hash_table_creation_options_t;
 
     /**
@@ -101,6 +116,18 @@ extern "C"
     _Must_inspect_result_ ebpf_result_t
     ebpf_hash_table_find(_In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* key, _Outptr_ uint8_t** value);
 
+    /**
+     * @brief Copy a value found in the hash table. If the hash table updates values in place, the copy is retried
+     * until it does not overlap with an update of the value.
+     *
+     * @param[in] hash_table Hash-table the value belongs to.
+     * @param[in] value Value returned by ebpf_hash_table_find or ebpf_hash_table_next_key_pointer_and_value.
+     * @param[out] copy Buffer of value_size bytes to copy the value to.
+     */
+    void
+    ebpf_hash_table_copy_value(
+        _In_ const ebpf_hash_table_t* hash_table, _In_ const uint8_t* value, _Out_ uint8_t* copy);
+
     /**
      * @brief Insert or update an entry in the hash table.
      *
@@ -134,7 +161,8 @@ extern "C"
     /**
      * @brief Fetch pointers to keys and values from one or more buckets in the hash table. Whole buckets worth of keys
      * and values are returned at a time, with *count being the number of keys and values returned. If *count is too
-     * small to hold all the keys and values in the next bucket, EBPF_INSUFFICIENT_BUFFER is returned.
+     * small to hold all the keys and values in the next bucket, EBPF_INSUFFICIENT_BUFFER is returned. The cookie stays
+     * valid if the hash table is resized between calls, but keys may be returned twice if the hash table shrank.
      *
      * @param[in] hash_table Hash-table to iterate.
      * @param[in,out] cookie Cookie to pass to the iterator or NULL to restart. Updated on return.
@@ -156,6 +184,33 @@ extern "C"
         _Out_writes_(*count) const uint8_t** keys,
         _Out_writes_(*count) const uint8_t** values);
 
+    /**
+     * @brief Fetch pointers to keys and values from one or more buckets in the hash table, like
+     * ebpf_hash_table_iterate, but stop at the bucket with cookie end_bucket. This lets a caller walk a part of the
+     * hash table, such as [start, end) for start and end between 0 and EBPF_HASH_TABLE_ITERATE_END, without visiting
+     * the empty buckets that follow it.
+     *
+     * @param[in] hash_table Hash-table to iterate.
+     * @param[in,out] bucket Cookie returned by the previous call, or the start of the range. Updated on return.
+     * @param[in] end_bucket Cookie at which to stop.
+     * @param[in,out] count On input, the number of keys and values that can be stored in the buffers. On output, the
+     * number of keys and values returned.
+     * @param[out] keys An array of pointers to keys in the hash table.
+     * @param[out] values An array of pointers to values in the hash table.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_NO_MORE_KEYS No more keys before end_bucket.
+     * @retval EBPF_INSUFFICIENT_BUFFER The buffer is too small to hold all the keys and values in the bucket and *count
+     * has been updated to reflect the number of keys and values in the next bucket.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_hash_table_iterate_range(
+        _In_ const ebpf_hash_table_t* hash_table,
+        _Inout_ size_t* bucket,
+        size_t end_bucket,
+        _Inout_ size_t* count,
+        _Out_writes_(*count) const uint8_t** keys,
+        _Out_writes_(*count) const uint8_t** values);
+
     /**
      * @brief Find the next key in the hash table.
      *
@@ -207,6 +262,28 @@ extern "C"
         _Outptr_ uint8_t** next_key_pointer,
         _Outptr_opt_ uint8_t** next_value);
 
+    /**
+     * @brief Returns the next (key, value) pair in the hash table in the same order as
+     * ebpf_hash_table_next_key_and_value. The cursor returned with a key lets the next call resume directly after it,
+     * without hashing the key and searching its bucket again. A stale cursor is detected and ignored.
+     *
+     * @param[in] hash_table Hash-table to query.
+     * @param[in] previous_key Previous key or NULL to restart.
+     * @param[in, out] cursor Cursor returned with the previous key, or zero. Updated to the cursor of the next key.
+     * @param[out] next_key Next key if it exists.
+     * @param[out] next_value If non-NULL, returns the next value if it exists.
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_KEY_NOT_FOUND The previous key was not found.
+     * @retval EBPF_NO_MORE_KEYS No more keys exist in the hash table.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_hash_table_next_key_and_value_with_cursor(
+        _In_ const ebpf_hash_table_t* hash_table,
+        _In_opt_ const uint8_t* previous_key,
+        _Inout_ ebpf_hash_table_cursor_t* cursor,
+        _Out_ uint8_t* next_key,
+        _Inout_opt_ uint8_t** next_value);
+
     /**
      * @brief Get the number of keys in the hash table
      *
@@ -216,6 +293,37 @@ extern "C"
     size_t
     ebpf_hash_table_key_count(_In_ const ebpf_hash_table_t* hash_table);
 
+    /**
+     * @brief Get the number of updates and deletes that found the lock of their bucket held by another operation
+     * while counting was enabled by the count_lock_contention option.
+     *
+     * @param[in] hash_table Hash table to query.
+     * @return Number of contended bucket lock acquisitions.
+     */
+    int64_t
+    ebpf_hash_table_lock_contention_count(_In_ const ebpf_hash_table_t* hash_table);
+
+    /**
+     * @brief Get the number of values and buckets that were allocated from the memory pool because the preallocated
+     * storage of the hash table was exhausted.
+     *
+     * @param[in] hash_table Hash table to query.
+     * @return Number of fallback allocations, 0 if the hash table is not preallocated.
+     */
+    int64_t
+    ebpf_hash_table_pool_fallback_count(_In_ const ebpf_hash_table_t* hash_table);
+
+    /**
+     * @brief Hash a buffer with the hash function used for hash table keys.
+     *
+     * @param[in] data Buffer to hash.
+     * @param[in] length Length of the buffer in bytes.
+     * @param[in] seed Seed to randomize the hash.
+     * @return Hash of the buffer.
+     */
+    uint32_t
+    ebpf_hash_table_hash_buffer(_In_reads_(length) const uint8_t* data, size_t length, uint32_t seed);
+
     /**
      * @brief Returns the next (key, value) pair in the hash table in lexicographical order.
      * The keys are sorted using the supplied comparison function and filtered using the supplied filter function.
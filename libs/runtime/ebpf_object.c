@@ -58,6 +58,23 @@ typedef struct _ebpf_id_entry
 static ebpf_hash_table_t* _ebpf_id_table = NULL; ///< Table of object IDs to object pointers.
 static volatile ebpf_id_t _ebpf_next_id = 1;     ///< Next ID to assign to an object.
 
+/**
+ * @brief Sorted array of the IDs of one object type that are present in the ID table. IDs are assigned in increasing
+ * order, so new IDs are normally appended, and successor queries are a binary search instead of a scan of the
+ * (unordered) ID table.
+ */
+typedef struct _ebpf_id_index
+{
+    ebpf_id_t* ids;  ///< IDs in ascending order.
+    size_t count;    ///< Number of IDs in use.
+    size_t capacity; ///< Number of IDs allocated.
+} ebpf_id_index_t;
+
+#define EBPF_ID_INDEX_MINIMUM_CAPACITY 64
+
+static ebpf_lock_t _ebpf_id_index_lock = {0};
+static _Guarded_by_(_ebpf_id_index_lock) ebpf_id_index_t _ebpf_id_index[EBPF_OBJECT_PROGRAM + 1];
+
 /**
  * @brief An enum of operations that can be performed on an object reference.
  */
@@ -131,6 +148,124 @@ ebpf_object_update_reference_history(void* object, bool acquire, uint32_t file_i
     _update_reference_history(object, acquire ? EBPF_OBJECT_ACQUIRE : EBPF_OBJECT_RELEASE, file_id, line);
 }
 
+/**
+ * @brief Find the position of the first ID in the index that is greater than or equal to id.
+ *
+ * @param[in] index Index to search.
+ * @param[in] id ID to search for.
+ * @return Position of the first ID >= id, or index->count if there is none.
+ */
+static size_t
+_ebpf_id_index_lower_bound(_In_ const ebpf_id_index_t* index, ebpf_id_t id)
+{
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->ids[middle] < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static _Must_inspect_result_ ebpf_result_t
+_ebpf_id_index_insert(ebpf_id_t id, ebpf_object_type_t object_type)
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    if ((size_t)object_type >= EBPF_COUNT_OF(_ebpf_id_index)) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&_ebpf_id_index_lock);
+    ebpf_id_index_t* index = &_ebpf_id_index[object_type];
+
+    if (index->count == index->capacity) {
+        size_t new_capacity = index->capacity ? index->capacity * 2 : EBPF_ID_INDEX_MINIMUM_CAPACITY;
+        ebpf_id_t* new_ids;
+        if (index->ids) {
+            new_ids = ebpf_reallocate(
+                index->ids,
+                CXPLAT_POOL_FLAG_NON_PAGED,
+                index->capacity * sizeof(ebpf_id_t),
+                new_capacity * sizeof(ebpf_id_t),
+                EBPF_POOL_TAG_DEFAULT);
+        } else {
+            new_ids = ebpf_allocate_with_tag(new_capacity * sizeof(ebpf_id_t), EBPF_POOL_TAG_DEFAULT);
+        }
+        if (new_ids == NULL) {
+            result = EBPF_NO_MEMORY;
+            goto Done;
+        }
+        index->ids = new_ids;
+        index->capacity = new_capacity;
+    }
+
+    // IDs only arrive out of order after the ID counter wraps, so this is almost always an append.
+    size_t position = index->count;
+    if (position > 0 && index->ids[position - 1] > id) {
+        position = _ebpf_id_index_lower_bound(index, id);
+        memmove(&index->ids[position + 1], &index->ids[position], (index->count - position) * sizeof(ebpf_id_t));
+    }
+    index->ids[position] = id;
+    index->count++;
+
+Done:
+    ebpf_lock_unlock(&_ebpf_id_index_lock, state);
+    return result;
+}
+
+static void
+_ebpf_id_index_delete(ebpf_id_t id, ebpf_object_type_t object_type)
+{
+    ebpf_assert((size_t)object_type < EBPF_COUNT_OF(_ebpf_id_index));
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&_ebpf_id_index_lock);
+    ebpf_id_index_t* index = &_ebpf_id_index[object_type];
+
+    size_t position = _ebpf_id_index_lower_bound(index, id);
+    ebpf_assert(position < index->count && index->ids[position] == id);
+    if (position < index->count && index->ids[position] == id) {
+        memmove(&index->ids[position], &index->ids[position + 1], (index->count - position - 1) * sizeof(ebpf_id_t));
+        index->count--;
+    }
+
+    ebpf_lock_unlock(&_ebpf_id_index_lock, state);
+}
+
+/**
+ * @brief Find the smallest ID of the given type that is greater than start_id.
+ *
+ * @param[in] start_id ID to start after, or 0 to start from the beginning.
+ * @param[in] object_type Type of object to find.
+ * @param[out] next_id The next ID.
+ * @retval EBPF_SUCCESS The next ID was found.
+ * @retval EBPF_NO_MORE_KEYS No ID of this type is greater than start_id.
+ */
+static _Must_inspect_result_ ebpf_result_t
+_ebpf_id_index_next(ebpf_id_t start_id, ebpf_object_type_t object_type, _Out_ ebpf_id_t* next_id)
+{
+    ebpf_result_t result = EBPF_NO_MORE_KEYS;
+    *next_id = 0;
+    if ((size_t)object_type >= EBPF_COUNT_OF(_ebpf_id_index) || start_id == EBPF_ID_NONE) {
+        return result;
+    }
+
+    ebpf_lock_state_t state = ebpf_lock_lock(&_ebpf_id_index_lock);
+    const ebpf_id_index_t* index = &_ebpf_id_index[object_type];
+
+    size_t position = _ebpf_id_index_lower_bound(index, start_id + 1);
+    if (position < index->count) {
+        *next_id = index->ids[position];
+        result = EBPF_SUCCESS;
+    }
+
+    ebpf_lock_unlock(&_ebpf_id_index_lock, state);
+    return result;
+}
+
 static void
 _ebpf_object_tracking_list_remove(_In_ const ebpf_core_object_t* object, ebpf_file_id_t file_id, uint32_t line)
 {
@@ -153,10 +288,12 @@ ebpf_object_tracking_initiate()
         .value_size = sizeof(ebpf_id_entry_t),
         .max_entries = EBPF_HASH_TABLE_NO_LIMIT,
         .minimum_bucket_count = 1024,
+        .maximum_bucket_count = EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT,
     };
 
     memset(_ebpf_object_reference_history, 0, sizeof(_ebpf_object_reference_history));
     _ebpf_object_reference_history_index = 0;
+    memset(_ebpf_id_index, 0, sizeof(_ebpf_id_index));
 
     cxplat_initialize_rundown_protection(&_ebpf_object_rundown_ref);
 
@@ -174,6 +311,11 @@ ebpf_object_tracking_terminate()
 
     ebpf_hash_table_destroy(_ebpf_id_table);
     _ebpf_id_table = NULL;
+
+    for (size_t i = 0; i < EBPF_COUNT_OF(_ebpf_id_index); i++) {
+        ebpf_free(_ebpf_id_index[i].ids);
+    }
+    memset(_ebpf_id_index, 0, sizeof(_ebpf_id_index));
 }
 
 static void
@@ -243,6 +385,18 @@ ebpf_object_initialize(
         goto Done;
     }
 
+    result = _ebpf_id_index_insert(object->id, object_type);
+    if (result != EBPF_SUCCESS) {
+        EBPF_LOG_MESSAGE_POINTER_ENUM(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_BASE,
+            "eBPF object failed to initialize due to insert in _ebpf_id_index failure",
+            object,
+            object_type);
+        ebpf_assert_success(ebpf_hash_table_delete(_ebpf_id_table, (const uint8_t*)&object->id));
+        goto Done;
+    }
+
 #if !defined(NDEBUG)
     ebpf_id_entry_t* new_entry = NULL;
     result = ebpf_hash_table_find(_ebpf_id_table, (const uint8_t*)&object->id, (uint8_t**)&new_entry);
@@ -352,48 +506,10 @@ ebpf_duplicate_utf8_string(_Out_ cxplat_utf8_string_t* destination, _In_ const c
     return ebpf_result_from_cxplat_status(status);
 }
 
-static bool
-_ebpf_object_match_object_type(_In_ void* filter_context, _In_ const uint8_t* key, _In_ const uint8_t* value)
-{
-    ebpf_object_type_t* object_type = (ebpf_object_type_t*)filter_context;
-    ebpf_id_entry_t* entry = (ebpf_id_entry_t*)value;
-    UNREFERENCED_PARAMETER(key);
-    return (entry->type == *object_type);
-}
-
-static int
-_ebpf_object_id_sort(_In_ const uint8_t* key1, _In_ const uint8_t* key2)
-{
-    ebpf_id_t id1 = *(ebpf_id_t*)key1;
-    ebpf_id_t id2 = *(ebpf_id_t*)key2;
-    if (id1 < id2) {
-        return -1;
-    } else if (id1 > id2) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
 _Must_inspect_result_ ebpf_result_t
 ebpf_object_get_next_id(ebpf_id_t start_id, ebpf_object_type_t object_type, _Out_ ebpf_id_t* next_id)
 {
-    // TODO: https://github.com/microsoft/ebpf-for-windows/issues/2985
-    // Switch this to a data structure that supports sorted iteration.
-    ebpf_id_entry_t* entry = NULL;
-    ebpf_result_t result = ebpf_hash_table_next_key_and_value_sorted(
-        _ebpf_id_table,
-        start_id ? (const uint8_t*)&start_id : NULL,
-        _ebpf_object_id_sort,
-        &object_type,
-        _ebpf_object_match_object_type,
-        (uint8_t*)next_id,
-        (uint8_t**)&entry);
-    if (result != EBPF_SUCCESS) {
-        return EBPF_NO_MORE_KEYS;
-    } else {
-        return EBPF_SUCCESS;
-    }
+    return _ebpf_id_index_next(start_id, object_type, next_id);
 }
 
 void
@@ -412,16 +528,18 @@ ebpf_object_reference_next_object(
     *next_object = NULL;
 
     for (;;) {
-        result = ebpf_hash_table_next_key_and_value(
-            _ebpf_id_table,
-            previous_key ? (const uint8_t*)&previous_key : NULL,
-            (uint8_t*)&next_key,
-            (uint8_t**)&entry);
+        result = _ebpf_id_index_next(previous_key, object_type, &next_key);
         if (result != EBPF_SUCCESS) {
             break;
         }
         previous_key = next_key;
 
+        // Skip entries that were deleted after the index lookup.
+        result = ebpf_hash_table_find(_ebpf_id_table, (const uint8_t*)&next_key, (uint8_t**)&entry);
+        if (result != EBPF_SUCCESS) {
+            continue;
+        }
+
         object = entry->object;
 
         // Skip entries that have been deleted.
@@ -610,6 +728,7 @@ ebpf_object_release_id_reference(ebpf_id_t id, ebpf_object_type_t object_type, u
     ebpf_object_update_reference_history(entry, EBPF_OBJECT_RELEASE, file_id, line);
 
     if (new_refcount == 0) {
+        _ebpf_id_index_delete(id, object_type);
         result = ebpf_hash_table_delete(_ebpf_id_table, (const uint8_t*)&id);
         if (result != EBPF_SUCCESS) {
             __fastfail(FAST_FAIL_INVALID_REFERENCE_COUNT);
@@ -3,18 +3,17 @@
 
 #include "ebpf_epoch.h"
 #include "ebpf_perf_event_array.h"
-// #include "ebpf_perf_event_array_record.h"
+#include "ebpf_perf_event_array_record.h"
 #include "ebpf_platform.h"
 #include "ebpf_program.h"
 #include "ebpf_ring_buffer.h"
-#include "ebpf_ring_buffer_record.h"
 #include "ebpf_tracelog.h"
 
 typedef struct _ebpf_perf_ring
 {
     ebpf_ring_buffer_t ring;
     volatile size_t lost_records;
-    uint64_t pad;
+    uint8_t pad[EBPF_CACHE_LINE_SIZE - (sizeof(ebpf_ring_buffer_t) + sizeof(size_t)) % EBPF_CACHE_LINE_SIZE];
 } ebpf_perf_ring_t;
 typedef struct _ebpf_perf_event_array
 {
@@ -28,62 +27,81 @@ static_assert(sizeof(ebpf_perf_ring_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_perf_r
 static_assert(
     sizeof(ebpf_perf_event_array_t) % EBPF_CACHE_LINE_SIZE == 0, "ebpf_perf_event_array_t is not cache aligned.");
 
+inline static size_t
+_perf_record_size(size_t data_length)
+{
+    return EBPF_PAD_8(EBPF_OFFSET_OF(ebpf_perf_event_array_record_t, data) + data_length);
+}
+
+inline static _Ret_notnull_ ebpf_perf_event_array_record_t*
+_perf_record_at_offset(_In_ const ebpf_ring_buffer_t* ring, size_t offset)
+{
+    return (ebpf_perf_event_array_record_t*)&ring->shared_buffer[offset % ring->length];
+}
+
 /**
- * @brief Reserve a buffer in the ring buffer from a single exclusive producer.
- * Buffer is valid until either ebpf_ring_buffer_submit, ebpf_ring_buffer_discard, or the end of the current epoch.
+ * @brief Reserve a record in a perf ring from a single exclusive producer.
  *
- * @note This functions must only be called by a single thread at a time (with exclusive access).
- * With multiple producers should either be locked or written at dispatch to a per-cpu buffer.
+ * The record is valid until it is passed to _ebpf_perf_ring_submit.
  *
- * It is safe to alternate between exclusive and shared reserves as long exclusive reserve is mututally exclusive
- * with any exclusive or shared reserve. A single consumer may still be concurrently reading.
+ * @note This function must only be called by a single thread at a time (exclusive access). Perf rings are only
+ * written from their own CPU at DISPATCH_LEVEL, which provides that guarantee without a lock. A single consumer
+ * may still be concurrently reading.
  *
- * @param[in, out] ring_buffer Ring buffer to update.
- * @param[out] data Pointer to start of reserved buffer on success.
- * @param[in] length Length of buffer to reserve.
- * @retval EBPF_SUCCESS Successfully reserved space in the ring buffer.
- * @retval EBPF_INVALID_ARGUMENT Unable to reserve space in the ring buffer.
+ * Synchronization:
+ * - The record header is initialized with the locked bit set before producer_offset is advanced.
+ * - producer_offset is written with release semantics, so the consumer never observes the new offset before the
+ *   locked header.
+ * - producer_reserve_offset is kept in step with producer_offset so the ring stays consistent for the shared
+ *   (multi-producer) reserve path.
+ *
+ * @param[in, out] ring Ring to reserve the record in.
+ * @param[in] length Length of the record data.
+ * @param[out] record Pointer to the locked record on success.
+ * @retval EBPF_SUCCESS Successfully reserved space in the ring.
+ * @retval EBPF_INVALID_ARGUMENT The record can never fit in the ring.
+ * @retval EBPF_OUT_OF_SPACE Not enough free space in the ring.
  */
-_Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_exclusive_reserve(
-    _Inout_ ebpf_ring_buffer_t* ring_buffer, _Outptr_result_bytebuffer_(length) uint8_t** data, size_t length);
+static _Must_inspect_result_ ebpf_result_t
+_ebpf_perf_ring_exclusive_reserve(
+    _Inout_ ebpf_ring_buffer_t* ring, size_t length, _Outptr_ ebpf_perf_event_array_record_t** record)
+{
+    size_t record_size = _perf_record_size(length);
+    if (length > (UINT32_MAX >> 2) || record_size >= ring->length) {
+        return EBPF_INVALID_ARGUMENT;
+    }
 
-_Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_exclusive_reserve(
-    _Inout_ ebpf_ring_buffer_t* ring, _Outptr_result_bytebuffer_(length) uint8_t** data, size_t length)
+    // Only this producer writes producer_offset, so it can be read without a fence.
+    size_t producer_offset = ReadULong64NoFence(&ring->producer_offset);
+    size_t consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+    if ((producer_offset - consumer_offset) + record_size >= ring->length) {
+        return EBPF_OUT_OF_SPACE;
+    }
+    size_t new_producer_offset = producer_offset + record_size;
+    WriteULong64NoFence(&ring->producer_reserve_offset, new_producer_offset);
+
+    ebpf_perf_event_array_record_t* local_record = _perf_record_at_offset(ring, producer_offset);
+    local_record->header.length = (uint32_t)length;
+    local_record->header.discarded = 0;
+    local_record->header.locked = 1;
+
+    WriteULong64Release(&ring->producer_offset, new_producer_offset);
+
+    *record = local_record;
+    return EBPF_SUCCESS;
+}
+
+/**
+ * @brief Publish a record reserved with _ebpf_perf_ring_exclusive_reserve to the consumer.
+ *
+ * @param[in, out] record Record to publish.
+ */
+inline static void
+_ebpf_perf_ring_submit(_Inout_ ebpf_perf_event_array_record_t* record)
 {
-    return ebpf_ring_buffer_reserve(ring, data, length);
-    // // This function will be added to ebpf_ring_buffer.h/c after PR #4204 is merged.
-    // //  Exclusive Reserve notes:
-    // //  - This function must only be called by a single thread at a time (exclusive access).
-    // //    - A single consumer can be concurrently reading.
-    // //  - Synchronization:
-    // //    - producer_offset WriteRelease ensures record is locked before producer offset is updated.
-    // //    - With only a single producer we don't need the loop and can directly update the producer offset.
-    // //if (length > _ring_get_length(ring) || length == 0 || length > UINT32_MAX) {
-    // if (length > _ring_get_length(ring) || length == 0 || length > UINT32_MAX) {
-    //     return EBPF_INVALID_ARGUMENT;
-    // }
-    // size_t record_size = _ring_record_size(length);
-    // size_t consumer_offset = ReadULong64NoFence(&ring->consumer_offset);
-    // size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
-    // size_t used_capacity = producer_offset - consumer_offset;
-    // if (used_capacity + record_size >= _ring_get_length(ring)) {
-    //     return EBPF_NO_MEMORY;
-    // }
-    // size_t new_producer_offset = producer_offset + record_size;
-
-    // // Update reserve offset (not used for exclusive reserve, but allows switching between exclusive and shared).
-    // WriteULong64NoFence(&ring->producer_reserve_offset, new_producer_offset);
-
-    // // Initialize record.
-    // ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, producer_offset);
-    // _ring_record_initialize(record, (uint32_t)length);
-    // // Release producer offset to ensure ordering with setting the lock bit in initialize above.
-    // WriteULong64Release(&ring->producer_offset, new_producer_offset);
-
-    // *data = record->data;
-    // return EBPF_SUCCESS;
+    // Ensure the record data is written before the consumer can observe the record as unlocked.
+    MemoryBarrier();
+    record->header.locked = 0;
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -100,6 +118,15 @@ ebpf_ring_buffer_initialize_ring(
     }
     ring->shared_buffer = ebpf_ring_descriptor_get_base_address(ring->ring_descriptor);
     ring->length = capacity;
+    ring->consumer_offset = 0;
+    ring->producer_offset = 0;
+    ring->producer_reserve_offset = 0;
+    ring->overwrite = false;
+    ring->user_producer = false;
+    // Perf rings are drained through the perf event array IOCTLs, so they have no shared offsets page.
+    ring->offsets_memory = NULL;
+    ring->offsets = NULL;
+    ebpf_lock_create(&ring->lock);
 
     return EBPF_SUCCESS;
 }
@@ -130,7 +157,10 @@ ebpf_perf_event_array_create(
 
     for (uint32_t i = 0; i < ring_count; i++) {
         ebpf_perf_ring_t* ring = &local_perf_event_array->rings[i];
-        ebpf_ring_buffer_initialize_ring(&ring->ring, capacity);
+        result = ebpf_ring_buffer_initialize_ring(&ring->ring, capacity);
+        if (result != EBPF_SUCCESS) {
+            goto Error;
+        }
         ring->lost_records = 0;
     }
 
@@ -157,15 +187,6 @@ ebpf_perf_event_array_destroy(_Frees_ptr_opt_ ebpf_perf_event_array_t* perf_even
     }
 }
 
-// In ebpf_platform.h after ringbuf refactor PR #4204 merges.
-void
-ebpf_lower_irql_from_dispatch_if_needed(KIRQL irql_at_enter)
-{
-    if (irql_at_enter < DISPATCH_LEVEL) {
-        ebpf_lower_irql(irql_at_enter);
-    }
-}
-
 _Must_inspect_result_ ebpf_result_t
 _ebpf_perf_event_array_output(
     _Inout_ ebpf_perf_event_array_t* perf_event_array,
@@ -201,19 +222,20 @@ _ebpf_perf_event_array_output(
         *cpu_id = _cpu_id; // return the cpu we are writing to.
     }
 
-    uint8_t* record;
+    ebpf_perf_event_array_record_t* record;
     ebpf_perf_ring_t* ring = &perf_event_array->rings[_cpu_id];
 
-    result = ebpf_ring_buffer_exclusive_reserve(&ring->ring, &record, length + extra_length);
+    // Running at DISPATCH_LEVEL on the ring's own CPU makes this the only producer, so no lock is needed.
+    result = _ebpf_perf_ring_exclusive_reserve(&ring->ring, length + extra_length, &record);
     if (result != EBPF_SUCCESS) {
         ring->lost_records++;
         goto Done;
     }
-    memcpy(record, data, length);
+    memcpy(record->data, data, length);
     if (extra_data != NULL) {
-        memcpy(record + length, extra_data, extra_length);
+        memcpy(record->data + length, extra_data, extra_length);
     }
-    result = ebpf_ring_buffer_submit(record);
+    _ebpf_perf_ring_submit(record);
 
 Done:
     ebpf_lower_irql_from_dispatch_if_needed(irql_at_enter);
@@ -288,9 +310,51 @@ _Must_inspect_result_ ebpf_result_t
 ebpf_perf_event_array_return_buffer(
     _Inout_ ebpf_perf_event_array_t* perf_event_array, uint32_t cpu_id, size_t consumer_offset)
 {
-    // Correct command below (for after ringbuf refactor merges).
-    return ebpf_ring_buffer_return(&perf_event_array->rings[cpu_id].ring, consumer_offset);
-    // return ebpf_ring_buffer_return_buffer(&perf_event_array->rings[cpu_id].ring, consumer_offset);
+    ebpf_result_t result;
+    ebpf_ring_buffer_t* ring = &perf_event_array->rings[cpu_id].ring;
+
+    // The lock only serializes consumers of this ring; producers never acquire it.
+    ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
+    size_t old_consumer_offset = ring->consumer_offset;
+    size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
+
+    if (consumer_offset < old_consumer_offset || consumer_offset > producer_offset) {
+        EBPF_LOG_MESSAGE_UINT64_UINT64(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_MAP,
+            "ebpf_perf_event_array_return_buffer: Invalid consumer offset",
+            consumer_offset,
+            old_consumer_offset);
+        result = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    // Verify the new offset is on a record boundary and doesn't cover a record that is still locked.
+    size_t offset = old_consumer_offset;
+    while (offset < consumer_offset) {
+        const ebpf_perf_event_array_record_t* record = _perf_record_at_offset(ring, offset);
+        if (record->header.locked) {
+            break;
+        }
+        offset += _perf_record_size(record->header.length);
+    }
+    if (offset != consumer_offset) {
+        EBPF_LOG_MESSAGE_UINT64(
+            EBPF_TRACELOG_LEVEL_ERROR,
+            EBPF_TRACELOG_KEYWORD_MAP,
+            "ebpf_perf_event_array_return_buffer: Offset is not on a record boundary",
+            consumer_offset);
+        result = EBPF_INVALID_ARGUMENT;
+        goto Done;
+    }
+
+    // Release ensures the consumer has finished reading the records before the producer can reuse the space.
+    WriteULong64Release(&ring->consumer_offset, consumer_offset);
+    result = EBPF_SUCCESS;
+
+Done:
+    ebpf_lock_unlock(&ring->lock, state);
+    return result;
 }
 
 _Must_inspect_result_ ebpf_result_t
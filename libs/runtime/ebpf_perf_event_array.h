@@ -113,8 +113,9 @@ ebpf_perf_event_array_query(
  * @brief Mark one or more records in the ring buffer as returned to the ring.
  *
  * @param[in, out] perf_event_array Perf event array to update.
- * @param[in] cpu_id CPU ID to query.
- * @param[in] consumer_offset New consumer offset to advance to.
+ * @param[in] cpu_id CPU ID of the ring to update.
+ * @param[in] consumer_offset New consumer offset to advance to. Must be on a record boundary at or after the current
+ * consumer offset, and must not pass a record that is still being written.
  * @retval EBPF_SUCCESS Successfully returned records to the ring buffer.
  * @retval EBPF_INVALID_ARGUMENT Unable to return records to the ring buffer.
  */
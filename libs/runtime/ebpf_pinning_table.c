@@ -70,6 +70,7 @@ ebpf_pinning_table_allocate(ebpf_pinning_table_t** pinning_table)
         .extract_function = _ebpf_pinning_table_extract,
         .allocate = ebpf_allocate,
         .free = ebpf_free,
+        .maximum_bucket_count = EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT,
     };
 
     return_value = ebpf_hash_table_create(&(*pinning_table)->hash_table, &options);
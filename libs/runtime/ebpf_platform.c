@@ -11,6 +11,8 @@ static uint32_t _ebpf_platform_maximum_processor_count = 0;
 
 static bool _ebpf_platform_is_cxplat_initialized = false;
 
+static bool _ebpf_platform_is_user_mappings_initialized = false;
+
 bool ebpf_processor_supports_sse42 = false;
 
 _Ret_range_(>, 0) uint32_t ebpf_get_cpu_count() { return _ebpf_platform_maximum_processor_count; }
@@ -119,6 +121,13 @@ _IRQL_requires_max_(HIGH_LEVEL) void ebpf_lower_irql(_In_ _Notliteral_ _IRQL_res
     KeLowerIrql(old_irql);
 }
 
+_IRQL_requires_min_(DISPATCH_LEVEL) void ebpf_lower_irql_from_dispatch_if_needed(uint8_t irql_at_enter)
+{
+    if (irql_at_enter < DISPATCH_LEVEL) {
+        ebpf_lower_irql(irql_at_enter);
+    }
+}
+
 bool
 ebpf_should_yield_processor()
 {
@@ -259,6 +268,7 @@ ebpf_unmap_memory(_Frees_ptr_opt_ MDL* memory_descriptor)
         EBPF_RETURN_VOID();
     }
 
+    ebpf_unmap_memory_user(memory_descriptor);
     MmUnmapLockedPages(ebpf_memory_descriptor_get_base_address(memory_descriptor), memory_descriptor);
     MmFreePagesFromMdl(memory_descriptor);
     ExFreePool(memory_descriptor);
@@ -508,6 +518,10 @@ ebpf_platform_initiate()
 {
     ebpf_result_t result = ebpf_result_from_cxplat_status(cxplat_initialize());
     _ebpf_platform_is_cxplat_initialized = (result == EBPF_SUCCESS);
+    if (result == EBPF_SUCCESS) {
+        result = ebpf_user_mappings_initiate();
+        _ebpf_platform_is_user_mappings_initialized = (result == EBPF_SUCCESS);
+    }
     ebpf_initialize_cpu_count();
 #if defined(_M_X64)
     // Check if processor supports SSE4.2
@@ -523,6 +537,10 @@ void
 ebpf_platform_terminate()
 {
     KeFlushQueuedDpcs();
+    if (_ebpf_platform_is_user_mappings_initialized) {
+        ebpf_user_mappings_terminate();
+        _ebpf_platform_is_user_mappings_initialized = false;
+    }
     if (_ebpf_platform_is_cxplat_initialized) {
         cxplat_cleanup();
         _ebpf_platform_is_cxplat_initialized = false;
@@ -129,6 +129,45 @@ extern "C"
     void*
     ebpf_memory_descriptor_get_base_address(MDL* memory_descriptor);
 
+    /**
+     * @brief Create a read-write mapping in the calling process of memory
+     * allocated via ebpf_map_memory, or return the mapping the process already
+     * has. The mapping is removed when the process exits or when the memory is
+     * freed, whichever comes first.
+     *
+     * @param[in] memory_descriptor Pointer to an ebpf_memory_descriptor_t
+     * describing allocated pages.
+     * @return Pointer to the base of the mapping, or NULL on failure.
+     */
+    _Ret_maybenull_ void*
+    ebpf_map_memory_user(_In_ MDL* memory_descriptor);
+
+    /**
+     * @brief Remove the mappings of memory in all processes, each in the
+     * context of its process. Called before the pages are freed.
+     *
+     * @param[in] memory_descriptor Pointer to an ebpf_memory_descriptor_t
+     * describing allocated pages.
+     */
+    _IRQL_requires_max_(APC_LEVEL) void ebpf_unmap_memory_user(_In_ MDL* memory_descriptor);
+
+    /**
+     * @brief Initialize tracking of the user mappings created by
+     * ebpf_map_memory_user, ebpf_ring_map_user and ebpf_ring_map_readonly_user.
+     *
+     * @retval EBPF_SUCCESS The operation was successful.
+     * @retval EBPF_NO_MEMORY Unable to allocate resources for this
+     *  operation.
+     */
+    _Must_inspect_result_ ebpf_result_t
+    ebpf_user_mappings_initiate();
+
+    /**
+     * @brief Terminate tracking of user mappings.
+     */
+    void
+    ebpf_user_mappings_terminate();
+
     /**
      * @brief Allocate pages from physical memory and create a mapping into the
      * system address space with the same pages mapped twice.
@@ -161,7 +200,8 @@ extern "C"
     ebpf_ring_descriptor_get_base_address(_In_ const ebpf_ring_descriptor_t* ring);
 
     /**
-     * @brief Create a read-only mapping in the calling process of the ring buffer.
+     * @brief Create a read-only mapping in the calling process of the ring buffer, or return the mapping the process
+     * already has. The mapping is removed when the process exits or when the ring is freed.
      *
      * @param[in] ring Ring buffer to map.
      * @return Pointer to the base of the ring buffer.
@@ -169,6 +209,16 @@ extern "C"
     _Ret_maybenull_ void*
     ebpf_ring_map_readonly_user(_In_ const ebpf_ring_descriptor_t* ring);
 
+    /**
+     * @brief Create a read-write mapping in the calling process of the ring buffer, or return the mapping the process
+     * already has. The mapping is removed when the process exits or when the ring is freed.
+     *
+     * @param[in] ring Ring buffer to map.
+     * @return Pointer to the base of the ring buffer.
+     */
+    _Ret_maybenull_ void*
+    ebpf_ring_map_user(_In_ const ebpf_ring_descriptor_t* ring);
+
     /**
      * @brief Allocate and copy a UTF-8 string.
      *
@@ -238,6 +288,13 @@ extern "C"
      */
     _IRQL_requires_max_(HIGH_LEVEL) void ebpf_lower_irql(_In_ _Notliteral_ _IRQL_restores_ uint8_t old_irql);
 
+    /**
+     * @brief Lower the IRQL back to irql_at_enter if it was raised to DISPATCH_LEVEL from below it.
+     *
+     * @param[in] irql_at_enter The IRQL before it was raised.
+     */
+    _IRQL_requires_min_(DISPATCH_LEVEL) void ebpf_lower_irql_from_dispatch_if_needed(uint8_t irql_at_enter);
+
     /**
      * @brief Query the platform for the total number of CPUs.
      * @return The count of logical cores in the system.
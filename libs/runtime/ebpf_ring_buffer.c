@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 
 #include "ebpf_epoch.h"
+#include "ebpf_platform.h"
 #include "ebpf_ring_buffer.h"
 #include "ebpf_ring_buffer_record.h"
 #include "ebpf_tracelog.h"
@@ -12,12 +13,6 @@ _ring_get_length(_In_ const ebpf_ring_buffer_t* ring)
     return ring->length;
 }
 
-inline static size_t
-_ring_get_producer_offset(_In_ const ebpf_ring_buffer_t* ring)
-{
-    return ring->producer_offset % ring->length;
-}
-
 inline static size_t
 _ring_get_consumer_offset(_In_ const ebpf_ring_buffer_t* ring)
 {
@@ -27,20 +22,31 @@ _ring_get_consumer_offset(_In_ const ebpf_ring_buffer_t* ring)
 inline static size_t
 _ring_get_used_capacity(_In_ const ebpf_ring_buffer_t* ring)
 {
-    ebpf_assert(ring->producer_offset >= ring->consumer_offset);
-    return ring->producer_offset - ring->consumer_offset;
-}
-
-inline static void
-_ring_advance_producer_offset(_Inout_ ebpf_ring_buffer_t* ring, size_t length)
-{
-    ring->producer_offset += length;
+    size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
+    size_t consumer_offset = ReadULong64NoFence(&ring->consumer_offset);
+    ebpf_assert(producer_offset >= consumer_offset);
+    return producer_offset - consumer_offset;
 }
 
+/**
+ * @brief Move the consumer offset forward to new_consumer_offset unless it is already past it.
+ *
+ * Producers may concurrently fold in the consumer offset from the shared offsets page, so the offset is only ever
+ * moved forward with a compare-exchange. The interlocked operation also provides the release semantics that keep
+ * the consumer's reads of the records ahead of producers reusing the space.
+ */
 inline static void
-_ring_advance_consumer_offset(_Inout_ ebpf_ring_buffer_t* ring, size_t length)
+_ring_advance_consumer_offset(_Inout_ ebpf_ring_buffer_t* ring, size_t new_consumer_offset)
 {
-    ring->consumer_offset += length;
+    size_t consumer_offset = ReadULong64NoFence(&ring->consumer_offset);
+    while (new_consumer_offset > consumer_offset) {
+        size_t previous_consumer_offset = (size_t)ebpf_interlocked_compare_exchange_int64(
+            (volatile int64_t*)&ring->consumer_offset, (int64_t)new_consumer_offset, (int64_t)consumer_offset);
+        if (previous_consumer_offset == consumer_offset) {
+            break;
+        }
+        consumer_offset = previous_consumer_offset;
+    }
 }
 
 inline static _Ret_notnull_ ebpf_ring_buffer_record_t*
@@ -49,31 +55,196 @@ _ring_record_at_offset(_In_ const ebpf_ring_buffer_t* ring, size_t offset)
     return (ebpf_ring_buffer_record_t*)&ring->shared_buffer[offset % ring->length];
 }
 
+/**
+ * @brief Fold the consumer offset published in the shared offsets page into the ring.
+ *
+ * The shared consumer offset is written by the consumer process and is not trusted. It is only honored when it
+ * moves forward without passing the producer offset, and walking the published records from the current consumer
+ * offset ends exactly on it without skipping a record that is still being written.
+ *
+ * @param[in, out] ring Ring buffer to update.
+ * @return The consumer offset after the update.
+ */
+inline static size_t
+_ring_sync_consumer_offset(_Inout_ ebpf_ring_buffer_t* ring)
+{
+    size_t consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+    // The consumer of a user producer ring is the kernel, which already owns consumer_offset.
+    if (ring->offsets == NULL || ring->user_producer) {
+        return consumer_offset;
+    }
+
+    size_t shared_consumer_offset = ReadULong64Acquire(&ring->offsets->consumer_offset);
+    if (shared_consumer_offset <= consumer_offset ||
+        shared_consumer_offset > ReadULong64Acquire(&ring->producer_offset)) {
+        return consumer_offset;
+    }
+
+    size_t offset = consumer_offset;
+    while (offset < shared_consumer_offset) {
+        volatile ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, offset);
+        if (record->header.locked) {
+            break;
+        }
+        size_t record_length = record->header.length;
+        if (record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+            record_length > shared_consumer_offset - offset) {
+            break;
+        }
+        offset += record_length;
+    }
+    if (offset != shared_consumer_offset) {
+        return consumer_offset;
+    }
+
+    // Space is only reused once the consumer offset has moved past it, so the headers walked are intact if the
+    // consumer offset did not move in the meantime.
+    size_t previous_consumer_offset = (size_t)ebpf_interlocked_compare_exchange_int64(
+        (volatile int64_t*)&ring->consumer_offset, (int64_t)shared_consumer_offset, (int64_t)consumer_offset);
+    return (previous_consumer_offset == consumer_offset) ? shared_consumer_offset : previous_consumer_offset;
+}
+
 inline static _Ret_notnull_ ebpf_ring_buffer_record_t*
 _ring_next_consumer_record(_In_ const ebpf_ring_buffer_t* ring)
 {
     return _ring_record_at_offset(ring, _ring_get_consumer_offset(ring));
 }
 
-inline static _Ret_maybenull_ ebpf_ring_buffer_record_t*
-_ring_buffer_acquire_record(_Inout_ ebpf_ring_buffer_t* ring, size_t requested_length)
+/**
+ * @brief Drop the oldest record of an overwrite ring to make room for a new one.
+ *
+ * The record header is read before the compare-exchange and is only trusted if the consumer offset did not move in
+ * between. Space is only reused once the consumer offset has moved past it, so an unchanged consumer offset means
+ * the header could not have been overwritten.
+ *
+ * @param[in, out] ring Ring buffer to update.
+ * @param[in] consumer_offset Consumer offset the caller found the ring full at.
+ * @retval true The consumer offset moved forward, retry the reservation.
+ * @retval false The oldest record is not published or still being written.
+ */
+static bool
+_ring_drop_oldest_record(_Inout_ ebpf_ring_buffer_t* ring, size_t consumer_offset)
 {
-    ebpf_ring_buffer_record_t* record = NULL;
-    requested_length += EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
-    size_t remaining_space = ring->length - (ring->producer_offset - ring->consumer_offset);
-
-    if (remaining_space > requested_length) {
-        record = _ring_record_at_offset(ring, _ring_get_producer_offset(ring));
-        _ring_advance_producer_offset(ring, requested_length);
-        record->header.length = (uint32_t)requested_length;
-        record->header.locked = 1;
-        record->header.discarded = 0;
-    }
-    return record;
+    size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
+    if (consumer_offset >= producer_offset) {
+        // The ring is full of reservations that are not published yet.
+        return false;
+    }
+
+    volatile ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, consumer_offset);
+    if (record->header.locked) {
+        return false;
+    }
+    size_t record_length = record->header.length;
+    if (record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+        record_length > producer_offset - consumer_offset) {
+        return false;
+    }
+
+    ebpf_interlocked_compare_exchange_int64(
+        (volatile int64_t*)&ring->consumer_offset,
+        (int64_t)(consumer_offset + record_length),
+        (int64_t)consumer_offset);
+    // Either this producer or another one moved the consumer offset forward.
+    return true;
 }
 
-_Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
+/**
+ * @brief Claim space for a record and publish its locked header.
+ *
+ * Producers race to claim space by advancing producer_reserve_offset with a compare-exchange. Once a producer
+ * owns [reserve_offset, reserve_offset + record_length) it writes the record header with the locked bit set and
+ * then waits for all earlier reservations to be published before advancing producer_offset past its own record.
+ * The wait only covers the header write of earlier producers (never the data copy), and the IRQL is raised to
+ * DISPATCH_LEVEL for its duration so a producer can't be preempted by another producer on the same CPU.
+ *
+ * @param[in, out] ring Ring buffer to reserve space in.
+ * @param[in] length Length of the record data.
+ * @param[out] record Pointer to the locked record on success.
+ * @retval EBPF_SUCCESS Successfully reserved the record.
+ * @retval EBPF_INVALID_ARGUMENT The record can never fit in the ring buffer.
+ * @retval EBPF_OUT_OF_SPACE Not enough free space in the ring buffer.
+ */
+static _Must_inspect_result_ ebpf_result_t
+_ring_buffer_acquire_record(
+    _Inout_ ebpf_ring_buffer_t* ring, size_t length, _Outptr_ ebpf_ring_buffer_record_t** record)
+{
+    size_t record_length = length + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    if (ring->user_producer) {
+        return EBPF_OPERATION_NOT_SUPPORTED;
+    }
+    if (length > (UINT32_MAX >> 2) || record_length >= _ring_get_length(ring)) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+
+    KIRQL old_irql = KeGetCurrentIrql();
+    if (old_irql < DISPATCH_LEVEL) {
+        old_irql = ebpf_raise_irql(DISPATCH_LEVEL);
+    }
+
+    ebpf_result_t result;
+    size_t reserve_offset;
+    for (;;) {
+        reserve_offset = ReadULong64Acquire(&ring->producer_reserve_offset);
+        size_t consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+        // Keep at least one byte free so a full ring is distinguishable from an empty one.
+        if (_ring_get_length(ring) - (reserve_offset - consumer_offset) <= record_length) {
+            // The consumer may have released space through the shared offsets page since it was last read.
+            consumer_offset = _ring_sync_consumer_offset(ring);
+            if (_ring_get_length(ring) - (reserve_offset - consumer_offset) <= record_length) {
+                if (ring->overwrite && _ring_drop_oldest_record(ring, consumer_offset)) {
+                    continue;
+                }
+                result = EBPF_OUT_OF_SPACE;
+                goto Done;
+            }
+        }
+        if ((size_t)ebpf_interlocked_compare_exchange_int64(
+                (volatile int64_t*)&ring->producer_reserve_offset,
+                (int64_t)(reserve_offset + record_length),
+                (int64_t)reserve_offset) == reserve_offset) {
+            break;
+        }
+    }
+
+    ebpf_ring_buffer_record_t* local_record = _ring_record_at_offset(ring, reserve_offset);
+    local_record->header.length = (uint32_t)record_length;
+    local_record->header.discarded = 0;
+    local_record->header.locked = 1;
+
+    // Records are published in reservation order, so wait for earlier producers to publish their headers.
+    while (ReadULong64Acquire(&ring->producer_offset) != reserve_offset) {
+        YieldProcessor();
+    }
+    // Publish to the shared offsets page before producer_offset, so the next producer can't overwrite it with a
+    // larger offset first.
+    if (ring->offsets != NULL) {
+        WriteULong64Release(&ring->offsets->producer_offset, reserve_offset + record_length);
+    }
+    // Release ensures the locked header is visible before the consumer can observe the new producer offset.
+    WriteULong64Release(&ring->producer_offset, reserve_offset + record_length);
+
+    *record = local_record;
+    result = EBPF_SUCCESS;
+
+Done:
+    ebpf_lower_irql_from_dispatch_if_needed(old_irql);
+    return result;
+}
+
+inline static void
+_ring_buffer_release_record(_Inout_ ebpf_ring_buffer_record_t* record, bool discard)
+{
+    record->header.discarded = discard ? 1 : 0;
+    // Place a memory barrier here so that all prior writes to the record are completed before the record
+    // is unlocked. Caller needs to ensure a MemoryBarrier between reading the record->header.locked and
+    // the data in the record.
+    MemoryBarrier();
+    record->header.locked = 0;
+}
+
+static _Must_inspect_result_ ebpf_result_t
+_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity, bool overwrite, bool user_producer)
 {
     EBPF_LOG_ENTRY();
     ebpf_result_t result;
@@ -90,6 +261,8 @@ ebpf_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
     }
 
     local_ring_buffer->length = capacity;
+    local_ring_buffer->overwrite = overwrite;
+    local_ring_buffer->user_producer = user_producer;
 
     local_ring_buffer->ring_descriptor = ebpf_allocate_ring_buffer_memory(capacity);
     if (!local_ring_buffer->ring_descriptor) {
@@ -98,6 +271,18 @@ ebpf_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
     }
     local_ring_buffer->shared_buffer = ebpf_ring_descriptor_get_base_address(local_ring_buffer->ring_descriptor);
 
+    local_ring_buffer->offsets_memory = ebpf_map_memory(sizeof(ebpf_ring_buffer_offsets_t));
+    if (!local_ring_buffer->offsets_memory) {
+        result = EBPF_NO_MEMORY;
+        goto Error;
+    }
+    local_ring_buffer->offsets = ebpf_memory_descriptor_get_base_address(local_ring_buffer->offsets_memory);
+    if (!local_ring_buffer->offsets) {
+        result = EBPF_NO_MEMORY;
+        goto Error;
+    }
+    memset(local_ring_buffer->offsets, 0, sizeof(ebpf_ring_buffer_offsets_t));
+
     *ring = local_ring_buffer;
     local_ring_buffer = NULL;
     return EBPF_SUCCESS;
@@ -108,12 +293,31 @@ Error:
     EBPF_RETURN_RESULT(result);
 }
 
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
+{
+    return _ring_buffer_create(ring, capacity, false, false);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_create_overwrite(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
+{
+    return _ring_buffer_create(ring, capacity, true, false);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_create_user_producer(_Outptr_ ebpf_ring_buffer_t** ring, size_t capacity)
+{
+    return _ring_buffer_create(ring, capacity, false, true);
+}
+
 void
 ebpf_ring_buffer_destroy(_Frees_ptr_opt_ ebpf_ring_buffer_t* ring)
 {
     if (ring) {
         EBPF_LOG_ENTRY();
 
+        ebpf_unmap_memory(ring->offsets_memory);
         ebpf_free_ring_buffer_memory(ring->ring_descriptor);
         ebpf_epoch_free(ring);
 
@@ -124,39 +328,45 @@ ebpf_ring_buffer_destroy(_Frees_ptr_opt_ ebpf_ring_buffer_t* ring)
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_output(_Inout_ ebpf_ring_buffer_t* ring, _In_reads_bytes_(length) uint8_t* data, size_t length)
 {
-    ebpf_result_t result;
-    // Before acquiring the lock, check if there is enough space in the ring buffer.
-    // This is the common case when the consumer is not consuming fast enough, so no need to acquire the lock
-    // and slow down the producer.
-    size_t remaining_space = ring->length - (ring->producer_offset - ring->consumer_offset);
-    if (remaining_space < length) {
+    ebpf_ring_buffer_record_t* record;
+    ebpf_result_t result = _ring_buffer_acquire_record(ring, length, &record);
+    if (result == EBPF_OPERATION_NOT_SUPPORTED) {
+        return result;
+    } else if (result != EBPF_SUCCESS) {
+        // Output has always reported a record that can't fit as out of space.
         return EBPF_OUT_OF_SPACE;
     }
 
-    ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
-    ebpf_ring_buffer_record_t* record = _ring_buffer_acquire_record(ring, length);
-
-    if (record == NULL) {
-        result = EBPF_OUT_OF_SPACE;
-        goto Done;
-    }
-
-    record->header.discarded = 0;
-    record->header.locked = 0;
     memcpy(record->data, data, length);
-    result = EBPF_SUCCESS;
-Done:
-    ebpf_lock_unlock(&ring->lock, state);
-    return result;
+    _ring_buffer_release_record(record, false);
+    return EBPF_SUCCESS;
 }
 
 void
-ebpf_ring_buffer_query(_In_ ebpf_ring_buffer_t* ring, _Out_ size_t* consumer, _Out_ size_t* producer)
+ebpf_ring_buffer_query(_Inout_ ebpf_ring_buffer_t* ring, _Out_ size_t* consumer, _Out_ size_t* producer)
 {
-    ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
-    *consumer = ring->consumer_offset;
-    *producer = ring->producer_offset;
-    ebpf_lock_unlock(&ring->lock, state);
+    *consumer = _ring_sync_consumer_offset(ring);
+    *producer = ReadULong64Acquire(&ring->producer_offset);
+}
+
+size_t
+ebpf_ring_buffer_count_records(
+    _In_ const ebpf_ring_buffer_t* ring, size_t consumer, size_t producer, size_t max_records)
+{
+    size_t record_count = 0;
+    while (record_count < max_records && consumer < producer) {
+        volatile const ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, consumer);
+        size_t record_length = record->header.length;
+        if (record->header.locked || record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+            record_length > producer - consumer) {
+            break;
+        }
+        if (!record->header.discarded) {
+            record_count++;
+        }
+        consumer += record_length;
+    }
+    return record_count;
 }
 
 _Must_inspect_result_ ebpf_result_t
@@ -164,9 +374,13 @@ ebpf_ring_buffer_return(_Inout_ ebpf_ring_buffer_t* ring, size_t length)
 {
     EBPF_LOG_ENTRY();
     ebpf_result_t result;
+    if (ring->user_producer) {
+        EBPF_RETURN_RESULT(EBPF_OPERATION_NOT_SUPPORTED);
+    }
     ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
     size_t local_length = length;
-    size_t offset = _ring_get_consumer_offset(ring);
+    size_t consumer_offset = _ring_sync_consumer_offset(ring);
+    size_t offset = consumer_offset;
 
     if ((length > _ring_get_length(ring)) || length > _ring_get_used_capacity(ring)) {
         EBPF_LOG_MESSAGE_UINT64_UINT64(
@@ -182,7 +396,8 @@ ebpf_ring_buffer_return(_Inout_ ebpf_ring_buffer_t* ring, size_t length)
     // Verify count.
     while (local_length != 0) {
         ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, offset);
-        if (local_length < record->header.length) {
+        // Records that are still locked by a producer can't be returned.
+        if (record->header.locked || local_length < record->header.length) {
             break;
         }
         offset += record->header.length;
@@ -199,7 +414,16 @@ ebpf_ring_buffer_return(_Inout_ ebpf_ring_buffer_t* ring, size_t length)
         goto Done;
     }
 
-    _ring_advance_consumer_offset(ring, length);
+    if (ring->overwrite) {
+        // Producers may have dropped records while they were being verified. The verified length is then relative
+        // to a stale consumer offset, and the records it covers are already gone.
+        ebpf_interlocked_compare_exchange_int64(
+            (volatile int64_t*)&ring->consumer_offset,
+            (int64_t)(consumer_offset + length),
+            (int64_t)consumer_offset);
+    } else {
+        _ring_advance_consumer_offset(ring, consumer_offset + length);
+    }
     result = EBPF_SUCCESS;
 
 Done:
@@ -210,7 +434,8 @@ Done:
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_map_buffer(_In_ const ebpf_ring_buffer_t* ring, _Outptr_ uint8_t** buffer)
 {
-    *buffer = ebpf_ring_map_readonly_user(ring->ring_descriptor);
+    *buffer = ring->user_producer ? ebpf_ring_map_user(ring->ring_descriptor)
+                                  : ebpf_ring_map_readonly_user(ring->ring_descriptor);
     if (!*buffer) {
         return EBPF_INVALID_ARGUMENT;
     } else {
@@ -219,27 +444,178 @@ ebpf_ring_buffer_map_buffer(_In_ const ebpf_ring_buffer_t* ring, _Outptr_ uint8_
 }
 
 _Must_inspect_result_ ebpf_result_t
-ebpf_ring_buffer_reserve(
-    _Inout_ ebpf_ring_buffer_t* ring, _Outptr_result_bytebuffer_(length) uint8_t** data, size_t length)
+ebpf_ring_buffer_map_offsets(_In_ const ebpf_ring_buffer_t* ring, _Outptr_ ebpf_ring_buffer_offsets_t** offsets)
 {
-    ebpf_result_t result;
+    *offsets = NULL;
+    if (!ring->offsets_memory) {
+        return EBPF_INVALID_ARGUMENT;
+    }
+    // Producers of an overwrite ring drop records by moving the consumer offset, which a consumer walking the ring
+    // from its own copy of the offset would not notice.
+    if (ring->overwrite) {
+        return EBPF_OPERATION_NOT_SUPPORTED;
+    }
+    *offsets = ebpf_map_memory_user(ring->offsets_memory);
+    if (!*offsets) {
+        return EBPF_INVALID_ARGUMENT;
+    } else {
+        return EBPF_SUCCESS;
+    }
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_drain(
+    _Inout_ ebpf_ring_buffer_t* ring,
+    _In_ ebpf_ring_buffer_drain_callback_t callback,
+    _Inout_opt_ void* context,
+    size_t max_records,
+    _Out_ size_t* records_drained)
+{
+    ebpf_result_t result = EBPF_SUCCESS;
+    size_t record_count = 0;
+    *records_drained = 0;
+    if (!ring->user_producer) {
+        return EBPF_OPERATION_NOT_SUPPORTED;
+    }
+
+    // Serialize consumers, the drain callback may run on several CPUs at once.
     ebpf_lock_state_t state = ebpf_lock_lock(&ring->lock);
-    ebpf_ring_buffer_record_t* record = _ring_buffer_acquire_record(ring, length);
-    if (record == NULL) {
-        result = EBPF_INVALID_ARGUMENT;
+    size_t consumer_offset = ring->consumer_offset;
+    size_t producer_offset = ReadULong64Acquire(&ring->offsets->producer_offset);
+    if (producer_offset < consumer_offset || producer_offset - consumer_offset > _ring_get_length(ring)) {
+        result = EBPF_INVALID_STATE;
         goto Done;
     }
+    WriteULong64NoFence(&ring->producer_offset, producer_offset);
 
-    record->header.locked = 1;
-    MemoryBarrier();
+    while (record_count < max_records && consumer_offset != producer_offset) {
+        volatile ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, consumer_offset);
+        if (record->header.locked) {
+            break;
+        }
+        // Don't read the rest of the record until the lock bit has been observed clear.
+        MemoryBarrier();
+        // The producer can rewrite the header at any time, so each field is read once and only the copy is used.
+        size_t record_length = record->header.length;
+        bool discarded = record->header.discarded;
+        if (record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+            record_length > producer_offset - consumer_offset) {
+            result = EBPF_INVALID_STATE;
+            break;
+        }
+        consumer_offset += record_length;
+        if (discarded) {
+            continue;
+        }
+        record_count++;
+        if (callback(
+                context,
+                (const uint8_t*)record->data,
+                record_length - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data)) != 0) {
+            break;
+        }
+    }
+
+    // Release the space to the producer only after the callbacks are done with the records.
+    WriteULong64Release(&ring->consumer_offset, consumer_offset);
+    WriteULong64Release(&ring->offsets->consumer_offset, consumer_offset);
 
-    *data = record->data;
-    result = EBPF_SUCCESS;
 Done:
     ebpf_lock_unlock(&ring->lock, state);
+    *records_drained = record_count;
     return result;
 }
 
+#define EBPF_RING_BUFFER_SNAPSHOT_RETRIES 16
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_snapshot(
+    _Inout_ ebpf_ring_buffer_t* ring,
+    _Out_writes_to_(buffer_length, *length) uint8_t* buffer,
+    size_t buffer_length,
+    _Out_ size_t* start_offset,
+    _Out_ size_t* length)
+{
+    EBPF_LOG_ENTRY();
+    *start_offset = 0;
+    *length = 0;
+
+    for (uint32_t attempt = 0; attempt < EBPF_RING_BUFFER_SNAPSHOT_RETRIES; attempt++) {
+        size_t consumer_offset = _ring_sync_consumer_offset(ring);
+        size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
+        size_t window_start = consumer_offset;
+
+        // Skip the oldest records until the rest fit in the buffer. The headers are only trusted if the consumer
+        // offset is unchanged once the copy is done.
+        bool torn = false;
+        while (producer_offset - window_start > buffer_length) {
+            volatile ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, window_start);
+            size_t record_length = record->header.length;
+            if (record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+                record_length > producer_offset - window_start) {
+                torn = true;
+                break;
+            }
+            window_start += record_length;
+        }
+        if (torn) {
+            continue;
+        }
+
+        // The ring is double mapped, so the window is contiguous even when it wraps.
+        memcpy(buffer, _ring_record_at_offset(ring, window_start), producer_offset - window_start);
+        MemoryBarrier();
+
+        // Space is only reused once the consumer offset has moved past it, so everything copied at or after the
+        // current consumer offset is intact.
+        size_t current_consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+        if (current_consumer_offset != consumer_offset) {
+            if (current_consumer_offset < window_start) {
+                // Records were dropped from the skipped part, whose headers may have been torn.
+                continue;
+            }
+            if (current_consumer_offset > producer_offset) {
+                continue;
+            }
+            memmove(
+                buffer, buffer + (current_consumer_offset - window_start), producer_offset - current_consumer_offset);
+            window_start = current_consumer_offset;
+        }
+
+        // End the window before the first record that is still being written.
+        size_t window_length = 0;
+        while (window_length < producer_offset - window_start) {
+            const ebpf_ring_buffer_record_t* record = (const ebpf_ring_buffer_record_t*)(buffer + window_length);
+            size_t record_length = record->header.length;
+            if (record->header.locked || record_length < EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data) ||
+                record_length > producer_offset - window_start - window_length) {
+                break;
+            }
+            window_length += record_length;
+        }
+
+        *start_offset = window_start;
+        *length = window_length;
+        EBPF_RETURN_RESULT(EBPF_SUCCESS);
+    }
+
+    EBPF_RETURN_RESULT(EBPF_TIMEOUT);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_reserve(
+    _Inout_ ebpf_ring_buffer_t* ring, _Outptr_result_bytebuffer_(length) uint8_t** data, size_t length)
+{
+    ebpf_ring_buffer_record_t* record;
+    ebpf_result_t result = _ring_buffer_acquire_record(ring, length, &record);
+    if (result != EBPF_SUCCESS) {
+        return result;
+    }
+
+    *data = record->data;
+    return EBPF_SUCCESS;
+}
+
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_submit(_Frees_ptr_opt_ uint8_t* data)
 {
@@ -249,12 +625,7 @@ ebpf_ring_buffer_submit(_Frees_ptr_opt_ uint8_t* data)
     ebpf_ring_buffer_record_t* record =
         (ebpf_ring_buffer_record_t*)(data - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
 
-    record->header.discarded = 0;
-    // Place a memory barrier here so that all prior writes to the record are completed before the record
-    // is unlocked. Caller needs to ensure a MemoryBarrier between reading the record->header.locked and
-    // the data in the record.
-    MemoryBarrier();
-    record->header.locked = 0;
+    _ring_buffer_release_record(record, false);
     return EBPF_SUCCESS;
 }
 
@@ -267,11 +638,48 @@ ebpf_ring_buffer_discard(_Frees_ptr_opt_ uint8_t* data)
     ebpf_ring_buffer_record_t* record =
         (ebpf_ring_buffer_record_t*)(data - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
 
-    record->header.discarded = 1;
-    // Place a memory barrier here so that all prior writes to the record are completed before the record
-    // is unlocked. Caller needs to ensure a MemoryBarrier between reading the record->header.locked and
-    // the data in the record.
-    MemoryBarrier();
-    record->header.locked = 0;
+    _ring_buffer_release_record(record, true);
     return EBPF_SUCCESS;
 }
+
+bool
+ebpf_ring_buffer_is_reserved_record(_In_ const ebpf_ring_buffer_t* ring, _In_ const uint8_t* data)
+{
+    size_t header_length = EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    // Records always start in the first of the two back to back mappings of the ring.
+    if (data < ring->shared_buffer + header_length ||
+        data >= ring->shared_buffer + _ring_get_length(ring) + header_length) {
+        return false;
+    }
+
+    // A reserved record is published with its locked header and the consumer never moves past a locked record, so it
+    // stays between the consumer and producer offsets until it is submitted or discarded. Walk the published headers
+    // from the consumer offset so that only an exact record boundary matches, not an address inside a record.
+    size_t record_offset = (size_t)(data - header_length - ring->shared_buffer);
+    size_t consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+    for (;;) {
+        size_t producer_offset = ReadULong64Acquire(&ring->producer_offset);
+        bool reserved = false;
+        size_t offset = consumer_offset;
+        while (offset < producer_offset) {
+            volatile const ebpf_ring_buffer_record_t* record = _ring_record_at_offset(ring, offset);
+            if (offset % _ring_get_length(ring) == record_offset) {
+                reserved = record->header.locked;
+                break;
+            }
+            size_t record_length = record->header.length;
+            if (record_length < header_length || record_length > producer_offset - offset) {
+                break;
+            }
+            offset += record_length;
+        }
+
+        // Space is only reused once the consumer offset has moved past it, so the headers walked are intact if the
+        // consumer offset did not move in the meantime.
+        size_t current_consumer_offset = ReadULong64Acquire(&ring->consumer_offset);
+        if (current_consumer_offset == consumer_offset) {
+            return reserved;
+        }
+        consumer_offset = current_consumer_offset;
+    }
+}
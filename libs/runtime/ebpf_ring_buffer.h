@@ -8,16 +8,39 @@
 
 CXPLAT_EXTERN_C_BEGIN
 
-// typedef struct _ebpf_ring_buffer ebpf_ring_buffer_t;
-// TODO: temporarily moved from ebpf_ring_buffer.h for perf array testing until PR #4204 is merged.
+// The ring buffer is defined here rather than kept opaque because each perf event array embeds one ring per CPU.
+//
+// Producers never take a lock. Space is claimed by advancing producer_reserve_offset with a compare-exchange,
+// the record header is written with the locked bit set, and producer_offset is then advanced in reservation
+// order. Records between consumer_offset and producer_offset are visible to the consumer, which stops at the
+// first record that is still locked. The lock only serializes consumers returning space to the ring.
+//
+// Ring buffers created with ebpf_ring_buffer_create also publish their offsets through a shared
+// ebpf_ring_buffer_offsets_t page. Producers fold the consumer offset from that page into consumer_offset only
+// when they run out of space, so a consumer that advances it directly never needs to return space by IOCTL.
+//
+// In overwrite mode a producer that runs out of space drops the oldest published records by advancing
+// consumer_offset past them with a compare-exchange, so the ring always holds the newest records. A consumer that
+// drains such a ring while producers are overwriting it can observe torn records; ebpf_ring_buffer_snapshot gives a
+// consistent copy instead.
+//
+// In user producer mode the roles are reversed: a user-mode producer writes records into a writable mapping of the
+// ring and advances producer_offset in the offsets page, and ebpf_ring_buffer_drain consumes them in the kernel.
+// Everything the producer writes is untrusted, so each header is read once and validated before it is used.
+//
 typedef struct _ebpf_ring_buffer
 {
     ebpf_lock_t lock;
     size_t length;
-    size_t consumer_offset;
-    size_t producer_offset;
+    bool overwrite;
+    bool user_producer;
+    volatile size_t consumer_offset;
+    volatile size_t producer_offset;
+    volatile size_t producer_reserve_offset;
     uint8_t* shared_buffer;
     ebpf_ring_descriptor_t* ring_descriptor;
+    MDL* offsets_memory;
+    ebpf_ring_buffer_offsets_t* offsets;
 } ebpf_ring_buffer_t;
 
 /**
@@ -31,6 +54,28 @@ typedef struct _ebpf_ring_buffer
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_create(_Outptr_ ebpf_ring_buffer_t** ring_buffer, size_t capacity);
 
+/**
+ * @brief Allocate a ring_buffer with capacity that overwrites its oldest records instead of failing when full.
+ *
+ * @param[out] ring_buffer Pointer to buffer that holds ring buffer pointer on success.
+ * @param[in] capacity Size in bytes of ring buffer.
+ * @retval EBPF_SUCCESS Successfully allocated ring buffer.
+ * @retval EBPF_NO_MEMORY Unable to allocate ring buffer.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_create_overwrite(_Outptr_ ebpf_ring_buffer_t** ring_buffer, size_t capacity);
+
+/**
+ * @brief Allocate a ring_buffer with capacity that is written by a user-mode producer and drained in the kernel.
+ *
+ * @param[out] ring_buffer Pointer to buffer that holds ring buffer pointer on success.
+ * @param[in] capacity Size in bytes of ring buffer.
+ * @retval EBPF_SUCCESS Successfully allocated ring buffer.
+ * @retval EBPF_NO_MEMORY Unable to allocate ring buffer.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_create_user_producer(_Outptr_ ebpf_ring_buffer_t** ring_buffer, size_t capacity);
+
 /**
  * @brief Free a ring buffer.
  *
@@ -52,14 +97,29 @@ _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_output(_Inout_ ebpf_ring_buffer_t* ring_buffer, _In_reads_bytes_(length) uint8_t* data, size_t length);
 
 /**
- * @brief Query the current ready and free offsets from the ring buffer.
+ * @brief Query the current ready and free offsets from the ring buffer. Space the consumer has released through
+ * the shared offsets page is folded in first.
  *
- * @param[in] ring_buffer Ring buffer to query.
+ * @param[in, out] ring_buffer Ring buffer to query.
  * @param[out] consumer Offset of the first buffer that can be consumed.
  * @param[out] producer Offset of the next buffer to be produced.
  */
 void
-ebpf_ring_buffer_query(_In_ ebpf_ring_buffer_t* ring_buffer, _Out_ size_t* consumer, _Out_ size_t* producer);
+ebpf_ring_buffer_query(_Inout_ ebpf_ring_buffer_t* ring_buffer, _Out_ size_t* consumer, _Out_ size_t* producer);
+
+/**
+ * @brief Count the published records between two offsets returned by ebpf_ring_buffer_query. Discarded records are
+ * not counted, and counting stops at the first record that is still being written.
+ *
+ * @param[in] ring_buffer Ring buffer to count records in.
+ * @param[in] consumer Consumer offset to start counting at.
+ * @param[in] producer Producer offset to stop counting at.
+ * @param[in] max_records Number of records to stop counting at.
+ * @return Number of records counted.
+ */
+size_t
+ebpf_ring_buffer_count_records(
+    _In_ const ebpf_ring_buffer_t* ring_buffer, size_t consumer, size_t producer, size_t max_records);
 
 /**
  * @brief Mark one or more records in the ring buffer as returned to the ring.
@@ -73,7 +133,40 @@ _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_return(_Inout_ ebpf_ring_buffer_t* ring_buffer, size_t length);
 
 /**
- * @brief Get pointer to the ring buffer shared data.
+ * @brief Function called by ebpf_ring_buffer_drain for each record.
+ *
+ * @param[in, out] context Context passed to ebpf_ring_buffer_drain.
+ * @param[in] data Record data. It is shared with the producer and can change while it is being read.
+ * @param[in] length Length of the record data.
+ * @return 0 to continue draining, any other value to stop after this record.
+ */
+typedef int (*ebpf_ring_buffer_drain_callback_t)(
+    _Inout_opt_ void* context, _In_reads_bytes_(length) const uint8_t* data, size_t length);
+
+/**
+ * @brief Consume records written by the user-mode producer of a user producer ring buffer.
+ *
+ * @param[in, out] ring_buffer Ring buffer to drain.
+ * @param[in] callback Function called for each record that was not discarded.
+ * @param[in, out] context Context passed to callback.
+ * @param[in] max_records Maximum number of records to pass to callback.
+ * @param[out] records_drained Number of records passed to callback.
+ * @retval EBPF_SUCCESS Drained the records that were ready.
+ * @retval EBPF_OPERATION_NOT_SUPPORTED The ring buffer isn't written from user mode.
+ * @retval EBPF_INVALID_STATE The producer published an invalid offset or record. Records before it were drained.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_drain(
+    _Inout_ ebpf_ring_buffer_t* ring_buffer,
+    _In_ ebpf_ring_buffer_drain_callback_t callback,
+    _Inout_opt_ void* context,
+    size_t max_records,
+    _Out_ size_t* records_drained);
+
+/**
+ * @brief Get pointer to the ring buffer shared data. The mapping is read-only unless the ring buffer is written by
+ * a user-mode producer. Each process maps the ring once, and the mapping is removed when the process exits or the
+ * ring buffer is destroyed.
  *
  * @param[in] ring_buffer Ring buffer to query.
  * @param[out] buffer Pointer to ring buffer data.
@@ -83,6 +176,40 @@ ebpf_ring_buffer_return(_Inout_ ebpf_ring_buffer_t* ring_buffer, size_t length);
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_map_buffer(_In_ const ebpf_ring_buffer_t* ring_buffer, _Outptr_ uint8_t** buffer);
 
+/**
+ * @brief Get pointer to the ring buffer offsets page, mapped writable into the calling process. Each process maps the
+ * page once, and the mapping is removed when the process exits or the ring buffer is destroyed.
+ *
+ * @param[in] ring_buffer Ring buffer to query.
+ * @param[out] offsets Pointer to the shared producer and consumer offsets.
+ * @retval EBPF_SUCCESS Successfully mapped the offsets page.
+ * @retval EBPF_INVALID_ARGUMENT The ring buffer has no offsets page or it could not be mapped.
+ * @retval EBPF_OPERATION_NOT_SUPPORTED The ring buffer overwrites its oldest records.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_map_offsets(_In_ const ebpf_ring_buffer_t* ring_buffer, _Outptr_ ebpf_ring_buffer_offsets_t** offsets);
+
+/**
+ * @brief Copy a consistent window of the newest records in the ring buffer. Records overwritten by producers
+ * while they are being copied are trimmed from the start of the window, and the window ends before the first
+ * record that is still being written.
+ *
+ * @param[in, out] ring_buffer Ring buffer to copy from.
+ * @param[out] buffer Buffer that receives the records in ring buffer record format, oldest first.
+ * @param[in] buffer_length Length of buffer.
+ * @param[out] start_offset Ring buffer offset of the first record copied.
+ * @param[out] length Number of bytes copied.
+ * @retval EBPF_SUCCESS Successfully copied the window.
+ * @retval EBPF_TIMEOUT Producers kept overwriting the window faster than it could be copied.
+ */
+_Must_inspect_result_ ebpf_result_t
+ebpf_ring_buffer_snapshot(
+    _Inout_ ebpf_ring_buffer_t* ring_buffer,
+    _Out_writes_to_(buffer_length, *length) uint8_t* buffer,
+    size_t buffer_length,
+    _Out_ size_t* start_offset,
+    _Out_ size_t* length);
+
 /**
  * @brief Reserve a buffer in the ring buffer. Buffer is valid until either ebpf_ring_buffer_submit,
  * ebpf_ring_buffer_discard, or the end of the current epoch.
@@ -90,8 +217,11 @@ ebpf_ring_buffer_map_buffer(_In_ const ebpf_ring_buffer_t* ring_buffer, _Outptr_
  * @param[in, out] ring_buffer Ring buffer to update.
  * @param[out] data Pointer to start of reserved buffer on success.
  * @param[in] length Length of buffer to reserve.
+ * @note This function is safe to call concurrently from multiple producers.
+ *
  * @retval EBPF_SUCCESS Successfully reserved space in the ring buffer.
- * @retval EBPF_INVALID_ARGUMENT Unable to reserve space in the ring buffer.
+ * @retval EBPF_INVALID_ARGUMENT The requested length can never fit in the ring buffer.
+ * @retval EBPF_OUT_OF_SPACE Unable to reserve space in the ring buffer due to inadequate space.
  */
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_reserve(
@@ -117,4 +247,18 @@ ebpf_ring_buffer_submit(_Frees_ptr_opt_ uint8_t* data);
 _Must_inspect_result_ ebpf_result_t
 ebpf_ring_buffer_discard(_Frees_ptr_opt_ uint8_t* data);
 
+/**
+ * @brief Check whether an address is the data of a record reserved in the ring buffer that has not been submitted
+ * or discarded yet. The record headers between the consumer and producer offsets are walked to find it, so an
+ * address inside a record never matches and any address can be checked as long as the ring buffer itself is valid.
+ * The cost is linear in the number of records not yet returned by the consumer.
+ *
+ * @param[in] ring_buffer Ring buffer to check.
+ * @param[in] data Address to check.
+ * @retval true The address is the data of a reserved record.
+ * @retval false The address is not the data of a reserved record.
+ */
+bool
+ebpf_ring_buffer_is_reserved_record(_In_ const ebpf_ring_buffer_t* ring_buffer, _In_ const uint8_t* data);
+
 CXPLAT_EXTERN_C_END
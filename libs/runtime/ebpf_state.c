@@ -46,6 +46,7 @@ ebpf_state_initiate()
         .key_size = sizeof(uint64_t),
         .value_size = sizeof(ebpf_state_entry_t),
         .minimum_bucket_count = ebpf_get_cpu_count(),
+        .maximum_bucket_count = EBPF_HASH_TABLE_MAXIMUM_BUCKET_COUNT,
     };
 
     return_value = ebpf_hash_table_create(&_ebpf_state_thread_table, &options);
@@ -8,6 +8,7 @@ typedef struct _ebpf_timed_work_queue
     KTIMER timer;
     KDPC dpc;
     ebpf_list_entry_t work_items;
+    ebpf_list_entry_t deferred_work_items; ///< Moved to work_items when the DPC runs.
     ebpf_lock_t lock;
     bool timer_armed;
     LARGE_INTEGER interval;
@@ -47,6 +48,7 @@ ebpf_timed_work_queue_create(
     ebpf_lock_create(&local_work_queue->lock);
 
     ebpf_list_initialize(&local_work_queue->work_items);
+    ebpf_list_initialize(&local_work_queue->deferred_work_items);
 
     KeInitializeTimer(&local_work_queue->timer);
     KeInitializeDpc(&local_work_queue->dpc, _ebpf_timed_work_queue_timer_callback, local_work_queue);
@@ -106,7 +108,11 @@ ebpf_timed_work_queue_insert(
     lock_state = ebpf_lock_lock(&work_queue->lock);
 
     timer_armed = work_queue->timer_armed;
-    ebpf_list_insert_tail(&work_queue->work_items, work_item);
+    if (wake_behavior == EBPF_WORK_QUEUE_WAKEUP_DEFERRED) {
+        ebpf_list_insert_tail(&work_queue->deferred_work_items, work_item);
+    } else {
+        ebpf_list_insert_tail(&work_queue->work_items, work_item);
+    }
 
     if (wake_behavior == EBPF_WORK_QUEUE_WAKEUP_ON_INSERT) {
         KeCancelTimer(&work_queue->timer);
@@ -125,7 +131,7 @@ ebpf_timed_work_queue_insert(
 bool
 ebpf_timed_work_queue_is_empty(_In_ ebpf_timed_work_queue_t* work_queue)
 {
-    return ebpf_list_is_empty(&work_queue->work_items);
+    return ebpf_list_is_empty(&work_queue->work_items) && ebpf_list_is_empty(&work_queue->deferred_work_items);
 }
 
 void
@@ -149,6 +155,14 @@ ebpf_timed_work_queued_flush(_In_ ebpf_timed_work_queue_t* work_queue)
         lock_state = ebpf_lock_lock(&work_queue->lock);
     }
 
+    // Deferred work items only run when the DPC runs, so keep the timer armed for them.
+    if (!ebpf_list_is_empty(&work_queue->deferred_work_items) && !work_queue->timer_armed) {
+        LARGE_INTEGER due_time;
+        due_time.QuadPart = -work_queue->interval.QuadPart;
+        KeSetTimer(&work_queue->timer, due_time, &work_queue->dpc);
+        work_queue->timer_armed = true;
+    }
+
     ebpf_lock_unlock(&work_queue->lock, lock_state);
 }
 
@@ -161,6 +175,14 @@ _ebpf_timed_work_queue_timer_callback(
     UNREFERENCED_PARAMETER(system_argument2);
     ebpf_timed_work_queue_t* work_queue = (ebpf_timed_work_queue_t*)context;
     if (work_queue) {
+        ebpf_lock_state_t lock_state = ebpf_lock_lock(&work_queue->lock);
+        if (!ebpf_list_is_empty(&work_queue->deferred_work_items)) {
+            ebpf_list_entry_t* first_entry = work_queue->deferred_work_items.Flink;
+            ebpf_list_remove_entry(&work_queue->deferred_work_items);
+            ebpf_list_initialize(&work_queue->deferred_work_items);
+            ebpf_list_append_tail_list(&work_queue->work_items, first_entry);
+        }
+        ebpf_lock_unlock(&work_queue->lock, lock_state);
         ebpf_timed_work_queued_flush(work_queue);
     }
 }
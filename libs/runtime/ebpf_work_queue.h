@@ -25,6 +25,7 @@ extern "C"
     {
         EBPF_WORK_QUEUE_WAKEUP_ON_INSERT = 0, ///< Wake up the work queue.
         EBPF_WORK_QUEUE_WAKEUP_ON_TIMER = 1,  ///< Don't wake up the work queue.
+        EBPF_WORK_QUEUE_WAKEUP_DEFERRED = 2,  ///< Don't wake up the work queue or run in a flush already in progress.
     } ebpf_work_queue_wakeup_behavior_t;
 
     /**
@@ -58,6 +59,8 @@ extern "C"
 
     /**
      * @brief Insert a work item into the timed work queue. If immediate is true, the timer will fire immediately.
+     * Deferred work items wait for the next wakeup of the work queue, so a callback can re-insert its work item to
+     * run again later without being called again by the flush that is calling it.
      *
      * @param[in] work_queue The work queue to insert the work item into.
      * @param[in] work_item The work item to insert.
@@ -15,6 +15,95 @@ struct _ebpf_ring_descriptor
 };
 typedef struct _ebpf_ring_descriptor ebpf_ring_descriptor_t;
 
+// A mapping of memory into the user address space of a process. Each process maps a given MDL at most once, and
+// queries from the same process return the existing mapping.
+typedef struct _ebpf_user_mapping
+{
+    LIST_ENTRY list_entry;
+    MDL* memory_descriptor_list; ///< MDL describing the mapped pages.
+    PEPROCESS process;           ///< Referenced process that the pages are mapped into.
+    void* user_address;          ///< Base of the mapping in the process.
+} ebpf_user_mapping_t;
+
+// User mappings of all processes. Mappings are removed, in the context of their process, when the process exits or
+// when the pages they map are freed, so that user mode can never reach freed pages.
+static FAST_MUTEX _ebpf_user_mapping_mutex;
+static LIST_ENTRY _ebpf_user_mappings;
+static volatile long _ebpf_user_mapping_count;
+static bool _ebpf_user_mapping_notify_registered = false;
+
+/**
+ * @brief Map an MDL into the calling process, or return the mapping that the process already has.
+ *
+ * @param[in] memory_descriptor_list MDL describing the pages to map.
+ * @param[in] priority Page priority and mapping flags for MmMapLockedPagesSpecifyCache.
+ * @return Base of the mapping in the calling process, or NULL on failure.
+ */
+_IRQL_requires_max_(APC_LEVEL) static _Ret_maybenull_ void* _ebpf_user_mapping_get_or_create(
+    _In_ MDL* memory_descriptor_list, unsigned long priority)
+{
+    void* user_address = NULL;
+    PEPROCESS process = PsGetCurrentProcess();
+
+    ExAcquireFastMutex(&_ebpf_user_mapping_mutex);
+    for (LIST_ENTRY* list_entry = _ebpf_user_mappings.Flink; list_entry != &_ebpf_user_mappings;
+         list_entry = list_entry->Flink) {
+        ebpf_user_mapping_t* mapping = CONTAINING_RECORD(list_entry, ebpf_user_mapping_t, list_entry);
+        if (mapping->memory_descriptor_list == memory_descriptor_list && mapping->process == process) {
+            user_address = mapping->user_address;
+            goto Done;
+        }
+    }
+
+    ebpf_user_mapping_t* new_mapping = (ebpf_user_mapping_t*)ebpf_allocate(sizeof(ebpf_user_mapping_t));
+    if (!new_mapping) {
+        goto Done;
+    }
+
+    __try {
+        user_address =
+            MmMapLockedPagesSpecifyCache(memory_descriptor_list, UserMode, MmCached, NULL, FALSE, priority);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        EBPF_LOG_NTSTATUS_API_FAILURE(EBPF_TRACELOG_KEYWORD_BASE, MmMapLockedPagesSpecifyCache, STATUS_NO_MEMORY);
+        user_address = NULL;
+    }
+    if (!user_address) {
+        ebpf_free(new_mapping);
+        goto Done;
+    }
+
+    ObReferenceObject(process);
+    new_mapping->memory_descriptor_list = memory_descriptor_list;
+    new_mapping->process = process;
+    new_mapping->user_address = user_address;
+    InsertTailList(&_ebpf_user_mappings, &new_mapping->list_entry);
+    InterlockedIncrement(&_ebpf_user_mapping_count);
+
+Done:
+    ExReleaseFastMutex(&_ebpf_user_mapping_mutex);
+    return user_address;
+}
+
+/**
+ * @brief Unmap a user mapping in the context of its process and free it. The caller holds the mapping mutex.
+ *
+ * @param[in] mapping Mapping to remove.
+ */
+_IRQL_requires_max_(APC_LEVEL) static void _ebpf_user_mapping_delete(_In_ _Post_invalid_ ebpf_user_mapping_t* mapping)
+{
+    KAPC_STATE apc_state;
+
+    RemoveEntryList(&mapping->list_entry);
+    InterlockedDecrement(&_ebpf_user_mapping_count);
+
+    KeStackAttachProcess(mapping->process, &apc_state);
+    MmUnmapLockedPages(mapping->user_address, mapping->memory_descriptor_list);
+    KeUnstackDetachProcess(&apc_state);
+
+    ObDereferenceObject(mapping->process);
+    ebpf_free(mapping);
+}
+
 static KDEFERRED_ROUTINE _ebpf_deferred_routine;
 static KDEFERRED_ROUTINE _ebpf_timer_routine;
 
@@ -110,6 +199,7 @@ ebpf_free_ring_buffer_memory(_Frees_ptr_opt_ ebpf_ring_descriptor_t* ring)
         EBPF_RETURN_VOID();
     }
 
+    ebpf_unmap_memory_user(ring->memory_descriptor_list);
     MmUnmapLockedPages(ring->base_address, ring->memory_descriptor_list);
 
     IoFreeMdl(ring->memory_descriptor_list);
@@ -127,14 +217,92 @@ ebpf_ring_descriptor_get_base_address(_In_ const ebpf_ring_descriptor_t* memory_
 _Ret_maybenull_ void*
 ebpf_ring_map_readonly_user(_In_ const ebpf_ring_descriptor_t* ring)
 {
-    __try {
-        return MmMapLockedPagesSpecifyCache(
-            ring->memory_descriptor_list, UserMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoWrite);
-    } __except (EXCEPTION_EXECUTE_HANDLER) {
-        EBPF_LOG_NTSTATUS_API_FAILURE(EBPF_TRACELOG_KEYWORD_BASE, MmMapLockedPagesSpecifyCache, STATUS_NO_MEMORY);
-        return NULL;
+    return _ebpf_user_mapping_get_or_create(ring->memory_descriptor_list, NormalPagePriority | MdlMappingNoWrite);
+}
+
+_Ret_maybenull_ void*
+ebpf_ring_map_user(_In_ const ebpf_ring_descriptor_t* ring)
+{
+    return _ebpf_user_mapping_get_or_create(ring->memory_descriptor_list, NormalPagePriority | MdlMappingNoExecute);
+}
+
+_Ret_maybenull_ void*
+ebpf_map_memory_user(_In_ MDL* memory_descriptor)
+{
+    return _ebpf_user_mapping_get_or_create(memory_descriptor, NormalPagePriority | MdlMappingNoExecute);
+}
+
+void
+ebpf_unmap_memory_user(_In_ MDL* memory_descriptor)
+{
+    if (ReadNoFence(&_ebpf_user_mapping_count) == 0) {
+        return;
+    }
+
+    ExAcquireFastMutex(&_ebpf_user_mapping_mutex);
+    LIST_ENTRY* list_entry = _ebpf_user_mappings.Flink;
+    while (list_entry != &_ebpf_user_mappings) {
+        ebpf_user_mapping_t* mapping = CONTAINING_RECORD(list_entry, ebpf_user_mapping_t, list_entry);
+        list_entry = list_entry->Flink;
+        if (mapping->memory_descriptor_list == memory_descriptor) {
+            _ebpf_user_mapping_delete(mapping);
+        }
+    }
+    ExReleaseFastMutex(&_ebpf_user_mapping_mutex);
+}
+
+/**
+ * @brief Remove the mappings of an exiting process. Process exit notifications run in the context of the exiting
+ * process before its address space is torn down, so its mappings can still be unmapped.
+ */
+static void
+_ebpf_user_mapping_process_notify(HANDLE parent_id, HANDLE process_id, BOOLEAN create)
+{
+    UNREFERENCED_PARAMETER(parent_id);
+    if (create || ReadNoFence(&_ebpf_user_mapping_count) == 0) {
+        return;
+    }
+
+    ExAcquireFastMutex(&_ebpf_user_mapping_mutex);
+    LIST_ENTRY* list_entry = _ebpf_user_mappings.Flink;
+    while (list_entry != &_ebpf_user_mappings) {
+        ebpf_user_mapping_t* mapping = CONTAINING_RECORD(list_entry, ebpf_user_mapping_t, list_entry);
+        list_entry = list_entry->Flink;
+        if (PsGetProcessId(mapping->process) == process_id) {
+            _ebpf_user_mapping_delete(mapping);
+        }
+    }
+    ExReleaseFastMutex(&_ebpf_user_mapping_mutex);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_user_mappings_initiate()
+{
+    ExInitializeFastMutex(&_ebpf_user_mapping_mutex);
+    InitializeListHead(&_ebpf_user_mappings);
+    _ebpf_user_mapping_count = 0;
+
+    NTSTATUS status = PsSetCreateProcessNotifyRoutine(_ebpf_user_mapping_process_notify, FALSE);
+    if (!NT_SUCCESS(status)) {
+        EBPF_LOG_NTSTATUS_API_FAILURE(EBPF_TRACELOG_KEYWORD_BASE, PsSetCreateProcessNotifyRoutine, status);
+        return EBPF_NO_MEMORY;
+    }
+    _ebpf_user_mapping_notify_registered = true;
+    return EBPF_SUCCESS;
+}
+
+void
+ebpf_user_mappings_terminate()
+{
+    if (_ebpf_user_mapping_notify_registered) {
+        // Waits for process notifications that are already running.
+        (void)PsSetCreateProcessNotifyRoutine(_ebpf_user_mapping_process_notify, TRUE);
+        _ebpf_user_mapping_notify_registered = false;
     }
+    // Every mapping is removed when the memory it maps is freed, which happens before the platform terminates.
+    ebpf_assert(IsListEmpty(&_ebpf_user_mappings));
 }
+
 // There isn't an official API to query this information from kernel.
 // Use NtQuerySystemInformation with struct + header from winternl.h.
 
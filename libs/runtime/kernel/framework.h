@@ -27,5 +27,6 @@
 #define ebpf_list_remove_entry RemoveEntryList
 #define ebpf_list_remove_head_entry RemoveHeadList
 #define ebpf_list_append_tail_list AppendTailList
+#define ebpf_probe_for_read ProbeForRead
 #define ebpf_probe_for_write ProbeForWrite
 #define ebpf_fault_injection_is_enabled() false
@@ -26,6 +26,8 @@
 #include <winsock2.h>
 #include <Windows.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <complex>
@@ -35,6 +37,7 @@
 #include <mutex>
 #include <numeric>
 #include <sddl.h>
+#include <set>
 #include <thread>
 #include <vector>
 
@@ -379,6 +382,371 @@ TEST_CASE("hash_table_test", "[platform]")
     REQUIRE(ebpf_hash_table_key_count(table.get()) == 0);
 }
 
+TEST_CASE("hash_table_resize", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    const uint32_t key_count = 1000;
+    const ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(uint32_t),
+        .value_size = sizeof(uint64_t),
+        .allocate = ebpf_allocate,
+        .free = ebpf_free,
+        .minimum_bucket_count = 4,
+        .maximum_bucket_count = 1024,
+    };
+
+    ebpf_hash_table_t* raw_ptr = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_SUCCESS);
+    ebpf_hash_table_ptr table(raw_ptr);
+
+    // Insert enough keys to grow the table several times.
+    for (uint32_t key = 0; key < key_count; key++) {
+        uint64_t value = static_cast<uint64_t>(key) * 3;
+        REQUIRE(
+            ebpf_hash_table_update(
+                table.get(),
+                reinterpret_cast<const uint8_t*>(&key),
+                reinterpret_cast<const uint8_t*>(&value),
+                EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_SUCCESS);
+    }
+    REQUIRE(ebpf_hash_table_key_count(table.get()) == key_count);
+
+    for (uint32_t key = 0; key < key_count; key++) {
+        uint8_t* value = nullptr;
+        REQUIRE(ebpf_hash_table_find(table.get(), reinterpret_cast<const uint8_t*>(&key), &value) == EBPF_SUCCESS);
+        REQUIRE(*reinterpret_cast<uint64_t*>(value) == static_cast<uint64_t>(key) * 3);
+    }
+
+    // Walk the keys while inserting more, so that the table is resized during the walk. Every key present for the
+    // whole walk must be returned. Keys may be returned twice if their bucket was split after they were returned.
+    std::vector<uint32_t> seen(static_cast<size_t>(key_count) * 2);
+    uint32_t previous_key = 0;
+    uint32_t next_key = 0;
+    uint32_t inserted_key = key_count;
+    bool first = true;
+    while (ebpf_hash_table_next_key(
+               table.get(),
+               first ? nullptr : reinterpret_cast<const uint8_t*>(&previous_key),
+               reinterpret_cast<uint8_t*>(&next_key)) == EBPF_SUCCESS) {
+        REQUIRE(next_key < seen.size());
+        seen[next_key]++;
+        if (inserted_key < key_count * 2) {
+            uint64_t value = 0;
+            REQUIRE(
+                ebpf_hash_table_update(
+                    table.get(),
+                    reinterpret_cast<const uint8_t*>(&inserted_key),
+                    reinterpret_cast<const uint8_t*>(&value),
+                    EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_SUCCESS);
+            inserted_key++;
+        }
+        previous_key = next_key;
+        first = false;
+    }
+    for (uint32_t key = 0; key < key_count; key++) {
+        REQUIRE(seen[key] >= 1);
+    }
+    REQUIRE(ebpf_hash_table_key_count(table.get()) == key_count * 2);
+
+    // Iterate over all keys using the cookie.
+    size_t cookie = 0;
+    size_t found = 0;
+    std::vector<const uint8_t*> keys(64);
+    std::vector<const uint8_t*> values(64);
+    for (;;) {
+        size_t count = keys.size();
+        ebpf_result_t result = ebpf_hash_table_iterate(table.get(), &cookie, &count, keys.data(), values.data());
+        if (result == EBPF_NO_MORE_KEYS) {
+            break;
+        }
+        REQUIRE(result == EBPF_SUCCESS);
+        found += count;
+    }
+    REQUIRE(found == key_count * 2);
+
+    // Iterate over all keys in 3 ranges of buckets.
+    found = 0;
+    const size_t range_starts[] = {0, EBPF_HASH_TABLE_ITERATE_END / 3, EBPF_HASH_TABLE_ITERATE_END / 3 * 2};
+    const size_t range_ends[] = {range_starts[1], range_starts[2], EBPF_HASH_TABLE_ITERATE_END};
+    for (size_t range = 0; range < EBPF_COUNT_OF(range_starts); range++) {
+        cookie = range_starts[range];
+        for (;;) {
+            size_t count = keys.size();
+            ebpf_result_t result = ebpf_hash_table_iterate_range(
+                table.get(), &cookie, range_ends[range], &count, keys.data(), values.data());
+            if (result == EBPF_NO_MORE_KEYS) {
+                break;
+            }
+            REQUIRE(result == EBPF_SUCCESS);
+            found += count;
+        }
+    }
+    REQUIRE(found == key_count * 2);
+
+    // Delete all keys, shrinking the table.
+    for (uint32_t key = 0; key < key_count * 2; key++) {
+        REQUIRE(ebpf_hash_table_delete(table.get(), reinterpret_cast<const uint8_t*>(&key)) == EBPF_SUCCESS);
+    }
+    REQUIRE(ebpf_hash_table_key_count(table.get()) == 0);
+    REQUIRE(ebpf_hash_table_next_key(table.get(), nullptr, reinterpret_cast<uint8_t*>(&next_key)) == EBPF_NO_MORE_KEYS);
+}
+
+TEST_CASE("hash_table_preallocated", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    const size_t entry_count = 16;
+    ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(uint32_t),
+        .value_size = sizeof(uint64_t),
+        .allocate = ebpf_allocate,
+        .free = ebpf_free,
+        .minimum_bucket_count = entry_count,
+        .preallocated_entry_count = entry_count,
+    };
+
+    // Preallocated storage is returned to the pools by the epoch allocator.
+    ebpf_hash_table_t* raw_ptr = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_INVALID_ARGUMENT);
+
+    options.allocate = nullptr;
+    options.free = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_SUCCESS);
+
+    {
+        ebpf_epoch_scope_t epoch_scope;
+        // Insert more entries than were preallocated, and churn them so that storage is reused.
+        for (uint32_t iteration = 0; iteration < 100; iteration++) {
+            for (uint32_t key = 0; key < entry_count * 2; key++) {
+                uint64_t value = static_cast<uint64_t>(key) + iteration;
+                REQUIRE(
+                    ebpf_hash_table_update(
+                        raw_ptr,
+                        reinterpret_cast<const uint8_t*>(&key),
+                        reinterpret_cast<const uint8_t*>(&value),
+                        EBPF_HASH_TABLE_OPERATION_ANY) == EBPF_SUCCESS);
+            }
+            for (uint32_t key = 0; key < entry_count * 2; key++) {
+                uint8_t* value = nullptr;
+                REQUIRE(ebpf_hash_table_find(raw_ptr, reinterpret_cast<const uint8_t*>(&key), &value) == EBPF_SUCCESS);
+                REQUIRE(*reinterpret_cast<uint64_t*>(value) == static_cast<uint64_t>(key) + iteration);
+            }
+            for (uint32_t key = 0; key < entry_count * 2; key += 2) {
+                REQUIRE(ebpf_hash_table_delete(raw_ptr, reinterpret_cast<const uint8_t*>(&key)) == EBPF_SUCCESS);
+            }
+            REQUIRE(ebpf_hash_table_key_count(raw_ptr) == entry_count);
+        }
+        ebpf_hash_table_destroy(raw_ptr);
+    }
+    ebpf_epoch_synchronize();
+}
+
+TEST_CASE("hash_table_preallocated_full_churn", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    const uint32_t entry_count = 1024;
+    ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(uint32_t),
+        .value_size = sizeof(uint64_t),
+        .minimum_bucket_count = entry_count,
+        .max_entries = entry_count,
+        .preallocated_entry_count = entry_count,
+    };
+    ebpf_hash_table_t* raw_ptr = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_SUCCESS);
+
+    auto update = [&](uint32_t key, uint64_t value, ebpf_hash_table_operations_t operation) {
+        ebpf_epoch_scope_t epoch_scope;
+        return ebpf_hash_table_update(
+            raw_ptr, reinterpret_cast<const uint8_t*>(&key), reinterpret_cast<const uint8_t*>(&value), operation);
+    };
+
+    for (uint32_t key = 0; key < entry_count; key++) {
+        REQUIRE(update(key, key, EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_SUCCESS);
+    }
+    ebpf_epoch_synchronize();
+
+    // In each epoch replace the values of half of the keys, and delete and reinsert a quarter of them. The replaced
+    // values and buckets wait for the epoch to end, which the pools have room for.
+    for (uint32_t iteration = 0; iteration < 10; iteration++) {
+        for (uint32_t key = 1; key < entry_count; key += 2) {
+            REQUIRE(update(key, static_cast<uint64_t>(key) + iteration, EBPF_HASH_TABLE_OPERATION_ANY) == EBPF_SUCCESS);
+        }
+        for (uint32_t key = 0; key < entry_count; key += 4) {
+            ebpf_epoch_scope_t epoch_scope;
+            REQUIRE(ebpf_hash_table_delete(raw_ptr, reinterpret_cast<const uint8_t*>(&key)) == EBPF_SUCCESS);
+        }
+        for (uint32_t key = 0; key < entry_count; key += 4) {
+            REQUIRE(update(key, key, EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_SUCCESS);
+        }
+
+        // Inserting into the full hash table fails without taking storage.
+        REQUIRE(update(entry_count, 0, EBPF_HASH_TABLE_OPERATION_ANY) == EBPF_OUT_OF_SPACE);
+        REQUIRE(ebpf_hash_table_key_count(raw_ptr) == entry_count);
+        ebpf_epoch_synchronize();
+    }
+    REQUIRE(ebpf_hash_table_pool_fallback_count(raw_ptr) == 0);
+
+    {
+        ebpf_epoch_scope_t epoch_scope;
+        ebpf_hash_table_destroy(raw_ptr);
+    }
+    ebpf_epoch_synchronize();
+}
+
+TEST_CASE("hash_table_long_bucket", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    // A single bucket holds all keys, so lookups compare several blocks of tags.
+    const size_t key_count = 100;
+    std::vector<std::array<uint8_t, 40>> keys(key_count);
+    const ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(keys[0]),
+        .value_size = sizeof(uint64_t),
+        .minimum_bucket_count = 1,
+    };
+
+    ebpf_hash_table_t* raw_ptr = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_SUCCESS);
+    ebpf_hash_table_ptr table(raw_ptr);
+
+    ebpf_epoch_scope_t epoch_scope;
+    for (uint64_t index = 0; index < key_count; index++) {
+        keys[index].fill(0);
+        memcpy(keys[index].data() + keys[index].size() - sizeof(index), &index, sizeof(index));
+        REQUIRE(
+            ebpf_hash_table_update(
+                table.get(),
+                keys[index].data(),
+                reinterpret_cast<const uint8_t*>(&index),
+                EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_SUCCESS);
+    }
+
+    for (uint64_t index = 0; index < key_count; index += 2) {
+        REQUIRE(ebpf_hash_table_delete(table.get(), keys[index].data()) == EBPF_SUCCESS);
+    }
+
+    for (uint64_t index = 0; index < key_count; index++) {
+        uint8_t* value = nullptr;
+        if (index % 2 == 0) {
+            REQUIRE(ebpf_hash_table_find(table.get(), keys[index].data(), &value) == EBPF_KEY_NOT_FOUND);
+        } else {
+            REQUIRE(ebpf_hash_table_find(table.get(), keys[index].data(), &value) == EBPF_SUCCESS);
+            REQUIRE(*reinterpret_cast<uint64_t*>(value) == index);
+        }
+    }
+    REQUIRE(ebpf_hash_table_key_count(table.get()) == key_count / 2);
+}
+
+TEST_CASE("hash_table_update_in_place", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    // Two 64 bit words followed by a partial word.
+    typedef struct _test_value
+    {
+        uint64_t words[2];
+        uint32_t tail;
+    } test_value_t;
+
+    const ebpf_hash_table_creation_options_t options = {
+        .key_size = sizeof(uint32_t),
+        .value_size = sizeof(test_value_t),
+        .update_in_place = true,
+    };
+
+    ebpf_hash_table_t* raw_ptr = nullptr;
+    REQUIRE(ebpf_hash_table_create(&raw_ptr, &options) == EBPF_SUCCESS);
+    ebpf_hash_table_ptr table(raw_ptr);
+
+    ebpf_epoch_scope_t epoch_scope;
+    uint32_t key = 1;
+    test_value_t value = {{1, 2}, 3};
+    test_value_t copy;
+    uint8_t* first_value = nullptr;
+    uint8_t* second_value = nullptr;
+
+    // Updating a missing key inserts it.
+    REQUIRE(
+        ebpf_hash_table_update(
+            table.get(),
+            reinterpret_cast<const uint8_t*>(&key),
+            reinterpret_cast<const uint8_t*>(&value),
+            EBPF_HASH_TABLE_OPERATION_REPLACE) == EBPF_KEY_NOT_FOUND);
+    REQUIRE(
+        ebpf_hash_table_update(
+            table.get(),
+            reinterpret_cast<const uint8_t*>(&key),
+            reinterpret_cast<const uint8_t*>(&value),
+            EBPF_HASH_TABLE_OPERATION_ANY) == EBPF_SUCCESS);
+    REQUIRE(ebpf_hash_table_find(table.get(), reinterpret_cast<const uint8_t*>(&key), &first_value) == EBPF_SUCCESS);
+
+    // Updating an existing key overwrites the value without replacing its storage.
+    value = {{4, 5}, 6};
+    REQUIRE(
+        ebpf_hash_table_update(
+            table.get(),
+            reinterpret_cast<const uint8_t*>(&key),
+            reinterpret_cast<const uint8_t*>(&value),
+            EBPF_HASH_TABLE_OPERATION_REPLACE) == EBPF_SUCCESS);
+    REQUIRE(ebpf_hash_table_find(table.get(), reinterpret_cast<const uint8_t*>(&key), &second_value) == EBPF_SUCCESS);
+    REQUIRE(first_value == second_value);
+    ebpf_hash_table_copy_value(table.get(), second_value, reinterpret_cast<uint8_t*>(&copy));
+    REQUIRE(memcmp(&copy, &value, sizeof(value)) == 0);
+
+    // Inserting an existing key still fails.
+    REQUIRE(
+        ebpf_hash_table_update(
+            table.get(),
+            reinterpret_cast<const uint8_t*>(&key),
+            reinterpret_cast<const uint8_t*>(&value),
+            EBPF_HASH_TABLE_OPERATION_INSERT) == EBPF_OBJECT_ALREADY_EXISTS);
+
+    // A NULL value zeroes the value in place.
+    REQUIRE(
+        ebpf_hash_table_update(
+            table.get(), reinterpret_cast<const uint8_t*>(&key), nullptr, EBPF_HASH_TABLE_OPERATION_ANY) ==
+        EBPF_SUCCESS);
+    ebpf_hash_table_copy_value(table.get(), first_value, reinterpret_cast<uint8_t*>(&copy));
+    REQUIRE(copy.words[0] == 0);
+    REQUIRE(copy.words[1] == 0);
+    REQUIRE(copy.tail == 0);
+    REQUIRE(ebpf_hash_table_key_count(table.get()) == 1);
+
+    // Copies made while another thread updates the value are never torn.
+    std::atomic<bool> stop = false;
+    std::atomic<size_t> failed_updates = 0;
+    std::thread writer([&]() {
+        ebpf_epoch_scope_t writer_epoch_scope;
+        for (uint32_t iteration = 1; !stop; iteration++) {
+            test_value_t new_value = {{iteration, iteration}, iteration};
+            if (ebpf_hash_table_update(
+                    table.get(),
+                    reinterpret_cast<const uint8_t*>(&key),
+                    reinterpret_cast<const uint8_t*>(&new_value),
+                    EBPF_HASH_TABLE_OPERATION_ANY) != EBPF_SUCCESS) {
+                failed_updates++;
+            }
+        }
+    });
+    for (size_t iteration = 0; iteration < 100000; iteration++) {
+        ebpf_hash_table_copy_value(table.get(), first_value, reinterpret_cast<uint8_t*>(&copy));
+        REQUIRE(copy.words[0] == copy.words[1]);
+        REQUIRE(copy.words[0] == copy.tail);
+    }
+    stop = true;
+    writer.join();
+    REQUIRE(failed_updates == 0);
+}
+
 void
 run_in_epoch(std::function<void()> function)
 {
@@ -567,6 +935,95 @@ TEST_CASE("epoch_test_single_epoch_cache_aligned", "[platform]")
     ebpf_epoch_synchronize();
 }
 
+TEST_CASE("epoch_test_pool", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    const size_t element_count = 4;
+    ebpf_epoch_pool_t* pool = nullptr;
+    REQUIRE(ebpf_epoch_pool_create(&pool, 24, element_count, EBPF_POOL_TAG_EPOCH) == EBPF_SUCCESS);
+
+    std::set<void*> elements;
+    {
+        ebpf_epoch_scope_t epoch_scope;
+        for (size_t index = 0; index < element_count; index++) {
+            uint8_t* element = reinterpret_cast<uint8_t*>(ebpf_epoch_pool_allocate(pool));
+            REQUIRE(element != nullptr);
+            REQUIRE(std::all_of(element, element + 24, [](uint8_t value) { return value == 0; }));
+            memset(element, 0xcc, 24);
+            elements.insert(element);
+        }
+        REQUIRE(elements.size() == element_count);
+
+        // The pool is exhausted, so the next allocation falls back to the memory pool.
+        REQUIRE(ebpf_epoch_pool_fallback_count(pool) == 0);
+        void* fallback = ebpf_epoch_pool_allocate(pool);
+        REQUIRE(fallback != nullptr);
+        REQUIRE(elements.find(fallback) == elements.end());
+        REQUIRE(ebpf_epoch_pool_fallback_count(pool) == 1);
+        ebpf_epoch_free(fallback);
+
+        for (auto& element : elements) {
+            ebpf_epoch_free(element);
+        }
+    }
+    ebpf_epoch_synchronize();
+
+    // Freed elements are returned to the pool and zeroed when allocated again.
+    {
+        ebpf_epoch_scope_t epoch_scope;
+        std::vector<uint8_t*> reused;
+        for (size_t index = 0; index < element_count; index++) {
+            uint8_t* element = reinterpret_cast<uint8_t*>(ebpf_epoch_pool_allocate(pool));
+            REQUIRE(elements.find(element) != elements.end());
+            REQUIRE(std::all_of(element, element + 24, [](uint8_t value) { return value == 0; }));
+            reused.push_back(element);
+        }
+
+        // Elements waiting for the epoch to end keep the pool alive after it is destroyed.
+        for (auto& element : reused) {
+            ebpf_epoch_free(element);
+        }
+        ebpf_epoch_pool_destroy(pool);
+    }
+    ebpf_epoch_synchronize();
+}
+
+TEST_CASE("epoch_test_pool_cache_aligned", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+
+    const size_t element_count = 4;
+    ebpf_epoch_pool_t* pool = nullptr;
+    REQUIRE(ebpf_epoch_pool_create_cache_aligned(&pool, 72, element_count, EBPF_POOL_TAG_EPOCH) == EBPF_SUCCESS);
+
+    {
+        ebpf_epoch_scope_t epoch_scope;
+        std::vector<void*> elements;
+        for (size_t index = 0; index < element_count; index++) {
+            void* element = ebpf_epoch_pool_allocate(pool);
+            REQUIRE(element != nullptr);
+            REQUIRE(element == EBPF_CACHE_ALIGN_POINTER(element));
+            memset(element, 0xcc, 72);
+            elements.push_back(element);
+        }
+
+        // The fallback allocation is cache aligned too, and is freed the same way as the elements.
+        void* fallback = ebpf_epoch_pool_allocate(pool);
+        REQUIRE(fallback != nullptr);
+        REQUIRE(fallback == EBPF_CACHE_ALIGN_POINTER(fallback));
+        elements.push_back(fallback);
+
+        for (auto& element : elements) {
+            ebpf_epoch_free(element);
+        }
+        ebpf_epoch_pool_destroy(pool);
+    }
+    ebpf_epoch_synchronize();
+}
+
 TEST_CASE("epoch_test_two_threads", "[platform]")
 {
     _test_helper test_helper;
@@ -1165,6 +1622,537 @@ TEST_CASE("ring_buffer_reserve_submit_discard", "[platform]")
     ring_buffer = nullptr;
 }
 
+TEST_CASE("ring_buffer_is_reserved_record", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    ebpf_ring_buffer_t* ring_buffer;
+    size_t size = 64 * 1024;
+    size_t header_length = EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+
+    REQUIRE(ebpf_ring_buffer_create(&ring_buffer, size) == EBPF_SUCCESS);
+
+    uint8_t* first = nullptr;
+    uint8_t* second = nullptr;
+    REQUIRE(ebpf_ring_buffer_reserve(ring_buffer, &first, 64) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_reserve(ring_buffer, &second, 64) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_is_reserved_record(ring_buffer, first));
+    REQUIRE(ebpf_ring_buffer_is_reserved_record(ring_buffer, second));
+
+    // A program can write what looks like a locked header into its own record, an address inside the record must
+    // still not be accepted.
+    ebpf_ring_buffer_record_t* fake_record = reinterpret_cast<ebpf_ring_buffer_record_t*>(first + 16);
+    fake_record->header.length = static_cast<uint32_t>(header_length + 16);
+    fake_record->header.discarded = 0;
+    fake_record->header.locked = 1;
+    REQUIRE(!ebpf_ring_buffer_is_reserved_record(ring_buffer, first + 16 + header_length));
+    REQUIRE(!ebpf_ring_buffer_is_reserved_record(ring_buffer, first + 1));
+    REQUIRE(!ebpf_ring_buffer_is_reserved_record(ring_buffer, second + 64));
+
+    ebpf_result_t result = ebpf_ring_buffer_submit(first);
+    if (result != EBPF_SUCCESS) {
+        REQUIRE(result == EBPF_SUCCESS);
+    }
+    REQUIRE(!ebpf_ring_buffer_is_reserved_record(ring_buffer, first));
+    REQUIRE(ebpf_ring_buffer_is_reserved_record(ring_buffer, second));
+
+    result = ebpf_ring_buffer_discard(second);
+    if (result != EBPF_SUCCESS) {
+        REQUIRE(result == EBPF_SUCCESS);
+    }
+    REQUIRE(!ebpf_ring_buffer_is_reserved_record(ring_buffer, second));
+
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ring_buffer = nullptr;
+}
+
+typedef struct _ring_buffer_test_record
+{
+    uint32_t producer_id;
+    uint32_t sequence;
+    uint8_t payload[32];
+} ring_buffer_test_record_t;
+
+/**
+ * @brief Drain all ready records from a ring buffer, validating each submitted record.
+ *
+ * @param[in] ring_buffer Ring buffer to drain.
+ * @param[in] buffer Mapped ring buffer data.
+ * @param[in] size Size of the ring buffer.
+ * @param[in, out] next_sequence Next expected sequence number for each producer.
+ * @param[in, out] valid Set to false if a record fails validation.
+ * @return Number of non-discarded records consumed.
+ */
+static size_t
+_ring_buffer_drain(
+    _Inout_ ebpf_ring_buffer_t* ring_buffer,
+    _In_ const uint8_t* buffer,
+    size_t size,
+    std::vector<uint32_t>& next_sequence,
+    std::atomic<bool>& valid)
+{
+    size_t consumer_offset;
+    size_t producer_offset;
+    size_t consumed = 0;
+    size_t returned_length = 0;
+    ebpf_ring_buffer_query(ring_buffer, &consumer_offset, &producer_offset);
+    for (;;) {
+        auto record = ebpf_ring_buffer_next_record(buffer, size, consumer_offset, producer_offset);
+        if (record == nullptr) {
+            break;
+        }
+        if (!record->header.discarded) {
+            auto test_record = reinterpret_cast<const ring_buffer_test_record_t*>(record->data);
+            size_t data_length = record->header.length - EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+            size_t payload_length = test_record->sequence % sizeof(test_record->payload);
+            if (test_record->producer_id >= next_sequence.size() ||
+                data_length != EBPF_OFFSET_OF(ring_buffer_test_record_t, payload) + payload_length ||
+                test_record->sequence != next_sequence[test_record->producer_id]) {
+                valid = false;
+                break;
+            }
+            for (size_t i = 0; i < payload_length; i++) {
+                if (test_record->payload[i] != static_cast<uint8_t>(test_record->sequence)) {
+                    valid = false;
+                }
+            }
+            next_sequence[test_record->producer_id]++;
+            consumed++;
+        }
+        consumer_offset += record->header.length;
+        returned_length += record->header.length;
+    }
+    if (returned_length != 0 && ebpf_ring_buffer_return(ring_buffer, returned_length) != EBPF_SUCCESS) {
+        valid = false;
+    }
+    return consumed;
+}
+
+TEST_CASE("ring_buffer_shared_offsets", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    size_t consumer;
+    size_t producer;
+    ebpf_ring_buffer_t* ring_buffer;
+
+    uint8_t* buffer;
+    ebpf_ring_buffer_offsets_t* offsets;
+    std::vector<uint8_t> data(1023);
+    size_t size = 64 * 1024;
+
+    REQUIRE(ebpf_ring_buffer_create(&ring_buffer, size) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_buffer(ring_buffer, &buffer) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_offsets(ring_buffer, &offsets) == EBPF_SUCCESS);
+    REQUIRE(offsets->producer_offset == 0);
+    REQUIRE(offsets->consumer_offset == 0);
+
+    // The producer offset is published to the shared page.
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(offsets->producer_offset == producer);
+
+    // Fill the ring.
+    while (ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS) {
+    }
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(offsets->producer_offset == producer);
+    REQUIRE(consumer == 0);
+
+    // A consumer offset past the producer offset is ignored.
+    offsets->consumer_offset = producer + 1;
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_OUT_OF_SPACE);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == 0);
+
+    // A consumer offset that is not on a record boundary is ignored.
+    offsets->consumer_offset = data.size();
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_OUT_OF_SPACE);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == 0);
+
+    // Consume every record by advancing the shared consumer offset, without returning space to the ring.
+    size_t shared_consumer = 0;
+    const ebpf_ring_buffer_record_t* record;
+    while ((record = ebpf_ring_buffer_next_record(buffer, size, shared_consumer, offsets->producer_offset)) !=
+           nullptr) {
+        REQUIRE(record->header.length == data.size() + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data));
+        shared_consumer += record->header.length;
+    }
+    REQUIRE(shared_consumer == producer);
+    offsets->consumer_offset = shared_consumer;
+
+    // Producers pick up the released space.
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == shared_consumer);
+    REQUIRE(offsets->producer_offset == producer);
+
+    // The shared consumer offset never moves the ring backwards.
+    offsets->consumer_offset = 0;
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == shared_consumer);
+
+    // A consumer offset that skips a record still being written is ignored until the record is submitted.
+    uint8_t* reserved;
+    REQUIRE(ebpf_ring_buffer_reserve(ring_buffer, &reserved, data.size()) == EBPF_SUCCESS);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    offsets->consumer_offset = producer;
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == shared_consumer);
+    REQUIRE(ebpf_ring_buffer_submit(reserved) == EBPF_SUCCESS);
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == producer);
+
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ring_buffer = nullptr;
+}
+
+TEST_CASE("ring_buffer_overwrite", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    size_t consumer;
+    size_t producer;
+    ebpf_ring_buffer_t* ring_buffer;
+
+    uint8_t* buffer;
+    std::vector<uint8_t> data(1020);
+    size_t size = 64 * 1024;
+    size_t record_length = data.size() + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    uint32_t record_count = 200;
+
+    REQUIRE(ebpf_ring_buffer_create_overwrite(&ring_buffer, size) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_buffer(ring_buffer, &buffer) == EBPF_SUCCESS);
+    ebpf_ring_buffer_offsets_t* offsets;
+    REQUIRE(ebpf_ring_buffer_map_offsets(ring_buffer, &offsets) == EBPF_OPERATION_NOT_SUPPORTED);
+
+    // Writing more than the ring holds drops the oldest records instead of failing.
+    for (uint32_t sequence = 0; sequence < record_count; sequence++) {
+        memcpy(data.data(), &sequence, sizeof(sequence));
+        REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS);
+    }
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(producer == record_count * record_length);
+    REQUIRE(producer - consumer < size);
+    REQUIRE(size - (producer - consumer) <= record_length);
+
+    // The ring holds the newest records in order.
+    uint32_t expected_sequence = record_count - (uint32_t)((producer - consumer) / record_length);
+    size_t offset = consumer;
+    const ebpf_ring_buffer_record_t* record;
+    while ((record = ebpf_ring_buffer_next_record(buffer, size, offset, producer)) != nullptr) {
+        REQUIRE(record->header.length == record_length);
+        REQUIRE(*(uint32_t*)record->data == expected_sequence++);
+        offset += record->header.length;
+    }
+    REQUIRE(expected_sequence == record_count);
+
+    // A snapshot copies the same records without consuming them.
+    std::vector<uint8_t> snapshot(size);
+    size_t start_offset;
+    size_t length;
+    REQUIRE(
+        ebpf_ring_buffer_snapshot(ring_buffer, snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    REQUIRE(start_offset == consumer);
+    REQUIRE(length == producer - consumer);
+    record = (const ebpf_ring_buffer_record_t*)snapshot.data();
+    REQUIRE(*(uint32_t*)record->data == record_count - (uint32_t)(length / record_length));
+    size_t new_consumer;
+    ebpf_ring_buffer_query(ring_buffer, &new_consumer, &producer);
+    REQUIRE(new_consumer == consumer);
+
+    // A smaller snapshot keeps the newest records that fit.
+    snapshot.resize(4 * record_length + 10);
+    REQUIRE(
+        ebpf_ring_buffer_snapshot(ring_buffer, snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    REQUIRE(length == 4 * record_length);
+    REQUIRE(start_offset == producer - length);
+    for (uint32_t index = 0; index < 4; index++) {
+        record = (const ebpf_ring_buffer_record_t*)(snapshot.data() + index * record_length);
+        REQUIRE(*(uint32_t*)record->data == record_count - 4 + index);
+    }
+
+    // A snapshot ends before a record that is still being written.
+    size_t reserved_offset = producer;
+    uint8_t* reserved;
+    REQUIRE(ebpf_ring_buffer_reserve(ring_buffer, &reserved, data.size()) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS);
+    snapshot.resize(size);
+    REQUIRE(
+        ebpf_ring_buffer_snapshot(ring_buffer, snapshot.data(), snapshot.size(), &start_offset, &length) ==
+        EBPF_SUCCESS);
+    REQUIRE(start_offset + length == reserved_offset);
+
+    // Producers can't overwrite a record that is still being written.
+    while (ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS) {
+    }
+    ebpf_ring_buffer_query(ring_buffer, &consumer, &producer);
+    REQUIRE(consumer == reserved_offset);
+    REQUIRE(ebpf_ring_buffer_submit(reserved) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, data.data(), data.size()) == EBPF_SUCCESS);
+
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ring_buffer = nullptr;
+}
+
+typedef struct _user_ring_buffer_drain_context
+{
+    std::vector<uint32_t> sequences;
+    size_t stop_after;
+} user_ring_buffer_drain_context_t;
+
+static int
+_user_ring_buffer_drain_callback(_Inout_opt_ void* context, _In_reads_bytes_(length) const uint8_t* data, size_t length)
+{
+    user_ring_buffer_drain_context_t* drain_context = (user_ring_buffer_drain_context_t*)context;
+    REQUIRE(length == sizeof(uint32_t));
+    drain_context->sequences.push_back(*(const uint32_t*)data);
+    return drain_context->sequences.size() == drain_context->stop_after ? 1 : 0;
+}
+
+TEST_CASE("user_ring_buffer_drain", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    ebpf_ring_buffer_t* ring_buffer;
+    uint8_t* buffer;
+    ebpf_ring_buffer_offsets_t* offsets;
+    size_t size = 64 * 1024;
+    size_t record_length = sizeof(uint32_t) + EBPF_OFFSET_OF(ebpf_ring_buffer_record_t, data);
+    size_t producer = 0;
+    size_t records_drained;
+    user_ring_buffer_drain_context_t context{};
+
+    REQUIRE(ebpf_ring_buffer_create_user_producer(&ring_buffer, size) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_buffer(ring_buffer, &buffer) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_offsets(ring_buffer, &offsets) == EBPF_SUCCESS);
+
+    // Programs can't produce into a ring buffer owned by a user-mode producer.
+    uint32_t value = 0;
+    REQUIRE(ebpf_ring_buffer_output(ring_buffer, (uint8_t*)&value, sizeof(value)) == EBPF_OPERATION_NOT_SUPPORTED);
+
+    // Write records the same way user_ring_buffer__reserve does: 0 and 1 submitted, 2 discarded, 3 submitted and
+    // 4 still locked.
+    for (uint32_t sequence = 0; sequence < 5; sequence++) {
+        ebpf_ring_buffer_record_t* record = (ebpf_ring_buffer_record_t*)(buffer + producer);
+        record->header.length = (uint32_t)record_length;
+        record->header.discarded = sequence == 2;
+        record->header.locked = sequence == 4;
+        memcpy(record->data, &sequence, sizeof(sequence));
+        producer += record_length;
+    }
+    offsets->producer_offset = producer;
+
+    // Draining stops when the callback asks it to.
+    context.stop_after = 1;
+    REQUIRE(
+        ebpf_ring_buffer_drain(ring_buffer, _user_ring_buffer_drain_callback, &context, SIZE_MAX, &records_drained) ==
+        EBPF_SUCCESS);
+    REQUIRE(records_drained == 1);
+    REQUIRE(offsets->consumer_offset == record_length);
+
+    // Discarded records are skipped and draining stops at a record that is still being written.
+    context.stop_after = 0;
+    REQUIRE(
+        ebpf_ring_buffer_drain(ring_buffer, _user_ring_buffer_drain_callback, &context, SIZE_MAX, &records_drained) ==
+        EBPF_SUCCESS);
+    REQUIRE(records_drained == 2);
+    REQUIRE(context.sequences == std::vector<uint32_t>{0, 1, 3});
+    REQUIRE(offsets->consumer_offset == 4 * record_length);
+
+    ((ebpf_ring_buffer_record_t*)(buffer + 4 * record_length))->header.locked = 0;
+    REQUIRE(
+        ebpf_ring_buffer_drain(ring_buffer, _user_ring_buffer_drain_callback, &context, 1, &records_drained) ==
+        EBPF_SUCCESS);
+    REQUIRE(records_drained == 1);
+    REQUIRE(context.sequences.back() == 4);
+    REQUIRE(offsets->consumer_offset == producer);
+
+    // A producer offset behind the consumer or a record longer than the data written is rejected.
+    offsets->producer_offset = producer - 1;
+    REQUIRE(
+        ebpf_ring_buffer_drain(ring_buffer, _user_ring_buffer_drain_callback, &context, SIZE_MAX, &records_drained) ==
+        EBPF_INVALID_STATE);
+    ebpf_ring_buffer_record_t* record = (ebpf_ring_buffer_record_t*)(buffer + producer);
+    record->header.length = (uint32_t)(2 * record_length);
+    record->header.discarded = 0;
+    record->header.locked = 0;
+    offsets->producer_offset = producer + record_length;
+    REQUIRE(
+        ebpf_ring_buffer_drain(ring_buffer, _user_ring_buffer_drain_callback, &context, SIZE_MAX, &records_drained) ==
+        EBPF_INVALID_STATE);
+    REQUIRE(offsets->consumer_offset == producer);
+
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ring_buffer = nullptr;
+}
+
+TEST_CASE("ring_buffer_multi_producer_stress", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    ebpf_ring_buffer_t* ring_buffer;
+    uint8_t* buffer;
+    size_t size = 64 * 1024;
+    const uint32_t iterations = 10000;
+    // Each producer is pinned to its own CPU through a single-bit affinity mask.
+    uint32_t producer_count = std::min<uint32_t>(ebpf_get_cpu_count(), sizeof(uintptr_t) * 8);
+    std::atomic<bool> valid = true;
+    std::atomic<size_t> discarded_count = 0;
+
+    REQUIRE(ebpf_ring_buffer_create(&ring_buffer, size) == EBPF_SUCCESS);
+    REQUIRE(ebpf_ring_buffer_map_buffer(ring_buffer, &buffer) == EBPF_SUCCESS);
+
+    // Each producer alternates between output and reserve/submit, discarding every seventh reservation. Producers
+    // retry until the consumer frees space so that every sequence number is eventually delivered.
+    auto producer = [&](uint32_t producer_id) {
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<uintptr_t>(1) << producer_id);
+        ring_buffer_test_record_t record;
+        record.producer_id = producer_id;
+        for (uint32_t sequence = 0; sequence < iterations;) {
+            record.sequence = sequence;
+            size_t length = EBPF_OFFSET_OF(ring_buffer_test_record_t, payload) + sequence % sizeof(record.payload);
+            memset(record.payload, static_cast<uint8_t>(sequence), sizeof(record.payload));
+            if (sequence % 2 == 0) {
+                if (ebpf_ring_buffer_output(ring_buffer, reinterpret_cast<uint8_t*>(&record), length) ==
+                    EBPF_SUCCESS) {
+                    sequence++;
+                    continue;
+                }
+            } else {
+                uint8_t* data;
+                if (ebpf_ring_buffer_reserve(ring_buffer, &data, length) == EBPF_SUCCESS) {
+                    if ((sequence + producer_id) % 7 == 0) {
+                        (void)ebpf_ring_buffer_discard(data);
+                        discarded_count++;
+                        continue;
+                    }
+                    memcpy(data, &record, length);
+                    (void)ebpf_ring_buffer_submit(data);
+                    sequence++;
+                    continue;
+                }
+            }
+            std::this_thread::yield();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < producer_count; i++) {
+        threads.emplace_back(producer, i);
+    }
+
+    size_t expected = static_cast<size_t>(producer_count) * iterations;
+    size_t consumed = 0;
+    std::vector<uint32_t> next_sequence(producer_count, 0);
+    while (consumed < expected && valid) {
+        size_t drained = _ring_buffer_drain(ring_buffer, buffer, size, next_sequence, valid);
+        if (drained == 0) {
+            std::this_thread::yield();
+        }
+        consumed += drained;
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(valid);
+    REQUIRE(consumed == expected);
+    for (auto sequence : next_sequence) {
+        REQUIRE(sequence == iterations);
+    }
+
+    // Only discarded records may remain in the ring.
+    consumed = _ring_buffer_drain(ring_buffer, buffer, size, next_sequence, valid);
+    REQUIRE(consumed == 0);
+    size_t consumer_offset;
+    size_t producer_offset;
+    ebpf_ring_buffer_query(ring_buffer, &consumer_offset, &producer_offset);
+    REQUIRE(consumer_offset == producer_offset);
+    CAPTURE(discarded_count.load());
+
+    ebpf_ring_buffer_destroy(ring_buffer);
+    ring_buffer = nullptr;
+}
+
+TEST_CASE("ring_buffer_multi_producer_output", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    size_t size = 1024 * 1024;
+    const uint32_t iterations = 100000;
+    uint32_t cpu_count = std::min<uint32_t>(ebpf_get_cpu_count(), sizeof(uintptr_t) * 8);
+
+    for (uint32_t producer_count = 1; producer_count <= cpu_count; producer_count *= 2) {
+        ebpf_ring_buffer_t* ring_buffer;
+        uint8_t* buffer;
+        REQUIRE(ebpf_ring_buffer_create(&ring_buffer, size) == EBPF_SUCCESS);
+        REQUIRE(ebpf_ring_buffer_map_buffer(ring_buffer, &buffer) == EBPF_SUCCESS);
+
+        std::atomic<bool> valid = true;
+        std::atomic<size_t> dropped = 0;
+        std::atomic<uint32_t> running = producer_count;
+        auto producer = [&](uint32_t producer_id) {
+            SetThreadAffinityMask(GetCurrentThread(), static_cast<uintptr_t>(1) << producer_id);
+            ring_buffer_test_record_t record = {producer_id};
+            size_t local_dropped = 0;
+            for (uint32_t i = 0; i < iterations; i++) {
+                if (ebpf_ring_buffer_output(
+                        ring_buffer,
+                        reinterpret_cast<uint8_t*>(&record),
+                        EBPF_OFFSET_OF(ring_buffer_test_record_t, payload)) != EBPF_SUCCESS) {
+                    local_dropped++;
+                }
+            }
+            dropped += local_dropped;
+            running--;
+        };
+
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < producer_count; i++) {
+            threads.emplace_back(producer, i);
+        }
+
+        // Drain without validating sequence numbers, as dropped records leave gaps.
+        size_t consumed = 0;
+        while (valid) {
+            size_t consumer_offset;
+            size_t producer_offset;
+            size_t returned_length = 0;
+            ebpf_ring_buffer_query(ring_buffer, &consumer_offset, &producer_offset);
+            const ebpf_ring_buffer_record_t* record;
+            while ((record = ebpf_ring_buffer_next_record(buffer, size, consumer_offset, producer_offset)) !=
+                   nullptr) {
+                consumer_offset += record->header.length;
+                returned_length += record->header.length;
+                consumed++;
+            }
+            if (returned_length == 0) {
+                if (running == 0) {
+                    break;
+                }
+                std::this_thread::yield();
+            } else if (ebpf_ring_buffer_return(ring_buffer, returned_length) != EBPF_SUCCESS) {
+                valid = false;
+                break;
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        REQUIRE(valid);
+        REQUIRE(consumed + dropped == static_cast<size_t>(producer_count) * iterations);
+
+        ebpf_ring_buffer_destroy(ring_buffer);
+    }
+}
+
 const static size_t PERF_RECORD_HEADER_SIZE = EBPF_OFFSET_OF(ebpf_perf_event_array_record_t, data);
 
 size_t
@@ -1339,7 +2327,7 @@ _test_perf_event_output(
         // Verify the record just written.
         auto record = ebpf_perf_event_array_next_record(buffer, size, new_consumer, new_producer);
         REQUIRE(record != nullptr);
-        REQUIRE(record->header.length == _perf_record_size(length + capture_length));
+        REQUIRE(record->header.length == length + capture_length);
         REQUIRE(memcmp(record->data, data, length) == 0);
         REQUIRE(memcmp(record->data + length, ctx_data, capture_length) == 0);
 
@@ -1417,12 +2405,15 @@ TEST_CASE("perf_event_output", "[platform][perf_event_array]")
     size_t write_count = 0;
 
     data.resize(1023);
+    REQUIRE(ebpf_perf_event_array_get_lost_count(perf_event_array, cpu_id) == 0);
     while (ebpf_perf_event_array_output(ctx, perf_event_array, flags, data.data(), data.size(), NULL) == EBPF_SUCCESS) {
         if (++write_count > 1000) {
             INFO("Too many writes to perf_event_array.");
             REQUIRE(false);
         }
     }
+    // The failed write is counted as a lost record.
+    REQUIRE(ebpf_perf_event_array_get_lost_count(perf_event_array, cpu_id) == 1);
 
     ebpf_perf_event_array_query(perf_event_array, cpu_id, &consumer, &producer);
     REQUIRE(ebpf_perf_event_array_return_buffer(perf_event_array, cpu_id, producer) == EBPF_SUCCESS);
@@ -1931,3 +2922,69 @@ TEST_CASE("work_queue", "[platform]")
     // Verify the queue is now empty.
     REQUIRE(ebpf_timed_work_queue_is_empty(work_queue) == true);
 }
+
+TEST_CASE("work_queue_deferred", "[platform]")
+{
+    _test_helper test_helper;
+    test_helper.initialize();
+    struct _work_item_context
+    {
+        LIST_ENTRY list_entry;
+        KEVENT completion_event;
+        ebpf_timed_work_queue_t* work_queue;
+        volatile int32_t call_count;
+    } work_item_context = {};
+
+    ebpf_list_initialize(&work_item_context.list_entry);
+
+    KeInitializeEvent(&work_item_context.completion_event, NotificationEvent, FALSE);
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = 10 * 1000 * 10; // 10ms
+    int context = 1;
+    REQUIRE(
+        ebpf_timed_work_queue_create(
+            &work_item_context.work_queue,
+            0,
+            &interval,
+            [](_Inout_ void* context, uint32_t cpu_id, _Inout_ ebpf_list_entry_t* entry) {
+                UNREFERENCED_PARAMETER(context);
+                UNREFERENCED_PARAMETER(cpu_id);
+                auto work_item_context = reinterpret_cast<_work_item_context*>(entry);
+                // Re-insert the work item until it has run 3 times. Each run must come from a separate wakeup.
+                if (ebpf_interlocked_increment_int32(&work_item_context->call_count) < 3) {
+                    ebpf_timed_work_queue_insert(
+                        work_item_context->work_queue, &work_item_context->list_entry, EBPF_WORK_QUEUE_WAKEUP_DEFERRED);
+                } else {
+                    KeSetEvent(&work_item_context->completion_event, 0, FALSE);
+                }
+            },
+            &context) == EBPF_SUCCESS);
+
+    // Unique ptr that will call ebpf_timed_work_queue_destroy when it goes out of scope.
+    std::unique_ptr<ebpf_timed_work_queue_t, decltype(&ebpf_timed_work_queue_destroy)> work_queue_ptr(
+        work_item_context.work_queue, &ebpf_timed_work_queue_destroy);
+
+    // Queue a deferred work item.
+    ebpf_timed_work_queue_insert(
+        work_item_context.work_queue, &work_item_context.list_entry, EBPF_WORK_QUEUE_WAKEUP_DEFERRED);
+
+    // Verify that flushing the work queue doesn't run the deferred work item.
+    ebpf_timed_work_queued_flush(work_item_context.work_queue);
+    REQUIRE(ebpf_timed_work_queue_is_empty(work_item_context.work_queue) == false);
+
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -10 * 1000 * 1000; // 1s
+
+    // Verify that the work item runs on the timer and re-inserts itself until it has run 3 times.
+    REQUIRE(
+        KeWaitForSingleObject(&work_item_context.completion_event, Executive, KernelMode, FALSE, &timeout) ==
+        STATUS_SUCCESS);
+    REQUIRE(work_item_context.call_count == 3);
+
+    // Wait for active DPCs to complete.
+    KeFlushQueuedDpcs();
+
+    // Verify the queue is now empty.
+    REQUIRE(ebpf_timed_work_queue_is_empty(work_item_context.work_queue) == true);
+}
@@ -215,6 +215,38 @@ ebpf_ring_map_readonly_user(_In_ const ebpf_ring_descriptor_t* ring)
     EBPF_RETURN_POINTER(void*, ebpf_ring_descriptor_get_base_address(ring));
 }
 
+_Ret_maybenull_ void*
+ebpf_ring_map_user(_In_ const ebpf_ring_descriptor_t* ring)
+{
+    EBPF_LOG_ENTRY();
+    EBPF_RETURN_POINTER(void*, ebpf_ring_descriptor_get_base_address(ring));
+}
+
+_Ret_maybenull_ void*
+ebpf_map_memory_user(_In_ MDL* memory_descriptor)
+{
+    EBPF_LOG_ENTRY();
+    EBPF_RETURN_POINTER(void*, ebpf_memory_descriptor_get_base_address(memory_descriptor));
+}
+
+// User mode "mappings" are the base address of the memory itself, so there is nothing to track or unmap.
+void
+ebpf_unmap_memory_user(_In_ MDL* memory_descriptor)
+{
+    UNREFERENCED_PARAMETER(memory_descriptor);
+}
+
+_Must_inspect_result_ ebpf_result_t
+ebpf_user_mappings_initiate()
+{
+    return EBPF_SUCCESS;
+}
+
+void
+ebpf_user_mappings_terminate()
+{
+}
+
 static uint32_t
 _ntstatus_to_win32_error_code(NTSTATUS status)
 {
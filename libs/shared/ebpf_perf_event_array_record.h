@@ -24,7 +24,7 @@ typedef struct _ebpf_perf_event_array_record
  * @param[in] buffer_length Length of the ring buffer's data buffer.
  * @param[in] consumer Consumer offset.
  * @param[in] producer Producer offset.
- * @return Pointer to the next record or NULL if no more records.
+ * @return Pointer to the next record or NULL if no more records are ready.
  */
 inline const ebpf_perf_event_array_record_t*
 ebpf_perf_event_array_next_record(_In_ const uint8_t* buffer, size_t buffer_length, size_t consumer, size_t producer)
@@ -33,7 +33,15 @@ ebpf_perf_event_array_next_record(_In_ const uint8_t* buffer, size_t buffer_leng
     if (producer == consumer) {
         return NULL;
     }
-    return (ebpf_perf_event_array_record_t*)(buffer + consumer % buffer_length);
+    const ebpf_perf_event_array_record_t* record =
+        (ebpf_perf_event_array_record_t*)(buffer + consumer % buffer_length);
+    if (((volatile const ebpf_perf_event_array_record_t*)record)->header.locked) {
+        // The producer is still writing this record.
+        return NULL;
+    }
+    // Don't read the record data until the lock bit has been observed clear.
+    MemoryBarrier();
+    return record;
 }
 
 CXPLAT_EXTERN_C_END
@@ -16,15 +16,34 @@ typedef struct _ebpf_ring_buffer_record
     uint8_t data[1];
 } ebpf_ring_buffer_record_t;
 
+/**
+ * @brief Producer and consumer offsets of a ring buffer, kept in a page that is shared with the consumer process.
+ *
+ * The consumer reads producer_offset and advances consumer_offset directly instead of issuing an IOCTL for each
+ * drain. producer_offset is only ever written by the producers. consumer_offset is written by the consumer and is
+ * not trusted: producers only honor it when it moves forward without passing the producer offset.
+ */
+typedef struct _ebpf_ring_buffer_offsets
+{
+    volatile uint64_t producer_offset;
+    uint64_t pad1[7];
+    volatile uint64_t consumer_offset;
+    uint64_t pad2[7];
+} ebpf_ring_buffer_offsets_t;
+
 /**
  * @brief Locate the next record in the ring buffer's data buffer and
  * advance consumer offset.
  *
+ * Records are published in order but may still be locked by a producer that
+ * is filling them in. The consumer must stop at the first locked record and
+ * retry later; records after it are not yet safe to consume.
+ *
  * @param[in] buffer Pointer to the start of the ring buffer's data buffer.
  * @param[in] buffer_length Length of the ring buffer's data buffer.
  * @param[in] consumer Consumer offset.
  * @param[in] producer Producer offset.
- * @return Pointer to the next record or NULL if no more records.
+ * @return Pointer to the next record or NULL if no more records are ready.
  */
 inline const ebpf_ring_buffer_record_t*
 ebpf_ring_buffer_next_record(_In_ const uint8_t* buffer, size_t buffer_length, size_t consumer, size_t producer)
@@ -33,7 +52,13 @@ ebpf_ring_buffer_next_record(_In_ const uint8_t* buffer, size_t buffer_length, s
     if (producer == consumer) {
         return NULL;
     }
-    return (ebpf_ring_buffer_record_t*)(buffer + consumer % buffer_length);
+    const ebpf_ring_buffer_record_t* record = (ebpf_ring_buffer_record_t*)(buffer + consumer % buffer_length);
+    if (((volatile const ebpf_ring_buffer_record_t*)record)->header.locked) {
+        return NULL;
+    }
+    // Don't read the record data until the lock bit has been observed clear.
+    MemoryBarrier();
+    return record;
 }
 
 CXPLAT_EXTERN_C_END
@@ -33,8 +33,10 @@ namespace ebpf {
 #include <WinSock2.h>
 #include <in6addr.h>
 #include <array>
+#include <atomic>
 #include <cguid.h>
 #include <chrono>
+#include <future>
 #include <lsalookup.h>
 #include <mutex>
 #define _NTDEF_ // UNICODE_STRING is already defined
@@ -2083,6 +2085,292 @@ TEST_CASE("create_map_name", "[end_to_end]")
     Platform::_close(map_fd);
 }
 
+typedef struct _perf_buffer_test_context
+{
+    std::vector<std::vector<uint8_t>> records;
+    uint64_t lost_count = 0;
+} perf_buffer_test_context_t;
+
+static void
+_perf_buffer_test_sample(_Inout_ void* ctx, int cpu, _In_reads_bytes_(size) void* data, uint32_t size)
+{
+    perf_buffer_test_context_t* context = reinterpret_cast<perf_buffer_test_context_t*>(ctx);
+    REQUIRE(cpu >= 0);
+    REQUIRE(cpu < libbpf_num_possible_cpus());
+    context->records.emplace_back(reinterpret_cast<uint8_t*>(data), reinterpret_cast<uint8_t*>(data) + size);
+}
+
+static void
+_perf_buffer_test_lost(_Inout_ void* ctx, int cpu, uint64_t count)
+{
+    perf_buffer_test_context_t* context = reinterpret_cast<perf_buffer_test_context_t*>(ctx);
+    REQUIRE(cpu >= 0);
+    context->lost_count += count;
+}
+
+TEST_CASE("perf_buffer_poll", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    const uint32_t ring_size = 64 * 1024;
+    const uint32_t record_count = 100;
+
+    fd_t map_fd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY, "perf_map", 0, 0, ring_size, nullptr);
+    REQUIRE(map_fd > 0);
+
+    perf_buffer_test_context_t context;
+    struct perf_buffer* perf_buffer =
+        perf_buffer__new(map_fd, 0, _perf_buffer_test_sample, _perf_buffer_test_lost, &context, nullptr);
+    REQUIRE(perf_buffer != nullptr);
+
+    // Nothing has been written yet.
+    REQUIRE(perf_buffer__consume(perf_buffer) == 0);
+    REQUIRE(perf_buffer__poll(perf_buffer, 10) == 0);
+
+    // Records are only indicated from within poll or consume calls.
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(ebpf_perf_event_array_map_write(map_fd, &i, sizeof(i)) == EBPF_SUCCESS);
+    }
+    REQUIRE(context.records.empty());
+
+    for (int attempt = 0; attempt < 100 && context.records.size() < record_count; attempt++) {
+        REQUIRE(perf_buffer__poll(perf_buffer, 1000) >= 0);
+    }
+    REQUIRE(context.records.size() == record_count);
+
+    // The writing thread may have moved between CPUs, so records are only ordered within a CPU. Check that each
+    // record was received exactly once.
+    std::vector<uint32_t> received;
+    for (auto& record : context.records) {
+        REQUIRE(record.size() == sizeof(uint32_t));
+        received.push_back(*reinterpret_cast<uint32_t*>(record.data()));
+    }
+    std::sort(received.begin(), received.end());
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(received[i] == i);
+    }
+    REQUIRE(context.lost_count == 0);
+
+    // Fill the ring of the current CPU until a record is lost.
+    context.records.clear();
+    size_t written = 0;
+    std::vector<uint8_t> data(1024, 0xcc);
+    while (ebpf_perf_event_array_map_write(map_fd, data.data(), data.size()) == EBPF_SUCCESS) {
+        written++;
+    }
+    REQUIRE(written > 0);
+
+    for (int attempt = 0; attempt < 100 && (context.records.size() < written || context.lost_count == 0);
+         attempt++) {
+        REQUIRE(perf_buffer__poll(perf_buffer, 1000) >= 0);
+    }
+    REQUIRE(context.records.size() == written);
+    REQUIRE(context.lost_count == 1);
+
+    perf_buffer__free(perf_buffer);
+    Platform::_close(map_fd);
+}
+
+TEST_CASE("perf_buffer_auto_callback", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    const uint32_t record_count = 100;
+
+    fd_t map_fd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY, "perf_map", 0, 0, 64 * 1024, nullptr);
+    REQUIRE(map_fd > 0);
+
+    typedef struct _auto_callback_context
+    {
+        std::atomic<uint32_t> received = 0;
+        std::promise<void> done;
+    } auto_callback_context_t;
+    auto_callback_context_t context;
+    auto done = context.done.get_future();
+
+    ebpf_perf_buffer_opts_t opts = {sizeof(opts), EBPF_PERFBUF_FLAG_AUTO_CALLBACK};
+    struct perf_buffer* perf_buffer = ebpf_perf_buffer__new(
+        map_fd,
+        0,
+        [](void* ctx, int, void*, uint32_t) {
+            auto_callback_context_t* context = reinterpret_cast<auto_callback_context_t*>(ctx);
+            if (++context->received == record_count) {
+                context->done.set_value();
+            }
+        },
+        nullptr,
+        &context,
+        &opts);
+    REQUIRE(perf_buffer != nullptr);
+
+    // Polling is not supported when callbacks are automatic.
+    REQUIRE(perf_buffer__poll(perf_buffer, 0) < 0);
+
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(ebpf_perf_event_array_map_write(map_fd, &i, sizeof(i)) == EBPF_SUCCESS);
+    }
+    REQUIRE(done.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+
+    // No callback can be invoked once perf_buffer__free returns.
+    perf_buffer__free(perf_buffer);
+    REQUIRE(context.received == record_count);
+    Platform::_close(map_fd);
+}
+
+TEST_CASE("perf_buffer_negative", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    fd_t map_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, nullptr, sizeof(uint32_t), sizeof(uint32_t), 1, nullptr);
+    REQUIRE(map_fd > 0);
+
+    // Calls to perf buffer APIs on this map (array_map) must fail.
+    REQUIRE(perf_buffer__new(map_fd, 0, _perf_buffer_test_sample, nullptr, nullptr, nullptr) == nullptr);
+    REQUIRE(errno == EINVAL);
+    uint8_t data = 0;
+    REQUIRE(ebpf_perf_event_array_map_write(map_fd, &data, sizeof(data)) == EBPF_INVALID_ARGUMENT);
+
+    Platform::_close(map_fd);
+}
+
+typedef struct _ring_buffer_poll_test_context
+{
+    std::vector<uint32_t> records;
+    // Value returned from the callback once a record has been received.
+    int sample_result = 0;
+} ring_buffer_poll_test_context_t;
+
+static int
+_ring_buffer_poll_test_sample(_Inout_ void* ctx, _In_reads_bytes_(size) void* data, size_t size)
+{
+    ring_buffer_poll_test_context_t* context = reinterpret_cast<ring_buffer_poll_test_context_t*>(ctx);
+    REQUIRE(size == sizeof(uint32_t));
+    context->records.push_back(*reinterpret_cast<uint32_t*>(data));
+    return context->sample_result;
+}
+
+TEST_CASE("ring_buffer_poll", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    const uint32_t record_count = 100;
+
+    fd_t map_fd1 = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "ring_map1", 0, 0, 64 * 1024, nullptr);
+    REQUIRE(map_fd1 > 0);
+    fd_t map_fd2 = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "ring_map2", 0, 0, 64 * 1024, nullptr);
+    REQUIRE(map_fd2 > 0);
+
+    ring_buffer_poll_test_context_t context1;
+    ring_buffer_poll_test_context_t context2;
+    ebpf_ring_buffer_opts_t opts = {sizeof(opts)};
+    opts.flags = EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK;
+    struct ring_buffer* ring_buffer = ebpf_ring_buffer__new(map_fd1, _ring_buffer_poll_test_sample, &context1, &opts);
+    REQUIRE(ring_buffer != nullptr);
+    REQUIRE(ring_buffer__add(ring_buffer, map_fd2, _ring_buffer_poll_test_sample, &context2) == 0);
+
+    // There is no epoll on Windows.
+    REQUIRE(ring_buffer__epoll_fd(ring_buffer) == -ENOTSUP);
+
+    // Nothing has been written yet.
+    REQUIRE(ring_buffer__consume(ring_buffer) == 0);
+    REQUIRE(ring_buffer__poll(ring_buffer, 10) == 0);
+
+    // Records are only indicated from within poll or consume calls.
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(ebpf_ring_buffer_map_write(map_fd1, &i, sizeof(i)) == EBPF_SUCCESS);
+    }
+    REQUIRE(context1.records.empty());
+
+    // Records are drained through the shared offsets page, so consume sees them without waiting.
+    REQUIRE(ring_buffer__consume(ring_buffer) == static_cast<int>(record_count));
+    REQUIRE(context1.records.size() == record_count);
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(context1.records[i] == i);
+    }
+
+    // A single poll call waits for records on either map.
+    uint32_t value = record_count;
+    REQUIRE(ebpf_ring_buffer_map_write(map_fd2, &value, sizeof(value)) == EBPF_SUCCESS);
+    for (int attempt = 0; attempt < 100 && context2.records.empty(); attempt++) {
+        REQUIRE(ring_buffer__poll(ring_buffer, 1000) >= 0);
+    }
+    REQUIRE(context2.records.size() == 1);
+    REQUIRE(context2.records[0] == record_count);
+    REQUIRE(context1.records.size() == record_count);
+
+    // A negative callback result stops consuming and leaves the record in the ring.
+    context1.sample_result = -EINTR;
+    REQUIRE(ebpf_ring_buffer_map_write(map_fd1, &value, sizeof(value)) == EBPF_SUCCESS);
+    REQUIRE(ring_buffer__consume(ring_buffer) == -EINTR);
+    context1.sample_result = 0;
+    REQUIRE(ring_buffer__consume(ring_buffer) == 1);
+    REQUIRE(context1.records.size() == record_count + 2);
+    REQUIRE(context1.records[record_count] == value);
+    REQUIRE(context1.records[record_count + 1] == value);
+
+    ring_buffer__free(ring_buffer);
+    Platform::_close(map_fd2);
+    Platform::_close(map_fd1);
+}
+
+TEST_CASE("ring_buffer_map_snapshot", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    // More records than fit in the 64KB length of a reply.
+    const uint32_t record_count = 10000;
+
+    fd_t map_fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "ring_map", 0, 0, 256 * 1024, nullptr);
+    REQUIRE(map_fd > 0);
+
+    for (uint32_t i = 0; i < record_count; i++) {
+        REQUIRE(ebpf_ring_buffer_map_write(map_fd, &i, sizeof(i)) == EBPF_SUCCESS);
+    }
+
+    // The snapshot holds every record, and doesn't consume them.
+    for (int snapshot = 0; snapshot < 2; snapshot++) {
+        ring_buffer_poll_test_context_t context;
+        REQUIRE(ebpf_ring_buffer_map_snapshot(map_fd, _ring_buffer_poll_test_sample, &context) == EBPF_SUCCESS);
+        REQUIRE(context.records.size() == record_count);
+        for (uint32_t i = 0; i < record_count; i++) {
+            REQUIRE(context.records[i] == i);
+        }
+    }
+
+    Platform::_close(map_fd);
+}
+
+TEST_CASE("ring_buffer_poll_auto_callback", "[end_to_end]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    fd_t map_fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "ring_map", 0, 0, 64 * 1024, nullptr);
+    REQUIRE(map_fd > 0);
+
+    ring_buffer_poll_test_context_t context;
+    struct ring_buffer* ring_buffer = ring_buffer__new(map_fd, _ring_buffer_poll_test_sample, &context, nullptr);
+    REQUIRE(ring_buffer != nullptr);
+
+    // Polling is not supported when callbacks are automatic.
+    REQUIRE(ring_buffer__poll(ring_buffer, 0) < 0);
+    REQUIRE(ring_buffer__consume(ring_buffer) < 0);
+
+    // Invalid flags are rejected.
+    ebpf_ring_buffer_opts_t opts = {sizeof(opts)};
+    opts.flags = ~EBPF_RINGBUF_FLAG_NO_AUTO_CALLBACK;
+    REQUIRE(ebpf_ring_buffer__new(map_fd, _ring_buffer_poll_test_sample, &context, &opts) == nullptr);
+    REQUIRE(errno == EINVAL);
+
+    ring_buffer__free(ring_buffer);
+    Platform::_close(map_fd);
+}
+
 static void
 _xdp_reflect_packet_test(ebpf_execution_type_t execution_type, ADDRESS_FAMILY address_family)
 {
@@ -812,6 +812,49 @@ TEST_CASE("show maps", "[netsh][maps]")
                   "      3                hash     4      4        1     -1     0  inner_map\n"
                   "      4       array_of_maps     4      4        1      3     0  outer_map\n");
 
+    // Map statistics are not enabled, so no operations are counted.
+    output = _run_netsh_command(handle_ebpf_show_maps, L"level=verbose", nullptr, nullptr, &result);
+    REQUIRE(result == NO_ERROR);
+    REQUIRE(
+        output == "\n"
+                  "ID                      : 3\n"
+                  "Name                    : inner_map\n"
+                  "Map type                : hash\n"
+                  "Key size                : 4\n"
+                  "Value size              : 4\n"
+                  "Max entries             : 1\n"
+                  "Inner map ID            : -1\n"
+                  "# pinned paths          : 0\n"
+                  "# lookups               : 0\n"
+                  "# lookup hits           : 0\n"
+                  "# lookup misses         : 0\n"
+                  "# updates               : 0\n"
+                  "# updates out of space  : 0\n"
+                  "# updates out of memory : 0\n"
+                  "# deletes               : 0\n"
+                  "# LRU evictions         : 0\n"
+                  "# expired entries       : 0\n"
+                  "# bucket lock contention: 0\n"
+                  "\n"
+                  "ID                      : 4\n"
+                  "Name                    : outer_map\n"
+                  "Map type                : array_of_maps\n"
+                  "Key size                : 4\n"
+                  "Value size              : 4\n"
+                  "Max entries             : 1\n"
+                  "Inner map ID            : 3\n"
+                  "# pinned paths          : 0\n"
+                  "# lookups               : 0\n"
+                  "# lookup hits           : 0\n"
+                  "# lookup misses         : 0\n"
+                  "# updates               : 0\n"
+                  "# updates out of space  : 0\n"
+                  "# updates out of memory : 0\n"
+                  "# deletes               : 0\n"
+                  "# LRU evictions         : 0\n"
+                  "# expired entries       : 0\n"
+                  "# bucket lock contention: 0\n");
+
     output = _run_netsh_command(handle_ebpf_delete_program, L"5", nullptr, nullptr, &result);
     REQUIRE(result == NO_ERROR);
     REQUIRE(output == "Unpinned 5 from lookup\n");
@@ -177,6 +177,15 @@ static std::vector<std::pair<std::string, ebpf_map_definition_in_memory_t>> _map
             10,
         },
     },
+    {
+        "BPF_MAP_TYPE_BLOOM_FILTER",
+        {
+            BPF_MAP_TYPE_BLOOM_FILTER,
+            0,
+            20,
+            10,
+        },
+    },
     {
         "BPF_MAP_TYPE_PERCPU_ARRAY",
         {
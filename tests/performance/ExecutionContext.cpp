@@ -12,6 +12,8 @@ extern "C"
 #include "ubpf.h"
 }
 
+#include <algorithm>
+#include <array>
 #include <numeric>
 #include <optional>
 
@@ -150,6 +152,19 @@ typedef class _ebpf_map_test_state
         ebpf_epoch_exit(&epoch_state);
     }
 
+    void
+    test_find_write_shared_key()
+    {
+        // Every CPU updates the same key. For per-cpu maps each CPU writes its own copy of the value.
+        uint32_t key = 0;
+        uint64_t* value = nullptr;
+        ebpf_epoch_state_t epoch_state;
+        ebpf_epoch_enter(&epoch_state);
+        (void)ebpf_map_find_entry(map, 0, (uint8_t*)&key, 0, (uint8_t*)&value, EBPF_MAP_FLAG_HELPER);
+        (*value)++;
+        ebpf_epoch_exit(&epoch_state);
+    }
+
     void
     test_update(uint32_t cpu_id)
     {
@@ -239,6 +254,50 @@ typedef class _ebpf_map_lpm_trie_test_state
         }
     }
 
+    void
+    populate_ipv6_routes(size_t route_count)
+    {
+        cxplat_utf8_string_t name{(uint8_t*)"ipv6_route_table", 16};
+        ebpf_map_definition_in_memory_t definition{
+            BPF_MAP_TYPE_LPM_TRIE,
+            sizeof(uint32_t) + sizeof(ipv6_address_t),
+            sizeof(uint64_t),
+            static_cast<uint32_t>(route_count)};
+
+        (void)ebpf_map_create(&name, &definition, ebpf_handle_invalid, &map);
+
+        // Approximate prefix length distribution of the IPv6 default-free zone, in routes per 1000.
+        std::vector<std::pair<uint32_t, size_t>> ipv6_prefix_length_distribution{
+            {16, 1},   {19, 1},   {20, 2},   {24, 2},   {28, 10},  {29, 40},  {30, 6},   {31, 4},
+            {32, 120}, {33, 10},  {34, 12},  {35, 8},   {36, 40},  {37, 8},   {38, 12},  {39, 8},
+            {40, 70},  {41, 6},   {42, 20},  {43, 8},   {44, 90},  {45, 12},  {46, 30},  {47, 25},
+            {48, 430}, {56, 10},  {60, 2},   {64, 10},  {128, 3},
+        };
+
+        size_t total = 0;
+        for (auto& [prefix_length, weight] : ipv6_prefix_length_distribution) {
+            total += weight;
+        }
+        for (auto& [prefix_length, weight] : ipv6_prefix_length_distribution) {
+            size_t scaled_size = weight * route_count / total;
+            for (size_t count = 0; count < scaled_size; count++) {
+                ipv6_address_t prefix;
+                for (auto& word : prefix) {
+                    word = ebpf_random_uint32();
+                }
+                // Global unicast addresses are in 2000::/3.
+                uint8_t* prefix_bytes = reinterpret_cast<uint8_t*>(prefix.data());
+                prefix_bytes[0] = 0x20 | (prefix_bytes[0] & 0x1f);
+                ipv6_routes.push_back({prefix_length, prefix});
+            }
+        }
+        for (auto& [prefix_length, prefix] : ipv6_routes) {
+            std::vector<uint8_t> prefix_bytes(sizeof(prefix));
+            memcpy(prefix_bytes.data(), prefix.data(), sizeof(prefix));
+            populate_route(prefix_bytes, prefix_length);
+        }
+    }
+
     void
     populate_route(const std::vector<uint8_t>& prefix, uint32_t length)
     {
@@ -271,6 +330,23 @@ typedef class _ebpf_map_lpm_trie_test_state
         ebpf_epoch_exit(&epoch_state);
     }
 
+    void
+    test_find_ipv6_route()
+    {
+        struct _key
+        {
+            uint32_t prefix_length;
+            ipv6_address_t prefix;
+        } ipv6_key = {128, ipv6_routes[ebpf_random_uint32() % ipv6_routes.size()].second};
+        volatile uint64_t* value = nullptr;
+
+        ebpf_epoch_state_t epoch_state;
+        ebpf_epoch_enter(&epoch_state);
+        (void)ebpf_map_find_entry(map, sizeof(ipv6_key), (uint8_t*)&ipv6_key, sizeof(value), (uint8_t*)&value, 0);
+        UNREFERENCED_PARAMETER(value);
+        ebpf_epoch_exit(&epoch_state);
+    }
+
     ~_ebpf_map_lpm_trie_test_state()
     {
         EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
@@ -278,13 +354,92 @@ typedef class _ebpf_map_lpm_trie_test_state
     }
 
   private:
+    typedef std::array<uint32_t, 4> ipv6_address_t;
     ebpf_map_t* map;
     std::vector<std::pair<uint32_t, uint32_t>> ipv4_routes;
+    std::vector<std::pair<uint32_t, ipv6_address_t>> ipv6_routes;
 } ebpf_map_lpm_trie_test_state_t;
 
+typedef class _ebpf_perf_event_array_test_state
+{
+  public:
+    _ebpf_perf_event_array_test_state() : map(nullptr), producer_offsets(ebpf_get_cpu_count())
+    {
+        cxplat_utf8_string_t name{(uint8_t*)"perf_event_array", 16};
+        REQUIRE(ebpf_core_initiate() == EBPF_SUCCESS);
+        ebpf_map_definition_in_memory_t definition{BPF_MAP_TYPE_PERF_EVENT_ARRAY, 0, 0, 64 * 1024};
+        REQUIRE(ebpf_map_create(&name, &definition, ebpf_handle_invalid, &map) == EBPF_SUCCESS);
+    }
+    ~_ebpf_perf_event_array_test_state()
+    {
+        EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+        ebpf_core_terminate();
+    }
+
+    void
+    test_perf_event_output(uint32_t cpu_id)
+    {
+        uint64_t value = cpu_id;
+        ebpf_result_t result =
+            ebpf_perf_event_output(nullptr, map, EBPF_MAP_FLAG_CURRENT_CPU, (uint8_t*)&value, sizeof(value));
+        if (result == EBPF_SUCCESS) {
+            // Each record is an 8 byte header followed by the 8 byte value.
+            producer_offsets[cpu_id].offset += 16;
+        } else {
+            // Act as the consumer for this CPU's ring so that the producer keeps writing.
+            (void)ebpf_perf_event_array_map_return_buffer(map, cpu_id, producer_offsets[cpu_id].offset);
+        }
+    }
+
+  private:
+    // Each CPU updates its own offset, so keep them on separate cache lines.
+    typedef struct alignas(EBPF_CACHE_LINE_SIZE) _producer_offset
+    {
+        size_t offset;
+    } producer_offset_t;
+
+    ebpf_map_t* map;
+    std::vector<producer_offset_t> producer_offsets;
+} ebpf_perf_event_array_test_state_t;
+
+typedef class _ebpf_queue_map_test_state
+{
+  public:
+    _ebpf_queue_map_test_state() : map(nullptr)
+    {
+        cxplat_utf8_string_t name{(uint8_t*)"queue", 5};
+        REQUIRE(ebpf_core_initiate() == EBPF_SUCCESS);
+        ebpf_map_definition_in_memory_t definition{BPF_MAP_TYPE_QUEUE, 0, sizeof(uint64_t), 64 * 1024};
+        REQUIRE(ebpf_map_create(&name, &definition, ebpf_handle_invalid, &map) == EBPF_SUCCESS);
+    }
+    ~_ebpf_queue_map_test_state()
+    {
+        EBPF_OBJECT_RELEASE_REFERENCE((ebpf_core_object_t*)map);
+        ebpf_core_terminate();
+    }
+
+    void
+    test_push_pop(uint32_t cpu_id)
+    {
+        uint64_t value = cpu_id;
+        ebpf_epoch_state_t epoch_state;
+        ebpf_epoch_enter(&epoch_state);
+        // Every CPU pops the value it pushed (or one another CPU pushed), so the queue never fills and each call
+        // takes the path that claims a slot rather than the full or empty fast path.
+        (void)ebpf_map_push_entry(map, sizeof(value), (uint8_t*)&value, EBPF_MAP_FLAG_HELPER);
+        (void)ebpf_map_pop_entry(map, sizeof(value), (uint8_t*)&value, EBPF_MAP_FLAG_HELPER);
+        ebpf_epoch_exit(&epoch_state);
+    }
+
+  private:
+    ebpf_map_t* map;
+} ebpf_queue_map_test_state_t;
+
 static ebpf_program_test_state_t* _ebpf_program_test_state_instance = nullptr;
 static ebpf_map_test_state_t* _ebpf_map_test_state_instance = nullptr;
 static ebpf_map_lpm_trie_test_state_t* _ebpf_map_lpm_trie_test_state_instance = nullptr;
+static ebpf_perf_event_array_test_state_t* _ebpf_perf_event_array_test_state_instance = nullptr;
+static ebpf_queue_map_test_state_t* _ebpf_queue_map_test_state_instance = nullptr;
 
 #if !defined(CONFIG_BPF_JIT_DISABLED) || !defined(CONFIG_BPF_INTERPRETER_DISABLED)
 static void
@@ -306,6 +461,13 @@ _map_find_write_test(uint32_t cpu_id)
     _ebpf_map_test_state_instance->test_find_write(cpu_id);
 }
 
+static void
+_map_find_write_shared_key_test(uint32_t cpu_id)
+{
+    UNREFERENCED_PARAMETER(cpu_id);
+    _ebpf_map_test_state_instance->test_find_write_shared_key();
+}
+
 static void
 _map_update_test(uint32_t cpu_id)
 {
@@ -330,6 +492,24 @@ _lpm_trie_ipv4_find()
     _ebpf_map_lpm_trie_test_state_instance->test_find_ipv4_route();
 }
 
+static void
+_lpm_trie_ipv6_find()
+{
+    _ebpf_map_lpm_trie_test_state_instance->test_find_ipv6_route();
+}
+
+static void
+_perf_event_output_test(uint32_t cpu_id)
+{
+    _ebpf_perf_event_array_test_state_instance->test_perf_event_output(cpu_id);
+}
+
+static void
+_queue_push_pop_test(uint32_t cpu_id)
+{
+    _ebpf_queue_map_test_state_instance->test_push_pop(cpu_id);
+}
+
 static const char*
 _ebpf_map_type_t_to_string(ebpf_map_type_t type)
 {
@@ -404,6 +584,42 @@ test_bpf_map_update_elem(bool preemptible)
     measure.run_test();
 }
 
+/**
+ * @brief Measure updates to a single key of a map from cpu_count CPUs.
+ *
+ * Each CPU of a per-cpu map writes its own cache line, so the per-call cost should stay flat as CPUs are added.
+ */
+static void
+_test_bpf_map_lookup_elem_write_shared_key(
+    _In_z_ const char* function, ebpf_map_type_t map_type, uint32_t cpu_count, bool preemptible)
+{
+    size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT;
+    ebpf_map_test_state_t map_test_state(map_type);
+    _ebpf_map_test_state_instance = &map_test_state;
+    uint32_t active_cpu_count = std::min(cpu_count, ebpf_get_cpu_count());
+    std::string name = function;
+    name += "<";
+    name += std::to_string(active_cpu_count);
+    name += ">";
+    _performance_measure measure(
+        name.c_str(), preemptible, _map_find_write_shared_key_test, iterations, active_cpu_count);
+    measure.run_test();
+}
+
+template <uint32_t cpu_count>
+void
+test_bpf_percpu_hash_write_shared_key(bool preemptible)
+{
+    _test_bpf_map_lookup_elem_write_shared_key(__FUNCTION__, BPF_MAP_TYPE_PERCPU_HASH, cpu_count, preemptible);
+}
+
+template <uint32_t cpu_count>
+void
+test_bpf_percpu_array_write_shared_key(bool preemptible)
+{
+    _test_bpf_map_lookup_elem_write_shared_key(__FUNCTION__, BPF_MAP_TYPE_PERCPU_ARRAY, cpu_count, preemptible);
+}
+
 #define LRU_MAP_SIZE 8192
 
 template <ebpf_map_type_t map_type>
@@ -436,6 +652,27 @@ test_bpf_map_lookup_lru_elem(bool preemptible)
     measure.run_test();
 }
 
+/**
+ * @brief Measure inserts of random keys into a full LRU map from cpu_count CPUs.
+ *
+ * Nearly every insert evicts an entry, so the per-insert cost should stay flat as CPUs are added.
+ */
+template <uint32_t cpu_count>
+void
+test_bpf_map_update_full_lru_elem(bool preemptible)
+{
+    size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT / 10;
+    ebpf_map_test_state_t map_test_state(BPF_MAP_TYPE_LRU_HASH, {LRU_MAP_SIZE});
+    _ebpf_map_test_state_instance = &map_test_state;
+    uint32_t active_cpu_count = std::min(cpu_count, ebpf_get_cpu_count());
+    std::string name = __FUNCTION__;
+    name += "<";
+    name += std::to_string(active_cpu_count);
+    name += ">";
+    _performance_measure measure(name.c_str(), preemptible, _map_update_lru_test, iterations, active_cpu_count);
+    measure.run_test();
+}
+
 #if !defined(CONFIG_BPF_JIT_DISABLED) || !defined(CONFIG_BPF_INTERPRETER_DISABLED)
 void
 test_program_invoke_jit(bool preemptible)
@@ -482,6 +719,67 @@ test_lpm_trie_ipv4(bool preemptible)
     measure.run_test();
 }
 
+template <size_t route_count>
+void
+test_lpm_trie_ipv6(bool preemptible)
+{
+    size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT;
+    _ebpf_map_lpm_trie_test_state lpm_trie_state;
+    lpm_trie_state.populate_ipv6_routes(route_count);
+    _ebpf_map_lpm_trie_test_state_instance = &lpm_trie_state;
+    std::string name = __FUNCTION__;
+    name += "<";
+    name += std::to_string(route_count);
+    name += ">";
+
+    _performance_measure measure(name.c_str(), preemptible, _lpm_trie_ipv6_find, iterations);
+    measure.run_test();
+}
+
+/**
+ * @brief Measure bpf_perf_event_output with producers on cpu_count CPUs.
+ *
+ * Each CPU writes to its own ring, so the per-call cost should stay flat as CPUs are added.
+ */
+template <uint32_t cpu_count>
+void
+test_bpf_perf_event_output(bool preemptible)
+{
+    size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT;
+    ebpf_perf_event_array_test_state_t perf_event_array_state;
+    _ebpf_perf_event_array_test_state_instance = &perf_event_array_state;
+    uint32_t active_cpu_count = std::min(cpu_count, ebpf_get_cpu_count());
+    std::string name = __FUNCTION__;
+    name += "<";
+    name += std::to_string(active_cpu_count);
+    name += ">";
+
+    _performance_measure measure(name.c_str(), preemptible, _perf_event_output_test, iterations, active_cpu_count);
+    measure.run_test();
+}
+
+/**
+ * @brief Measure a queue map with cpu_count CPUs each pushing a value and then popping one.
+ *
+ * Pushes and pops don't take a lock, so the per-call cost should stay flat as CPUs are added.
+ */
+template <uint32_t cpu_count>
+void
+test_bpf_map_queue_push_pop(bool preemptible)
+{
+    size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT;
+    ebpf_queue_map_test_state_t queue_map_state;
+    _ebpf_queue_map_test_state_instance = &queue_map_state;
+    uint32_t active_cpu_count = std::min(cpu_count, ebpf_get_cpu_count());
+    std::string name = __FUNCTION__;
+    name += "<";
+    name += std::to_string(active_cpu_count);
+    name += ">";
+
+    _performance_measure measure(name.c_str(), preemptible, _queue_push_pop_test, iterations, active_cpu_count);
+    measure.run_test();
+}
+
 #if !defined(CONFIG_BPF_JIT_DISABLED)
 PERF_TEST(test_program_invoke_jit);
 #endif
@@ -500,6 +798,15 @@ PERF_TEST(test_bpf_map_lookup_elem_write<BPF_MAP_TYPE_PERCPU_HASH>);
 PERF_TEST(test_bpf_map_lookup_elem_write<BPF_MAP_TYPE_PERCPU_ARRAY>);
 PERF_TEST(test_bpf_map_lookup_elem_write<BPF_MAP_TYPE_LRU_HASH>);
 
+PERF_TEST(test_bpf_percpu_hash_write_shared_key<1>);
+PERF_TEST(test_bpf_percpu_hash_write_shared_key<4>);
+PERF_TEST(test_bpf_percpu_hash_write_shared_key<16>);
+PERF_TEST(test_bpf_percpu_hash_write_shared_key<64>);
+PERF_TEST(test_bpf_percpu_array_write_shared_key<1>);
+PERF_TEST(test_bpf_percpu_array_write_shared_key<4>);
+PERF_TEST(test_bpf_percpu_array_write_shared_key<16>);
+PERF_TEST(test_bpf_percpu_array_write_shared_key<64>);
+
 PERF_TEST(test_bpf_map_update_elem<BPF_MAP_TYPE_HASH>);
 PERF_TEST(test_bpf_map_update_elem<BPF_MAP_TYPE_ARRAY>);
 PERF_TEST(test_bpf_map_update_elem<BPF_MAP_TYPE_PERCPU_HASH>);
@@ -508,8 +815,28 @@ PERF_TEST(test_bpf_map_update_elem<BPF_MAP_TYPE_LRU_HASH>);
 
 PERF_TEST(test_bpf_map_update_lru_elem<BPF_MAP_TYPE_LRU_HASH>);
 PERF_TEST(test_bpf_map_lookup_lru_elem<BPF_MAP_TYPE_LRU_HASH>);
+PERF_TEST(test_bpf_map_update_full_lru_elem<1>);
+PERF_TEST(test_bpf_map_update_full_lru_elem<4>);
+PERF_TEST(test_bpf_map_update_full_lru_elem<16>);
+PERF_TEST(test_bpf_map_update_full_lru_elem<64>);
 
 PERF_TEST(test_lpm_trie_ipv4<1024>);
 PERF_TEST(test_lpm_trie_ipv4<1024 * 16>);
 PERF_TEST(test_lpm_trie_ipv4<1024 * 256>);
 PERF_TEST(test_lpm_trie_ipv4<1024 * 1024>);
+
+PERF_TEST(test_lpm_trie_ipv6<1024>);
+PERF_TEST(test_lpm_trie_ipv6<1024 * 16>);
+PERF_TEST(test_lpm_trie_ipv6<1024 * 256>);
+
+PERF_TEST(test_bpf_perf_event_output<1>);
+PERF_TEST(test_bpf_perf_event_output<2>);
+PERF_TEST(test_bpf_perf_event_output<4>);
+PERF_TEST(test_bpf_perf_event_output<8>);
+PERF_TEST(test_bpf_perf_event_output<16>);
+PERF_TEST(test_bpf_perf_event_output<64>);
+
+PERF_TEST(test_bpf_map_queue_push_pop<1>);
+PERF_TEST(test_bpf_map_queue_push_pop<4>);
+PERF_TEST(test_bpf_map_queue_push_pop<16>);
+PERF_TEST(test_bpf_map_queue_push_pop<64>);
@@ -29,14 +29,18 @@ template <typename T> class _performance_measure
      * @param[in] preemptible Run the test function in preemptible mode.
      * @param[in] worker Function under test
      * @param[in] iterations Iteration count to run.
+     * @param[in] cpu_count Number of CPUs to run the worker on (0 for all CPUs).
      */
     _performance_measure(
         _In_z_ const char* test_name,
         bool preemptible,
         T worker,
-        size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT)
-        : cpu_count(ebpf_get_cpu_count()), iterations(iterations), counters(cpu_count), worker(worker),
-          preemptible(preemptible), test_name(test_name)
+        size_t iterations = PERFORMANCE_MEASURE_ITERATION_COUNT,
+        uint32_t cpu_count = 0)
+        : cpu_count(
+              (cpu_count == 0 || cpu_count > ebpf_get_cpu_count()) ? ebpf_get_cpu_count() : cpu_count),
+          iterations(iterations), counters(this->cpu_count), worker(worker), preemptible(preemptible),
+          test_name(test_name)
     {
         start_event = CreateEvent(nullptr, true, false, nullptr);
     }
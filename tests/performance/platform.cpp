@@ -228,6 +228,95 @@ _ebpf_hash_table_test_replace_value_overlap()
     _ebpf_hash_table_test_state_instance->test_replace_value_overlap();
 }
 
+/**
+ * @brief Helper class to set up a hash table with keys of a given size and several keys per bucket, so that most key
+ * comparisons on lookup fail unless they are skipped.
+ * All tests perform the operation under test multiplier() times.
+ */
+typedef class _ebpf_hash_table_key_size_test_state
+{
+  public:
+    _ebpf_hash_table_key_size_test_state(size_t key_size) : key_size(key_size)
+    {
+        REQUIRE(ebpf_platform_initiate() == EBPF_SUCCESS);
+        platform_initiated = true;
+        REQUIRE(ebpf_random_initiate() == EBPF_SUCCESS);
+        REQUIRE(ebpf_epoch_initiate() == EBPF_SUCCESS);
+        epoch_initiated = true;
+
+        ebpf_epoch_state_t epoch_state;
+        ebpf_epoch_enter(&epoch_state);
+        keys.resize(key_count * key_size);
+        const ebpf_hash_table_creation_options_t options = {
+            .key_size = key_size,
+            .value_size = sizeof(uint64_t),
+            .minimum_bucket_count = key_count / keys_per_bucket,
+        };
+        REQUIRE(ebpf_hash_table_create(&table, &options) == EBPF_SUCCESS);
+        for (auto& byte : keys) {
+            byte = static_cast<uint8_t>(ebpf_random_uint32());
+        }
+        for (size_t index = 0; index < key_count; index++) {
+            uint64_t value = 12345678;
+            REQUIRE(
+                ebpf_hash_table_update(
+                    table,
+                    &keys[index * key_size],
+                    reinterpret_cast<uint8_t*>(&value),
+                    EBPF_HASH_TABLE_OPERATION_ANY) == EBPF_SUCCESS);
+        }
+        ebpf_epoch_exit(&epoch_state);
+    }
+    ~_ebpf_hash_table_key_size_test_state()
+    {
+        ebpf_hash_table_destroy(table);
+
+        if (epoch_initiated) {
+            ebpf_epoch_terminate();
+        }
+        ebpf_random_terminate();
+        if (platform_initiated) {
+            ebpf_platform_terminate();
+        }
+    }
+
+    void
+    test_find()
+    {
+        uint8_t* value;
+        for (size_t index = 0; index < key_count; index++) {
+            ebpf_epoch_state_t epoch_state;
+            ebpf_epoch_enter(&epoch_state);
+            (void)ebpf_hash_table_find(table, &keys[index * key_size], &value);
+            ebpf_epoch_exit(&epoch_state);
+        }
+    }
+
+    size_t
+    multiplier()
+    {
+        return key_count;
+    }
+
+  private:
+    static const size_t key_count = 1024;
+    static const size_t keys_per_bucket = 8;
+    ebpf_hash_table_t* table;
+    std::vector<uint8_t> keys;
+    size_t key_size;
+    bool platform_initiated = false;
+    bool epoch_initiated = false;
+
+} ebpf_hash_table_key_size_test_state_t;
+
+static ebpf_hash_table_key_size_test_state_t* _ebpf_hash_table_key_size_test_state_instance = nullptr;
+
+static void
+_ebpf_hash_table_key_size_test_find()
+{
+    _ebpf_hash_table_key_size_test_state_instance->test_find();
+}
+
 void
 test_bpf_get_prandom_u32(bool preemptible)
 {
@@ -329,12 +418,50 @@ test_ebpf_hash_table_update_overlapping(bool preemptible)
     measure.run_test(instance.multiplier());
 }
 
+static void
+_test_ebpf_hash_table_find_key_size(_In_z_ const char* test_name, bool preemptible, size_t key_size)
+{
+    _ebpf_hash_table_key_size_test_state instance(key_size);
+    _ebpf_hash_table_key_size_test_state_instance = &instance;
+    _performance_measure measure(test_name, preemptible, _ebpf_hash_table_key_size_test_find);
+    measure.run_test(instance.multiplier());
+}
+
+void
+test_ebpf_hash_table_find_key_size_4(bool preemptible)
+{
+    _test_ebpf_hash_table_find_key_size(__FUNCTION__, preemptible, 4);
+}
+
+void
+test_ebpf_hash_table_find_key_size_16(bool preemptible)
+{
+    _test_ebpf_hash_table_find_key_size(__FUNCTION__, preemptible, 16);
+}
+
+void
+test_ebpf_hash_table_find_key_size_40(bool preemptible)
+{
+    // Size of an IPv6 5-tuple.
+    _test_ebpf_hash_table_find_key_size(__FUNCTION__, preemptible, 40);
+}
+
+void
+test_ebpf_hash_table_find_key_size_64(bool preemptible)
+{
+    _test_ebpf_hash_table_find_key_size(__FUNCTION__, preemptible, 64);
+}
+
 PERF_TEST(test_epoch_enter_exit);
 PERF_TEST(test_epoch_enter_exit_alloc_free);
 PERF_TEST(test_ebpf_hash_table_find);
 PERF_TEST(test_ebpf_hash_table_next_key);
 PERF_TEST(test_ebpf_hash_table_update);
 PERF_TEST(test_ebpf_hash_table_update_overlapping);
+PERF_TEST(test_ebpf_hash_table_find_key_size_4);
+PERF_TEST(test_ebpf_hash_table_find_key_size_16);
+PERF_TEST(test_ebpf_hash_table_find_key_size_40);
+PERF_TEST(test_ebpf_hash_table_find_key_size_64);
 
 PERF_TEST(test_bpf_get_prandom_u32);
 PERF_TEST(test_bpf_ktime_get_boot_ns);
@@ -393,13 +393,18 @@ TEST_CASE("valid bpf_load_program_xattr", "[libbpf][deprecated]")
 #define BPF_EXIT_INSN() {INST_OP_EXIT}
 #define BPF_CALL_FUNC(imm) {INST_OP_CALL, 0, 0, 0, (imm)}
 #define BPF_STX_MEM(sz, dst, src, off) {INST_CLS_STX | INST_MODE_MEM | (sz), (dst), (src), (off), 0}
+#define BPF_LDX_MEM(sz, dst, src, off) {INST_CLS_LDX | INST_MODE_MEM | (sz), (dst), (src), (off), 0}
+#define BPF_JMP_IMM(op, dst, imm, off) {INST_CLS_JMP | INST_SRC_IMM | (op), (dst), 0, (off), (imm)}
 #define BPF_W INST_SIZE_W
+#define BPF_DW INST_SIZE_DW
+#define BPF_REG_0 R0_RETURN_VALUE
 #define BPF_REG_1 R1_ARG
 #define BPF_REG_2 R2_ARG
 #define BPF_REG_3 R3_ARG
 #define BPF_REG_4 R4_ARG
 #define BPF_REG_10 R10_STACK_POINTER
 #define BPF_ADD 0
+#define BPF_JSLT 0xc0
 
 #if !defined(CONFIG_BPF_JIT_DISABLED)
 TEST_CASE("valid bpf_load_program with map", "[libbpf][deprecated]")
@@ -446,6 +451,76 @@ TEST_CASE("valid bpf_load_program with map", "[libbpf][deprecated]")
     Platform::_close(map_fd);
 }
 
+TEST_CASE("user ring buffer read by program", "[libbpf]")
+{
+    _test_helper_libbpf test_helper;
+    test_helper.initialize();
+
+    int map_fd = bpf_map_create(BPF_MAP_TYPE_USER_RINGBUF, "user_ring", 0, 0, 64 * 1024, nullptr);
+    REQUIRE(map_fd >= 0);
+
+    // Return the next record, or the negative result of bpf_user_ringbuf_read if there is none.
+    struct ebpf_inst instructions[] = {
+        BPF_MOV64_IMM(BPF_REG_1, 0),                    // r1 = 0
+        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -8), // *(u64 *)(r10 - 8) = r1
+        BPF_LD_MAP_FD(BPF_REG_1, map_fd),               // r1 = map_fd ll
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),           // r2 = r10
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -8),          // r2 += -8
+        BPF_MOV64_IMM(BPF_REG_3, sizeof(uint64_t)),     // r3 = 8
+        BPF_MOV64_IMM(BPF_REG_4, 0),                    // r4 = 0
+        BPF_CALL_FUNC(BPF_FUNC_user_ringbuf_read),      // call user_ringbuf_read
+        BPF_JMP_IMM(BPF_JSLT, BPF_REG_0, 0, 1),         // if r0 s< 0 goto +1
+        BPF_LDX_MEM(BPF_DW, BPF_REG_0, BPF_REG_10, -8), // r0 = *(u64 *)(r10 - 8)
+        BPF_EXIT_INSN(),                                // return r0
+    };
+    int program_fd = bpf_prog_load(
+        BPF_PROG_TYPE_SAMPLE, "name", "license", (struct bpf_insn*)instructions, _countof(instructions), nullptr);
+    REQUIRE(program_fd >= 0);
+
+    struct user_ring_buffer* user_ring_buffer = user_ring_buffer__new(map_fd, nullptr);
+    REQUIRE(user_ring_buffer != nullptr);
+
+    // Produce records from user mode, the discarded one is skipped by the program.
+    for (uint64_t value = 1; value <= 3; value++) {
+        uint64_t* record = static_cast<uint64_t*>(user_ring_buffer__reserve(user_ring_buffer, sizeof(uint64_t)));
+        REQUIRE(record != nullptr);
+        *record = value;
+        if (value == 2) {
+            user_ring_buffer__discard(user_ring_buffer, record);
+        } else {
+            user_ring_buffer__submit(user_ring_buffer, record);
+        }
+    }
+
+    sample_program_context_t context = {0};
+    bpf_test_run_opts opts = {};
+    opts.ctx_in = reinterpret_cast<uint8_t*>(&context);
+    opts.ctx_size_in = sizeof(context);
+    opts.ctx_out = reinterpret_cast<uint8_t*>(&context);
+    opts.ctx_size_out = sizeof(context);
+
+    REQUIRE(bpf_prog_test_run_opts(program_fd, &opts) == 0);
+    REQUIRE(opts.retval == 1);
+    REQUIRE(bpf_prog_test_run_opts(program_fd, &opts) == 0);
+    REQUIRE(opts.retval == 3);
+
+    // The ring is empty once every record has been read.
+    REQUIRE(bpf_prog_test_run_opts(program_fd, &opts) == 0);
+    REQUIRE(static_cast<int32_t>(opts.retval) == -EBPF_OBJECT_NOT_FOUND);
+
+    // Space read by the program can be reused by the producer.
+    uint64_t* record = static_cast<uint64_t*>(user_ring_buffer__reserve(user_ring_buffer, sizeof(uint64_t)));
+    REQUIRE(record != nullptr);
+    *record = 4;
+    user_ring_buffer__submit(user_ring_buffer, record);
+    REQUIRE(bpf_prog_test_run_opts(program_fd, &opts) == 0);
+    REQUIRE(opts.retval == 4);
+
+    user_ring_buffer__free(user_ring_buffer);
+    Platform::_close(program_fd);
+    Platform::_close(map_fd);
+}
+
 TEST_CASE("libbpf program", "[libbpf]")
 {
     _test_helper_libbpf test_helper;
@@ -2100,6 +2175,56 @@ TEST_CASE("enumerate map IDs", "[libbpf]")
     Platform::_close(fd2);
 }
 
+TEST_CASE("enumerate map IDs in order", "[libbpf]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    // Create enough maps to span several growths of the ID index.
+    std::vector<int> map_fds;
+    std::vector<uint32_t> map_ids;
+    for (int i = 0; i < 200; i++) {
+        int map_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, nullptr, sizeof(__u32), sizeof(__u32), 1, nullptr);
+        REQUIRE(map_fd > 0);
+        struct bpf_map_info info = {};
+        uint32_t info_size = sizeof(info);
+        REQUIRE(bpf_obj_get_info_by_fd(map_fd, &info, &info_size) == 0);
+        map_fds.push_back(map_fd);
+        map_ids.push_back(info.id);
+    }
+
+    // Close every third map so the enumeration has to skip the holes.
+    std::vector<uint32_t> expected_ids;
+    for (size_t i = 0; i < map_fds.size(); i++) {
+        if (i % 3 == 0) {
+            Platform::_close(map_fds[i]);
+            map_fds[i] = -1;
+        } else {
+            expected_ids.push_back(map_ids[i]);
+        }
+    }
+
+    // Verify the IDs are returned in ascending order and match the maps still open.
+    std::vector<uint32_t> enumerated_ids;
+    uint32_t id = 0;
+    while (bpf_map_get_next_id(id, &id) == 0) {
+        enumerated_ids.push_back(id);
+    }
+    REQUIRE(errno == ENOENT);
+    REQUIRE(enumerated_ids == expected_ids);
+
+    // Starting from an ID that is no longer present returns the next ID that is.
+    uint32_t next_id;
+    REQUIRE(bpf_map_get_next_id(map_ids[3], &next_id) == 0);
+    REQUIRE(next_id == map_ids[4]);
+
+    for (int map_fd : map_fds) {
+        if (map_fd >= 0) {
+            Platform::_close(map_fd);
+        }
+    }
+}
+
 #if !defined(CONFIG_BPF_JIT_DISABLED)
 TEST_CASE("enumerate link IDs", "[libbpf]")
 {
@@ -3935,6 +4060,78 @@ TEST_CASE("libbpf percpu hash map batch", "[libbpf]") { _test_maps_batch(BPF_MAP
 
 TEST_CASE("libbpf lru percpu hash map batch", "[libbpf]") { _test_maps_batch(BPF_MAP_TYPE_LRU_PERCPU_HASH); }
 
+TEST_CASE("libbpf hash map batch larger than a request", "[libbpf]")
+{
+    _test_helper_end_to_end test_helper;
+    test_helper.initialize();
+
+    // Each batch is several times larger than the 64KB that fits in a single request or reply.
+    const uint32_t value_size = 1024;
+    const uint32_t batch_size = 1024;
+
+    union bpf_attr attr = {};
+    attr.map_create.map_type = BPF_MAP_TYPE_HASH;
+    attr.map_create.key_size = sizeof(uint32_t);
+    attr.map_create.value_size = value_size;
+    attr.map_create.max_entries = batch_size;
+
+    fd_t map_fd = bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+    REQUIRE(map_fd > 0);
+
+    std::vector<uint32_t> keys(batch_size);
+    std::vector<uint8_t> values(static_cast<size_t>(batch_size) * value_size);
+    for (uint32_t i = 0; i < batch_size; i++) {
+        keys[i] = i;
+        std::fill_n(values.begin() + static_cast<size_t>(i) * value_size, value_size, static_cast<uint8_t>(i));
+    }
+
+    bpf_map_batch_opts opts = {.elem_flags = BPF_NOEXIST};
+    uint32_t update_batch_size = batch_size;
+    REQUIRE(bpf_map_update_batch(map_fd, keys.data(), values.data(), &update_batch_size, &opts) == 0);
+    REQUIRE(update_batch_size == batch_size);
+
+    // All the entries are returned by a single call.
+    opts.elem_flags = 0;
+    uint32_t next_key = 0;
+    uint32_t fetched_batch_size = batch_size;
+    std::vector<uint32_t> fetched_keys(batch_size);
+    std::vector<uint8_t> fetched_values(values.size());
+    REQUIRE(
+        bpf_map_lookup_batch(
+            map_fd, nullptr, &next_key, fetched_keys.data(), fetched_values.data(), &fetched_batch_size, &opts) == 0);
+    REQUIRE(fetched_batch_size == batch_size);
+    REQUIRE(next_key == fetched_keys[batch_size - 1]);
+    for (uint32_t i = 0; i < batch_size; i++) {
+        uint32_t key = fetched_keys[i];
+        REQUIRE(key < batch_size);
+        auto value = fetched_values.begin() + static_cast<size_t>(i) * value_size;
+        REQUIRE(std::all_of(
+            value, value + value_size, [&](uint8_t byte) { return byte == static_cast<uint8_t>(key); }));
+    }
+
+    fetched_batch_size = batch_size;
+    REQUIRE(
+        bpf_map_lookup_and_delete_batch(
+            map_fd, nullptr, &next_key, fetched_keys.data(), fetched_values.data(), &fetched_batch_size, &opts) == 0);
+    REQUIRE(fetched_batch_size == batch_size);
+    std::sort(fetched_keys.begin(), fetched_keys.end());
+    REQUIRE(fetched_keys == keys);
+
+    REQUIRE(
+        bpf_map_lookup_batch(
+            map_fd, nullptr, &next_key, fetched_keys.data(), fetched_values.data(), &fetched_batch_size, &opts) ==
+        -ENOENT);
+
+    // Delete all the entries in one call.
+    update_batch_size = batch_size;
+    REQUIRE(bpf_map_update_batch(map_fd, keys.data(), values.data(), &update_batch_size, &opts) == 0);
+    uint32_t delete_batch_size = batch_size;
+    REQUIRE(bpf_map_delete_batch(map_fd, keys.data(), &delete_batch_size, &opts) == 0);
+    REQUIRE(delete_batch_size == batch_size);
+
+    Platform::_close(map_fd);
+}
+
 void
 _hash_of_map_initial_value_test(ebpf_execution_type_t execution_type)
 {